@@ -20,6 +20,7 @@
 #include <assert.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
 #ifdef _WIN32
 # include <windows.h>
 # include "../windows/platform.h"
@@ -65,6 +66,50 @@ static inline int posix_thread_id(void) {
 # error Unsupported platform
 #endif
 
+/*
+ * Lock classes for contention profiling.
+ *
+ * Every tracing_mutex_t belongs to a class, and when built with
+ * ENABLE_LOCKSTAT acquisition counts, wait and hold times are
+ * aggregated per class.  Names are in lockstat.c.
+ */
+enum lockstat_class {
+    LOCKSTAT_OTHER = 0,             //!< Anything not given a class.
+    LOCKSTAT_GLOBAL,                //!< Global kq_mtx.
+    LOCKSTAT_KQUEUE,                //!< Per-kqueue kq_mtx.
+    LOCKSTAT_SIGTBL,                //!< Signal table (sigtbl_mtx).
+    LOCKSTAT_PROC,                  //!< POSIX EVFILT_PROC pid index and waiter init.
+    LOCKSTAT_CLASS_MAX
+};
+
+#ifdef LIBKQUEUE_LOCKSTAT
+/*
+ * Recursive mutexes count every level as an acquisition, and
+ * the hold time is measured from the innermost lock.
+ */
+# define LOCKSTAT_FIELDS \
+    enum lockstat_class mtx_class; \
+    uint64_t mtx_locked_at;
+# define LOCKSTAT_INITIALIZER(_cls) , .mtx_class = (_cls)
+# define LOCKSTAT_INIT(_mtx, _cls) (_mtx)->mtx_class = (_cls)
+
+# define lockstat_mutex_lock(x)         lockstat_lock(&(x)->mtx_lock, (x)->mtx_class, &(x)->mtx_locked_at)
+# define lockstat_mutex_trylock(x)      lockstat_trylock(&(x)->mtx_lock, (x)->mtx_class, &(x)->mtx_locked_at)
+# define lockstat_mutex_unlock(x)       lockstat_release((x)->mtx_class, (x)->mtx_locked_at)
+
+void lockstat_lock(pthread_mutex_t *mtx, enum lockstat_class cls, uint64_t *locked_at);
+int  lockstat_trylock(pthread_mutex_t *mtx, enum lockstat_class cls, uint64_t *locked_at);
+void lockstat_release(enum lockstat_class cls, uint64_t locked_at);
+#else
+# define LOCKSTAT_FIELDS
+# define LOCKSTAT_INITIALIZER(_cls)
+# define LOCKSTAT_INIT(_mtx, _cls)      (void)(_cls)
+
+# define lockstat_mutex_lock(x)         pthread_mutex_lock(&(x)->mtx_lock)
+# define lockstat_mutex_trylock(x)      pthread_mutex_trylock(&(x)->mtx_lock)
+# define lockstat_mutex_unlock(x)
+#endif
+
 #ifndef NDEBUG
 #define dbg_puts(str) do {                                                                              \
     if (libkqueue_debug)                                                                                \
@@ -120,16 +165,20 @@ typedef struct {
     pthread_mutex_t mtx_lock;
     enum tracing_mutex_status mtx_status;
     int mtx_owner;
+    LOCKSTAT_FIELDS
 } tracing_mutex_t;
 
-# define TRACING_MUTEX_INITIALIZER { .mtx_lock = PTHREAD_MUTEX_INITIALIZER, .mtx_status = MTX_UNLOCKED, .mtx_owner = -1 }
+# define TRACING_MUTEX_INITIALIZER_CLASS(_cls) { .mtx_lock = PTHREAD_MUTEX_INITIALIZER, .mtx_status = MTX_UNLOCKED, .mtx_owner = -1 LOCKSTAT_INITIALIZER(_cls) }
 
-# define tracing_mutex_init(mtx, attr) do { \
+# define tracing_mutex_init_class(mtx, attr, _cls) do { \
     pthread_mutex_init(&(mtx)->mtx_lock, (attr)); \
     (mtx)->mtx_status = MTX_UNLOCKED; \
     (mtx)->mtx_owner = -1; \
+    LOCKSTAT_INIT(mtx, _cls); \
 } while (0)
 
+# define tracing_mutex_raw(mtx) (&(mtx)->mtx_lock)
+
 # define tracing_mutex_destroy(mtx) pthread_mutex_destroy(&(mtx)->mtx_lock)
 
 # define tracing_mutex_assert(x,y) do { \
@@ -152,7 +201,7 @@ typedef struct {
 
 # define tracing_mutex_lock(x)  do { \
     dbg_printf("[%i]: waiting for %s", __LINE__, #x); \
-    pthread_mutex_lock(&((x)->mtx_lock)); \
+    lockstat_mutex_lock(x); \
     dbg_printf("[%i]: locked %s", __LINE__, #x); \
     (x)->mtx_owner = THREAD_ID; \
     (x)->mtx_status = MTX_LOCKED; \
@@ -160,7 +209,7 @@ typedef struct {
 
 # define tracing_mutex_trylock(ret, x)  do { \
     dbg_printf("[%i]: waiting for %s", __LINE__, #x); \
-    ret = pthread_mutex_trylock(&((x)->mtx_lock)); \
+    ret = lockstat_mutex_trylock(x); \
     if (ret == 0) { \
         dbg_printf("[%i]: locked %s", __LINE__, #x); \
         (x)->mtx_owner = THREAD_ID; \
@@ -174,6 +223,7 @@ typedef struct {
 # define tracing_mutex_unlock(x)  do { \
     (x)->mtx_status = MTX_UNLOCKED; \
     (x)->mtx_owner = -1; \
+    lockstat_mutex_unlock(x); \
     pthread_mutex_unlock(&((x)->mtx_lock)); \
     dbg_printf("[%i]: unlocked %s", __LINE__, # x); \
 } while (0)
@@ -181,6 +231,7 @@ typedef struct {
 # define tracing_mutex_unlock(x)  do { \
     (x)->mtx_status = MTX_UNLOCKED; \
     (x)->mtx_owner = -1; \
+    lockstat_mutex_unlock(x); \
     if (unlikely(pthread_mutex_unlock(&((x)->mtx_lock)) < 0)) {\
         dbg_perror("pthread_mutex_unlock"); \
         assert(0); \
@@ -209,16 +260,45 @@ void libkqueue_debug_ident_clear(void);
 # define reset_errno()
 # define MTX_UNLOCKED
 # define MTX_LOCKED
-# define tracing_mutex_t            pthread_mutex_t
-# define TRACING_MUTEX_INITIALIZER  PTHREAD_MUTEX_INITIALIZER
-# define tracing_mutex_init         pthread_mutex_init
-# define tracing_mutex_destroy      pthread_mutex_destroy
 # define tracing_mutex_assert(x,y)
 # define tracing_mutex_assert_state(x,y)
-# define tracing_mutex_lock         pthread_mutex_lock
-# define tracing_mutex_trylock(ret,x) do { ret = pthread_mutex_trylock(x); } while (0)
-# define tracing_mutex_unlock       pthread_mutex_unlock
+# ifdef LIBKQUEUE_LOCKSTAT
+typedef struct {
+    pthread_mutex_t mtx_lock;
+    LOCKSTAT_FIELDS
+} tracing_mutex_t;
+
+#  define TRACING_MUTEX_INITIALIZER_CLASS(_cls) { .mtx_lock = PTHREAD_MUTEX_INITIALIZER LOCKSTAT_INITIALIZER(_cls) }
+#  define tracing_mutex_init_class(mtx, attr, _cls) do { \
+    pthread_mutex_init(&(mtx)->mtx_lock, (attr)); \
+    LOCKSTAT_INIT(mtx, _cls); \
+} while (0)
+#  define tracing_mutex_raw(mtx)     (&(mtx)->mtx_lock)
+#  define tracing_mutex_destroy(mtx) pthread_mutex_destroy(&(mtx)->mtx_lock)
+#  define tracing_mutex_lock(x)      lockstat_mutex_lock(x)
+#  define tracing_mutex_trylock(ret,x) do { ret = lockstat_mutex_trylock(x); } while (0)
+#  define tracing_mutex_unlock(x)    do { \
+    lockstat_mutex_unlock(x); \
+    pthread_mutex_unlock(&(x)->mtx_lock); \
+} while (0)
+# else
+#  define tracing_mutex_t            pthread_mutex_t
+#  define TRACING_MUTEX_INITIALIZER_CLASS(_cls) PTHREAD_MUTEX_INITIALIZER
+#  define tracing_mutex_init_class(mtx, attr, _cls) pthread_mutex_init(mtx, attr)
+#  define tracing_mutex_raw(mtx)     (mtx)
+#  define tracing_mutex_destroy      pthread_mutex_destroy
+#  define tracing_mutex_lock         pthread_mutex_lock
+#  define tracing_mutex_trylock(ret,x) do { ret = pthread_mutex_trylock(x); } while (0)
+#  define tracing_mutex_unlock       pthread_mutex_unlock
+# endif
 #endif
 
+#define TRACING_MUTEX_INITIALIZER           TRACING_MUTEX_INITIALIZER_CLASS(LOCKSTAT_OTHER)
+#define tracing_mutex_init(mtx, attr)       tracing_mutex_init_class(mtx, attr, LOCKSTAT_OTHER)
+
+struct libkqueue_lockstat;
+int  lockstat_export(struct libkqueue_lockstat *out, size_t n);
+void lockstat_report(FILE *fp);
+
 
 #endif  /* ! _DEBUG_H */
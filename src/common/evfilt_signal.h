@@ -93,7 +93,7 @@ struct sentry {
     LIST_HEAD(, sig_link)  s_links;
 };
 
-static pthread_mutex_t sigtbl_mtx = PTHREAD_MUTEX_INITIALIZER;
+static tracing_mutex_t sigtbl_mtx = TRACING_MUTEX_INITIALIZER_CLASS(LOCKSTAT_SIGTBL);
 /*
  * UNUSED suppresses a spurious -Wunused-variable from musl-gcc;
  * sigtbl is referenced through sig_dispatch_handle which the
@@ -514,13 +514,13 @@ evfilt_signal_destroy(struct filter *filt)
     int sig;
 
     if (sfs != NULL) {
-        pthread_mutex_lock(&sigtbl_mtx);
+        tracing_mutex_lock(&sigtbl_mtx);
         for (sig = 0; sig < SIGNAL_MAX; sig++) {
             struct sig_link *sl = &sfs->sfs_links[sig];
             if (LIST_INSERTED(sl, sl_entry))
                 LIST_REMOVE_ZERO(sl, sl_entry);
         }
-        pthread_mutex_unlock(&sigtbl_mtx);
+        tracing_mutex_unlock(&sigtbl_mtx);
         free(sfs);
         filt->kf_state.sig.state = NULL;
     }
@@ -573,7 +573,7 @@ evfilt_signal_knote_create(struct filter *filt, struct knote *kn)
     sfs = filt->kf_state.sig.state;
     sl = &sfs->sfs_links[sig];
 
-    pthread_mutex_lock(&sigtbl_mtx);
+    tracing_mutex_lock(&sigtbl_mtx);
     first = LIST_EMPTY(&sigtbl[sig].s_links);
     if (!LIST_INSERTED(sl, sl_entry))
         LIST_INSERT_HEAD(&sigtbl[sig].s_links, sl, sl_entry);
@@ -596,7 +596,7 @@ evfilt_signal_knote_create(struct filter *filt, struct knote *kn)
             rv = -1;
         }
     }
-    pthread_mutex_unlock(&sigtbl_mtx);
+    tracing_mutex_unlock(&sigtbl_mtx);
 
     if (rv == 0)
         dbg_printf("registered knote for signal %d (first=%d)", sig, first);
@@ -627,7 +627,7 @@ evfilt_signal_knote_delete(struct filter *filt, struct knote *kn)
 
     (void) filt;
 
-    pthread_mutex_lock(&sigtbl_mtx);
+    tracing_mutex_lock(&sigtbl_mtx);
     if (LIST_INSERTED(kn, kn_signal_entry))
         LIST_REMOVE_ZERO(kn, kn_signal_entry);
     if (LIST_INSERTED(kn, kn_signal_pending))
@@ -645,7 +645,7 @@ evfilt_signal_knote_delete(struct filter *filt, struct knote *kn)
      */
     if (LIST_EMPTY(&sigtbl[sig].s_links) && sig_platform_remove(sig) < 0)
         dbg_perror("sig_platform_remove(%d)", sig);
-    pthread_mutex_unlock(&sigtbl_mtx);
+    tracing_mutex_unlock(&sigtbl_mtx);
 
     return (0);
 }
@@ -657,7 +657,7 @@ evfilt_signal_knote_enable(struct filter *filt, struct knote *kn)
     struct sig_link *sl = &sfs->sfs_links[(int) kn->kev.ident];
     int wake = 0;
 
-    pthread_mutex_lock(&sigtbl_mtx);
+    tracing_mutex_lock(&sigtbl_mtx);
     if (LIST_INSERTED(kn, kn_signal_entry))
         LIST_REMOVE_ZERO(kn, kn_signal_entry);
     LIST_INSERT_HEAD(&sl->kn_enabled, kn, kn_signal_entry);
@@ -671,7 +671,7 @@ evfilt_signal_knote_enable(struct filter *filt, struct knote *kn)
         LIST_INSERT_HEAD(&sfs->sfs_pending, kn, kn_signal_pending);
         wake = 1;
     }
-    pthread_mutex_unlock(&sigtbl_mtx);
+    tracing_mutex_unlock(&sigtbl_mtx);
 
     if (wake)
         (void) kqops.eventfd_raise(&filt->kf_efd);
@@ -686,7 +686,7 @@ evfilt_signal_knote_disable(struct filter *filt, struct knote *kn)
 
     (void) filt;
 
-    pthread_mutex_lock(&sigtbl_mtx);
+    tracing_mutex_lock(&sigtbl_mtx);
     if (LIST_INSERTED(kn, kn_signal_entry))
         LIST_REMOVE_ZERO(kn, kn_signal_entry);
     /*
@@ -697,7 +697,7 @@ evfilt_signal_knote_disable(struct filter *filt, struct knote *kn)
     if (LIST_INSERTED(kn, kn_signal_pending))
         LIST_REMOVE_ZERO(kn, kn_signal_pending);
     LIST_INSERT_HEAD(&sl->kn_disabled, kn, kn_signal_entry);
-    pthread_mutex_unlock(&sigtbl_mtx);
+    tracing_mutex_unlock(&sigtbl_mtx);
     return (0);
 }
 
@@ -718,7 +718,7 @@ evfilt_signal_copyout(struct kevent *dst, int nevents, struct filter *filt,
     int n_emitted = 0;
     int rv = 0;
 
-    pthread_mutex_lock(&sigtbl_mtx);
+    tracing_mutex_lock(&sigtbl_mtx);
     LIST_FOREACH_SAFE(kn, &sfs->sfs_pending, kn_signal_pending, kn_tmp) {
         if (n_emitted >= nevents)
             break;
@@ -734,7 +734,7 @@ evfilt_signal_copyout(struct kevent *dst, int nevents, struct filter *filt,
         kn->kn_signal_count = 0;
         emitted[n_emitted++] = kn;
     }
-    pthread_mutex_unlock(&sigtbl_mtx);
+    tracing_mutex_unlock(&sigtbl_mtx);
 
     for (int i = 0; i < n_emitted; i++) {
         if (knote_copyout_flag_actions(filt, emitted[i]) < 0) {
@@ -208,24 +208,24 @@ sig_platform_wait_dispatch(void)
          * and dispatch and cause pre-existing siginfos to be
          * mis-attributed.
          */
-        pthread_mutex_lock(&sigtbl_mtx);
+        tracing_mutex_lock(&sigtbl_mtx);
         n = read(sig_signalfd, si, sizeof(si));
         if (n < 0) {
             int saved = errno;
-            pthread_mutex_unlock(&sigtbl_mtx);
+            tracing_mutex_unlock(&sigtbl_mtx);
             if (saved == EINTR || saved == EAGAIN) return (1);
             dbg_printf("read(signalfd): %s", strerror(saved));
             return (-1);
         }
         if ((size_t) n < sizeof(si[0])) {
-            pthread_mutex_unlock(&sigtbl_mtx);
+            tracing_mutex_unlock(&sigtbl_mtx);
             dbg_printf("read(signalfd): short read (%zd bytes)", n);
             return (1);
         }
         count = (size_t) n / sizeof(si[0]);
         for (i = 0; i < count; i++)
             sig_dispatch_handle((int) si[i].ssi_signo);
-        pthread_mutex_unlock(&sigtbl_mtx);
+        tracing_mutex_unlock(&sigtbl_mtx);
     }
 
     return (1);
@@ -59,26 +59,42 @@ filter_free_all(void)
 #undef FILTER_ENTRY
 }
 
+/** Set up a kqueue's state for a filter the first time it's used
+ *
+ * A kqueue only carries a pointer per filter type, most sessions
+ * use two or three of the twelve, so per-filter state (the knote
+ * index, ready lists, eventfd and the like) is only allocated when
+ * an EV_ADD or a filter setting first names the filter.  Changes and
+ * queries which only read state use filter_peek instead.
+ *
+ * Must be called with the kq_mtx held.
+ *
+ * @param[in] kq    to set up the filter on.
+ * @param[in] id    EVFILT_* of the filter.
+ * @return
+ *    - 0 on success.
+ *    - -1 on failure (errno set).  ENOSYS if the filter isn't
+ *      implemented on this platform.
+ */
 static int
-filter_register(struct kqueue *kq, const struct filter *src)
+filter_register(struct kqueue *kq, short id)
 {
+    const struct filter *src = NULL;
     struct filter *dst;
-    unsigned int filt;
-    int rv = 0;
+
+#define FILTER_ENTRY(_name) if (_name.kf_id == id) src = &_name;
+#include "filter_list.h"
+#undef FILTER_ENTRY
 
     /*
-     * This filter is not implemented, see EVFILT_NOTIMPL.
+     * Not compiled in, or this filter is not implemented,
+     * see EVFILT_NOTIMPL.
      */
-    if (src->kf_id == 0) return (0);
-
-    filt = (-1 * src->kf_id) - 1; /* flip sign, and convert to array offset */
-    if (filt >= EVFILT_SYSCOUNT)
+    if (src == NULL) {
+        dbg_printf("filt=%d - filt_name=%s not implemented", id, filter_name(id));
+        errno = ENOSYS;
         return (-1);
-
-    dst = &kq->kq_filt[filt];
-    memcpy(dst, src, sizeof(*src));
-    dst->kf_kqueue = kq;
-    RB_INIT(&dst->kf_index);
+    }
 
     assert(src->kf_copyout);
     assert(src->kn_create);
@@ -87,49 +103,70 @@ filter_register(struct kqueue *kq, const struct filter *src)
     assert(src->kn_enable);
     assert(src->kn_disable);
 
+    dst = malloc(sizeof(*dst));
+    if (dst == NULL)
+        return (-1);
+    memcpy(dst, src, sizeof(*src));
+    dst->kf_kqueue = kq;
+    RB_INIT(&dst->kf_index);
+    TAILQ_INIT(&dst->kf_coalesced);
+
     /* Perform (optional) per-filter initialization */
     if (src->kf_init != NULL) {
-        rv = src->kf_init(dst);
-        if (rv < 0) {
+        if (src->kf_init(dst) < 0) {
             dbg_puts("filter failed to initialize");
-            dst->kf_id = 0;
+            free(dst);
             return (-1);
         }
     }
 
-    /* kqops.filter_init's signature takes non-const; cast is safe
-     * here (we're the only caller) but the vtable should take
-     * const - see TODO.md. */
-    if ((kqops.filter_init != NULL) && (kqops.filter_init(kq, dst) < 0))
+    if ((kqops.filter_init != NULL) && (kqops.filter_init(kq, dst) < 0)) {
+        if (src->kf_destroy != NULL)
+            src->kf_destroy(dst);
+        free(dst);
         return (-1);
+    }
+
+    kq->kq_filt[~id] = dst;
+    dbg_printf("filt=%d - filt_name=%s registered", id, filter_name(id));
 
     return (0);
 }
 
+/** Set up the filters which can't wait until first use
+ *
+ * Called from a backend's kqueue_init, before the kqueue is
+ * reachable from any other thread.
+ *
+ * @param[in] kq    to set up the kf_eager filters on.
+ * @return
+ *    - 0 on success.
+ *    - -1 on failure (errno set), with no filters registered.
+ */
 int
-filter_register_all(struct kqueue *kq)
+filter_register_eager(struct kqueue *kq)
 {
-    int rv;
+    int rv = 0;
 
-    rv = 0;
-#define FILTER_ENTRY(_name) rv += filter_register(kq, &_name);
+#define FILTER_ENTRY(_name) \
+    if ((rv == 0) && _name.kf_eager) rv = filter_register(kq, _name.kf_id);
 #include "filter_list.h"
 #undef FILTER_ENTRY
-    if (rv != 0) {
+    if (rv < 0) {
+        int err = errno;
+
         /*
          * Per-kq lock is required by knote_delete_all's lockset
-         * assertion.  filter_register_all runs from kqueue() before
-         * the kq is reachable from any other thread, so the lock is
-         * uncontended; we just satisfy the invariant.
+         * assertion, it's uncontended here.
          */
         kqueue_lock(kq);
         filter_unregister_all(kq);
         kqueue_unlock(kq);
+        errno = err;
         return (-1);
-    } else {
-        dbg_puts("complete");
-        return (0);
     }
+
+    return (0);
 }
 
 void
@@ -138,9 +175,9 @@ filter_unregister_all(struct kqueue *kq)
     int i;
 
     for (i = 0; i < NUM_ELEMENTS(kq->kq_filt); i++) {
-        struct filter *filt = &kq->kq_filt[i];
+        struct filter *filt = kq->kq_filt[i];
 
-        if (filt->kf_id == 0)
+        if (filt == NULL)
             continue;
 
         /*
@@ -156,18 +193,75 @@ filter_unregister_all(struct kqueue *kq)
         knote_delete_all(filt);
 
         if (filt->kf_destroy != NULL)
-            filt->kf_destroy(&kq->kq_filt[i]);
+            filt->kf_destroy(filt);
 
         if (kqops.filter_free != NULL)
             kqops.filter_free(kq, filt);
 
+        free(filt);
+        kq->kq_filt[i] = NULL;
     }
-    memset(&kq->kq_filt[0], 0, sizeof(kq->kq_filt));
+}
+
+/** @return true if the filter sets up knotes before the kqueue is locked, see kn_prepare
+ */
+bool
+filter_has_prepare(short id)
+{
+    bool has = false;
+
+#define FILTER_ENTRY(_name) \
+    if ((_name.kf_id == id) && _name.kn_prepare) has = true;
+#include "filter_list.h"
+#undef FILTER_ENTRY
+
+    return (has);
+}
+
+/** Set up a knote for an EV_ADD change before the kqueue is locked
+ *
+ * @param[in] kev   change to prepare for.
+ * @return a knote with KNFL_PREPARED set, or NULL if the filter
+ *      has no kn_prepare or didn't prepare anything.
+ */
+struct knote *
+filter_prepare(const struct kevent *kev)
+{
+    struct knote *kn = NULL;
+
+#define FILTER_ENTRY(_name) \
+    if ((_name.kf_id == kev->filter) && _name.kn_prepare) kn = _name.kn_prepare(kev);
+#include "filter_list.h"
+#undef FILTER_ENTRY
+
+    if (kn != NULL)
+        memcpy(&kn->kev, kev, sizeof(kn->kev));     /* so filter_unprepare can find the filter */
+
+    return (kn);
+}
+
+/** Free a knote from filter_prepare that kevent_copyin didn't use
+ *
+ * @param[in] kn    to free.
+ */
+void
+filter_unprepare(struct knote *kn)
+{
+#define FILTER_ENTRY(_name) \
+    if ((_name.kf_id == kn->kev.filter) && _name.kn_unprepare) _name.kn_unprepare(kn);
+#include "filter_list.h"
+#undef FILTER_ENTRY
+
+    kn->kn_flags |= KNFL_KNOTE_DELETED;
+    knote_release(kn);
 }
 
 /*
  * Lookup filters in the array of filters registered for kq
  *
+ * The filter's state is allocated on first lookup, so this must be
+ * called with the kq_mtx held.
+ *
  * @param[out] filt    the specified ID resolves to.
  * @param[in] kq       to lookup the filter in.
  * @param[in] id       of the filter to lookup.
@@ -184,11 +278,51 @@ filter_lookup(struct filter **filt, struct kqueue *kq, short id)
         *filt = NULL;
         return (-1);
     }
-    *filt = &kq->kq_filt[~id];
-    if ((*filt)->kf_copyout == NULL) {
+    *filt = kq->kq_filt[~id];
+    if (likely(*filt != NULL))
+        return (0);
+
+    if (filter_register(kq, id) < 0)
+        return (-1);
+    *filt = kq->kq_filt[~id];
+
+    return (0);
+}
+
+/** Lookup a filter without setting up its state
+ *
+ * For changes and queries which only read existing state, so
+ * naming a filter the kqueue has never used doesn't allocate it.
+ *
+ * @param[out] filt    the specified ID resolves to, NULL if the
+ *                     kqueue hasn't used the filter yet.
+ * @param[in] kq       to lookup the filter in.
+ * @param[in] id       of the filter to lookup.
+ * @return
+ *    - 0 on success.
+ *    - -1 on failure (errno set), as filter_lookup.
+ */
+int
+filter_peek(struct filter **filt, struct kqueue *kq, short id)
+{
+    bool found = false;
+
+    if (~id < 0 || ~id >= EVFILT_SYSCOUNT) {
+        dbg_printf("filt=%d inv_filt=%d - invalid id", id, (~id));
+        errno = EINVAL;
+        *filt = NULL;
+        return (-1);
+    }
+    *filt = kq->kq_filt[~id];
+    if (likely(*filt != NULL))
+        return (0);
+
+#define FILTER_ENTRY(_name) if (_name.kf_id == id) found = true;
+#include "filter_list.h"
+#undef FILTER_ENTRY
+    if (!found) {
         dbg_printf("filt=%d - filt_name=%s not implemented", id, filter_name(id));
         errno = ENOSYS;
-        *filt = NULL;
         return (-1);
     }
 
@@ -25,6 +25,10 @@
 
 static struct kevent null_kev[1]; /* null kevent for when we get passed a NULL eventlist */
 
+#ifndef _WIN32
+__thread const sigset_t *kevent_wait_sigmask;
+#endif
+
 static const char *
 kevent_filter_dump(const struct kevent *kev)
 {
@@ -95,6 +99,7 @@ kevent_fflags_dump(const struct kevent *kev)
         KEVFFL_DUMP(NOTE_USECONDS);
         KEVFFL_DUMP(NOTE_NSECONDS);
         KEVFFL_DUMP(NOTE_ABSOLUTE);
+        KEVFFL_DUMP(NOTE_LEEWAY);
         break;
 #endif
 #ifdef EVFILT_LIBKQUEUE
@@ -186,7 +191,8 @@ kevent_dump(const struct kevent *kev)
  *       in the data field.
  */
 static int
-kevent_copyin_one(const struct knote **out, struct kqueue *kq, const struct kevent *src)
+kevent_copyin_one(const struct knote **out, struct kqueue *kq, const struct kevent *src,
+                  struct knote **prep)
 {
     struct knote  *kn = NULL;
     struct filter *filt;
@@ -198,15 +204,34 @@ kevent_copyin_one(const struct knote **out, struct kqueue *kq, const struct keve
         return (-1);
     }
 
-    if (filter_lookup(&filt, kq, src->filter) < 0)
-        return (-1);
+    /*
+     * Only EV_ADD sets up a filter the kqueue hasn't used yet,
+     * anything else on it can't find a knote.
+     */
+    if (src->flags & EV_ADD) {
+        if (filter_lookup(&filt, kq, src->filter) < 0)
+            return (-1);
+    } else {
+        if (filter_peek(&filt, kq, src->filter) < 0)
+            return (-1);
+        if (filt == NULL) {
+            dbg_printf("ident=%u - no knote found, filter unused", (unsigned int)src->ident);
+            errno = ENOENT;
+            *out = NULL;
+            return (-1);
+        }
+    }
+    filter_stat_inc(filt, kfs_changes);
 
     dbg_printf("src=%s", kevent_dump(src));
 
     kn = knote_lookup(filt, src->ident);
     if (kn == NULL) {
         if (src->flags & EV_ADD) {
-            if ((kn = knote_new()) == NULL) {
+            if (prep && *prep) {
+                kn = *prep;     /* set up by kevent_prepare, kn_create takes its resources */
+                *prep = NULL;
+            } else if ((kn = knote_new()) == NULL) {
                 errno = ENOENT;
                 *out = NULL;
                 return (-1);
@@ -215,7 +240,15 @@ kevent_copyin_one(const struct knote **out, struct kqueue *kq, const struct keve
             kn->kev.flags &= ~EV_ENABLE;
             kn->kn_kq = kq;
             assert(filt->kn_create);
-            rv = filt->kn_create(filt, kn);
+
+            /*
+             * Receipts are written as the changelist is processed,
+             * so only changes without one can have their kernel
+             * registration queued until kevent_flush.
+             */
+            kq->kq_creating = (src->flags & EV_RECEIPT) ? NULL : src;
+            rv = filter_kn_create(filt, kn);
+            kq->kq_creating = NULL;
             if (rv < 0) {
                 int saved_errno = errno;
 
@@ -242,7 +275,7 @@ kevent_copyin_one(const struct knote **out, struct kqueue *kq, const struct keve
  */
             if (src->flags & EV_DISABLE) {
                 kn->kev.flags |= EV_DISABLE;
-                return filt->kn_disable(filt, kn);
+                return filter_kn_disable(filt, kn);
             }
             //........................................
             return (rv);
@@ -297,7 +330,7 @@ kevent_copyin_one(const struct knote **out, struct kqueue *kq, const struct keve
         if (src->flags & EV_ADD || src->flags == 0 ||
             src->flags & EV_RECEIPT ||
             ((src->flags & EV_ENABLE) && (src->fflags & NOTE_TRIGGER))) {
-            rv = filt->kn_modify(filt, kn, src);
+            rv = filter_kn_modify(filt, kn, src);
             if (rv == 0) {
                 /*
                  * udata is opaque user state every filter stores
@@ -330,10 +363,62 @@ out:
     return (rv);
 }
 
+/** Report changes whose queued kernel registration was rejected
+ *
+ * Their knotes were inserted when kn_create returned, so they're
+ * deleted here.  Each gets an EV_ERROR entry after the receipts
+ * for the rest of the changelist.
+ *
+ * @param[in] kq        to flush.
+ * @param[in,out] el_p  where to write the next EV_ERROR entry.
+ * @param[in] el_end    end of the eventlist.
+ * @return
+ *      - 0 on success.
+ *      - -1 if there wasn't room for every entry, errno set
+ *        to the first error which couldn't be reported.
+ */
+static int
+kevent_copyin_flush(struct kqueue *kq, struct kevent **el_p, struct kevent *el_end)
+{
+    struct kevent_change_error *errors;
+    int i, n, rv = 0;
+
+    if (kqops.kevent_flush == NULL)
+        return (0);
+
+    n = kqops.kevent_flush(kq, &errors);
+    for (i = 0; i < n; i++) {
+        struct kevent_change_error *ce = &errors[i];
+        struct filter *filt;
+
+        dbg_printf("kn=%p - registration failed: %s", ce->kce_kn, strerror(ce->kce_errno));
+
+        /* A later change may have deleted it already */
+        if (!(ce->kce_kn->kn_flags & KNFL_KNOTE_DELETED) &&
+            (filter_lookup(&filt, kq, ce->kce_kev.filter) == 0))
+            knote_delete(filt, ce->kce_kn);
+        knote_release(ce->kce_kn);
+
+        if (*el_p == el_end) {
+            if (rv == 0) {
+                errno = ce->kce_errno;
+                rv = -1;
+            }
+            continue;
+        }
+        memcpy(*el_p, &ce->kce_kev, sizeof(**el_p));
+        (*el_p)->flags |= EV_ERROR;
+        (*el_p)->data = ce->kce_errno;
+        (*el_p)++;
+    }
+
+    return (rv);
+}
+
 /** @return number of events added to the eventlist */
 static int
 kevent_copyin(struct kqueue *kq, const struct kevent changelist[], int nchanges,
-        struct kevent eventlist[], int nevents)
+        struct kevent eventlist[], int nevents, struct knote *prep[], int nprep)
 {
     int status;
     int rv;
@@ -354,12 +439,14 @@ kevent_copyin(struct kqueue *kq, const struct kevent changelist[], int nchanges,
          cl_p < cl_end;
          cl_p++) {
         const struct knote *kn;
+        int i = cl_p - changelist;
 
-        rv = kevent_copyin_one(&kn, kq, cl_p);
+        rv = kevent_copyin_one(&kn, kq, cl_p, (i < nprep) ? &prep[i] : NULL);
+        trace_record(TRACE_COPYIN, kq->kq_id, cl_p, cl_p->data, rv);
         if (rv == 1) {
             if (el_p == el_end) {
                 errno = EFAULT;
-                return (-1);
+                goto error;
             }
             memcpy(el_p, &kn->kev, sizeof(*el_p));
             el_p->flags |= EV_RECEIPT;
@@ -376,7 +463,7 @@ kevent_copyin(struct kqueue *kq, const struct kevent changelist[], int nchanges,
              * a kevent array with >= entries as the changelist.
              */
             if (el_p == el_end)
-                return (-1);
+                goto error;
             status = errno;
             errno = 0; /* Reset back to 0 if we recorded the error as a kevent */
 
@@ -401,13 +488,114 @@ kevent_copyin(struct kqueue *kq, const struct kevent changelist[], int nchanges,
             status = 0;
             if (el_p == el_end) {
                 errno = EFAULT;
-                return (-1);
+                goto error;
             }
             goto receipt;
         }
     }
 
+    if (kevent_copyin_flush(kq, &el_p, el_end) < 0)
+        return (-1);
+
     return (el_p - eventlist);
+
+error:
+    /*
+     * Queued registrations must still be submitted, and
+     * rejected ones deleted, but there's no room to say so.
+     */
+    status = errno;
+    (void) kevent_copyin_flush(kq, &el_p, el_end);
+    errno = status;
+
+    return (-1);
+}
+
+/** Set up knotes for the first KEVENT_PREPARE_MAX EV_ADD changes
+ *
+ * Runs before the kqueue is locked for copyin so filters can do
+ * expensive setup, like opening descriptors, without serialising
+ * other threads.  See kn_prepare.
+ *
+ * An EV_ADD for a knote which already exists is a modify, and
+ * anything prepared for it would just be thrown away again, so
+ * those are looked up first.  That's a brief hold of the kqueue
+ * lock, only taken if there's something to prepare.  The knote
+ * may be added or deleted before copyin, kevent_copyin handles
+ * a change either way, prepared or not.
+ *
+ * @param[in] kqfd          the changes are for.
+ * @param[in] changelist    from the caller.
+ * @param[in] nchanges      entries in changelist.
+ * @param[out] prep         one entry per change, NULL if nothing
+ *                          was prepared for it.
+ * @return the number of entries in prep that are valid.
+ */
+static int
+kevent_prepare(int kqfd, const struct kevent changelist[], int nchanges, struct knote *prep[])
+{
+    bool want[KEVENT_PREPARE_MAX];
+    struct kqueue *kq;
+    int i, n = 0, nwant = 0;
+
+    if (nchanges > KEVENT_PREPARE_MAX)
+        nchanges = KEVENT_PREPARE_MAX;
+
+    for (i = 0; i < nchanges; i++) {
+        want[i] = (changelist[i].flags & EV_ADD) && filter_has_prepare(changelist[i].filter);
+        if (want[i])
+            nwant++;
+    }
+
+    if (nwant > 0) {
+        if (libkqueue_thread_safe)
+            tracing_mutex_lock(&kq_mtx);
+        kq = kqueue_lookup(kqfd);
+        if (kq != NULL) {
+            kqueue_lock(kq);
+            if (libkqueue_thread_safe)
+                tracing_mutex_unlock(&kq_mtx);
+
+            for (i = 0; i < nchanges; i++) {
+                struct filter *filt;
+
+                if (!want[i])
+                    continue;
+
+                /* Not allocated yet means no knotes */
+                filt = kq->kq_filt[~changelist[i].filter];
+                if ((filt != NULL) && (knote_lookup(filt, changelist[i].ident) != NULL))
+                    want[i] = false;
+            }
+            kqueue_unlock(kq);
+        } else if (libkqueue_thread_safe) {
+            tracing_mutex_unlock(&kq_mtx);
+        }
+    }
+
+    for (i = 0; i < nchanges; i++) {
+        prep[i] = want[i] ? filter_prepare(&changelist[i]) : NULL;
+        if (prep[i] != NULL)
+            n = i + 1;
+    }
+
+    return (n);
+}
+
+/** Free any prepared knotes kevent_copyin didn't use
+ *
+ * Called after the kqueue is unlocked.
+ */
+static void
+kevent_unprepare(struct knote *prep[], int nprep)
+{
+    int i, saved_errno = errno;
+
+    for (i = 0; i < nprep; i++) {
+        if (prep[i] != NULL)
+            filter_unprepare(prep[i]);
+    }
+    errno = saved_errno;
 }
 
 #ifndef _WIN32
@@ -430,6 +618,214 @@ kevent_release_kq_mutex(void *arg)
 }
 #endif
 
+/** Re-enable coalesced knotes and limit the wait to the end of the next NOTE_COALESCE window
+ *
+ * @param[in] kq            to check.
+ * @param[in] timeout       the caller's timeout, NULL for forever.
+ * @param[in] deadline      when the caller's timeout expires, from trace_now().
+ * @param[out] buf          storage for a shortened timeout.
+ * @param[out] shortened    true if the returned timeout ends a window
+ *                          rather than the caller's wait.
+ * @return the timeout to pass to kevent_wait.
+ *
+ * @note Only the caller's own wait is shortened.  Threads already
+ *       parked in kevent() when a window opens aren't woken when
+ *       it ends, if they waited with a NULL timeout they sleep
+ *       until some other event arrives.  The next kevent() call
+ *       on the kqueue, from any thread, re-enables the knotes.
+ */
+static const struct timespec *
+kevent_coalesce_timeout(struct kqueue *kq, const struct timespec *timeout, uint64_t deadline,
+                        struct timespec *buf, bool *shortened)
+{
+    uint64_t now, next;
+
+    *shortened = false;
+    if (kq->kq_coalesced == 0)
+        return timeout;
+
+    now = trace_now();
+    next = knote_coalesce_expire(kq, now);
+    if ((next == 0) || ((timeout != NULL) && ((now + next) >= deadline)))
+        return timeout;
+
+    buf->tv_sec = (time_t)(next / 1000000000ULL);
+    buf->tv_nsec = (long)(next % 1000000000ULL);
+    *shortened = true;
+
+    return buf;
+}
+
+/** Wait for events then copy them out
+ *
+ * Called with the kqueue locked.  On platforms with
+ * KEVENT_WAIT_DROP_LOCK the lock is released across the wait.
+ *
+ * @param[in] kq                to wait on.
+ * @param[in] timeout           how long to wait, NULL for forever.
+ * @param[out] el_p             where to write events.
+ * @param[in] nevents           space at el_p.
+ * @param[in] cancel_state      to set while waiting, the caller's
+ *                              own cancel state is restored so a
+ *                              long wait can be cancelled.
+ * @param[out] nout             events written to el_p.
+ * @return
+ *      - > 0 if the wait returned readiness (nout may still be 0).
+ *      - 0 on timeout.
+ *      - -1 on error.
+ */
+static int
+kevent_wait_copyout(struct kqueue *kq, const struct timespec *timeout,
+                    struct kevent *el_p, int nevents, UNUSED int cancel_state, int *nout)
+{
+    uint64_t wait_start = 0, deadline = 0;
+    struct timespec coalesce_timeout, remaining;
+    const struct timespec *wait_timeout;
+    bool shortened;
+    int rv;
+
+    *nout = 0;
+
+#ifndef _WIN32
+    (void)pthread_setcancelstate(cancel_state, NULL);
+    if (cancel_state == PTHREAD_CANCEL_ENABLE) {
+        dbg_printf("Checking for deferred cancellations");
+        pthread_testcancel();
+    }
+#endif
+    /*
+     * Drop the kq mutex across the wait on platforms that opt
+     * in via KEVENT_WAIT_DROP_LOCK in their platform.h.
+     *
+     * Holding the userspace kq_mtx across the wait syscall blocks
+     * any other thread that wants to add or trigger events on this
+     * kq, which breaks the cross-thread EVFILT_USER wake pattern.
+     * Every libkqueue backend that compiles this file (Linux,
+     * POSIX, Solaris, Windows) opts in; each pairs the drop with
+     * its own in-flight tracking so the wait doesn't return into a
+     * freed kq.  Native BSD/macOS use the host kqueue and never
+     * build this path.
+     */
+    if ((kq->kq_coalesced > 0) && (timeout != NULL))
+        deadline = trace_now() + (uint64_t)timeout->tv_sec * 1000000000ULL + (uint64_t)timeout->tv_nsec;
+
+    for (;;) {
+        /*
+         * NOTE_COALESCE: don't sleep past the end of a window,
+         * the knote has to be re-enabled for anything that
+         * became ready during it to be reported.
+         */
+        wait_timeout = kevent_coalesce_timeout(kq, timeout, deadline, &coalesce_timeout, &shortened);
+
+        if (unlikely(trace_enabled()))
+            wait_start = trace_now();
+#ifdef KEVENT_WAIT_DROP_LOCK
+        kqueue_unlock(kq);
+#endif
+        rv = kqueue_kevent_wait(kq, nevents, wait_timeout);
+        trace_record(TRACE_WAIT, kq->kq_id, NULL,
+                     wait_start ? (int64_t)(trace_now() - wait_start) : 0, rv);
+#ifdef KEVENT_WAIT_DROP_LOCK
+        kqueue_lock(kq);
+#endif
+        if ((rv != 0) || !shortened)
+            break;
+
+        /*
+         * Only a window ended, wait again for whatever's
+         * left of the caller's timeout.
+         */
+        if (timeout != NULL) {
+            uint64_t now = trace_now();
+
+            if (now >= deadline)
+                break;
+            remaining.tv_sec = (time_t)((deadline - now) / 1000000000ULL);
+            remaining.tv_nsec = (long)((deadline - now) % 1000000000ULL);
+            timeout = &remaining;
+        }
+    }
+#ifndef _WIN32
+    (void)pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+#endif
+    dbg_printf("kqops.kevent_wait rv=%i", rv);
+    if (rv <= 0)
+        return rv;
+
+    rv = kqueue_kevent_copyout(kq, rv, el_p, nevents);
+    dbg_printf("kevent_copyout rv=%i", rv);
+    if (rv < 0)
+        return (-1);
+    if (rv == 0) {
+        kqueue_stat_inc(kq, kqs_empty_wakeups);
+        return (1);
+    }
+
+    kqueue_stat_add(kq, kqs_events, rv);
+    if (unlikely(trace_enabled())) {
+        int n;
+
+        for (n = 0; n < rv; n++)
+            trace_emit(TRACE_COPYOUT, kq->kq_id, &el_p[n], el_p[n].data, 0);
+    }
+    *nout = rv;
+
+    return (1);
+}
+
+/** Keep collecting events until the NOTE_BATCH minimum is reached
+ *
+ * Called once the first wait has produced events.  Waits at most
+ * the kqueue's batch timeout (or the caller's own timeout if that's
+ * shorter) from now, so a batch adds bounded latency to the events
+ * already collected.  Errors end the batch early, the events we
+ * already have are still returned.
+ *
+ * @param[in] kq        to wait on.
+ * @param[in,out] el_p  next free slot in the eventlist, advanced
+ *                      past any events collected.
+ * @param[in] el_end    end of the eventlist.
+ * @param[in] have      events collected so far.
+ * @param[in] timeout   the caller's timeout, NULL for forever.
+ */
+static void
+kevent_batch(struct kqueue *kq, struct kevent **el_p, struct kevent *el_end,
+             int have, const struct timespec *timeout)
+{
+    uint64_t want = kq->kq_batch_min;
+    uint64_t batch_ns, deadline, now;
+    struct timespec remaining;
+    int n;
+#ifndef _WIN32
+    int cancel_state = PTHREAD_CANCEL_DISABLE;  /* batch waits are short */
+#else
+    int cancel_state = 0;
+#endif
+
+    if (want > (uint64_t)(el_end - *el_p) + have)
+        want = (uint64_t)(el_end - *el_p) + have;
+
+    batch_ns = kq->kq_batch_timeout_ns ? (uint64_t)kq->kq_batch_timeout_ns : KEVENT_BATCH_TIMEOUT_NS;
+    if ((timeout != NULL) &&
+        (((uint64_t)timeout->tv_sec * 1000000000ULL + (uint64_t)timeout->tv_nsec) < batch_ns))
+        batch_ns = (uint64_t)timeout->tv_sec * 1000000000ULL + (uint64_t)timeout->tv_nsec;
+
+    now = trace_now();
+    deadline = now + batch_ns;
+
+    while (((uint64_t)have < want) && (now < deadline)) {
+        remaining.tv_sec = (time_t)((deadline - now) / 1000000000ULL);
+        remaining.tv_nsec = (long)((deadline - now) % 1000000000ULL);
+
+        if (kevent_wait_copyout(kq, &remaining, *el_p, el_end - *el_p,
+                                cancel_state, &n) <= 0)
+            break;
+        *el_p += n;
+        have += n;
+        now = trace_now();
+    }
+}
+
 int VISIBLE
 kevent(int kqfd,
        const struct kevent changelist[], int nchanges,
@@ -439,10 +835,10 @@ kevent(int kqfd,
     struct kqueue *kq;
     struct kevent *el_p, *el_end;
     struct kqueue_kevent_state state = { 0 };
+    struct knote *prep[KEVENT_PREPARE_MAX];
+    int nprep;
     int rv = 0;
-#ifndef _WIN32
-    int prev_cancel_state;
-#endif
+    int prev_cancel_state = 0;
 #ifndef NDEBUG
     static atomic_uint _kevent_counter = 0;
     unsigned int myid = 0;
@@ -473,6 +869,8 @@ kevent(int kqfd,
 #ifndef _WIN32
     pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &prev_cancel_state);
 #endif
+    nprep = kevent_prepare(kqfd, changelist, nchanges, prep);
+
     /*
      * Grab the global mutex.  This prevents
      * any operations that might free the
@@ -487,6 +885,7 @@ kevent(int kqfd,
         errno = ENOENT;
         if (libkqueue_thread_safe)
             tracing_mutex_unlock(&kq_mtx);
+        kevent_unprepare(prep, nprep);
 #ifndef _WIN32
         pthread_setcancelstate(prev_cancel_state, NULL);
 #endif
@@ -519,17 +918,20 @@ kevent(int kqfd,
      * in our own changelist sees this caller's epoch when it queues a udata.
      */
     kqueue_kevent_enter(kq, &state);
+    kqueue_stat_inc(kq, kqs_kevent_calls);
+    trace_record(TRACE_KEVENT_ENTER, kq->kq_id, NULL, nchanges, nevents);
 
     /*
      * Process each kevent on the changelist.
      */
     if (nchanges > 0) {
+        kqueue_stat_add(kq, kqs_changes, nchanges);
         /*
          * Grab the kqueue specific mutex, this
          * prevents any operations on the specific
          * kqueue from progressing.
          */
-        rv = kevent_copyin(kq, changelist, nchanges, el_p, el_end - el_p);
+        rv = kevent_copyin(kq, changelist, nchanges, el_p, el_end - el_p, prep, nprep);
         dbg_printf("(%u) kevent_copyin rv=%d", myid, rv);
         if (rv < 0)
             goto out;
@@ -543,49 +945,25 @@ kevent(int kqfd,
      * the changelist, copy events out.
      */
     if ((el_end - el_p) > 0) {
+        int nout;
+
         /*
          * Allow cancellation in kevent_wait as we
          * may be waiting a long time for the thread
          * to exit...
          */
-#ifndef _WIN32
-        (void)pthread_setcancelstate(prev_cancel_state, NULL);
-        if (prev_cancel_state == PTHREAD_CANCEL_ENABLE) {
-            dbg_printf("Checking for deferred cancellations");
-            pthread_testcancel();
-        }
-#endif
-        /*
-         * Drop the kq mutex across the wait on platforms that opt
-         * in via KEVENT_WAIT_DROP_LOCK in their platform.h.
-         *
-         * Holding the userspace kq_mtx across the wait syscall blocks
-         * any other thread that wants to add or trigger events on this
-         * kq, which breaks the cross-thread EVFILT_USER wake pattern.
-         * Every libkqueue backend that compiles this file (Linux,
-         * POSIX, Solaris, Windows) opts in; each pairs the drop with
-         * its own in-flight tracking so the wait doesn't return into a
-         * freed kq.  Native BSD/macOS use the host kqueue and never
-         * build this path.
-         */
-#ifdef KEVENT_WAIT_DROP_LOCK
-        kqueue_unlock(kq);
-#endif
-        rv = kqops.kevent_wait(kq, nevents, timeout);
-#ifdef KEVENT_WAIT_DROP_LOCK
-        kqueue_lock(kq);
-#endif
-#ifndef _WIN32
-        (void)pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-#endif
-        dbg_printf("kqops.kevent_wait rv=%i", rv);
-        if (likely(rv > 0)) {
-            rv = kqops.kevent_copyout(kq, rv, el_p, el_end - el_p);
-            dbg_printf("(%u) kevent_copyout rv=%i", myid, rv);
-            if (rv >= 0) {
-                el_p += rv;             /* Add events from copyin */
-                rv = el_p - eventlist;  /* recalculate rv to be the total events in the eventlist */
-            }
+        rv = kevent_wait_copyout(kq, timeout, el_p, el_end - el_p, prev_cancel_state, &nout);
+        if (rv > 0) {
+            el_p += nout;               /* Add events from copyin */
+
+            /*
+             * NOTE_BATCH: trade a little latency on the first
+             * event for collecting more in the same call.
+             */
+            if ((nout > 0) && (kq->kq_batch_min > (unsigned int)nout) && (el_p < el_end))
+                kevent_batch(kq, &el_p, el_end, nout, timeout);
+
+            rv = el_p - eventlist;      /* recalculate rv to be the total events in the eventlist */
         } else if (rv == 0) {
             /* Timeout reached */
             dbg_printf("(%u) kevent_wait timedout", myid);
@@ -634,6 +1012,7 @@ out:
      * sweep.  No-op on platforms without deferred-free tracking.
      */
     kqueue_kevent_exit(kq, &state);
+    trace_record(TRACE_KEVENT_EXIT, kq->kq_id, NULL, 0, rv);
 
     /*
      * Snapshot kq_freeing under the per-kq lock so we can safely
@@ -654,8 +1033,90 @@ out:
     kqueue_unlock(kq);
     dbg_printf("--- END kevent %u ret %d ---", myid, rv);
 
+    kevent_unprepare(prep, nprep);
+
     if (needs_free)
         kqueue_complete_deferred_free(kq);
 
     return (rv);
 }
+
+#ifndef _WIN32
+/** kevent() which installs a signal mask for the duration of the wait
+ *
+ * The mask is swapped atomically by the backend's wait syscall
+ * (epoll_pwait, ppoll or pselect), so a loop that only wants a
+ * signal delivered while it's waiting doesn't need to call
+ * sigprocmask around each kevent().  A signal delivered during
+ * the wait fails the call with EINTR.
+ *
+ * @param[in] sigmask   to wait with, NULL to behave as kevent().
+ * @return as kevent(), or -1 with errno ENOTSUP if sigmask is set
+ *      and the backend can't swap masks atomically.
+ */
+int VISIBLE
+kevent_pwait(int kqfd,
+             const struct kevent changelist[], int nchanges,
+             struct kevent eventlist[], int nevents,
+             const struct timespec *timeout, const sigset_t *sigmask)
+{
+    int rv;
+
+#ifndef KEVENT_WAIT_SIGMASK
+    if (sigmask != NULL) {
+        errno = ENOTSUP;
+        return -1;
+    }
+#endif
+    kevent_wait_sigmask = sigmask;
+    rv = kevent(kqfd, changelist, nchanges, eventlist, nevents, timeout);
+    kevent_wait_sigmask = NULL;
+
+    return (rv);
+}
+#endif
+
+/** Wait for events and hand each to the handler registered in its udata
+ *
+ * Events are collected with kevent() into a buffer on our stack, and
+ * the handlers run once the kqueue is unlocked, so they're free to
+ * call kevent() on the same kqueue.  Events with a NULL udata are
+ * dropped, as are EV_ERROR entries.  Those are errors and EV_RECEIPT
+ * acknowledgements for changelist entries, not events, and their
+ * udata is whatever the change carried.
+ *
+ * @param[in] kqfd          to wait on.
+ * @param[in] changelist    applied before waiting, as with kevent().
+ * @param[in] nchanges      entries in changelist.
+ * @param[in] nevents       most events to dispatch, capped at KEVENT_DISPATCH_MAX.
+ * @param[in] timeout       as with kevent().
+ * @return
+ *      - The number of events collected, including any dropped.
+ *      - -1 on error (errno set).
+ */
+int VISIBLE
+kevent_dispatch(int kqfd,
+                const struct kevent changelist[], int nchanges,
+                int nevents, const struct timespec *timeout)
+{
+    struct kevent events[KEVENT_DISPATCH_MAX];
+    struct kevent_handler const *kh;
+    int i, rv;
+
+    if (nevents < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (nevents > KEVENT_DISPATCH_MAX)
+        nevents = KEVENT_DISPATCH_MAX;
+
+    rv = kevent(kqfd, changelist, nchanges, events, nevents, timeout);
+    for (i = 0; i < rv; i++) {
+        kh = events[i].udata;
+        if ((events[i].flags & EV_ERROR) || (kh == NULL))
+            continue;
+        kh->func(&events[i], kh->ctx);
+    }
+
+    return (rv);
+}
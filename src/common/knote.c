@@ -79,6 +79,7 @@ knote_insert(struct filter *filt, struct knote *kn)
     kqueue_mutex_assert(filt->kf_kqueue, MTX_LOCKED);
     RB_INSERT(knote_index, &filt->kf_index, kn);
     filt->kf_kqueue->kq_knote_count++;
+    filter_stat_inc(filt, kfs_knotes);
 }
 
 struct knote *
@@ -145,6 +146,22 @@ knote_foreach(struct filter *filt, int (*cb)(struct knote *, void *), void *uctx
     return (0);
 }
 
+/** Remove a knote from its filter's NOTE_COALESCE list
+ *
+ * The knote is left in whatever state it's in, callers enable,
+ * disable or delete it as appropriate.
+ */
+static inline void
+knote_coalesce_cancel(struct filter *filt, struct knote *kn)
+{
+    if (!(kn->kn_flags & KNFL_COALESCED))
+        return;
+
+    TAILQ_REMOVE(&filt->kf_coalesced, kn, kn_coalesce);
+    kn->kn_flags &= ~KNFL_COALESCED;
+    filt->kf_kqueue->kq_coalesced--;
+}
+
 int
 knote_delete(struct filter *filt, struct knote *kn)
 {
@@ -171,11 +188,13 @@ knote_delete(struct filter *filt, struct knote *kn)
     RB_REMOVE(knote_index, &filt->kf_index, kn);
     if (filt->kf_kqueue->kq_knote_count > 0)
         filt->kf_kqueue->kq_knote_count--;
+    stats_dec(&filt->kf_stats, kfs_knotes);
 
     if (LIST_INSERTED(kn, kn_ready))
         LIST_REMOVE_ZERO(kn, kn_ready);
+    knote_coalesce_cancel(filt, kn);
 
-    rv = filt->kn_delete(filt, kn);
+    rv = filter_kn_delete(filt, kn);
     dbg_printf("kn=%p - kn_delete rv=%i", kn, rv);
 
     kn->kn_flags |= KNFL_KNOTE_DELETED;
@@ -189,12 +208,18 @@ knote_disable(struct filter *filt, struct knote *kn)
 {
     int rv = 0;
 
+    /*
+     * An explicit EV_DISABLE overrides coalescing, the
+     * knote stays disabled when the window ends.
+     */
+    knote_coalesce_cancel(filt, kn);
+
     /* If the knote is already disabled, this call is a noop */
     if (KNOTE_DISABLED(kn))
         return (0);
 
     dbg_printf("kn=%p - calling kn_disable", kn);
-    rv = filt->kn_disable(filt, kn);
+    rv = filter_kn_disable(filt, kn);
     dbg_printf("kn=%p - kn_disable rv=%i", kn, rv);
     if (rv == 0) {
         kqueue_mutex_assert(filt->kf_kqueue, MTX_LOCKED);
@@ -211,13 +236,91 @@ knote_enable(struct filter *filt, struct knote *kn)
 {
     int rv = 0;
 
+    knote_coalesce_cancel(filt, kn);
+
     /* If the knote is already enabled, this call is a noop */
     if (KNOTE_ENABLED(kn))
         return (0);
 
     dbg_printf("kn=%p - calling kn_enable", kn);
-    rv = filt->kn_enable(filt, kn);
+    rv = filter_kn_enable(filt, kn);
     dbg_printf("kn=%p - kn_enable rv=%i", kn, rv);
     if (rv == 0) KNOTE_ENABLE(kn);
     return (rv);
 }
+
+/** Hold back further events on a knote until its filter's NOTE_COALESCE window ends
+ *
+ * Called after the knote has been copied out.  The knote is
+ * disabled in the backend, so readiness accumulates in the
+ * kernel (bytes queued, buffer space freed) instead of waking
+ * us, and knote_coalesce_expire re-enables it when the window
+ * ends.  Anything that became ready in the meantime is then
+ * reported as a single event with current data.
+ *
+ * @param[in] filt  the knote belongs to.
+ * @param[in] kn    that was just copied out.
+ * @return
+ *    - 0 on success.
+ *    - -1 on failure, the knote is left enabled.
+ */
+int
+knote_coalesce(struct filter *filt, struct knote *kn)
+{
+    int rv;
+
+    if (KNOTE_DISABLED(kn))
+        return (0);
+
+    rv = knote_disable(filt, kn);
+    if (rv < 0)
+        return (rv);
+
+    kn->kn_coalesce_until = trace_now() + filt->kf_coalesce_ns;
+    kn->kn_flags |= KNFL_COALESCED;
+    TAILQ_INSERT_TAIL(&filt->kf_coalesced, kn, kn_coalesce);
+    filt->kf_kqueue->kq_coalesced++;
+
+    return (0);
+}
+
+/** Re-enable knotes whose NOTE_COALESCE window has ended
+ *
+ * @param[in] kq    to check.
+ * @param[in] now   current monotonic time from trace_now().
+ * @return how long until the next window ends in nanoseconds,
+ *      0 if no knotes are being held back.
+ */
+uint64_t
+knote_coalesce_expire(struct kqueue *kq, uint64_t now)
+{
+    uint64_t next = 0;
+    unsigned int i;
+
+    kqueue_mutex_assert(kq, MTX_LOCKED);
+
+    for (i = 0; (i < EVFILT_SYSCOUNT) && (kq->kq_coalesced > 0); i++) {
+        struct filter *filt = kq->kq_filt[i];
+        struct knote *kn;
+
+        if (filt == NULL)
+            continue;
+
+        while ((kn = TAILQ_FIRST(&filt->kf_coalesced)) != NULL) {
+            if (kn->kn_coalesce_until > now) {
+                if ((next == 0) || ((kn->kn_coalesce_until - now) < next))
+                    next = kn->kn_coalesce_until - now;
+                break;
+            }
+
+            /*
+             * Failure leaves the knote disabled, same as
+             * a failed EV_ENABLE.
+             */
+            if (knote_enable(filt, kn) < 0)
+                dbg_printf("kn=%p - failed re-enabling coalesced knote", kn);
+        }
+    }
+
+    return (next);
+}
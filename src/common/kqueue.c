@@ -40,7 +40,7 @@ static bool libkqueue_in_child = false;
  */
 tracing_mutex_t kq_mtx;
 #else
-tracing_mutex_t kq_mtx = TRACING_MUTEX_INITIALIZER;
+tracing_mutex_t kq_mtx = TRACING_MUTEX_INITIALIZER_CLASS(LOCKSTAT_GLOBAL);
 #endif
 pthread_once_t kq_is_initialized = PTHREAD_ONCE_INIT;
 
@@ -112,6 +112,10 @@ get_fd_used(void)
 
 static struct map *kqmap;
 
+/** Write lock contention stats to stderr at exit, from KQUEUE_LOCKSTAT
+ */
+static bool libkqueue_lockstat_report;
+
 void
 libkqueue_free(void)
 {
@@ -127,6 +131,11 @@ libkqueue_free(void)
 
     filter_free_all();
 
+    trace_free();
+
+    if (libkqueue_lockstat_report)
+        lockstat_report(stderr);
+
     if (kqops.libkqueue_free)
         kqops.libkqueue_free();
 }
@@ -246,6 +255,16 @@ libkqueue_init(void)
     }
 #endif
 
+   if (trace_init() < 0)
+       abort();
+
+#ifdef LIBKQUEUE_LOCKSTAT
+    {
+        char *ls = getenv("KQUEUE_LOCKSTAT");
+        libkqueue_lockstat_report = (ls != NULL) && (*ls != '\0') && (*ls != '0');
+    }
+#endif
+
    kqmap = map_new(get_fd_limit()); // INT_MAX
    if (kqmap == NULL)
        abort();
@@ -270,8 +289,10 @@ kqueue_knote_mark_disabled_all(struct kqueue *kq)
     unsigned int i;
 
     for (i = 0; i < EVFILT_SYSCOUNT; i++) {
-        struct filter *kf = &kq->kq_filt[i];
-        knote_mark_disabled_all(kf);
+        struct filter *kf = kq->kq_filt[i];
+
+        if (kf != NULL)
+            knote_mark_disabled_all(kf);
     }
 }
 
@@ -436,7 +457,7 @@ kqueue(void)
     if (kq == NULL)
         return (-1);
 
-    tracing_mutex_init(&kq->kq_mtx, NULL);
+    tracing_mutex_init_class(&kq->kq_mtx, NULL, LOCKSTAT_KQUEUE);
 
     /*
      * Init, evict and insert must be atomic under kq_mtx.  When an fd
@@ -15,6 +15,131 @@
  */
 #include "private.h"
 
+/** Fill in a struct libkqueue_stats for NOTE_STATS
+ *
+ * Counters are read with relaxed loads so the snapshot isn't
+ * guaranteed to be self-consistent across fields, which is fine
+ * for monitoring purposes.
+ *
+ * @param[out] out     stats structure to populate.
+ * @param[in] kq       to read counters from.
+ * @param[in] filter   EVFILT_* id to report on, or 0 for the whole kqueue.
+ * @return
+ *    - 0 on success.
+ *    - -1 if filter isn't valid for this kqueue (errno set).
+ */
+static int
+common_libkqueue_stats(struct libkqueue_stats *out, struct kqueue *kq, intptr_t filter)
+{
+    struct filter *filt;
+    size_t i;
+
+    memset(out, 0, sizeof(*out));
+
+    if (filter != 0) {
+        if ((filter >= 0) || (~filter >= EVFILT_SYSCOUNT)) {
+            errno = EINVAL;
+            return (-1);
+        }
+        if (filter_peek(&filt, kq, (short)filter) < 0) {
+            errno = EINVAL;
+            return (-1);
+        }
+        if (filt == NULL)
+            return (0);                 /* Never used, so nothing to count */
+        out->changes = stats_get(&filt->kf_stats, kfs_changes);
+        out->events = stats_get(&filt->kf_stats, kfs_events);
+        out->syscalls = stats_get(&filt->kf_stats, kfs_syscalls);
+        out->knotes = stats_get(&filt->kf_stats, kfs_knotes);
+        return (0);
+    }
+
+    out->kevent_calls = stats_get(&kq->kq_stats, kqs_kevent_calls);
+    out->changes = stats_get(&kq->kq_stats, kqs_changes);
+    out->events = stats_get(&kq->kq_stats, kqs_events);
+    out->syscalls = stats_get(&kq->kq_stats, kqs_syscalls);
+    out->empty_wakeups = stats_get(&kq->kq_stats, kqs_empty_wakeups);
+    out->lock_contended = stats_get(&kq->kq_stats, kqs_lock_contended);
+    out->knotes = (uint64_t)kq->kq_knote_count;
+
+    for (i = 0; i < NUM_ELEMENTS(kq->kq_filt); i++) {
+        filt = kq->kq_filt[i];
+        if (filt == NULL)
+            continue;
+        out->syscalls += stats_get(&filt->kf_stats, kfs_syscalls);
+    }
+
+    return (0);
+}
+
+/** Move a filter into a NOTE_PRIORITY delivery class
+ *
+ * Only allowed while no events are registered, so backends which
+ * keep a kernel registration set per class never have to migrate
+ * an existing registration between sets.
+ *
+ * @param[in] kq        to change.
+ * @param[in] filter    EVFILT_* id to change the priority of.
+ * @param[in] priority  0 (the default) to NOTE_PRIORITY_MAX.
+ * @return
+ *    - 0 on success.
+ *    - -1 on failure (errno set).
+ */
+static int
+common_libkqueue_priority(struct kqueue *kq, short filter, intptr_t priority)
+{
+    struct filter *filt, *pair = NULL;
+    size_t i;
+
+    if ((priority < 0) || (priority > NOTE_PRIORITY_MAX) ||
+        (filter >= 0) || (~filter >= EVFILT_SYSCOUNT)) {
+        errno = EINVAL;
+        return (-1);
+    }
+    if ((filter == EVFILT_LIBKQUEUE) || (filter_lookup(&filt, kq, filter) < 0)) {
+        errno = EINVAL;
+        return (-1);
+    }
+
+    for (i = 0; i < NUM_ELEMENTS(kq->kq_filt); i++) {
+        if ((kq->kq_filt[i] == NULL) || (kq->kq_filt[i]->kf_id == EVFILT_LIBKQUEUE) ||
+            RB_EMPTY(&kq->kq_filt[i]->kf_index))
+            continue;
+        errno = EBUSY;
+        return (-1);
+    }
+
+    if (kqops.priority_init == NULL) {
+        errno = ENOSYS;
+        return (-1);
+    }
+    if (kqops.priority_init(kq) < 0)
+        return (-1);
+
+    /*
+     * READ and WRITE knotes on the same descriptor share a
+     * single kernel registration, so they can't be split
+     * across classes.
+     */
+#if defined(EVFILT_READ) && defined(EVFILT_WRITE)
+    if (filter == EVFILT_READ)
+        (void) filter_lookup(&pair, kq, EVFILT_WRITE);
+    else if (filter == EVFILT_WRITE)
+        (void) filter_lookup(&pair, kq, EVFILT_READ);
+#endif
+    filt->kf_priority = (unsigned int)priority;
+    if (pair != NULL)
+        pair->kf_priority = (unsigned int)priority;
+
+    kq->kq_priority_max = 0;
+    for (i = 0; i < NUM_ELEMENTS(kq->kq_filt); i++) {
+        if (kq->kq_filt[i] && (kq->kq_filt[i]->kf_priority > kq->kq_priority_max))
+            kq->kq_priority_max = kq->kq_filt[i]->kf_priority;
+    }
+
+    return (0);
+}
+
 int
 common_libkqueue_knote_create(struct filter *filt, struct knote *kn)
 {
@@ -70,6 +195,118 @@ common_libkqueue_knote_create(struct filter *filt, struct knote *kn)
             return (-1);
         break;
 
+    case NOTE_BATCH:
+        if (kn->kev.data < 0) {
+            errno = EINVAL;
+            return (-1);
+        }
+        filt->kf_kqueue->kq_batch_min = (unsigned int)kn->kev.data;
+        break;
+
+    case NOTE_BATCH_TIMEOUT:
+        if (kn->kev.data < 0) {
+            errno = EINVAL;
+            return (-1);
+        }
+        filt->kf_kqueue->kq_batch_timeout_ns = (long)kn->kev.data;
+        break;
+
+    case NOTE_PRIORITY:
+        if (common_libkqueue_priority(filt->kf_kqueue, (short)kn->kev.ident, kn->kev.data) < 0)
+            return (-1);
+        break;
+
+    case NOTE_COALESCE:
+    {
+        struct filter *target;
+
+        if ((kn->kev.data < 0) || ((uint64_t)kn->kev.data > (INT64_MAX / 1000)) ||
+            (((short)kn->kev.ident != EVFILT_READ) && ((short)kn->kev.ident != EVFILT_WRITE))) {
+            errno = EINVAL;
+            return (-1);
+        }
+        if (filter_lookup(&target, filt->kf_kqueue, (short)kn->kev.ident) < 0)
+            return (-1);
+        target->kf_coalesce_ns = (uint64_t)kn->kev.data * 1000;
+    }
+        break;
+
+    case NOTE_POLL_FD:
+        if (kqops.kqueue_poll_fd == NULL) {
+            errno = ENOSYS;
+            return (-1);
+        }
+        kn->kev.data = kqops.kqueue_poll_fd(filt->kf_kqueue);
+        kn->kev.flags |= EV_RECEIPT; /* Causes the knote to be copied to the eventlist */
+        break;
+
+    case NOTE_LISTEN_BACKLOG:
+        if (kqops.listen_backlog == NULL) {
+            errno = ENOSYS;
+            return (-1);
+        }
+        kn->kev.data = kqops.listen_backlog(filt->kf_kqueue, kn->kev.data > 0);
+        break;
+
+    case NOTE_BATCH_CHANGES:
+    {
+        int old;
+
+        if (kqops.batch_changes == NULL) {
+            errno = ENOSYS;
+            return (-1);
+        }
+        old = kqops.batch_changes(filt->kf_kqueue, kn->kev.data > 0);
+        if (old < 0)
+            return (-1);
+        kn->kev.data = old;
+    }
+        break;
+
+    case NOTE_STATS:
+        if (kn->kev.udata == NULL) {
+            errno = EINVAL;
+            return (-1);
+        }
+        if (common_libkqueue_stats(kn->kev.udata, filt->kf_kqueue, kn->kev.data) < 0)
+            return (-1);
+        kn->kev.data = sizeof(struct libkqueue_stats);
+        kn->kev.flags |= EV_RECEIPT; /* Causes the knote to be copied to the eventlist */
+        break;
+
+    case NOTE_TRACE:
+    {
+        kn->kev.data = atomic_exchange_explicit(&libkqueue_trace, kn->kev.data > 0,
+                                                memory_order_relaxed);
+    }
+        break;
+
+    case NOTE_TRACE_DUMP:
+    {
+        ssize_t ret = trace_dump((int)kn->kev.data);
+        if (ret < 0)
+            return (-1);
+        kn->kev.data = ret;
+        kn->kev.flags |= EV_RECEIPT; /* Causes the knote to be copied to the eventlist */
+    }
+        break;
+
+    case NOTE_LOCKSTAT:
+    {
+        int ret;
+
+        if (kn->kev.udata == NULL) {
+            errno = EINVAL;
+            return (-1);
+        }
+        ret = lockstat_export(kn->kev.udata, (size_t)kn->kev.data);
+        if (ret < 0)
+            return (-1);
+        kn->kev.data = ret;
+        kn->kev.flags |= EV_RECEIPT; /* Causes the knote to be copied to the eventlist */
+    }
+        break;
+
 #ifndef NDEBUG
     case NOTE_DEBUG:
     {
@@ -0,0 +1,189 @@
+/*
+ * Copyright (c) 2026 Arran Cudbard-Bell <a.cudbardb@freeradius.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Lock contention profiling for tracing_mutex_t.
+ *
+ * Only compiled in with ENABLE_LOCKSTAT, as every lock and unlock
+ * pays for a clock read.  Stats are kept per lock class rather than
+ * per mutex, which is what you want for "which lock is serialising
+ * my threads" (there's one kq_mtx per kqueue, but they're all the
+ * same lock as far as the application's design is concerned).
+ */
+#include <errno.h>
+#include <stdatomic.h>
+#include <string.h>
+
+#include "private.h"
+
+#ifdef LIBKQUEUE_LOCKSTAT
+struct lockstat_counters {
+    atomic_uint_least64_t   acquisitions;
+    atomic_uint_least64_t   contended;
+    atomic_uint_least64_t   wait_ns;
+    atomic_uint_least64_t   wait_max_ns;
+    atomic_uint_least64_t   hold_ns;
+    atomic_uint_least64_t   hold_max_ns;
+};
+
+static struct lockstat_counters lockstat[LOCKSTAT_CLASS_MAX];
+
+static char const *lockstat_names[LOCKSTAT_CLASS_MAX] = {
+    [LOCKSTAT_OTHER]  = "other",
+    [LOCKSTAT_GLOBAL] = "global",
+    [LOCKSTAT_KQUEUE] = "kqueue",
+    [LOCKSTAT_SIGTBL] = "sigtbl",
+    [LOCKSTAT_PROC]   = "proc"
+};
+
+static inline void
+lockstat_max(atomic_uint_least64_t *max, uint64_t val)
+{
+    uint_least64_t cur = atomic_load_explicit(max, memory_order_relaxed);
+
+    while ((val > cur) &&
+           !atomic_compare_exchange_weak_explicit(max, &cur, val,
+                                                  memory_order_relaxed, memory_order_relaxed));
+}
+
+/** Acquire a mutex, recording whether we had to wait and for how long
+ *
+ * @param[in] mtx           to lock.
+ * @param[in] cls           lock class to account against.
+ * @param[out] locked_at    when the lock was acquired, for hold time.
+ */
+void
+lockstat_lock(pthread_mutex_t *mtx, enum lockstat_class cls, uint64_t *locked_at)
+{
+    struct lockstat_counters *lc = &lockstat[cls];
+    uint64_t start, now, waited;
+
+    if (pthread_mutex_trylock(mtx) == 0) {
+        atomic_fetch_add_explicit(&lc->acquisitions, 1, memory_order_relaxed);
+        *locked_at = trace_now();
+        return;
+    }
+
+    start = trace_now();
+    pthread_mutex_lock(mtx);
+    now = trace_now();
+    waited = now - start;
+
+    atomic_fetch_add_explicit(&lc->acquisitions, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&lc->contended, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&lc->wait_ns, waited, memory_order_relaxed);
+    lockstat_max(&lc->wait_max_ns, waited);
+    *locked_at = now;
+}
+
+/** Try to acquire a mutex, failures aren't counted
+ */
+int
+lockstat_trylock(pthread_mutex_t *mtx, enum lockstat_class cls, uint64_t *locked_at)
+{
+    int ret = pthread_mutex_trylock(mtx);
+
+    if (ret == 0) {
+        atomic_fetch_add_explicit(&lockstat[cls].acquisitions, 1, memory_order_relaxed);
+        *locked_at = trace_now();
+    }
+
+    return ret;
+}
+
+/** Record hold time, called with the mutex still held
+ */
+void
+lockstat_release(enum lockstat_class cls, uint64_t locked_at)
+{
+    struct lockstat_counters *lc = &lockstat[cls];
+    uint64_t held = trace_now() - locked_at;
+
+    atomic_fetch_add_explicit(&lc->hold_ns, held, memory_order_relaxed);
+    lockstat_max(&lc->hold_max_ns, held);
+}
+
+/** Copy out per class stats for NOTE_LOCKSTAT
+ *
+ * @param[out] out  array to fill.
+ * @param[in] n     entries in out.
+ * @return
+ *      - The number of entries written.
+ *      - -1 if n is too small to hold every class (errno set).
+ */
+int
+lockstat_export(struct libkqueue_lockstat *out, size_t n)
+{
+    size_t i;
+
+    if (n < LOCKSTAT_CLASS_MAX) {
+        errno = ENOSPC;
+        return (-1);
+    }
+
+    for (i = 0; i < LOCKSTAT_CLASS_MAX; i++) {
+        struct lockstat_counters *lc = &lockstat[i];
+
+        memset(&out[i], 0, sizeof(out[i]));
+        strncpy(out[i].name, lockstat_names[i], sizeof(out[i].name) - 1);
+        out[i].acquisitions = atomic_load_explicit(&lc->acquisitions, memory_order_relaxed);
+        out[i].contended = atomic_load_explicit(&lc->contended, memory_order_relaxed);
+        out[i].wait_ns = atomic_load_explicit(&lc->wait_ns, memory_order_relaxed);
+        out[i].wait_max_ns = atomic_load_explicit(&lc->wait_max_ns, memory_order_relaxed);
+        out[i].hold_ns = atomic_load_explicit(&lc->hold_ns, memory_order_relaxed);
+        out[i].hold_max_ns = atomic_load_explicit(&lc->hold_max_ns, memory_order_relaxed);
+    }
+
+    return (LOCKSTAT_CLASS_MAX);
+}
+
+/** Write a human readable table of per class stats
+ *
+ * Called at exit if KQUEUE_LOCKSTAT is set.
+ */
+void
+lockstat_report(FILE *fp)
+{
+    struct libkqueue_lockstat ls[LOCKSTAT_CLASS_MAX];
+    int i, n;
+
+    n = lockstat_export(ls, LOCKSTAT_CLASS_MAX);
+
+    fprintf(fp, "%-8s %14s %12s %14s %12s %14s %12s\n",
+            "class", "acquisitions", "contended", "wait_ns", "wait_max", "hold_ns", "hold_max");
+    for (i = 0; i < n; i++) {
+        if (ls[i].acquisitions == 0)
+            continue;
+        fprintf(fp, "%-8s %14llu %12llu %14llu %12llu %14llu %12llu\n",
+                ls[i].name,
+                (unsigned long long)ls[i].acquisitions, (unsigned long long)ls[i].contended,
+                (unsigned long long)ls[i].wait_ns, (unsigned long long)ls[i].wait_max_ns,
+                (unsigned long long)ls[i].hold_ns, (unsigned long long)ls[i].hold_max_ns);
+    }
+}
+#else
+int
+lockstat_export(UNUSED struct libkqueue_lockstat *out, UNUSED size_t n)
+{
+    errno = ENOTSUP;
+    return (-1);
+}
+
+void
+lockstat_report(UNUSED FILE *fp)
+{
+}
+#endif
@@ -190,6 +190,7 @@ struct kqueue_kevent_state {
 #define COPY_FFLAGS_BIT(_dst, _src, _flag) (_dst).fflags = ((_dst).fflags & ~(_flag)) | ((_src).fflags & (_flag))
 
 #include "debug.h"
+#include "trace.h"
 
 /** An eventfd provides a mechanism to signal the eventing system that an event has occurred
  *
@@ -206,6 +207,56 @@ struct eventfd {
 #endif
 };
 
+/** Hot-path counters maintained for every filter
+ *
+ * Always compiled in (unlike dbg_printf) and bumped with relaxed
+ * atomics, so the cost on the fast path is a single uncontended
+ * add.  Read back by NOTE_STATS on EVFILT_LIBKQUEUE.
+ */
+struct filter_stats {
+    atomic_uint_least64_t  kfs_changes;        //!< Changelist entries resolved to this filter.
+    atomic_uint_least64_t  kfs_events;         //!< Events the filter copied out.
+    atomic_uint_least64_t  kfs_syscalls;       //!< Backend syscalls issued on the filter's
+                                               ///< behalf (epoll_ctl, timerfd/eventfd
+                                               ///< reads etc...).
+    atomic_uint_least64_t  kfs_knotes;         //!< Live knotes owned by the filter.
+};
+
+/** Hot-path counters maintained for every kqueue
+ *
+ * Per-filter activity is kept in struct filter_stats and summed
+ * into the kqueue totals when NOTE_STATS is queried.
+ */
+struct kqueue_stats {
+    atomic_uint_least64_t  kqs_kevent_calls;   //!< kevent() calls against this kqueue.
+    atomic_uint_least64_t  kqs_changes;        //!< Changelist entries processed.
+    atomic_uint_least64_t  kqs_events;         //!< Events returned from the wait path.
+    atomic_uint_least64_t  kqs_syscalls;       //!< Backend syscalls not attributable to
+                                               ///< a single filter (waits, wake pipes).
+    atomic_uint_least64_t  kqs_empty_wakeups;  //!< Waits which reported readiness but
+                                               ///< copied out zero events.
+    atomic_uint_least64_t  kqs_lock_contended; //!< kq_mtx acquisitions which had to block.
+};
+
+/** Add to one of the stats counters
+ *
+ * @param[in] _stats   struct filter_stats or struct kqueue_stats.
+ * @param[in] _field   counter to bump.
+ * @param[in] _n       amount to add.
+ */
+#define stats_add(_stats, _field, _n) \
+    (void) atomic_fetch_add_explicit(&(_stats)->_field, (uint_least64_t)(_n), memory_order_relaxed)
+#define stats_inc(_stats, _field)     stats_add(_stats, _field, 1)
+#define stats_dec(_stats, _field) \
+    (void) atomic_fetch_sub_explicit(&(_stats)->_field, 1, memory_order_relaxed)
+#define stats_get(_stats, _field) \
+    ((uint64_t) atomic_load_explicit(&(_stats)->_field, memory_order_relaxed))
+
+#define filter_stat_add(_filt, _field, _n)  stats_add(&(_filt)->kf_stats, _field, _n)
+#define filter_stat_inc(_filt, _field)      stats_inc(&(_filt)->kf_stats, _field)
+#define kqueue_stat_add(_kq, _field, _n)    stats_add(&(_kq)->kq_stats, _field, _n)
+#define kqueue_stat_inc(_kq, _field)        stats_inc(&(_kq)->kq_stats, _field)
+
 /*
  * Flags used by knote->kn_flags
  */
@@ -219,7 +270,9 @@ struct eventfd {
 #define KNFL_SOCKET_RDM          (1U << 7U)
 #define KNFL_SOCKET_SEQPACKET    (1U << 8U)
 #define KNFL_SOCKET_RAW          (1U << 9U)
-#define KNFL_ALWAYS_READY_BUMPED (1U << 10U)    /* this knote contributed +1 to kq_always_ready */
+#define KNFL_COALESCED           (1U << 10U)   //!< Disabled until its NOTE_COALESCE window ends.
+#define KNFL_PREPARED            (1U << 11U)   //!< kn_prepare set up the knote's resources,
+                                               ///< cleared by kn_create once it takes them.
 #define KNFL_KNOTE_DELETED       (1U << 31U)
 #define KNFL_SOCKET              (KNFL_SOCKET_STREAM |\
                                   KNFL_SOCKET_DGRAM |\
@@ -271,6 +324,9 @@ struct knote {
                                                ///< pending bitmask, so multiple back-to-back
                                                ///< kills before a drain surface as one bump.
 
+    TAILQ_ENTRY(knote)     kn_coalesce;        //!< Entry in the filter's kf_coalesced list.
+    uint64_t               kn_coalesce_until;  //!< When the knote's NOTE_COALESCE window ends.
+
 #if defined(KNOTE_PLATFORM_SPECIFIC)
     KNOTE_PLATFORM_SPECIFIC;
 #endif
@@ -338,6 +394,10 @@ struct knote {
  */
 struct filter {
     short                  kf_id;              //!< EVFILT_* facility this filter provides.
+    bool                   kf_eager;           //!< Set up as the kqueue is created, not on first
+                                               ///< use.  For filters whose kf_init has process-wide
+                                               ///< side effects which must be in place before any
+                                               ///< knote is added.
 
     /** Called once on startup
      *
@@ -360,7 +420,8 @@ struct filter {
 
     /** Perform initialisation for this filter
      *
-     * This is called once per filer per kqueue as the kqueue is initialised.
+     * This is called once per filter per kqueue, the first time the filter
+     * is used, or as the kqueue is initialised if kf_eager is set.
      *
      * @param[in] filt    to initialise.
      * @return
@@ -526,6 +587,34 @@ struct filter {
      */
     int                    (*kn_disable)(struct filter *filt, struct knote *kn);
 
+    /** Allocate a knote and set up its resources before the kqueue is locked
+     *
+     * Optional.  Called by kevent() for EV_ADD changes, so expensive
+     * setup (opening descriptors, resolving paths, classifying the
+     * descriptor) doesn't hold up other threads using the kqueue.
+     * The knote is returned with KNFL_PREPARED
+     * set.  If no knote exists for the ident once the kqueue is
+     * locked, it's passed to kn_create, which must take over or
+     * release the resources.  Otherwise it's passed to kn_unprepare.
+     *
+     * @note The filter isn't known at this point, only the backend.
+     *
+     * @param[in] kev      the change being applied.
+     * @return
+     *    - A knote with KNFL_PREPARED set.
+     *    - NULL if nothing was prepared, kn_create does all the work.
+     */
+    struct knote           *(*kn_prepare)(const struct kevent *kev);
+
+    /** Release the resources of a prepared knote that wasn't needed
+     *
+     * Required if kn_prepare is set.  The knote itself is freed by
+     * the caller.
+     *
+     * @param[in] kn       returned by kn_prepare.
+     */
+    void                   (*kn_unprepare)(struct knote *kn);
+
     struct evfilt_data     *kf_data;           //!< Filter-specific data.
 
     RB_HEAD(knote_index, knote) kf_index;      //!< Tree of knotes. This is for easy lookup
@@ -551,6 +640,20 @@ struct filter {
 
     struct kqueue          *kf_kqueue;         //!< kqueue this filter is associated with.
 
+    struct filter_stats    kf_stats;           //!< Counters reported by NOTE_STATS.
+
+    unsigned int           kf_priority;        //!< NOTE_PRIORITY delivery class.  When the
+                                               ///< eventlist can't hold every ready event,
+                                               ///< higher classes are copied out first.
+
+    uint64_t               kf_coalesce_ns;     //!< NOTE_COALESCE window, 0 to deliver every
+                                               ///< event as soon as it's ready.
+    TAILQ_HEAD(knote_coalesced, knote) kf_coalesced;
+                                               //!< knotes disabled until their NOTE_COALESCE
+                                               ///< window ends.  All windows on a filter are
+                                               ///< the same length, so this is also the order
+                                               ///< they end in.
+
 #if defined(FILTER_PLATFORM_SPECIFIC)
     FILTER_PLATFORM_SPECIFIC;
 #endif
@@ -569,9 +672,10 @@ struct kqueue {
 
     LIST_ENTRY(kqueue)     kq_entry;           //!< Entry in the global list of active kqueues.
 
-    struct filter          kq_filt[EVFILT_SYSCOUNT];    //!< Filters supported by the kqueue.  Each
-                                               ///< kqueue maintains one filter state structure
-                                               ///< per filter type.
+    struct filter          *kq_filt[EVFILT_SYSCOUNT];   //!< Filters used on the kqueue.  Each entry
+                                               ///< is NULL until filter_lookup first resolves
+                                               ///< that filter type, then points at the
+                                               ///< kqueue's state for it.
     tracing_mutex_t        kq_mtx;
 
     bool                   kq_freeing;         //!< A kqueue_free has run while in-flight kevent()
@@ -588,6 +692,24 @@ struct kqueue {
                                                ///< "only always-ready knotes registered" state
                                                ///< and adjust their wait policy accordingly.
 
+    struct kqueue_stats    kq_stats;           //!< Counters reported by NOTE_STATS.
+
+    unsigned int           kq_batch_min;       //!< NOTE_BATCH: once one event is ready keep
+                                               ///< waiting until this many are, 0 or 1 to
+                                               ///< return as soon as anything is ready.
+    long                   kq_batch_timeout_ns;//!< NOTE_BATCH_TIMEOUT: how long to keep
+                                               ///< waiting for the rest of a batch, 0 for
+                                               ///< KEVENT_BATCH_TIMEOUT_NS.
+
+    unsigned int           kq_priority_max;    //!< Highest kf_priority of any filter, 0 if
+                                               ///< NOTE_PRIORITY has never been used.
+
+    unsigned int           kq_coalesced;       //!< knotes on any filter's kf_coalesced list.
+
+    const struct kevent    *kq_creating;       //!< Change whose kn_create is running, if the
+                                               ///< backend may queue its kernel registration
+                                               ///< until kevent_flush.  NULL otherwise.
+
 #if defined(KQUEUE_PLATFORM_SPECIFIC)
     KQUEUE_PLATFORM_SPECIFIC;
 #endif
@@ -595,6 +717,28 @@ struct kqueue {
 
 void    kqueue_complete_deferred_free(struct kqueue *kq);
 
+/** Most changes per kevent() call that get knotes set up before the kqueue is locked
+ *
+ * Later changes are handled entirely under the lock, see kn_prepare.
+ */
+#define KEVENT_PREPARE_MAX 16
+
+/** Most events kevent_dispatch() collects before running their handlers
+ */
+#define KEVENT_DISPATCH_MAX 256
+
+/** Default time to wait for the rest of a NOTE_BATCH batch after the first event
+ */
+#define KEVENT_BATCH_TIMEOUT_NS (50L * 1000L)
+
+/** A change whose queued kernel registration was rejected, see kevent_flush
+ */
+struct kevent_change_error {
+    struct knote           *kce_kn;            //!< Created by the change.
+    struct kevent          kce_kev;            //!< The change, for its EV_ERROR entry.
+    int                    kce_errno;          //!< Why the registration failed.
+};
+
 /** Capability flags for a backend's kqueue_vtable (the `flags` field). */
 enum kqueue_vtable_flags {
     /** Close detection is asynchronous: a background thread frees a
@@ -776,7 +920,7 @@ struct kqueue_vtable {
      *
      * Optional, NULL on backends with kernel-driven file-knote
      * dispatch (Linux/epoll, Solaris/event ports, Windows/IOCP).
-     * The POSIX backend uses this to clamp pselect's timeout
+     * The POSIX backend uses this to clamp poll's timeout
      * when the only readiness sources are KNFL_FILE knotes,
      * so the kqueue can sleep between polls instead of busy-
      * looping.
@@ -792,12 +936,101 @@ struct kqueue_vtable {
      *      - -1 on failure (errno set).
      */
     int    (*set_file_poll_interval)(struct kqueue *kq, intptr_t interval_ns);
+
+    /** Prepare the backend to deliver events in priority order
+     *
+     * Optional, NULL on backends which can't order delivery
+     * (Solaris, Windows), in which case NOTE_PRIORITY fails
+     * with ENOSYS.  Called before any filter is moved into a
+     * non-default class, and only while the kqueue has no
+     * knotes other than EVFILT_LIBKQUEUE ones.
+     *
+     * @param[in] kq            kqueue to prepare.
+     * @return
+     *      - 0 on success.
+     *      - -1 on failure (errno set).
+     */
+    int    (*priority_init)(struct kqueue *kq);
+
+    /** Return a descriptor which polls readable while events are pending
+     *
+     * Optional, NULL on backends where readiness isn't tracked by
+     * a single kernel object (POSIX, Solaris, Windows), in which
+     * case NOTE_POLL_FD fails with ENOSYS.
+     *
+     * @param[in] kq            kqueue to return the descriptor for.
+     * @return the descriptor, which remains owned by the kqueue.
+     */
+    int    (*kqueue_poll_fd)(struct kqueue *kq);
+
+    /** Turn reporting of listeners' accept queue depth on or off
+     *
+     * Optional, NULL on backends which can only report that a
+     * listening socket has at least one connection waiting, in
+     * which case NOTE_LISTEN_BACKLOG fails with ENOSYS.
+     *
+     * @param[in] kq            kqueue to configure.
+     * @param[in] on            true to report the depth in data.
+     * @return the previous setting.
+     */
+    int    (*listen_backlog)(struct kqueue *kq, bool on);
+
+    /** Turn queueing of kernel registrations made by kn_create on or off
+     *
+     * Optional, NULL on backends which can't submit registrations
+     * in batches, in which case NOTE_BATCH_CHANGES fails with
+     * ENOSYS.  Backends providing this must provide kevent_flush.
+     *
+     * @param[in] kq            kqueue to configure.
+     * @param[in] on            true to queue registrations.
+     * @return
+     *      - The previous setting.
+     *      - -1 on failure (errno set).
+     */
+    int    (*batch_changes)(struct kqueue *kq, bool on);
+
+    /** Submit registrations queued while processing the changelist
+     *
+     * Optional.  Called with the kqueue locked once kevent_copyin
+     * has been through the changelist.  Registrations may be queued
+     * by kn_create while kq_creating is set, so the knote is already
+     * inserted by the time the kernel rejects one.
+     *
+     * @param[in] kq            kqueue to submit registrations for.
+     * @param[out] errors       rejected changes, owned by the backend
+     *                          and valid until the next change is
+     *                          processed.  Each holds a reference to
+     *                          its knote, which the caller releases.
+     * @return the number of entries in errors.
+     */
+    int    (*kevent_flush)(struct kqueue *kq, struct kevent_change_error **errors);
 };
 LIST_HEAD(kqueue_head, kqueue);
 
 extern bool libkqueue_thread_safe;
 extern bool libkqueue_fork_cleanup;
 extern const struct kqueue_vtable kqops;
+
+/*
+ * The wait/copyout pair on the kevent() hot path.  Backends which
+ * support ENABLE_STATIC_DISPATCH map these to their implementations
+ * in platform.h, so they're called directly rather than via kqops.
+ */
+#ifndef kqueue_kevent_wait
+#  define kqueue_kevent_wait(_kq, _nevents, _ts)         kqops.kevent_wait((_kq), (_nevents), (_ts))
+#endif
+#ifndef kqueue_kevent_copyout
+#  define kqueue_kevent_copyout(_kq, _nready, _el, _n)   kqops.kevent_copyout((_kq), (_nready), (_el), (_n))
+#endif
+
+#ifndef _WIN32
+/** Signal mask passed to kevent_pwait(), NULL for plain kevent()
+ *
+ * Backends which define KEVENT_WAIT_SIGMASK install it atomically
+ * for the duration of their wait syscall.
+ */
+extern __thread const sigset_t *kevent_wait_sigmask;
+#endif
 extern tracing_mutex_t kq_mtx;
 extern struct kqueue_head kq_list;
 extern unsigned int kq_cnt;
@@ -808,8 +1041,13 @@ extern unsigned int kq_cnt;
 #define kqueue_mutex_assert(kq, state) tracing_mutex_assert(&(kq)->kq_mtx, state)
 
 #define kqueue_lock(kq)                do { \
+                                           int _kq_trv; \
                                            dbg_printf("locking kq=%p", kq); \
-                                           tracing_mutex_lock(&(kq)->kq_mtx); \
+                                           tracing_mutex_trylock(_kq_trv, &(kq)->kq_mtx); \
+                                           if (_kq_trv != 0) { \
+                                               kqueue_stat_inc(kq, kqs_lock_contended); \
+                                               tracing_mutex_lock(&(kq)->kq_mtx); \
+                                           } \
                                        } while(0)
 
 #define kqueue_unlock(kq)              do { \
@@ -834,6 +1072,92 @@ int             knote_delete(struct filter *, struct knote *);
 int             knote_disable(struct filter *, struct knote *);
 int             knote_enable(struct filter *, struct knote *);
 int             knote_modify(struct filter *, struct knote *);
+int             knote_coalesce(struct filter *, struct knote *);
+uint64_t        knote_coalesce_expire(struct kqueue *, uint64_t now);
+
+/*
+ * Filter method dispatch for the hot paths.
+ *
+ * Normally these call through the filter's copy of its vtable in
+ * the kqueue's filter state.  With ENABLE_STATIC_DISPATCH the filter is matched
+ * by kf_id against every filter compiled into the build and the
+ * method is called through the filter's const definition instead.
+ * That build also enables IPO, so the loads from the definitions
+ * are folded at link time and each arm becomes a direct call the
+ * compiler is free to inline.
+ */
+#ifdef LIBKQUEUE_STATIC_DISPATCH
+#define FILTER_ENTRY(_name) extern const struct filter _name;
+#include "filter_list.h"
+#undef FILTER_ENTRY
+#endif
+
+static inline int filter_copyout(struct kevent *el, int nevents, struct filter *filt,
+                                 struct knote *kn, void *ev)
+{
+#ifdef LIBKQUEUE_STATIC_DISPATCH
+#define FILTER_ENTRY(_name) \
+    if (filt->kf_id == _name.kf_id) return _name.kf_copyout(el, nevents, filt, kn, ev);
+#include "filter_list.h"
+#undef FILTER_ENTRY
+#endif
+    return filt->kf_copyout(el, nevents, filt, kn, ev);
+}
+
+static inline int filter_kn_create(struct filter *filt, struct knote *kn)
+{
+#ifdef LIBKQUEUE_STATIC_DISPATCH
+#define FILTER_ENTRY(_name) \
+    if (filt->kf_id == _name.kf_id) return _name.kn_create(filt, kn);
+#include "filter_list.h"
+#undef FILTER_ENTRY
+#endif
+    return filt->kn_create(filt, kn);
+}
+
+static inline int filter_kn_modify(struct filter *filt, struct knote *kn, const struct kevent *kev)
+{
+#ifdef LIBKQUEUE_STATIC_DISPATCH
+#define FILTER_ENTRY(_name) \
+    if (filt->kf_id == _name.kf_id) return _name.kn_modify(filt, kn, kev);
+#include "filter_list.h"
+#undef FILTER_ENTRY
+#endif
+    return filt->kn_modify(filt, kn, kev);
+}
+
+static inline int filter_kn_delete(struct filter *filt, struct knote *kn)
+{
+#ifdef LIBKQUEUE_STATIC_DISPATCH
+#define FILTER_ENTRY(_name) \
+    if (filt->kf_id == _name.kf_id) return _name.kn_delete(filt, kn);
+#include "filter_list.h"
+#undef FILTER_ENTRY
+#endif
+    return filt->kn_delete(filt, kn);
+}
+
+static inline int filter_kn_enable(struct filter *filt, struct knote *kn)
+{
+#ifdef LIBKQUEUE_STATIC_DISPATCH
+#define FILTER_ENTRY(_name) \
+    if (filt->kf_id == _name.kf_id) return _name.kn_enable(filt, kn);
+#include "filter_list.h"
+#undef FILTER_ENTRY
+#endif
+    return filt->kn_enable(filt, kn);
+}
+
+static inline int filter_kn_disable(struct filter *filt, struct knote *kn)
+{
+#ifdef LIBKQUEUE_STATIC_DISPATCH
+#define FILTER_ENTRY(_name) \
+    if (filt->kf_id == _name.kf_id) return _name.kn_disable(filt, kn);
+#include "filter_list.h"
+#undef FILTER_ENTRY
+#endif
+    return filt->kn_disable(filt, kn);
+}
 
 /** Common code for respecting EV_DISPATCH and EV_ONESHOT
  *
@@ -860,11 +1184,35 @@ static inline int knote_copyout_flag_actions(struct filter *filt, struct knote *
 
     if (kn->kev.flags & EV_ONESHOT)
         rv = knote_delete(filt, kn);
+    else if (filt->kf_coalesce_ns && !(kn->kev.flags & EV_DISPATCH))
+        rv = knote_coalesce(filt, kn);
 
     return rv;
 }
 
-#define knote_get_filter(knt) &((knt)->kn_kq->kq_filt[~(knt)->kev.filter])
+/** How late an EVFILT_TIMER knote may fire, see NOTE_LEEWAY
+ *
+ * @param[in] fflags    of the timer knote.
+ * @param[in] period_ns the timer's period, or its delay if oneshot.
+ * @return the leeway in nanoseconds, 0 if the timer must fire on time.
+ */
+static inline int64_t timer_leeway_ns(unsigned int fflags, int64_t period_ns)
+{
+    unsigned int pct;
+
+    if (!(fflags & NOTE_LEEWAY) || (fflags & NOTE_ABSOLUTE))
+        return 0;
+
+    pct = (fflags & NOTE_LEEWAY_MASK) >> NOTE_LEEWAY_SHIFT;
+    if (pct == 0)
+        pct = 10;
+    else if (pct > 100)
+        pct = 100;
+
+    return (period_ns / 100) * pct;
+}
+
+#define knote_get_filter(knt) ((knt)->kn_kq->kq_filt[~(knt)->kev.filter])
 
 void            filter_init_all(void);
 #ifndef _WIN32
@@ -872,8 +1220,12 @@ void            filter_fork_all(void);
 #endif
 void            filter_free_all(void);
 
+int             filter_register_eager(struct kqueue *);
 int             filter_lookup(struct filter **, struct kqueue *, short);
-int             filter_register_all(struct kqueue *);
+int             filter_peek(struct filter **, struct kqueue *, short);
+bool            filter_has_prepare(short id);
+struct knote    *filter_prepare(const struct kevent *kev);
+void            filter_unprepare(struct knote *kn);
 void            filter_unregister_all(struct kqueue *);
 const char      *filter_name(short);
 
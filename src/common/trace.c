@@ -0,0 +1,373 @@
+/*
+ * Copyright (c) 2026 Arran Cudbard-Bell <a.cudbardb@freeradius.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "private.h"
+
+#define TRACE_RING_MASK (TRACE_RING_SIZE - 1)
+
+#if (TRACE_RING_SIZE & TRACE_RING_MASK) != 0
+#  error TRACE_RING_SIZE must be a power of two
+#endif
+
+/** A per-thread ring of trace records
+ *
+ * Rings are only ever written by the thread that owns them.
+ * Readers (trace_dump) may run concurrently in another thread or
+ * in a signal handler, in which case the oldest record may be
+ * torn if the writer laps it mid-dump.  That's an acceptable
+ * trade for a lock-free writer.
+ */
+struct trace_ring {
+    struct trace_ring       *tr_next;           //!< Next ring in the global list.
+    int32_t                 tr_tid;             //!< THREAD_ID of the owner.
+    atomic_bool             tr_orphaned;        //!< Owner exited, ring may be adopted.
+    atomic_uint_least64_t   tr_head;            //!< Total records written.
+    struct trace_record     tr_rec[TRACE_RING_SIZE];
+};
+
+/** Global tracing switch, checked by trace_record()
+ */
+atomic_bool libkqueue_trace = false;
+
+/** All rings ever allocated
+ *
+ * Rings are only ever pushed onto this list, never removed, so
+ * readers can walk it without locking.  Rings belonging to exited
+ * threads are kept (they're often the interesting ones), and are
+ * adopted by new threads rather than allocating fresh rings.
+ * Records left by the previous owner stay until they're
+ * overwritten, and are reported under the new owner's tid.
+ */
+static _Atomic(struct trace_ring *) trace_rings;
+
+static __thread struct trace_ring *trace_ring_local;
+
+/** Where to dump at exit or on trace_signal, from KQUEUE_TRACE
+ */
+static char *trace_path;
+
+#ifndef _WIN32
+static pthread_key_t trace_ring_key;
+static bool trace_ring_key_init;
+static int trace_signal;
+
+/** Mark the exiting thread's ring as available for adoption
+ */
+static void
+trace_ring_release(void *arg)
+{
+    struct trace_ring *ring = arg;
+
+    atomic_store_explicit(&ring->tr_orphaned, true, memory_order_release);
+}
+#endif
+
+uint64_t
+trace_now(void)
+{
+#ifdef _WIN32
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER now;
+
+    if (freq.QuadPart == 0)
+        QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+
+    return ((uint64_t)(now.QuadPart / freq.QuadPart) * 1000000000ULL) +
+           ((uint64_t)(now.QuadPart % freq.QuadPart) * 1000000000ULL / (uint64_t)freq.QuadPart);
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ((uint64_t)ts.tv_sec * 1000000000ULL) + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+/** Find or allocate a ring for the calling thread
+ *
+ * @return the ring, or NULL if we couldn't allocate one.
+ */
+static struct trace_ring *
+trace_ring_get(void)
+{
+    struct trace_ring *ring;
+
+    /*
+     * Prefer adopting an orphaned ring, so applications
+     * which churn threads don't grow without bound.
+     */
+    for (ring = atomic_load_explicit(&trace_rings, memory_order_acquire);
+         ring != NULL;
+         ring = ring->tr_next) {
+        bool orphaned = true;
+
+        if (atomic_compare_exchange_strong(&ring->tr_orphaned, &orphaned, false))
+            break;
+    }
+
+    if (ring == NULL) {
+        struct trace_ring *head;
+
+        ring = calloc(1, sizeof(*ring));
+        if (ring == NULL)
+            return (NULL);
+
+        head = atomic_load_explicit(&trace_rings, memory_order_relaxed);
+        do {
+            ring->tr_next = head;
+        } while (!atomic_compare_exchange_weak_explicit(&trace_rings, &head, ring,
+                                                        memory_order_release, memory_order_relaxed));
+    }
+    ring->tr_tid = THREAD_ID;
+
+#ifndef _WIN32
+    if (trace_ring_key_init)
+        (void) pthread_setspecific(trace_ring_key, ring);
+#endif
+    trace_ring_local = ring;
+
+    return (ring);
+}
+
+void
+trace_emit(enum trace_type type, int kq, const struct kevent *kev, int64_t data, int rv)
+{
+    struct trace_ring *ring = trace_ring_local;
+    struct trace_record *rec;
+    uint64_t head;
+
+    if (unlikely(ring == NULL)) {
+        ring = trace_ring_get();
+        if (ring == NULL)
+            return;
+    }
+
+    head = atomic_load_explicit(&ring->tr_head, memory_order_relaxed);
+    rec = &ring->tr_rec[head & TRACE_RING_MASK];
+
+    rec->tr_time = trace_now();
+    rec->tr_kq = kq;
+    rec->tr_type = type;
+    rec->tr_data = data;
+    rec->tr_rv = rv;
+    if (kev) {
+        rec->tr_ident = kev->ident;
+        rec->tr_filter = kev->filter;
+        rec->tr_flags = kev->flags;
+        rec->tr_fflags = kev->fflags;
+    } else {
+        rec->tr_ident = 0;
+        rec->tr_filter = 0;
+        rec->tr_flags = 0;
+        rec->tr_fflags = (type == TRACE_KEVENT_EXIT) ? (uint32_t)errno : 0;
+    }
+
+    atomic_store_explicit(&ring->tr_head, head + 1, memory_order_release);
+}
+
+/** write(2) the whole buffer, retrying on short writes and EINTR
+ */
+static int
+trace_write(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+
+    while (len > 0) {
+        ssize_t ret = write(fd, p, len);
+
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return (-1);
+        }
+        p += ret;
+        len -= (size_t)ret;
+    }
+
+    return (0);
+}
+
+/** Write all rings to a file descriptor
+ *
+ * Only uses write(2) and atomic loads, so is safe to call from a
+ * signal handler.
+ *
+ * @param[in] fd    to write the dump to.
+ * @return
+ *      - Number of records written.
+ *      - -1 on error (errno set).
+ */
+TSAN_IGNORE
+ssize_t
+trace_dump(int fd)
+{
+    struct trace_file_header fh;
+    struct trace_ring *ring, *rings;
+    ssize_t total = 0;
+    uint32_t nrings = 0;
+
+    rings = atomic_load_explicit(&trace_rings, memory_order_acquire);
+    for (ring = rings; ring != NULL; ring = ring->tr_next)
+        nrings++;
+
+    memset(&fh, 0, sizeof(fh));
+    memcpy(fh.tf_magic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+    fh.tf_version = TRACE_VERSION;
+    fh.tf_record_size = sizeof(struct trace_record);
+    fh.tf_ring_size = TRACE_RING_SIZE;
+    fh.tf_nrings = nrings;
+
+    if (trace_write(fd, &fh, sizeof(fh)) < 0)
+        return (-1);
+
+    /*
+     * Walk exactly the rings we counted, any pushed since
+     * are ahead of `rings` and won't be visited.
+     */
+    for (ring = rings; ring != NULL; ring = ring->tr_next) {
+        struct trace_ring_header th;
+        uint64_t head = atomic_load_explicit(&ring->tr_head, memory_order_acquire);
+        uint32_t count = head < TRACE_RING_SIZE ? (uint32_t)head : TRACE_RING_SIZE;
+        uint32_t start = (uint32_t)((head - count) & TRACE_RING_MASK);
+        uint32_t first = count < (TRACE_RING_SIZE - start) ? count : (TRACE_RING_SIZE - start);
+
+        th.th_tid = ring->tr_tid;
+        th.th_count = count;
+        th.th_head = head;
+
+        if ((trace_write(fd, &th, sizeof(th)) < 0) ||
+            (trace_write(fd, &ring->tr_rec[start], first * sizeof(struct trace_record)) < 0) ||
+            (trace_write(fd, &ring->tr_rec[0], (count - first) * sizeof(struct trace_record)) < 0))
+            return (-1);
+
+        total += count;
+    }
+
+    return (total);
+}
+
+/** Dump to trace_path, truncating whatever's there
+ */
+static void
+trace_dump_path(void)
+{
+    int fd;
+
+    if (trace_path == NULL)
+        return;
+
+#ifdef _WIN32
+    fd = _open(trace_path, _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+    fd = open(trace_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+#endif
+    if (fd < 0)
+        return;
+
+    (void) trace_dump(fd);
+    close(fd);
+}
+
+#ifndef _WIN32
+static void
+trace_signal_handler(UNUSED int sig)
+{
+    int saved_errno = errno;
+
+    trace_dump_path();
+
+    errno = saved_errno;
+}
+#endif
+
+/** Configure the flight recorder from the environment
+ *
+ * - KQUEUE_TRACE=<path> enables tracing, and dumps to <path> at exit.
+ * - KQUEUE_TRACE_SIGNAL=<signo> additionally dumps to <path> whenever
+ *   <signo> is received.
+ *
+ * @return
+ *      - 0 on success.
+ *      - -1 on failure.
+ */
+int
+trace_init(void)
+{
+    char *s;
+
+#ifndef _WIN32
+    if (pthread_key_create(&trace_ring_key, trace_ring_release) == 0)
+        trace_ring_key_init = true;
+#endif
+
+    s = getenv("KQUEUE_TRACE");
+    if ((s == NULL) || (*s == '\0'))
+        return (0);
+
+    trace_path = strdup(s);
+    if (trace_path == NULL)
+        return (-1);
+    atomic_store_explicit(&libkqueue_trace, true, memory_order_relaxed);
+
+#ifndef _WIN32
+    s = getenv("KQUEUE_TRACE_SIGNAL");
+    if ((s != NULL) && (*s != '\0')) {
+        struct sigaction sa;
+
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = trace_signal_handler;
+        sa.sa_flags = SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+
+        trace_signal = atoi(s);
+        if (sigaction(trace_signal, &sa, NULL) < 0) {
+            dbg_perror("sigaction(2)");
+            trace_signal = 0;
+        }
+    }
+#endif
+
+    return (0);
+}
+
+/** Dump to KQUEUE_TRACE (if set) and release global state
+ *
+ * Rings are not freed, other threads may still be recording
+ * while atexit handlers run.
+ */
+void
+trace_free(void)
+{
+#ifndef _WIN32
+    if (trace_signal) {
+        (void) signal(trace_signal, SIG_DFL);
+        trace_signal = 0;
+    }
+#endif
+
+    trace_dump_path();
+
+    free(trace_path);
+    trace_path = NULL;
+}
@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) 2026 Arran Cudbard-Bell <a.cudbardb@freeradius.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef  _TRACE_H
+#define  _TRACE_H
+
+/*
+ * Flight recorder.
+ *
+ * Unlike dbg_printf this is compiled into release builds.  Each
+ * thread that calls kevent() with tracing enabled gets its own
+ * ring of fixed-size binary records, so recording is a TLS
+ * lookup, a clock read and a 48 byte store; there are no locks
+ * and no formatting on the hot path.  When tracing is disabled
+ * the cost is a single predictable branch.
+ *
+ * Rings are dumped in the format below, and decoded by
+ * tools/kqueue-trace.py.
+ */
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/** Number of records kept per thread, must be a power of two
+ */
+#ifndef TRACE_RING_SIZE
+#  define TRACE_RING_SIZE 1024
+#endif
+
+#define TRACE_MAGIC     "KQTRACE"
+#define TRACE_VERSION   1
+
+/** Record types
+ *
+ * Field usage per type is listed alongside.  Fields not listed
+ * are zero.
+ */
+enum trace_type {
+    TRACE_KEVENT_ENTER = 1,     //!< kevent() entry.  data = nchanges, rv = nevents.
+    TRACE_KEVENT_EXIT,          //!< kevent() return.  rv = return value, fflags = errno.
+    TRACE_COPYIN,               //!< One changelist entry.  ident/filter/flags/fflags/data
+                                ///< from the kevent, rv = copyin result.
+    TRACE_COPYOUT,              //!< One event returned.  ident/filter/flags/fflags/data
+                                ///< from the kevent.
+    TRACE_WAIT                  //!< Backend wait.  data = duration in ns, rv = wait result.
+};
+
+/** A single flight recorder entry
+ *
+ * Layout is part of the dump format, change TRACE_VERSION if it changes.
+ */
+struct trace_record {
+    uint64_t            tr_time;        //!< CLOCK_MONOTONIC timestamp in ns.
+    uint64_t            tr_ident;       //!< kevent ident.
+    int64_t             tr_data;        //!< kevent data, or type specific value.
+    int32_t             tr_kq;          //!< kqueue id (the kqueue fd).
+    uint32_t            tr_fflags;      //!< kevent fflags, or type specific value.
+    int32_t             tr_rv;          //!< Return value of the traced operation.
+    uint16_t            tr_type;        //!< One of the trace_type values.
+    int16_t             tr_filter;      //!< kevent filter.
+    uint16_t            tr_flags;       //!< kevent flags.
+    uint16_t            tr_pad[3];
+};
+
+/** Dump file header, written once per dump
+ */
+struct trace_file_header {
+    char                tf_magic[8];    //!< TRACE_MAGIC, NUL terminated.
+    uint32_t            tf_version;     //!< TRACE_VERSION.
+    uint32_t            tf_record_size; //!< sizeof(struct trace_record).
+    uint32_t            tf_ring_size;   //!< TRACE_RING_SIZE.
+    uint32_t            tf_nrings;      //!< Number of rings which follow.
+};
+
+/** Per-thread header, followed by tr_count records, oldest first
+ */
+struct trace_ring_header {
+    int32_t             th_tid;         //!< THREAD_ID of the ring's owner.
+    uint32_t            th_count;       //!< Records which follow.
+    uint64_t            th_head;        //!< Total records ever written to the ring.
+};
+
+extern atomic_bool libkqueue_trace;
+
+/** @return true if tracing is enabled
+ *
+ * Relaxed, it's toggled by NOTE_TRACE while other threads are in
+ * kevent(), and records racing the toggle may or may not be kept.
+ */
+#define trace_enabled() atomic_load_explicit(&libkqueue_trace, memory_order_relaxed)
+
+void     trace_emit(enum trace_type type, int kq, const struct kevent *kev, int64_t data, int rv);
+uint64_t trace_now(void);
+ssize_t  trace_dump(int fd);
+int      trace_init(void);
+void     trace_free(void);
+
+/** Record a flight recorder entry if tracing is enabled
+ *
+ * @param[in] _type     trace_type.
+ * @param[in] _kq       kqueue id.
+ * @param[in] _kev      kevent to take ident/filter/flags/fflags from, may be NULL.
+ * @param[in] _data     written to tr_data.
+ * @param[in] _rv       written to tr_rv.
+ */
+#define trace_record(_type, _kq, _kev, _data, _rv) do { \
+    if (unlikely(trace_enabled())) \
+        trace_emit(_type, _kq, _kev, _data, _rv); \
+} while (0)
+
+#endif  /* ! _TRACE_H */
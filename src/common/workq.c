@@ -0,0 +1,291 @@
+/*
+ * Copyright (c) 2026 Arran Cudbard-Bell <a.cudbardb@freeradius.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * A pool of threads draining a kqueue and calling the
+ * struct kevent_handler in each event's udata.
+ *
+ * Each worker asks kevent() for one event at a time, so events
+ * are spread over whichever workers are free.  Knotes registered
+ * with EV_DISPATCH are disabled by copyout until the worker
+ * running their handler re-enables them, which it does in the
+ * changelist of its next kevent() call.  That means a handler is
+ * never running on more than one thread at once.
+ *
+ * Idle workers are parked in kevent() itself.  When a worker
+ * picks up an event and there are no others left waiting, it
+ * starts another (up to max_threads).  Workers above min_threads
+ * exit after sitting idle for workq_idle_timeout.
+ */
+#include <errno.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "private.h"
+
+/** How long a worker above min_threads waits for an event before exiting
+ */
+static const struct timespec workq_idle_timeout = { .tv_sec = 1, .tv_nsec = 0 };
+
+struct kqueue_workq {
+    int                 kqfd;           //!< kqueue being drained.
+    unsigned int        min_threads;    //!< Workers kept even when idle.
+    unsigned int        max_threads;    //!< Most workers to run at once.
+    atomic_uint         nthreads;       //!< Workers currently running.
+    atomic_uint         idle;           //!< Workers waiting in kevent().
+    atomic_bool         stopping;       //!< Set by kqueue_workq_destroy().
+    pthread_mutex_t     mtx;            //!< Serialises worker exit with destroy.
+    pthread_cond_t      cond;           //!< Signalled as each worker exits.
+};
+
+static void *workq_worker(void *arg);
+
+/** Start a worker if we're under max_threads
+ *
+ * @return
+ *      - 0 on success, or if we're already at max_threads.
+ *      - -1 if the thread couldn't be created (errno set).
+ */
+static int
+workq_grow(struct kqueue_workq *wq)
+{
+    unsigned int n = atomic_load(&wq->nthreads);
+    pthread_attr_t attr;
+    pthread_t tid;
+    int rv;
+
+    do {
+        if ((n >= wq->max_threads) || atomic_load(&wq->stopping))
+            return (0);
+    } while (!atomic_compare_exchange_weak(&wq->nthreads, &n, n + 1));
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    rv = pthread_create(&tid, &attr, workq_worker, wq);
+    pthread_attr_destroy(&attr);
+    if (rv != 0) {
+        dbg_printf("pthread_create: %s", strerror(rv));
+        pthread_mutex_lock(&wq->mtx);
+        atomic_fetch_sub(&wq->nthreads, 1);
+        pthread_cond_broadcast(&wq->cond);
+        pthread_mutex_unlock(&wq->mtx);
+        errno = rv;
+        return (-1);
+    }
+    dbg_printf("wq=%p - started worker, %u running", wq, n + 1);
+
+    return (0);
+}
+
+/** Give up our slot if there are more than min_threads workers
+ *
+ * The count is lowered under wq->mtx, as once it reaches 0
+ * kqueue_workq_destroy() may free wq.
+ *
+ * @return true if the caller should exit, without touching wq again.
+ */
+static bool
+workq_shrink(struct kqueue_workq *wq)
+{
+    pthread_mutex_lock(&wq->mtx);
+    if (atomic_load(&wq->nthreads) <= wq->min_threads) {
+        pthread_mutex_unlock(&wq->mtx);
+        return (false);
+    }
+    atomic_fetch_sub(&wq->nthreads, 1);
+    pthread_cond_broadcast(&wq->cond);
+    pthread_mutex_unlock(&wq->mtx);
+
+    return (true);
+}
+
+static void *
+workq_worker(void *arg)
+{
+    struct kqueue_workq *wq = arg;
+    struct kevent_handler const *kh;
+    struct kevent change, ev;
+    int nchanges = 0;
+    sigset_t all;
+    int rv;
+
+    /* Signals are for the application's threads, not ours */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
+
+    for (;;) {
+        atomic_fetch_add(&wq->idle, 1);
+        rv = kevent(wq->kqfd, &change, nchanges, &ev, 1, &workq_idle_timeout);
+        atomic_fetch_sub(&wq->idle, 1);
+        nchanges = 0;
+
+        if (rv < 0) {
+            if (errno == EINTR)
+                continue;
+            dbg_perror("kevent");
+            break;
+        }
+
+        if (rv == 0) {
+            if (atomic_load(&wq->stopping))
+                break;
+            if (workq_shrink(wq))
+                return (NULL);
+            continue;
+        }
+
+        /*
+         * Our own wakeup from kqueue_workq_destroy().  Any other
+         * event is still handled while stopping, as dropping it
+         * would lose an EV_ONESHOT or EV_CLEAR event, or leave an
+         * EV_DISPATCH knote disabled.
+         */
+        if ((ev.filter == EVFILT_USER) && (ev.ident == (uintptr_t)wq)) {
+            if (atomic_load(&wq->stopping))
+                break;
+            continue;
+        }
+
+        /*
+         * EV_ERROR here is our re-enable failing because the
+         * handler deleted its knote.
+         */
+        if ((ev.flags & EV_ERROR) || (ev.udata == NULL))
+            continue;
+
+        if (atomic_load(&wq->idle) == 0)
+            (void) workq_grow(wq);
+
+        kh = ev.udata;
+        kh->func(&ev, kh->ctx);
+
+        if ((ev.flags & EV_DISPATCH) && !(ev.flags & EV_ONESHOT)) {
+            EV_SET(&change, ev.ident, ev.filter, EV_ENABLE, 0, 0, ev.udata);
+            nchanges = 1;
+        }
+    }
+
+    /*
+     * Once we unlock, destroy may free wq, so this
+     * must be the last thing we touch.
+     */
+    pthread_mutex_lock(&wq->mtx);
+    atomic_fetch_sub(&wq->nthreads, 1);
+    pthread_cond_broadcast(&wq->cond);
+    pthread_mutex_unlock(&wq->mtx);
+
+    return (NULL);
+}
+
+/** Create a pool of threads to drain a kqueue
+ *
+ * Knotes are added with kevent() as normal, with udata pointing
+ * to a struct kevent_handler.  Add them with EV_DISPATCH to
+ * guarantee their handler only runs on one thread at a time.
+ *
+ * @param[in] kqfd          to drain.  Must outlive the pool.
+ * @param[in] min_threads   to keep running, at least 1.
+ * @param[in] max_threads   to start under load.
+ * @return
+ *      - The new pool.
+ *      - NULL on error (errno set).
+ */
+VISIBLE struct kqueue_workq *
+kqueue_workq_create(int kqfd, unsigned int min_threads, unsigned int max_threads)
+{
+    struct kqueue_workq *wq;
+    struct kevent kev;
+    unsigned int i;
+
+    if ((min_threads == 0) || (max_threads < min_threads)) {
+        errno = EINVAL;
+        return (NULL);
+    }
+
+    wq = calloc(1, sizeof(*wq));
+    if (wq == NULL)
+        return (NULL);
+    wq->kqfd = kqfd;
+    wq->min_threads = min_threads;
+    wq->max_threads = max_threads;
+    pthread_mutex_init(&wq->mtx, NULL);
+    pthread_cond_init(&wq->cond, NULL);
+
+    /* Level triggered, so once it fires every worker sees it */
+    EV_SET(&kev, (uintptr_t)wq, EVFILT_USER, EV_ADD, 0, 0, NULL);
+    if (kevent(kqfd, &kev, 1, NULL, 0, NULL) < 0) {
+        int saved_errno = errno;
+
+        pthread_cond_destroy(&wq->cond);
+        pthread_mutex_destroy(&wq->mtx);
+        free(wq);
+        errno = saved_errno;
+        return (NULL);
+    }
+
+    for (i = 0; i < min_threads; i++) {
+        if (workq_grow(wq) < 0) {
+            int saved_errno = errno;
+
+            kqueue_workq_destroy(wq);
+            errno = saved_errno;
+            return (NULL);
+        }
+    }
+
+    return (wq);
+}
+
+/** Stop and free a pool
+ *
+ * Waits for running handlers to return.  Must not be called
+ * from a handler.  Knotes are left registered.
+ *
+ * @param[in] wq    to destroy.
+ * @return
+ *      - 0 on success.
+ *      - -1 if the workers couldn't be woken (errno set).
+ */
+int VISIBLE
+kqueue_workq_destroy(struct kqueue_workq *wq)
+{
+    struct kevent kev;
+
+    atomic_store(&wq->stopping, true);
+
+    EV_SET(&kev, (uintptr_t)wq, EVFILT_USER, 0, NOTE_TRIGGER, 0, NULL);
+    if (kevent(wq->kqfd, &kev, 1, NULL, 0, NULL) < 0) {
+        /* Leave the pool usable, so destroy can be retried */
+        atomic_store(&wq->stopping, false);
+        return (-1);
+    }
+
+    pthread_mutex_lock(&wq->mtx);
+    while (atomic_load(&wq->nthreads) > 0)
+        pthread_cond_wait(&wq->cond, &wq->mtx);
+    pthread_mutex_unlock(&wq->mtx);
+
+    EV_SET(&kev, (uintptr_t)wq, EVFILT_USER, EV_DELETE, 0, 0, NULL);
+    (void) kevent(wq->kqfd, &kev, 1, NULL, 0, NULL);
+
+    pthread_cond_destroy(&wq->cond);
+    pthread_mutex_destroy(&wq->mtx);
+    free(wq);
+
+    return (0);
+}
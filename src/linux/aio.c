@@ -0,0 +1,440 @@
+/*
+ * Copyright (c) 2026 Arran Cudbard-Bell <a.cudbardb@freeradius.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * EVFILT_AIO on io_uring.
+ *
+ * On BSD, requests are started with aio_read(2)/aio_write(2) and
+ * a SIGEV_KEVENT sigevent, and the kernel creates the knote.  We
+ * can't hook the libc aio functions, so the request is started by
+ * the EV_ADD instead.  ident points to a struct aiocb, and kn_create
+ * writes an IORING_OP_READ or IORING_OP_WRITE for it to the
+ * filter's ring, with the knote as user_data.  Like NOTE_BATCH_CHANGES,
+ * the SQEs are submitted with one io_uring_enter at the end of the
+ * changelist (linux_evfilt_aio_flush).
+ *
+ * The ring has an eventfd registered (IORING_REGISTER_EVENTFD),
+ * which is in the kqueue's epoll set, so completions wake
+ * kevent_wait like any other event.  Copyout reaps the CQEs and
+ * returns as many as there's room for, the rest go on kf_ready and
+ * are returned through the kqueue's pending eventfd.
+ *
+ * Each request holds a reference to its knote until its CQE is
+ * reaped, as the kernel may still be using it after EV_DELETE.
+ */
+#include "private.h"
+
+#ifdef EVFILT_AIO
+#include "uring.h"
+#include <aio.h>
+
+/** Submission queue entries, the CQ has twice as many
+ */
+#define AIO_RING_ENTRIES 256
+
+struct aio_filter_state {
+    struct linux_ring       ring;
+    unsigned int            cqes_due;   //!< CQEs the kernel still owes us, for requests
+                                        ///< and cancellations.
+};
+
+static uint8_t const aio_ops[] = { IORING_OP_READ, IORING_OP_WRITE, IORING_OP_ASYNC_CANCEL };
+
+/** Record a request's result, and link its knote on kf_ready
+ *
+ * Also used for requests which were never submitted, with a
+ * CQE made up by aio_fail_unsubmitted.
+ */
+static void
+aio_complete(void *uctx, struct io_uring_cqe const *cqe)
+{
+    struct filter *filt = uctx;
+    struct aio_filter_state *afs = filt->kf_state.aio.state;
+    struct knote *kn = (struct knote *)(uintptr_t)cqe->user_data;
+
+    afs->cqes_due--;
+    if (!kn)
+        return;                         /* An IORING_OP_ASYNC_CANCEL */
+
+    kn->kn_aio.inflight = false;
+
+    if (kn->kn_flags & KNFL_KNOTE_DELETED) {
+        dbg_printf("kn=%p - deleted request completed: %i", kn, cqe->res);
+        knote_release(kn);
+        return;
+    }
+
+    dbg_printf("kn=%p - request completed: %i", kn, cqe->res);
+    kn->kn_aio.res = cqe->res;
+    kn->kn_aio.done = true;
+    if (!(kn->kev.flags & EV_DISABLE))
+        LIST_INSERT_HEAD(&filt->kf_ready, kn, kn_ready);
+    knote_release(kn);
+}
+
+/** Complete every SQE the kernel didn't consume with an error
+ *
+ * @param[in] filt  whose ring couldn't be submitted.
+ * @param[in] error to report for each request.
+ */
+static void
+aio_fail_unsubmitted(struct filter *filt, int error)
+{
+    struct linux_ring *ring = &filt->kf_state.aio.state->ring;
+    unsigned int head = atomic_load_explicit(ring->sq_head, memory_order_acquire);
+    unsigned int i;
+
+    for (i = head; i != ring->tail; i++) {
+        aio_complete(filt, &(struct io_uring_cqe){
+            .user_data = ring->sqes[i & ring->sq_mask].user_data,
+            .res = -error
+        });
+    }
+    ring->tail = head;
+    linux_ring_publish(ring);
+
+    if (!LIST_EMPTY(&filt->kf_ready))
+        (void) linux_kqueue_pending_raise(filt->kf_kqueue, filt);
+}
+
+/** Submit every queued SQE
+ *
+ * Requests which can't be submitted complete with the error.
+ */
+static void
+aio_submit(struct filter *filt)
+{
+    struct linux_ring *ring = &filt->kf_state.aio.state->ring;
+    unsigned int n;
+
+    linux_ring_publish(ring);
+    while ((n = linux_ring_sq_pending(ring)) > 0) {
+        int rv;
+
+        filter_stat_inc(filt, kfs_syscalls);
+        rv = linux_ring_enter(ring, n, 0, 0);
+        if (rv > 0)
+            continue;
+        if (rv == 0)
+            errno = EAGAIN;
+        else if (errno == EINTR)
+            continue;
+
+        dbg_perror("io_uring_enter(2) - uring_fd=%i", ring->fd);
+        aio_fail_unsubmitted(filt, errno);
+        break;
+    }
+}
+
+/** Get an SQE, submitting the queue first if it's full
+ */
+static struct io_uring_sqe *
+aio_sqe(struct filter *filt)
+{
+    struct aio_filter_state *afs = filt->kf_state.aio.state;
+
+    if (linux_ring_sq_space(&afs->ring) == 0)
+        aio_submit(filt);
+    afs->cqes_due++;
+
+    return linux_ring_sqe(&afs->ring);
+}
+
+static int
+aio_copyout_one(struct kevent *dst, struct filter *filt, struct knote *kn)
+{
+    memcpy(dst, &kn->kev, sizeof(*dst));
+    if (kn->kn_aio.res < 0) {
+        dst->flags |= EV_EOF;
+        dst->fflags = -kn->kn_aio.res;
+        dst->data = 0;
+    } else {
+        dst->data = kn->kn_aio.res;
+    }
+
+    kn->kn_aio.done = false;
+    if (LIST_INSERTED(kn, kn_ready))
+        LIST_REMOVE_ZERO(kn, kn_ready);
+
+    if (knote_copyout_flag_actions(filt, kn) < 0) return -1;
+
+    return (1);
+}
+
+static int
+evfilt_aio_copyout(struct kevent *dst, int nevents, struct filter *filt,
+    struct knote *src, UNUSED void *ptr)
+{
+    struct knote *kn, *tmp;
+    int n = 0;
+
+    /* Left on kf_ready by an earlier copyout */
+    if (src)
+        return aio_copyout_one(dst, filt, src);
+
+    /*
+     * The ring's eventfd fired.  Lower it before reaping,
+     * so a CQE posted after we look still wakes us.
+     */
+    kqops.eventfd_lower(&filt->kf_efd);
+    (void) linux_ring_reap(&filt->kf_state.aio.state->ring, aio_complete, filt);
+
+    LIST_FOREACH_SAFE(kn, &filt->kf_ready, kn_ready, tmp) {
+        if (n == nevents)
+            break;
+        if (aio_copyout_one(&dst[n], filt, kn) < 0)
+            return (-1);
+        n++;
+    }
+
+    if (!LIST_EMPTY(&filt->kf_ready) && (linux_kqueue_pending_raise(filt->kf_kqueue, filt) < 0))
+        return (-1);
+
+    return (n);
+}
+
+static int
+evfilt_aio_init(struct filter *filt)
+{
+    struct aio_filter_state *afs;
+    int efd;
+
+    if (linux_kqueue_pending_init(filt->kf_kqueue) < 0)
+        return (-1);
+
+    afs = calloc(1, sizeof(*afs));
+    if (!afs)
+        return (-1);
+
+    if (linux_ring_init(&afs->ring, AIO_RING_ENTRIES, aio_ops, NUM_ELEMENTS(aio_ops)) < 0)
+        goto error;
+
+    if (kqops.eventfd_init(&filt->kf_efd, filt) < 0)
+        goto error_ring;
+
+    efd = kqops.eventfd_descriptor(&filt->kf_efd);
+    if (linux_ring_register(&afs->ring, IORING_REGISTER_EVENTFD, &efd, 1) < 0) {
+        dbg_perror("io_uring_register(2) - IORING_REGISTER_EVENTFD");
+        goto error_efd;
+    }
+
+    if (kqops.eventfd_register(filt->kf_kqueue, &filt->kf_efd) < 0)
+        goto error_efd;
+
+    filt->kf_state.aio.state = afs;
+
+    return (0);
+
+error_efd:
+    kqops.eventfd_close(&filt->kf_efd);
+error_ring:
+    linux_ring_free(&afs->ring);
+error:
+    {
+        int saved_errno = errno;
+
+        free(afs);
+        errno = saved_errno;
+    }
+    return (-1);
+}
+
+/** Wait for the requests still in flight, and release the ring
+ *
+ * The knotes have all been deleted by now, which queued a cancel
+ * for each request.  We still have to wait for the CQEs, as the
+ * caller's buffers may be freed as soon as the kqueue is closed.
+ */
+static void
+evfilt_aio_destroy(struct filter *filt)
+{
+    struct aio_filter_state *afs = filt->kf_state.aio.state;
+
+    if (!afs)
+        return;
+
+    if (afs->ring.fd >= 0) {
+        aio_submit(filt);
+        while (afs->cqes_due > 0) {
+            filter_stat_inc(filt, kfs_syscalls);
+            if ((linux_ring_enter(&afs->ring, 0, afs->cqes_due, IORING_ENTER_GETEVENTS) < 0) &&
+                (errno != EINTR)) {
+                dbg_perror("io_uring_enter(2) - uring_fd=%i", afs->ring.fd);
+                break;
+            }
+            (void) linux_ring_reap(&afs->ring, aio_complete, filt);
+        }
+    }
+
+    kqops.eventfd_unregister(filt->kf_kqueue, &filt->kf_efd);
+    kqops.eventfd_close(&filt->kf_efd);
+    linux_ring_free(&afs->ring);
+    free(afs);
+    filt->kf_state.aio.state = NULL;
+}
+
+static int
+evfilt_aio_knote_create(struct filter *filt, struct knote *kn)
+{
+    struct aio_filter_state *afs = filt->kf_state.aio.state;
+    struct aiocb *cb = (struct aiocb *)kn->kev.ident;
+    struct io_uring_sqe *sqe;
+    uint8_t opcode;
+
+    if (!cb || (cb->aio_nbytes > UINT32_MAX)) {
+        errno = EINVAL;
+        return (-1);
+    }
+
+    switch (cb->aio_lio_opcode) {
+    case LIO_READ:
+        opcode = IORING_OP_READ;
+        break;
+
+    case LIO_WRITE:
+        opcode = IORING_OP_WRITE;
+        break;
+
+    default:
+        errno = EINVAL;
+        return (-1);
+    }
+
+    /*
+     * Leave room in the CQ for every request to be
+     * cancelled, so it can never overflow.  Cancels
+     * count too, their CQEs may still be due after the
+     * request they cancelled has completed.
+     */
+    if (afs->cqes_due >= (afs->ring.cq_entries / 2)) {
+        dbg_printf("kn=%p - too many requests in flight", kn);
+        errno = EAGAIN;
+        return (-1);
+    }
+
+    sqe = aio_sqe(filt);
+    sqe->opcode = opcode;
+    sqe->fd = cb->aio_fildes;
+    sqe->addr = (uintptr_t)cb->aio_buf;
+    sqe->len = cb->aio_nbytes;
+    sqe->off = cb->aio_offset;
+    sqe->user_data = (uintptr_t)kn;
+
+    /* There's nothing to report after the completion */
+    kn->kev.flags |= EV_ONESHOT;
+    kn->kn_aio.inflight = true;
+    kn->kn_aio.done = false;
+    (void) knote_retain(kn);
+    dbg_printf("kn=%p fd=%i - queued %s of %zu bytes", kn, cb->aio_fildes,
+               opcode == IORING_OP_READ ? "read" : "write", (size_t)cb->aio_nbytes);
+
+    return (0);
+}
+
+static int
+evfilt_aio_knote_modify(UNUSED struct filter *filt, UNUSED struct knote *kn,
+    UNUSED const struct kevent *kev)
+{
+    /* The request has already been started */
+    errno = EBUSY;
+    return (-1);
+}
+
+/** Cancel the request if it's still in flight
+ *
+ * Cancellation is best effort.  A request the kernel has
+ * already started (e.g. a read from a regular file) still
+ * completes, so its buffer must stay valid until the kqueue
+ * is closed.
+ */
+static int
+evfilt_aio_knote_delete(struct filter *filt, struct knote *kn)
+{
+    struct io_uring_sqe *sqe;
+
+    if (!kn->kn_aio.inflight || (filt->kf_state.aio.state->ring.fd < 0))
+        return (0);
+
+    sqe = aio_sqe(filt);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (uintptr_t)kn;
+    sqe->user_data = 0;
+    dbg_printf("kn=%p - queued cancel", kn);
+
+    return (0);
+}
+
+static int
+evfilt_aio_knote_enable(struct filter *filt, struct knote *kn)
+{
+    /* Completed while disabled */
+    if (!kn->kn_aio.done || LIST_INSERTED(kn, kn_ready))
+        return (0);
+
+    LIST_INSERT_HEAD(&filt->kf_ready, kn, kn_ready);
+
+    return linux_kqueue_pending_raise(filt->kf_kqueue, filt);
+}
+
+static int
+evfilt_aio_knote_disable(UNUSED struct filter *filt, UNUSED struct knote *kn)
+{
+    return (0);
+}
+
+/** Submit the requests queued by the changelist
+ *
+ * @param[in] filt  EVFILT_AIO filter of the kqueue.
+ */
+void
+linux_evfilt_aio_flush(struct filter *filt)
+{
+    struct aio_filter_state *afs = filt->kf_state.aio.state;
+
+    if ((afs->ring.fd >= 0) && (afs->ring.tail != atomic_load_explicit(afs->ring.sq_tail, memory_order_relaxed)))
+        aio_submit(filt);
+}
+
+/** Close the ring in a forked child
+ *
+ * Only async-signal-safe calls, the memory is leaked.
+ */
+void
+linux_evfilt_aio_close(struct kqueue *kq)
+{
+    struct filter *filt = kq->kq_filt[~EVFILT_AIO];
+    struct aio_filter_state *afs;
+
+    if (!filt || !(afs = filt->kf_state.aio.state) || (afs->ring.fd < 0))
+        return;
+
+    if (close(afs->ring.fd) < 0)
+        dbg_perror("close(2)");
+    afs->ring.fd = -1;
+}
+
+const struct filter evfilt_aio = {
+    .kf_id      = EVFILT_AIO,
+    .kf_init    = evfilt_aio_init,
+    .kf_destroy = evfilt_aio_destroy,
+    .kf_copyout = evfilt_aio_copyout,
+    .kn_create  = evfilt_aio_knote_create,
+    .kn_modify  = evfilt_aio_knote_modify,
+    .kn_delete  = evfilt_aio_knote_delete,
+    .kn_enable  = evfilt_aio_knote_enable,
+    .kn_disable = evfilt_aio_knote_disable,
+};
+#endif
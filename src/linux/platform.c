@@ -30,6 +30,13 @@
  */
 static __thread struct epoll_event epoll_events[MAX_KEVENT];
 
+/*
+ * Per-thread buffer for draining NOTE_PRIORITY class sets in
+ * kevent_copyout().  Separate from epoll_events as that still
+ * holds the top level results while the classes are drained.
+ */
+static __thread struct epoll_event epoll_prio_events[MAX_KEVENT];
+
 /*
  * Monitoring thread that takes care of cleaning up kqueues (on linux only)
  */
@@ -86,6 +93,9 @@ linux_kqueue_free(struct kqueue *kq);
 static void
 linux_kqueue_interrupt(struct kqueue *kq);
 
+static void
+linux_kqueue_priority_close(struct kqueue *kq);
+
 /*
  * TSAN false-positive on this function.
  *
@@ -413,6 +423,22 @@ linux_libkqueue_fork(void)
          */
         close(kq->epollfd);
         kq->epollfd = -1;
+        linux_kqueue_priority_close(kq);
+
+        if ((kq->kq_pending_efd >= 0) && (close(kq->kq_pending_efd) < 0))
+            dbg_perror("close(2)");
+        kq->kq_pending_efd = -1;
+
+        if ((kq->kq_diag_fd >= 0) && (close(kq->kq_diag_fd) < 0))
+            dbg_perror("close(2)");
+        kq->kq_diag_fd = -1;
+
+#if HAVE_IO_URING
+        linux_uring_close(kq);
+#endif
+#ifdef EVFILT_AIO
+        linux_evfilt_aio_close(kq);
+#endif
 
         if ((kq->pipefd[0] > 0) && (close(kq->pipefd[0]) < 0))
             dbg_perror("close(2)");
@@ -526,17 +552,20 @@ linux_libkqueue_free(void)
  * kq_mtx is a tracing_mutex_t: in debug builds it wraps a
  * pthread_mutex_t with lock-tracking metadata, so cond_wait must
  * operate on the inner lock and we restore the bookkeeping by hand
- * around it.  In NDEBUG builds tracing_mutex_t IS a pthread_mutex_t.
+ * around it.  In NDEBUG builds tracing_mutex_raw() gives the inner
+ * lock (tracing_mutex_t is a pthread_mutex_t unless ENABLE_LOCKSTAT
+ * is on).  Under ENABLE_LOCKSTAT the time spent in the cond_wait is
+ * counted as hold time.
  */
 static void
 monitoring_drain_cond_wait(void)
 {
 #ifdef NDEBUG
-    pthread_cond_wait(&monitoring_drain_cond, &kq_mtx);
+    pthread_cond_wait(&monitoring_drain_cond, tracing_mutex_raw(&kq_mtx));
 #else
     kq_mtx.mtx_status = MTX_UNLOCKED;
     kq_mtx.mtx_owner = -1;
-    pthread_cond_wait(&monitoring_drain_cond, &kq_mtx.mtx_lock);
+    pthread_cond_wait(&monitoring_drain_cond, tracing_mutex_raw(&kq_mtx));
     kq_mtx.mtx_owner = THREAD_ID;
     kq_mtx.mtx_status = MTX_LOCKED;
 #endif
@@ -577,12 +606,197 @@ libkqueue_drain_pending_close(void)
     tracing_mutex_unlock(&kq_mtx);
 }
 
+/** Close the NOTE_PRIORITY class sets
+ *
+ * Only calls close(), so is safe to use from the fork handler.
+ *
+ * @param[in] kq    whose class sets to close.
+ */
+static void
+linux_kqueue_priority_close(struct kqueue *kq)
+{
+    size_t i;
+
+    for (i = 0; i < NUM_ELEMENTS(kq->kq_prio_epollfd); i++) {
+        if (kq->kq_prio_epollfd[i] < 0)
+            continue;
+        if (close(kq->kq_prio_epollfd[i]) < 0)
+            dbg_perror("close(2) - prio_epoll_fd=%i", kq->kq_prio_epollfd[i]);
+        kq->kq_prio_epollfd[i] = -1;
+    }
+}
+
+/** Create an epoll set for each NOTE_PRIORITY class
+ *
+ * Each class set is nested in the kqueue's main epoll set, so a
+ * waiter parked on the main set wakes for readiness in any class.
+ * Once created, filter_epoll_fd() routes every new registration to
+ * the class set of its filter, and copyout drains the readable
+ * class sets highest first.  Epoll keeps whatever doesn't fit in the
+ * eventlist queued in its class set, edge triggered readiness
+ * included, and rotates level triggered entries so delivery within
+ * a class stays fair.
+ *
+ * @param[in] kq    to create the class sets for.
+ * @return
+ *      - 0 on success, or if the class sets already exist.
+ *      - -1 on failure (errno set).
+ */
+static int
+linux_kqueue_priority_init(struct kqueue *kq)
+{
+    size_t i;
+
+    if (kq->kq_prio_epollfd[0] >= 0)
+        return (0);
+
+    for (i = 0; i < NUM_ELEMENTS(kq->kq_prio_epollfd); i++) {
+        struct epoll_udata *ud = &kq->kq_prio_udata[i];
+        int fd;
+
+        fd = epoll_create1(EPOLL_CLOEXEC);
+        if (fd < 0) {
+            dbg_perror("epoll_create1(2)");
+        error:
+            linux_kqueue_priority_close(kq);
+            return (-1);
+        }
+        kq->kq_prio_epollfd[i] = fd;
+
+        ud->ud_type = EPOLL_UDATA_PRIORITY;
+        ud->ud_kq = kq;
+        kqueue_stat_inc(kq, kqs_syscalls);
+        if (epoll_ctl(kq->epollfd, EPOLL_CTL_ADD, fd,
+                      &(struct epoll_event){ .events = EPOLLIN, .data = { .ptr = ud } }) < 0) {
+            dbg_perror("epoll_ctl(2) - add prio_epoll_fd=%i", fd);
+            goto error;
+        }
+        dbg_printf("prio_epoll_fd=%i - class %zu created", fd, i);
+    }
+
+    return (0);
+}
+
+/** Create the kqueue's pending eventfd
+ *
+ * Filters whose events are raised from userland (EVFILT_USER) don't
+ * get an fd per knote.  They link ready knotes on kf_ready and call
+ * linux_kqueue_pending_raise(), which sets the filter's bit in
+ * kq_pending and raises this one eventfd.  Copyout then walks
+ * kf_ready for every filter with its bit set.
+ *
+ * The eventfd is created the first time a filter needs it, so a
+ * kqueue that never uses one costs only its epoll fd and the two
+ * ends of the close-detect pipe.
+ *
+ * @param[in] kq    to create the pending eventfd for.
+ * @return
+ *      - 0 on success, or if the eventfd already exists.
+ *      - -1 on failure (errno set).
+ */
+int
+linux_kqueue_pending_init(struct kqueue *kq)
+{
+    struct epoll_udata *ud = &kq->kq_pending_udata;
+    int fd;
+
+    if (kq->kq_pending_efd >= 0)
+        return (0);
+
+    fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (fd < 0) {
+        if ((errno == EMFILE) || (errno == ENFILE)) {
+            dbg_perror("eventfd(2) fd_used=%u fd_max=%u", get_fd_used(), get_fd_limit());
+        } else {
+            dbg_perror("eventfd(2)");
+        }
+        return (-1);
+    }
+
+    /*
+     * Always in the main set, with NOTE_PRIORITY copyout
+     * picks out the ready filters of each class itself.
+     */
+    ud->ud_type = EPOLL_UDATA_KQ_PENDING;
+    ud->ud_kq = kq;
+    kqueue_stat_inc(kq, kqs_syscalls);
+    if (epoll_ctl(kq->epollfd, EPOLL_CTL_ADD, fd,
+                  &(struct epoll_event){ .events = EPOLLIN, .data = { .ptr = ud } }) < 0) {
+        dbg_perror("epoll_ctl(2) - add pending_fd=%i", fd);
+        close(fd);
+        return (-1);
+    }
+    kq->kq_pending_efd = fd;
+    dbg_printf("pending_fd=%i - created", fd);
+
+    return (0);
+}
+
+/** Mark a filter as having knotes on its kf_ready list
+ *
+ * The eventfd is only written when kq_pending goes from empty to
+ * non-empty, so back to back triggers cost no syscalls.  It stays
+ * readable, waking every waiter, until copyout finds kq_pending
+ * empty again.
+ *
+ * @param[in] kq    the filter belongs to.
+ * @param[in] filt  with knotes on kf_ready.
+ * @return
+ *      - 0 on success.
+ *      - -1 if the eventfd couldn't be raised.
+ */
+int
+linux_kqueue_pending_raise(struct kqueue *kq, struct filter *filt)
+{
+    uint64_t counter = 1;
+    bool     was_pending = (kq->kq_pending != 0);
+
+    kqueue_mutex_assert(kq, MTX_LOCKED);
+    assert(kq->kq_pending_efd >= 0);
+
+    kq->kq_pending |= 1U << ~filt->kf_id;
+    if (was_pending)
+        return (0);
+
+    dbg_printf("pending_fd=%i - raising event level", kq->kq_pending_efd);
+    filter_stat_inc(filt, kfs_syscalls);
+    if ((write(kq->kq_pending_efd, &counter, sizeof(counter)) < 0) && (errno != EAGAIN)) {
+        dbg_perror("write(2) - pending_fd=%i", kq->kq_pending_efd);
+        return (-1);
+    }
+
+    return (0);
+}
+
+/** Return the kqueue's main epoll set for NOTE_POLL_FD
+ *
+ * Every registration, including the NOTE_PRIORITY class sets, is
+ * in the main set, and an epoll fd polls readable while its ready
+ * list is non-empty.  So the main set is readable exactly when
+ * epoll_wait in linux_kevent_wait would return something, which
+ * lets it be nested in another epoll set or a foreign event loop.
+ *
+ * @param[in] kq    to return the epoll fd for.
+ * @return the epoll fd.
+ */
+static int
+linux_kqueue_poll_fd(struct kqueue *kq)
+{
+    return kq->epollfd;
+}
+
 static int
 linux_kqueue_init(struct kqueue *kq)
 {
+    size_t i;
+
     kq->kq_next_epoch = 0;
     TAILQ_INIT(&kq->kq_inflight);
     TAILQ_INIT(&kq->ud_deferred_free);
+    for (i = 0; i < NUM_ELEMENTS(kq->kq_prio_epollfd); i++)
+        kq->kq_prio_epollfd[i] = -1;
+    kq->kq_pending_efd = -1;
+    kq->kq_diag_fd = -1;
 
     kq->epollfd = epoll_create1(EPOLL_CLOEXEC);
     if (kq->epollfd < 0) {
@@ -606,7 +820,19 @@ linux_kqueue_init(struct kqueue *kq)
         return (-1);
     }
 
-    if (filter_register_all(kq) < 0) {
+    /*
+     * O_NONBLOCK - Ensure pipe ends are non-blocking so that there's
+     * no chance of them delaying close(), and so the wake-byte write
+     * (linux_kqueue_interrupt) and the residual drain in
+     * linux_kqueue_free never block.
+     */
+    if ((fcntl(kq->pipefd[0], F_SETFL, O_NONBLOCK) < 0) ||
+        (fcntl(kq->pipefd[1], F_SETFL, O_NONBLOCK) < 0)) {
+        dbg_perror("fcntl(2)");
+        goto error;
+    }
+
+    if (filter_register_eager(kq) < 0) {
     error:
         if (close(kq->epollfd) < 0)
             dbg_perror("close(2)");
@@ -623,18 +849,6 @@ linux_kqueue_init(struct kqueue *kq)
         return (-1);
     }
 
-    /*
-     * O_NONBLOCK - Ensure pipe ends are non-blocking so that there's
-     * no chance of them delaying close(), and so the wake-byte write
-     * (linux_kqueue_interrupt) and the residual drain in
-     * linux_kqueue_free never block.
-     */
-    if ((fcntl(kq->pipefd[0], F_SETFL, O_NONBLOCK) < 0) ||
-        (fcntl(kq->pipefd[1], F_SETFL, O_NONBLOCK) < 0)) {
-        dbg_perror("fcntl(2)");
-        goto error;
-    }
-
     kq->kq_id = kq->pipefd[1];
 
     /*
@@ -746,6 +960,21 @@ linux_kqueue_free(struct kqueue *kq)
             dbg_perror("close(2) - epoll_fd=%i", kq->epollfd);
         kq->epollfd = -1;
     }
+    linux_kqueue_priority_close(kq);
+
+    if (kq->kq_pending_efd >= 0) {
+        dbg_printf("pending_fd=%i - closed", kq->kq_pending_efd);
+        if (close(kq->kq_pending_efd) < 0)
+            dbg_perror("close(2) - pending_fd=%i", kq->kq_pending_efd);
+        kq->kq_pending_efd = -1;
+    }
+
+#if HAVE_LINUX_SOCK_DIAG_H
+    linux_listen_backlog_free(kq);
+#endif
+#if HAVE_IO_URING
+    linux_uring_free(kq);
+#endif
 
     /*
      * read will return 0 on pipe EOF (i.e. if the write end of the pipe has been closed)
@@ -1065,7 +1294,8 @@ linux_kevent_wait_hires(
     fds.fd = kqueue_epoll_fd(kq);
     fds.events = POLLIN;
 
-    n = ppoll(&fds, 1, timeout, NULL);
+    n = ppoll(&fds, 1, timeout, kevent_wait_sigmask);
+    kqueue_stat_inc(kq, kqs_syscalls);
 #else
     int epoll_fd;
     fd_set fds;
@@ -1076,7 +1306,8 @@ linux_kevent_wait_hires(
     epoll_fd = kqueue_epoll_fd(kq);
     FD_ZERO(&fds);
     FD_SET(epoll_fd, &fds);
-    n = pselect(epoll_fd + 1, &fds, NULL , NULL, timeout, NULL);
+    n = pselect(epoll_fd + 1, &fds, NULL , NULL, timeout, kevent_wait_sigmask);
+    kqueue_stat_inc(kq, kqs_syscalls);
 #endif
 
     if (n < 0) {
@@ -1090,7 +1321,7 @@ linux_kevent_wait_hires(
     return (n);
 }
 
-static int
+int
 linux_kevent_wait(struct kqueue *kq, int nevents, const struct timespec *ts)
 {
     int timeout, nret;
@@ -1112,10 +1343,20 @@ linux_kevent_wait(struct kqueue *kq, int nevents, const struct timespec *ts)
             timeout = (1000 * ts->tv_sec) + (ts->tv_nsec / 1000000);
     }
 
+    /*
+     * With NOTE_PRIORITY in use the main set only holds the class
+     * sets, the close-detect pipe and level triggered filter and
+     * pending eventfds.  Fetch all of them so copyout sees every class
+     * that's ready, nothing is lost by over-fetching.
+     */
+    if (kq->kq_prio_epollfd[0] >= 0)
+        nevents = NUM_ELEMENTS(epoll_events);
+
     dbg_puts("waiting for events");
-    nret = epoll_wait(kqueue_epoll_fd(kq), epoll_events, nevents, timeout);
+    nret = epoll_pwait(kqueue_epoll_fd(kq), epoll_events, nevents, timeout, kevent_wait_sigmask);
+    kqueue_stat_inc(kq, kqs_syscalls);
     if (nret < 0) {
-        dbg_perror("epoll_wait");
+        dbg_perror("epoll_pwait");
         return (-1);
     }
 
@@ -1127,8 +1368,10 @@ static inline int linux_kevent_copyout_ev(struct kevent *el, int nevents, struct
 {
     int rv;
 
-    rv = filt->kf_copyout(el, nevents, filt, kn, ev);
+    rv = filter_copyout(el, nevents, filt, kn, ev);
     dbg_printf("rv=%i", rv);
+    if (rv > 0)
+        filter_stat_add(filt, kfs_events, rv);
 
     if (unlikely(rv < 0)) {
         dbg_puts("knote_copyout failed");
@@ -1177,6 +1420,8 @@ udata_type(enum epoll_udata_type ud_type)
         [EPOLL_UDATA_FD_STATE] = "EPOLL_UDATA_FD_STATE",
         [EPOLL_UDATA_EVENT_FD] = "EPOLL_UDATA_EVENT_FD",
         [EPOLL_UDATA_KQ_WAKE] = "EPOLL_UDATA_KQ_WAKE",
+        [EPOLL_UDATA_PRIORITY] = "EPOLL_UDATA_PRIORITY",
+        [EPOLL_UDATA_KQ_PENDING] = "EPOLL_UDATA_KQ_PENDING",
     };
 
     if (ud_type < 0 || ud_type >= NUM_ELEMENTS(ud_name))
@@ -1252,158 +1497,292 @@ epoll_event_dump(const struct epoll_event *ev)
     return ((const char *) buf);
 }
 
-int
-linux_kevent_copyout(struct kqueue *kq, int nready, struct kevent *el, int nevents)
+/** Copy out knotes from the kf_ready lists of pending filters
+ *
+ * Knotes are left on kf_ready unless their filter's copyout
+ * consumes the trigger, so a filter's bit is only cleared once its
+ * list is empty, and the eventfd is only lowered once every bit is.
+ *
+ * @param[in] kq        whose pending filters to copy out.
+ * @param[in,out] el_p  next free slot in the eventlist, advanced
+ *                      past any kevents written.
+ * @param[in] el_end    end of the eventlist.
+ * @param[in] prio      only copy out filters in this NOTE_PRIORITY
+ *                      class, or -1 for all of them.
+ * @return
+ *      - 0 to carry on with the next epoll event.
+ *      - 1 if the eventlist is full, or copyout failed.
+ */
+static int
+linux_kevent_copyout_pending(struct kqueue *kq, struct kevent **el_p, struct kevent *el_end, int prio)
 {
-    struct kevent   *el_p = el, *el_end = el + nevents;
-    int             i;
+    unsigned int    pending = kq->kq_pending;
+    uint64_t        cur;
+    int             ret = 0, rv;
 
-    dbg_printf("got %i events from epoll", nready);
-
-    for (i = 0; i < nready; i++) {
-        struct epoll_event    *ev = &epoll_events[i];    /* Thread local storage populated in linux_kevent_wait */
-        struct epoll_udata    *epoll_udata = ev->data.ptr;
-        int                   rv;
+    while (pending) {
+        unsigned int    idx = __builtin_ctz(pending);
+        struct filter   *filt = kq->kq_filt[idx];
+        struct knote    *kn, *tmp;
 
-        if (!epoll_udata) {
-            dbg_puts("event has no knote, skipping..."); /* Forgot to call KN_UDATA_ALLOC()? */
+        pending &= pending - 1;
+        if ((prio >= 0) && (filt->kf_priority != (unsigned int)prio))
             continue;
+
+        LIST_FOREACH_SAFE(kn, &filt->kf_ready, kn_ready, tmp) {
+            if (*el_p >= el_end) {
+                dbg_puts("no more available kevent slots");
+                ret = 1;
+                break;
+            }
+
+            rv = linux_kevent_copyout_ev(*el_p, (el_end - *el_p), NULL, filt, kn);
+            if (rv < 0) return (1);
+            *el_p += rv;
         }
 
+        if (LIST_EMPTY(&filt->kf_ready))
+            kq->kq_pending &= ~(1U << idx);
+        if (ret) break;
+    }
+
+    if (kq->kq_pending == 0) {
+        /* EAGAIN, another waiter lowered it first, is fine */
+        kqueue_stat_inc(kq, kqs_syscalls);
+        if ((read(kq->kq_pending_efd, &cur, sizeof(cur)) < 0) && (errno != EAGAIN))
+            dbg_perror("read(2) - pending_fd=%i", kq->kq_pending_efd);
+    }
+
+    return (ret);
+}
+
+/** Copy out the kevents for a single epoll event
+ *
+ * @param[in] ev        epoll event to dispatch.
+ * @param[in,out] el_p  next free slot in the eventlist, advanced
+ *                      past any kevents written.
+ * @param[in] el_end    end of the eventlist.
+ * @return
+ *      - 0 to carry on with the next epoll event.
+ *      - 1 if the eventlist is full, or copyout failed.
+ *      - -1 on error (errno set).
+ */
+static int
+linux_kevent_copyout_one(struct epoll_event *ev, struct kevent **el_p, struct kevent *el_end)
+{
+    struct epoll_udata    *epoll_udata = ev->data.ptr;
+    int                   rv;
+
+    if (!epoll_udata) {
+        dbg_puts("event has no knote, skipping..."); /* Forgot to call KN_UDATA_ALLOC()? */
+        return (0);
+    }
+
+    /*
+     * The udata may have been queued for deferred free by an
+     * EV_DELETE that ran while we were inside epoll_wait.  In
+     * that case the back-pointer (ud_kn / ud_fds / ud_efd) is
+     * dangling: the knote / fd_state / eventfd has already been
+     * freed.  The udata itself is still alive (the kq_inflight
+     * tracking we added to kevent_enter ensures it can't be
+     * reclaimed before our matching kevent_exit) but we must
+     * skip dispatch.
+     */
+    if (epoll_udata->ud_stale) {
+        dbg_printf("udata=%p stale, skipping dispatch", epoll_udata);
+        return (0);
+    }
+
+    dbg_printf("%s", epoll_event_dump(ev));
+
+    /*
+     * epoll event is associated with a single filter
+     * so we just have one knote per event.
+     *
+     * As different filters store pointers to different
+     * structures, we need to examine ud_type to figure
+     * out what epoll_data contains.
+     */
+    switch (epoll_udata->ud_type) {
+    case EPOLL_UDATA_KNOTE:
+    {
+        struct knote *kn = epoll_udata->ud_kn;
+
+        assert(kn);
+        if (*el_p >= el_end) {
+        oos:
+            dbg_puts("no more available kevent slots");
+            return (1);
+        }
+
+        rv = linux_kevent_copyout_ev(*el_p, (el_end - *el_p), ev, knote_get_filter(kn), kn);
+        if (rv < 0) return (1);
+        *el_p += rv;
+    }
+        break;
+
+    /*
+     * epoll event is associated with one filter for
+     * reading and one filter for writing.
+     */
+    case EPOLL_UDATA_FD_STATE:
+    {
+        struct fd_state   *fds = epoll_udata->ud_fds;
+        struct knote      *kn, *write;
+        assert(fds);
+
         /*
-         * The udata may have been queued for deferred free by an
-         * EV_DELETE that ran while we were inside epoll_wait.  In
-         * that case the back-pointer (ud_kn / ud_fds / ud_efd) is
-         * dangling: the knote / fd_state / eventfd has already been
-         * freed.  The udata itself is still alive (the kq_inflight
-         * tracking we added to kevent_enter ensures it can't be
-         * reclaimed before our matching kevent_exit) but we must
-         * skip dispatch.
+         * fds can be freed after the first linux_kevent_copyout_ev
+         * so cache the pointer value here.
          */
-        if (epoll_udata->ud_stale) {
-            dbg_printf("[%i] udata=%p stale, skipping dispatch", i, epoll_udata);
-            continue;
-        }
+        write = fds->fds_write;
 
-        dbg_printf("[%i] %s", i, epoll_event_dump(ev));
+        /*
+         *    FD, or errored, or other side shutdown
+         */
+        if ((kn = fds->fds_read) && (ev->events & (EPOLLIN | EPOLLHUP | EPOLLRDHUP | EPOLLERR))) {
+            if (*el_p >= el_end) goto oos;
+
+            rv = linux_kevent_copyout_ev(*el_p, (el_end - *el_p), ev, knote_get_filter(kn), kn);
+            if (rv < 0) return (1);
+            *el_p += rv;
+        }
 
         /*
-         * epoll event is associated with a single filter
-         * so we just have one knote per event.
-         *
-         * As different filters store pointers to different
-         * structures, we need to examine ud_type to figure
-         * out what epoll_data contains.
+         *    FD is writable, or errored, or other side shutdown
          */
-        switch (epoll_udata->ud_type) {
-        case EPOLL_UDATA_KNOTE:
-        {
-            struct knote *kn = epoll_udata->ud_kn;
-
-            assert(kn);
-            if (el_p >= el_end) {
-            oos:
-                dbg_printf("no more available kevent slots, used %zu", el_p - el);
-                goto done;
-            }
+        if ((kn = write) && (ev->events & (EPOLLOUT | POLLHUP | EPOLLERR))) {
+            if (*el_p >= el_end) goto oos;
 
-            rv = linux_kevent_copyout_ev(el_p, (el_end - el_p), ev, knote_get_filter(kn), kn);
-            if (rv < 0) goto done;
-            el_p += rv;
+            rv = linux_kevent_copyout_ev(*el_p, (el_end - *el_p), ev, knote_get_filter(kn), kn);
+            if (rv < 0) return (1);
+            *el_p += rv;
         }
-            break;
+    }
+        break;
+
+    case EPOLL_UDATA_EVENT_FD:
+    {
+        struct eventfd    *efd = epoll_udata->ud_efd;
 
+        assert(efd);
+
+        rv = linux_kevent_copyout_ev(*el_p, (el_end - *el_p), ev, efd->ef_filt, NULL);
+        if (rv < 0) return (1);
+        *el_p += rv;
+        break;
+    }
+
+    case EPOLL_UDATA_KQ_WAKE:
+    {
         /*
-         * epoll event is associated with one filter for
-         * reading and one filter for writing.
+         * Kq close-detect pipe[0] became readable.  Two
+         * triggers:
+         *   1. User closed kqfd (= pipefd[1]) - kernel marks
+         *      pipefd[0] as "no writers", EPOLLHUP fires for
+         *      every parked epoll_wait.  No bytes to drain.
+         *   2. linux_kqueue_interrupt() wrote a byte to
+         *      pipefd[1] from kqueue_free's defer path so a
+         *      parked waiter exits and the deferred free can
+         *      complete.  The byte must be drained here so
+         *      linux_kqueue_free's later read doesn't see
+         *      stray data.
+         *
+         * Either way, surface as -1/EBADF so the caller's
+         * outer kevent() returns the same error native
+         * kqueue produces, instead of a 0-event timeout.
          */
-        case EPOLL_UDATA_FD_STATE:
-        {
-            struct fd_state   *fds = epoll_udata->ud_fds;
-            struct knote      *kn, *write;
-            assert(fds);
+        char drain[16];
+        ssize_t n;
 
-            /*
-             * fds can be freed after the first linux_kevent_copyout_ev
-             * so cache the pointer value here.
-             */
-            write = fds->fds_write;
+        do {
+            n = read(epoll_udata->ud_kq->pipefd[0], drain, sizeof(drain));
+        } while (n > 0);
+        /* EAGAIN/EBADF/0 all benign here. */
 
-            /*
-             *    FD, or errored, or other side shutdown
-             */
-            if ((kn = fds->fds_read) && (ev->events & (EPOLLIN | EPOLLHUP | EPOLLRDHUP | EPOLLERR))) {
-                if (el_p >= el_end) goto oos;
+        dbg_printf("kq=%p - EPOLL_UDATA_KQ_WAKE, returning EBADF",
+                   epoll_udata->ud_kq);
+        errno = EBADF;
+        return (-1);
+    }
 
-                rv = linux_kevent_copyout_ev(el_p, (el_end - el_p), ev, knote_get_filter(kn), kn);
-                if (rv < 0) goto done;
-                el_p += rv;
-            }
+    case EPOLL_UDATA_KQ_PENDING:
+        return linux_kevent_copyout_pending(epoll_udata->ud_kq, el_p, el_end, -1);
 
-            /*
-             *    FD is writable, or errored, or other side shutdown
-             */
-            if ((kn = write) && (ev->events & (EPOLLOUT | POLLHUP | EPOLLERR))) {
-                if (el_p >= el_end) goto oos;
+    /*
+     *    Bad udata value. Maybe use after free?
+     */
+    default:
+        assert(0);
+        return (-1);
+    }
 
-                rv = linux_kevent_copyout_ev(el_p, (el_end - el_p), ev, knote_get_filter(kn), kn);
-                if (rv < 0) goto done;
-                el_p += rv;
-            }
+    return (0);
+}
+
+/** Copy out events when NOTE_PRIORITY class sets are in use
+ *
+ * The main epoll set only told us which class sets are readable.
+ * Drain those highest class first, only asking each for as many
+ * events as there's room left for, so lower class readiness stays
+ * queued in the kernel for the next call.  Filter eventfds and the
+ * pending eventfd are registered in the main set and level
+ * triggered, so they're dispatched from the wait results in their
+ * filter's class.
+ */
+static int
+linux_kevent_copyout_priority(struct kqueue *kq, int nready, struct kevent *el, int nevents)
+{
+    struct kevent   *el_p = el, *el_end = el + nevents;
+    unsigned int    ready = 0;
+    bool            pending = false;
+    int             i, n, prio, rv;
+
+    for (i = 0; i < nready; i++) {
+        struct epoll_udata *ud = epoll_events[i].data.ptr;
+
+        if (!ud) continue;
+
+        if (ud->ud_type == EPOLL_UDATA_PRIORITY) {
+            ready |= 1U << (ud - kq->kq_prio_udata);
+        } else if (ud->ud_type == EPOLL_UDATA_KQ_PENDING) {
+            pending = true;
+        } else if (ud->ud_type == EPOLL_UDATA_KQ_WAKE) {
+            return linux_kevent_copyout_one(&epoll_events[i], &el_p, el_end);
         }
-            break;
+    }
 
-        case EPOLL_UDATA_EVENT_FD:
-        {
-            struct eventfd    *efd = epoll_udata->ud_efd;
+    for (prio = NOTE_PRIORITY_MAX; prio >= 0; prio--) {
+        for (i = 0; i < nready; i++) {
+            struct epoll_udata *ud = epoll_events[i].data.ptr;
 
-            assert(efd);
+            if (!ud || (ud->ud_type != EPOLL_UDATA_EVENT_FD) || ud->ud_stale ||
+                (ud->ud_efd->ef_filt->kf_priority != (unsigned int)prio))
+                continue;
 
-            rv = linux_kevent_copyout_ev(el_p, (el_end - el_p), ev, efd->ef_filt, NULL);
-            if (rv < 0) goto done;
-            el_p += rv;
-            break;
+            rv = linux_kevent_copyout_one(&epoll_events[i], &el_p, el_end);
+            if (rv < 0) return (-1);
+            if (rv > 0) goto done;
         }
 
-        case EPOLL_UDATA_KQ_WAKE:
-        {
-            /*
-             * Kq close-detect pipe[0] became readable.  Two
-             * triggers:
-             *   1. User closed kqfd (= pipefd[1]) - kernel marks
-             *      pipefd[0] as "no writers", EPOLLHUP fires for
-             *      every parked epoll_wait.  No bytes to drain.
-             *   2. linux_kqueue_interrupt() wrote a byte to
-             *      pipefd[1] from kqueue_free's defer path so a
-             *      parked waiter exits and the deferred free can
-             *      complete.  The byte must be drained here so
-             *      linux_kqueue_free's later read doesn't see
-             *      stray data.
-             *
-             * Either way, surface as -1/EBADF so the caller's
-             * outer kevent() returns the same error native
-             * kqueue produces, instead of a 0-event timeout.
-             */
-            char drain[16];
-            ssize_t n;
+        if (pending && (linux_kevent_copyout_pending(kq, &el_p, el_end, prio) > 0))
+            goto done;
 
-            do {
-                n = read(epoll_udata->ud_kq->pipefd[0], drain, sizeof(drain));
-            } while (n > 0);
-            /* EAGAIN/EBADF/0 all benign here. */
+        if (!(ready & (1U << prio))) continue;
+        if (el_p >= el_end) break;
 
-            dbg_printf("kq=%p - EPOLL_UDATA_KQ_WAKE, returning EBADF",
-                       epoll_udata->ud_kq);
-            errno = EBADF;
+        n = epoll_wait(kq->kq_prio_epollfd[prio], epoll_prio_events, el_end - el_p, 0);
+        kqueue_stat_inc(kq, kqs_syscalls);
+        if (n < 0) {
+            dbg_perror("epoll_wait(2) - prio_epoll_fd=%i", kq->kq_prio_epollfd[prio]);
             return (-1);
         }
+        dbg_printf("got %i events from priority class %i", n, prio);
 
-        /*
-         *    Bad udata value. Maybe use after free?
-         */
-        default:
-            assert(0);
-            return (-1);
+        for (i = 0; i < n; i++) {
+            rv = linux_kevent_copyout_one(&epoll_prio_events[i], &el_p, el_end);
+            if (rv < 0) return (-1);
+            if (rv > 0) goto done;
         }
     }
 
@@ -1411,6 +1790,31 @@ done:
     return el_p - el;
 }
 
+int
+linux_kevent_copyout(struct kqueue *kq, int nready, struct kevent *el, int nevents)
+{
+    struct kevent   *el_p = el, *el_end = el + nevents;
+    int             i, rv;
+
+    dbg_printf("got %i events from epoll", nready);
+
+    /* Listener depths are only good for one copyout */
+    kq->kq_diag_len = 0;
+    kq->kq_diag_fresh = 0;
+
+    if (kq->kq_prio_epollfd[0] >= 0)
+        return linux_kevent_copyout_priority(kq, nready, el, nevents);
+
+    for (i = 0; i < nready; i++) {
+        /* Thread local storage populated in linux_kevent_wait */
+        rv = linux_kevent_copyout_one(&epoll_events[i], &el_p, el_end);
+        if (rv < 0) return (-1);
+        if (rv > 0) break;
+    }
+
+    return el_p - el;
+}
+
 int
 linux_eventfd_register(struct kqueue *kq, struct eventfd *efd)
 {
@@ -1469,6 +1873,8 @@ linux_eventfd_raise(struct eventfd *efd)
 
     dbg_printf("eventfd=%i - raising event level", efd->ef_id);
     counter = 1;
+    if (efd->ef_filt)
+        filter_stat_inc(efd->ef_filt, kfs_syscalls);
     if (write(efd->ef_id, &counter, sizeof(counter)) < 0) {
         switch (errno) {
         case EAGAIN:
@@ -1505,6 +1911,8 @@ linux_eventfd_lower(struct eventfd *efd)
      * still be lowered.
      */
     dbg_printf("eventfd=%i - lowering event level", efd->ef_id);
+    if (efd->ef_filt)
+        filter_stat_inc(efd->ef_filt, kfs_syscalls);
     n = read(efd->ef_id, &cur, sizeof(cur));
     if (n < 0) {
         switch (errno) {
@@ -1695,6 +2103,34 @@ linux_get_descriptor_type(struct knote *kn)
     return (0);
 }
 
+/** Create an eventfd that always polls readable
+ *
+ * Stands in for regular files in the epoll set.  epoll refuses
+ * them (EPERM), but they're always readable and writable.
+ *
+ * @return
+ *    - The eventfd.
+ *    - -1 on failure.
+ */
+int
+linux_surrogate_eventfd(void)
+{
+    int evfd;
+
+    evfd = eventfd(0, EFD_CLOEXEC);
+    if (evfd < 0) {
+        dbg_perror("eventfd(2)");
+        return (-1);
+    }
+    if (eventfd_write(evfd, 1) < 0) {
+        dbg_perror("eventfd_write(3)");
+        (void) close(evfd);
+        return (-1);
+    }
+
+    return (evfd);
+}
+
 /** Determine if two fd state entries are equal
  *
  * @param[in] a           first entry.
@@ -1894,6 +2330,10 @@ epoll_fd_registered(struct filter *filt, struct knote *kn)
      */
     if (!kn->kn_fds) return false;        /* No file descriptor state, can't be in epoll */
 
+#if HAVE_IO_URING
+    if (kn->kn_kq->kq_uring) linux_uring_sync(kn);   /* A queued ADD must land first */
+#endif
+
     have_ev = epoll_fd_state(&fds, kn, false);            /* ...enabled only */
     if (!have_ev) return false;
 
@@ -1901,6 +2341,7 @@ epoll_fd_registered(struct filter *filt, struct knote *kn)
      * This *SHOULD* be a noop if the FD is already
      * registered.
      */
+    filter_stat_inc(filt, kfs_syscalls);
     if (epoll_ctl(filter_epoll_fd(filt), EPOLL_CTL_MOD, fd, EPOLL_EV_FDS(have_ev, fds)) < 0) return false;
 
     return true;
@@ -1920,6 +2361,14 @@ epoll_update(int op, struct filter *filt, struct knote *kn, int ev, bool delete)
     if (KNOTE_DISABLED(kn)) dbg_printf("fd=%i kn=%p is disabled", fd, kn);
     if (KNOTE_IS_EOF(kn)) dbg_printf("fd=%i kn=%p is EOF", fd, kn);
 
+#if HAVE_IO_URING
+    /*
+     * The state below assumes the kernel has seen every
+     * earlier operation on the fd.
+     */
+    if (kn->kn_kq->kq_uring) linux_uring_sync(kn);
+#endif
+
     /*
      * Determine the current state of the file descriptor
      * and see if we need to make changes.
@@ -1997,6 +2446,18 @@ epoll_update(int op, struct filter *filt, struct knote *kn, int ev, bool delete)
                opn, epoll_op_dump(opn),
                epoll_event_dump(EPOLL_EV_FDS(want, fds)));
 
+#if HAVE_IO_URING
+    /*
+     * Registrations for new knotes may be submitted at the end
+     * of the changelist, see NOTE_BATCH_CHANGES.  If the kernel
+     * rejects one the state added above is removed then.
+     */
+    if ((opn == EPOLL_CTL_ADD) && kn->kn_kq->kq_creating && kn->kn_kq->kq_uring &&
+        (linux_uring_epoll_ctl(filt, kn, want_ev & ~have_ev, EPOLL_EV_FDS(want, fds)) == 0))
+        return (0);
+#endif
+
+    filter_stat_inc(filt, kfs_syscalls);
     if (epoll_ctl(filter_epoll_fd(filt), opn, fd, EPOLL_EV_FDS(want, fds)) < 0) {
         dbg_printf("epoll_ctl(2): %s", strerror(errno));
 
@@ -2106,4 +2567,13 @@ const struct kqueue_vtable kqops = {
     .eventfd_raise      = linux_eventfd_raise,
     .eventfd_lower      = linux_eventfd_lower,
     .eventfd_descriptor = linux_eventfd_descriptor,
+    .priority_init      = linux_kqueue_priority_init,
+    .kqueue_poll_fd     = linux_kqueue_poll_fd,
+#if HAVE_LINUX_SOCK_DIAG_H
+    .listen_backlog     = linux_kqueue_listen_backlog,
+#endif
+#if HAVE_IO_URING
+    .batch_changes      = linux_kqueue_batch_changes,
+    .kevent_flush       = linux_kevent_flush,
+#endif
 };
@@ -88,14 +88,25 @@ struct linux_knote_timer {
     int             timerfd;
 };
 
-struct linux_knote_user {
+struct linux_knote_read {
     int             eventfd;
+    int             sock_family;    /* Listener's address family for NOTE_LISTEN_BACKLOG, */
+                                    /* AF_UNSPEC until first reported, -1 if unknown */
+    ino_t           sock_ino;       /* Listener's inode, matched against sock_diag replies */
 };
 
-struct linux_knote_read {
-    int             eventfd;
+/** Accept queue depth of one listener, from a sock_diag dump
+ */
+struct linux_listen_depth {
+    ino_t           ino;
+    uint32_t        depth;
 };
 
+/** io_uring used to submit queued epoll_ctl operations, private to uring.c
+ */
+struct linux_uring;
+struct kevent_change_error;
+
 struct linux_knote_write {
     int             eventfd;
 };
@@ -104,6 +115,13 @@ struct linux_knote_vnode {
     nlink_t         nlink;
     off_t           size;
     int             inotifyfd;
+    int             wd;             /* Watch from kn_prepare, kn_create moves it to kev.data */
+};
+
+struct linux_knote_aio {
+    int             res;            /* Bytes transferred, or -errno, once complete */
+    bool            inflight;       /* Request queued or submitted, and not yet complete */
+    bool            done;           /* Complete, and not yet copied out */
 };
 
 /*
@@ -138,7 +156,9 @@ extern long int syscall (long int __sysno, ...);
 
 /* Convenience macros to access the epoll descriptor for the kqueue */
 #define kqueue_epoll_fd(kq)     ((kq)->epollfd)
-#define filter_epoll_fd(filt)   ((filt)->kf_kqueue->epollfd)
+#define filter_epoll_fd(filt)   ((filt)->kf_kqueue->kq_prio_epollfd[0] < 0 ? \
+                                 (filt)->kf_kqueue->epollfd : \
+                                 (filt)->kf_kqueue->kq_prio_epollfd[(filt)->kf_priority])
 
 /*
  * Tell common/kevent.c to drop kq->kq_mtx across kevent_wait.
@@ -151,6 +171,12 @@ extern long int syscall (long int __sysno, ...);
  */
 #define KEVENT_WAIT_DROP_LOCK   1
 
+/*
+ * linux_kevent_wait passes kevent_wait_sigmask to epoll_pwait,
+ * ppoll or pselect, so kevent_pwait() is supported.
+ */
+#define KEVENT_WAIT_SIGMASK     1
+
 /** What type of udata was passed to epoll
  *
  */
@@ -158,10 +184,15 @@ enum epoll_udata_type {
     EPOLL_UDATA_KNOTE = 1,           //!< Udata is a pointer to a knote.
     EPOLL_UDATA_FD_STATE,            //!< Udata is a pointer to a fd state structure.
     EPOLL_UDATA_EVENT_FD,            //!< Udata is a pointer to an eventfd.
-    EPOLL_UDATA_KQ_WAKE              //!< Sentinel for the kq's close-detect pipe[0] read end,
+    EPOLL_UDATA_KQ_WAKE,             //!< Sentinel for the kq's close-detect pipe[0] read end,
                                      ///< registered in the epoll set so EPOLLHUP fires for every
                                      ///< parked epoll_wait when the user closes the kqueue fd.
                                      ///< Copyout sees this type and skips the slot silently.
+    EPOLL_UDATA_PRIORITY,            //!< A NOTE_PRIORITY class's epoll set, nested in the
+                                     ///< kq's main epoll set.  Copyout drains the class sets
+                                     ///< that are readable, highest class first.
+    EPOLL_UDATA_KQ_PENDING           //!< The kq's pending eventfd.  Copyout walks kf_ready
+                                     ///< for every filter with its bit set in kq_pending.
 };
 
 struct epoll_udata;
@@ -315,8 +346,10 @@ struct epoll_udata {
         struct knote        *ud_kn;     //!< Pointer back to the containing knote.
         struct fd_state     *ud_fds;    //!< Pointer back to the containing fd_state.
         struct eventfd      *ud_efd;    //!< Pointer back to the containing eventfd.
-        struct kqueue       *ud_kq;     //!< For EPOLL_UDATA_KQ_WAKE.  Lifecycle bound to the
-                                        ///< kqueue itself; never goes through deferred-free.
+        struct kqueue       *ud_kq;     //!< For EPOLL_UDATA_KQ_WAKE, EPOLL_UDATA_PRIORITY and
+                                        ///< EPOLL_UDATA_KQ_PENDING.
+                                        ///< Lifecycle bound to the kqueue itself; never goes
+                                        ///< through deferred-free.
     };
     enum epoll_udata_type   ud_type;    //!< Which union member is live.
     bool                    ud_stale;   //!< Set true under kq_mtx by EV_DELETE.
@@ -371,6 +404,8 @@ struct fd_state {
     struct epoll_udata    *fds_udata;     //!< Heap-allocated demux header registered with
                                           ///< epoll via data.ptr.  Lifecycled separately from
                                           ///< the fd_state itself.
+    bool                  fds_queued;     //!< An EPOLL_CTL_ADD for the fd is waiting to be
+                                          ///< submitted, see NOTE_BATCH_CHANGES.
 };
 
 /** Additional members of struct eventfd
@@ -392,10 +427,10 @@ struct fd_state {
     int epoll_events;                     /* Which events this file descriptor is registered for */ \
     union { \
         struct linux_knote_timer kn_timer; \
-        struct linux_knote_user  kn_user; \
         struct linux_knote_read  kn_read; \
         struct linux_knote_write kn_write; \
         struct linux_knote_vnode kn_vnode; \
+        struct linux_knote_aio   kn_aio; \
         KNOTE_PROC_PLATFORM_SPECIFIC; \
     }; \
     struct epoll_udata    *kn_udata      /* Heap-allocated demux header.  The udata's lifecycle
@@ -418,8 +453,6 @@ struct fd_state {
     int epollfd;                          /* Main epoll FD */ \
     int pipefd[2];                        /* FD for pipe that catches close */ \
     RB_HEAD(fd_st, fd_state) kq_fd_st;    /* EVFILT_READ/EVFILT_WRITE fd state */ \
-    struct epoll_event kq_plist[MAX_KEVENT]; \
-    size_t kq_nplist; \
     struct epoll_udata *kq_wake_udata;    /* Sentinel registered against pipefd[0] in the epoll */ \
                                           /* set so user close(kqfd) wakes every parked */ \
                                           /* epoll_wait via EPOLLHUP.  Lets kqueue_complete_deferred_free */ \
@@ -429,11 +462,50 @@ struct fd_state {
                                           /* approaches UINT64_MAX (centuries away in practice). */ \
     struct kqueue_kevent_state_head kq_inflight; /* Callers currently inside kevent().  Tail-inserted, */ \
                                           /* so head = oldest = lowest still-active epoch. */ \
-    struct epoll_udata_head ud_deferred_free /* Stale udatas waiting for safe reclamation.  Tail- */ \
-                                          /* inserted, so head = smallest boundary epoch. */
+    struct epoll_udata_head ud_deferred_free; /* Stale udatas waiting for safe reclamation.  Tail- */ \
+                                          /* inserted, so head = smallest boundary epoch. */ \
+    int kq_prio_epollfd[NOTE_PRIORITY_MAX + 1]; /* One epoll set per NOTE_PRIORITY class, nested */ \
+                                          /* in epollfd.  -1 until NOTE_PRIORITY is first used, */ \
+                                          /* after which every registration goes to its */ \
+                                          /* filter's class set. */ \
+    struct epoll_udata kq_prio_udata[NOTE_PRIORITY_MAX + 1]; /* Registered against each class set */ \
+    int kq_pending_efd;                   /* Raised while any bit in kq_pending is set.  -1 until */ \
+                                          /* a filter first needs it. */ \
+    unsigned int kq_pending;              /* Bitmask of filters (by ~kf_id) with knotes on kf_ready */ \
+    struct epoll_udata kq_pending_udata;  /* Registered against kq_pending_efd */ \
+    bool kq_listen_backlog;               /* NOTE_LISTEN_BACKLOG, report listeners' accept queue depth */ \
+    int kq_diag_fd;                       /* NETLINK_SOCK_DIAG socket, -1 until a listener is reported */ \
+    uint32_t kq_diag_seq;                 /* Sequence number of the last dump request */ \
+    unsigned int kq_diag_fresh;           /* Address families dumped during this copyout */ \
+    struct linux_listen_depth *kq_diag;   /* Depths from those dumps, sorted by inode */ \
+    size_t kq_diag_len;                   /* Entries in kq_diag */ \
+    size_t kq_diag_size;                  /* Entries kq_diag has room for */ \
+    struct linux_uring *kq_uring          /* NOTE_BATCH_CHANGES ring, NULL until first turned on */
 
 int     linux_knote_copyout(struct kevent *, struct knote *);
 
+int     linux_kqueue_pending_init(struct kqueue *kq);
+int     linux_kqueue_pending_raise(struct kqueue *kq, struct filter *filt);
+
+#if HAVE_LINUX_SOCK_DIAG_H
+int     linux_listen_backlog(struct filter *filt, struct knote *kn, intptr_t *depth);
+int     linux_kqueue_listen_backlog(struct kqueue *kq, bool on);
+void    linux_listen_backlog_free(struct kqueue *kq);
+#endif
+
+#if HAVE_IO_URING
+int     linux_uring_epoll_ctl(struct filter *filt, struct knote *kn, int rollback, const struct epoll_event *ev);
+void    linux_uring_sync(struct knote *kn);
+int     linux_kqueue_batch_changes(struct kqueue *kq, bool on);
+int     linux_kevent_flush(struct kqueue *kq, struct kevent_change_error **errors);
+void    linux_uring_close(struct kqueue *kq);
+void    linux_uring_free(struct kqueue *kq);
+#endif
+#ifdef EVFILT_AIO
+void    linux_evfilt_aio_flush(struct filter *filt);
+void    linux_evfilt_aio_close(struct kqueue *kq);
+#endif
+
 void    linux_kevent_enter(struct kqueue *kq, struct kqueue_kevent_state *state);
 void    linux_kevent_exit(struct kqueue *kq, struct kqueue_kevent_state *state);
 
@@ -441,9 +513,18 @@ void    linux_kevent_exit(struct kqueue *kq, struct kqueue_kevent_state *state);
 #define kqueue_kevent_enter(_kq, _state) linux_kevent_enter((_kq), (_state))
 #define kqueue_kevent_exit(_kq, _state)  linux_kevent_exit((_kq), (_state))
 
+int     linux_kevent_wait(struct kqueue *kq, int nevents, const struct timespec *ts);
+int     linux_kevent_copyout(struct kqueue *kq, int nready, struct kevent *el, int nevents);
+
+#ifdef LIBKQUEUE_STATIC_DISPATCH
+#define kqueue_kevent_wait(_kq, _nevents, _ts)          linux_kevent_wait((_kq), (_nevents), (_ts))
+#define kqueue_kevent_copyout(_kq, _nready, _el, _n)    linux_kevent_copyout((_kq), (_nready), (_el), (_n))
+#endif
+
 /* utility functions */
 
 int     linux_get_descriptor_type(struct knote *);
+int     linux_surrogate_eventfd(void);
 int     linux_fd_to_path(char *, size_t, int);
 
 /* epoll-related functions */
@@ -455,6 +536,7 @@ char const *  epoll_event_dump(const struct epoll_event *);
 int     epoll_fd_state(struct fd_state **, struct knote *, bool);
 int     epoll_fd_state_init(struct fd_state **, struct knote *, int);
 void    epoll_fd_state_free(struct fd_state **, struct knote *, int);
+void    epoll_fd_state_del(struct fd_state **, struct knote *, int);
 
 bool    epoll_fd_registered(struct filter *filt, struct knote *kn);
 int     epoll_update(int op, struct filter *filt, struct knote *kn, int ev, bool delete);
@@ -27,6 +27,52 @@
 #include <sys/syscall.h>
 #include <sys/wait.h>
 
+/*
+ * waitid() on a pidfd (Linux >= 5.4) rather than the pid, so a pid
+ * that's been reaped and reused can't be confused with the process
+ * the pidfd refers to.  Older libcs don't define the idtype.
+ */
+#ifndef P_PIDFD
+#  define P_PIDFD 3
+#endif
+
+/*
+ * Cleared the first time the kernel rejects P_PIDFD (Linux 5.3 has
+ * pidfd_open but not P_PIDFD), after which we always wait on the pid.
+ */
+static bool proc_have_p_pidfd = true;
+
+/** Fetch a dead process's exit state without reaping it
+ *
+ * @param[in] filt  for syscall accounting.
+ * @param[in] kn    whose pidfd polled readable.
+ * @param[out] info populated with the exit state.
+ * @return 0 on success, -1 on failure (errno set).
+ */
+static int
+linux_proc_waitid(struct filter *filt, struct knote *kn, siginfo_t *info)
+{
+    int ret;
+
+    memset(info, 0, sizeof(*info));
+
+    filter_stat_inc(filt, kfs_syscalls);
+    if (proc_have_p_pidfd) {
+        ret = waitid(P_PIDFD, (id_t)kn->kn_proc.procfd, info, WEXITED | WNOHANG | WNOWAIT);
+        if ((ret == 0) || (errno != EINVAL))
+            goto done;
+        dbg_puts("waitid(P_PIDFD) not supported, falling back to P_PID");
+        proc_have_p_pidfd = false;
+        filter_stat_inc(filt, kfs_syscalls);
+    }
+    ret = waitid(P_PID, (id_t)kn->kev.ident, info, WEXITED | WNOHANG | WNOWAIT);
+
+done:
+    if (ret < 0)
+        dbg_printf("waitid(2): %s", strerror(errno));
+    return (ret);
+}
+
 int
 evfilt_proc_copyout(struct kevent *dst, UNUSED int nevents, struct filter *filt,
     struct knote *src, UNUSED_NDEBUG void *ptr)
@@ -52,25 +98,28 @@ evfilt_proc_copyout(struct kevent *dst, UNUSED int nevents, struct filter *filt,
     dbg_printf("epoll_ev=%s", epoll_event_dump(ev));
     memcpy(dst, &src->kev, sizeof(*dst)); /* Populate flags from the src kevent */
 
-    /* Get the exit status _without_ reaping the process, waitpid() should still work in the caller */
-    if (waitid(P_PID, (id_t)src->kev.ident, &info, WEXITED | WNOHANG | WNOWAIT) < 0) {
-        dbg_printf("waitid(2): %s", strerror(errno));
+    /*
+     * Get the exit status _without_ reaping the process, waitpid() should
+     * still work in the caller.  The status is only fetched here, when the
+     * event is copied out, not when the pidfd becomes readable.
+     */
+    if (linux_proc_waitid(filt, src, &info) < 0)
         return (-1);
-    }
 
     /*
      * musl's waitid(WNOHANG) can return success with a zero-filled siginfo even
      * when the child has already exited (the pidfd being readable guarantees
-     * it has).  Retry without WNOHANG: the process is definitively dead so
-     * this will not block.
+     * it has).  Retry once: the process is definitively dead, so by now the
+     * exit state is visible.  Don't drop WNOHANG for the retry, with P_PID a
+     * reaped and reused pid could be a live process and we'd block.
      */
     if (info.si_pid == 0) {
         dbg_printf("waitid(WNOHANG) returned si_pid=0 for dead pid %u, retrying",
                    (unsigned int)src->kev.ident);
-        if (waitid(P_PID, (id_t)src->kev.ident, &info, WEXITED | WNOWAIT) < 0) {
-            dbg_printf("waitid(2) retry: %s", strerror(errno));
+        if (linux_proc_waitid(filt, src, &info) < 0)
             return (-1);
-        }
+        if (info.si_pid == 0)
+            return (0);
     }
 
     /*
@@ -111,6 +160,7 @@ evfilt_proc_copyout(struct kevent *dst, UNUSED int nevents, struct filter *filt,
 int
 evfilt_proc_knote_enable(struct filter *filt, struct knote *kn)
 {
+    filter_stat_inc(filt, kfs_syscalls);
     if (epoll_ctl(filter_epoll_fd(filt), EPOLL_CTL_ADD, kn->kn_proc.procfd, EPOLL_EV_KN(EPOLLIN, kn)) < 0) {
         dbg_printf("epoll_ctl(2): %s", strerror(errno));
         return -1;
@@ -131,6 +181,7 @@ evfilt_proc_knote_disable(struct filter *filt, struct knote *kn)
     if (kn->kn_proc.procfd < 0)
         return (0);
 
+    filter_stat_inc(filt, kfs_syscalls);
     if (epoll_ctl(filter_epoll_fd(filt), EPOLL_CTL_DEL, kn->kn_proc.procfd, NULL) < 0) {
         dbg_printf("epoll_ctl(EPOLL_CTL_DEL pidfd=%i): %s",
                    kn->kn_proc.procfd, strerror(errno));
@@ -139,41 +190,63 @@ evfilt_proc_knote_disable(struct filter *filt, struct knote *kn)
     return (0);
 }
 
-/*
- * Open the pidfd, allocate udata, register in epoll.
+/** Open a close-on-exec pidfd for a process
  *
- * Mirrors posix/proc.c's proc_pid_arm in shape: a single "start
- * watching this pid" entry point used by kn_create and kn_modify's
- * late-arm branch.  Common code calls knote_release (not kn_delete)
- * on kn_create failure, so the only cleanup chance is here.
- *
- * @return 0 on success, -1 on failure (pidfd + udata released).
+ * @return the pidfd, or -1 on failure (errno set).
  */
 static int
-linux_proc_arm(struct filter *filt, struct knote *kn)
+linux_pidfd_open(pid_t pid)
 {
     int pfd;
 
-    pfd = syscall(SYS_pidfd_open, (pid_t)kn->kev.ident, 0);
+    pfd = syscall(SYS_pidfd_open, pid, 0);
     if (pfd < 0) {
         dbg_perror("pidfd_open(2)");
-    error_0:
         return (-1);
     }
     if (fcntl(pfd, F_SETFD, FD_CLOEXEC) < 0) {
         dbg_perror("fcntl(F_SETFD)");
-    error_1:
         (void) close(pfd);
-        kn->kn_proc.procfd = -1;
-        goto error_0;
+        return (-1);
     }
-    dbg_printf("created pidfd=%i monitoring pid=%u", pfd, (unsigned int)kn->kev.ident);
+    dbg_printf("created pidfd=%i monitoring pid=%u", pfd, (unsigned int)pid);
 
-    kn->kn_proc.procfd = pfd;
+    return (pfd);
+}
+
+/*
+ * Take the pidfd, allocate udata, register in epoll.
+ *
+ * Mirrors posix/proc.c's proc_pid_arm in shape: a single "start
+ * watching this pid" entry point used by kn_create and kn_modify's
+ * late-arm branch.  The pidfd is the one kevent_prepare opened
+ * (KNFL_PREPARED) if there is one, otherwise it's opened here.
+ * Common code calls knote_release (not kn_delete) on kn_create
+ * failure, so the only cleanup chance is here.
+ *
+ * @return 0 on success, -1 on failure (pidfd + udata released).
+ */
+static int
+linux_proc_arm(struct filter *filt, struct knote *kn)
+{
+    /*
+     * kevent_prepare may already have opened the pidfd,
+     * before the kqueue was locked.
+     */
+    if (kn->kn_flags & KNFL_PREPARED) {
+        kn->kn_flags &= ~KNFL_PREPARED;
+    } else {
+        kn->kn_proc.procfd = linux_pidfd_open((pid_t)kn->kev.ident);
+        if (kn->kn_proc.procfd < 0)
+            return (-1);
+    }
 
     if (KN_UDATA_ALLOC(kn) == NULL) {
         dbg_perror("epoll_udata_alloc");
-        goto error_1;
+    error:
+        (void) close(kn->kn_proc.procfd);
+        kn->kn_proc.procfd = -1;
+        return (-1);
     }
 
     if (evfilt_proc_knote_enable(filt, kn) < 0) {
@@ -182,7 +255,7 @@ linux_proc_arm(struct filter *filt, struct knote *kn)
          * saw the udata, free direct (no defer needed).
          */
         KN_UDATA_FREE(kn);
-        goto error_1;
+        goto error;
     }
 
     return (0);
@@ -232,6 +305,40 @@ evfilt_proc_knote_create(struct filter *filt, struct knote *kn)
     return (0);
 }
 
+/*
+ * Open the pidfd for an EV_ADD before the kqueue is locked, so a
+ * burst of spawns doesn't serialise other threads on pidfd_open.
+ */
+static struct knote *
+evfilt_proc_knote_prepare(const struct kevent *kev)
+{
+    struct knote *kn;
+    int pfd;
+
+    if (!(kev->fflags & NOTE_EXIT) || ((pid_t)kev->ident <= 0))
+        return (NULL);
+
+    pfd = linux_pidfd_open((pid_t)kev->ident);
+    if (pfd < 0)
+        return (NULL);  /* kn_create retries and reports the error */
+
+    kn = knote_new();
+    if (kn == NULL) {
+        (void) close(pfd);
+        return (NULL);
+    }
+    kn->kn_proc.procfd = pfd;
+    kn->kn_flags |= KNFL_PREPARED;
+
+    return (kn);
+}
+
+static void
+evfilt_proc_knote_unprepare(struct knote *kn)
+{
+    (void) close(kn->kn_proc.procfd);
+}
+
 int
 evfilt_proc_knote_modify(struct filter *filt, struct knote *kn, const struct kevent *kev)
 {
@@ -277,4 +384,6 @@ const struct filter evfilt_proc = {
     .kn_delete  = evfilt_proc_knote_delete,
     .kn_enable  = evfilt_proc_knote_enable,
     .kn_disable = evfilt_proc_knote_disable,
+    .kn_prepare = evfilt_proc_knote_prepare,
+    .kn_unprepare = evfilt_proc_knote_unprepare,
 };
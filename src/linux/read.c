@@ -130,15 +130,22 @@ evfilt_read_copyout(struct kevent *dst, UNUSED int nevents, struct filter *filt,
     if (src->kn_flags & KNFL_SOCKET_PASSIVE) {
         /*
          * On return, data contains the length of the
-           socket backlog. This is not available under Linux.
+         * socket backlog.  That's only available from
+         * sock_diag, see NOTE_LISTEN_BACKLOG.  Otherwise
+         * report that at least one connection is waiting.
          */
         dst->data = 1;
+#if HAVE_LINUX_SOCK_DIAG_H
+        if (filt->kf_kqueue->kq_listen_backlog)
+            (void) linux_listen_backlog(filt, src, &dst->data);
+#endif
     } else {
         /*
          * On return, data contains the number of bytes of protocol
            data available to read.
          */
         int i;
+        filter_stat_inc(filt, kfs_syscalls);
         if (ioctl(dst->ident, SIOCINQ, &i) < 0) {
             /* race condition with socket close, so ignore this error */
             dbg_puts("ioctl(2) of socket failed");
@@ -158,9 +165,20 @@ evfilt_read_copyout(struct kevent *dst, UNUSED int nevents, struct filter *filt,
 int
 evfilt_read_knote_create(struct filter *filt, struct knote *kn)
 {
+    bool prepared = false;
+
     /* TODO: kn_create arms before EV_DISABLE - see kevent_copyin_one EV_ADD|EV_DISABLE race. */
-    if (linux_get_descriptor_type(kn) < 0)
+
+    /*
+     * kevent_prepare may already have classified the descriptor,
+     * and opened the surrogate eventfd for a regular file.
+     */
+    if (kn->kn_flags & KNFL_PREPARED) {
+        kn->kn_flags &= ~KNFL_PREPARED;
+        prepared = true;
+    } else if (linux_get_descriptor_type(kn) < 0) {
         return (-1);
+    }
 
     /* Convert the kevent into an epoll_event */
 #if defined(HAVE_EPOLLRDHUP)
@@ -201,20 +219,18 @@ evfilt_read_knote_create(struct filter *filt, struct knote *kn)
             kn->epoll_events |= EPOLLONESHOT;
 
         kn->kn_epollfd = filter_epoll_fd(filt);
-        evfd = eventfd(0, EFD_CLOEXEC);
-        if (evfd < 0) {
-            dbg_perror("eventfd(2)");
-            return (-1);
-        }
-        if (eventfd_write(evfd, 1) < 0) {
-            dbg_perror("eventfd_write(3)");
-            (void) close(evfd);
-            return (-1);
+        if (prepared) {
+            evfd = kn->kn_read.eventfd;
+        } else {
+            evfd = linux_surrogate_eventfd();
+            if (evfd < 0)
+                return (-1);
         }
 
         kn->kn_read.eventfd = evfd;
 
         KN_UDATA_ALLOC(kn);   /* populate this knote's kn_udata field */
+        filter_stat_inc(filt, kfs_syscalls);
         if (epoll_ctl(kn->kn_epollfd, EPOLL_CTL_ADD, kn->kn_read.eventfd, EPOLL_EV_KN(kn->epoll_events, kn)) < 0) {
             dbg_printf("epoll_ctl(2): %s", strerror(errno));
             (void) close(evfd);
@@ -231,6 +247,44 @@ evfilt_read_knote_create(struct filter *filt, struct knote *kn)
     return epoll_update(EPOLL_CTL_ADD, filt, kn, kn->epoll_events, false);
 }
 
+/*
+ * Classify the descriptor, and for regular files create the
+ * surrogate eventfd, before the kqueue is locked, see kn_prepare.
+ */
+static struct knote *
+evfilt_read_knote_prepare(const struct kevent *kev)
+{
+    struct knote *kn;
+
+    kn = knote_new();
+    if (kn == NULL)
+        return (NULL);
+    kn->kev.ident = kev->ident;
+
+    if (linux_get_descriptor_type(kn) < 0)
+        goto error;
+
+    if (kn->kn_flags & KNFL_FILE) {
+        kn->kn_read.eventfd = linux_surrogate_eventfd();
+        if (kn->kn_read.eventfd < 0) {
+        error:
+            kn->kn_flags |= KNFL_KNOTE_DELETED;
+            knote_release(kn);
+            return (NULL);  /* kn_create retries and reports the error */
+        }
+    }
+    kn->kn_flags |= KNFL_PREPARED;
+
+    return (kn);
+}
+
+static void
+evfilt_read_knote_unprepare(struct knote *kn)
+{
+    if (kn->kn_flags & KNFL_FILE)
+        (void) close(kn->kn_read.eventfd);
+}
+
 int
 evfilt_read_knote_modify(UNUSED struct filter *filt, struct knote *kn,
         const struct kevent *kev)
@@ -317,6 +371,7 @@ int
 evfilt_read_knote_enable(struct filter *filt, struct knote *kn)
 {
     if (kn->kn_flags & KNFL_FILE) {
+        filter_stat_inc(filt, kfs_syscalls);
         if (epoll_ctl(kn->kn_epollfd, EPOLL_CTL_ADD, kn->kn_read.eventfd, EPOLL_EV_KN(kn->epoll_events, kn)) < 0) {
             dbg_perror("epoll_ctl(2)");
             return (-1);
@@ -332,6 +387,7 @@ int
 evfilt_read_knote_disable(struct filter *filt, struct knote *kn)
 {
     if (kn->kn_flags & KNFL_FILE) {
+        filter_stat_inc(filt, kfs_syscalls);
         if (epoll_ctl(kn->kn_epollfd, EPOLL_CTL_DEL, kn->kn_read.eventfd, NULL) < 0) {
             dbg_perror("epoll_ctl(2)");
             return (-1);
@@ -351,4 +407,6 @@ const struct filter evfilt_read = {
     .kn_delete  = evfilt_read_knote_delete,
     .kn_enable  = evfilt_read_knote_enable,
     .kn_disable = evfilt_read_knote_disable,
+    .kn_prepare = evfilt_read_knote_prepare,
+    .kn_unprepare = evfilt_read_knote_unprepare,
 };
@@ -0,0 +1,298 @@
+/*
+ * Copyright (c) 2026 Arran Cudbard-Bell <a.cudbardb@freeradius.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Accept queue depth of listening sockets, for NOTE_LISTEN_BACKLOG.
+ *
+ * BSD reports the number of pending connections in the data field
+ * of an EVFILT_READ event on a listening socket.  Linux has no
+ * per-socket call which returns that for every socket type, but
+ * sock_diag(7) does, for every listener in the network namespace.
+ *
+ * So the first listener copied out by a kevent() call dumps all
+ * the listeners of its address family in one netlink request,
+ * and the depths are cached (by inode) for the rest of that
+ * copyout.  linux_kevent_copyout invalidates the cache.
+ */
+#include "private.h"
+
+#if HAVE_LINUX_SOCK_DIAG_H
+#include <linux/inet_diag.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/sock_diag.h>
+#include <linux/unix_diag.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+/** Bits in kq_diag_fresh, one per address family we can dump
+ */
+enum {
+    LISTEN_DIAG_INET  = (1U << 0),
+    LISTEN_DIAG_INET6 = (1U << 1),
+    LISTEN_DIAG_UNIX  = (1U << 2)
+};
+
+static int
+listen_depth_cmp(void const *a, void const *b)
+{
+    ino_t x = ((struct linux_listen_depth const *)a)->ino;
+    ino_t y = ((struct linux_listen_depth const *)b)->ino;
+
+    return (x > y) - (x < y);
+}
+
+static int
+listen_depth_add(struct kqueue *kq, ino_t ino, uint32_t depth)
+{
+    if (kq->kq_diag_len == kq->kq_diag_size) {
+        size_t size = kq->kq_diag_size ? kq->kq_diag_size * 2 : 16;
+        struct linux_listen_depth *p;
+
+        p = realloc(kq->kq_diag, size * sizeof(*p));
+        if (p == NULL)
+            return (-1);
+        kq->kq_diag = p;
+        kq->kq_diag_size = size;
+    }
+    kq->kq_diag[kq->kq_diag_len++] = (struct linux_listen_depth){ .ino = ino, .depth = depth };
+
+    return (0);
+}
+
+/** Pull the inode and queue length out of one sock_diag response
+ */
+static int
+listen_diag_parse(struct kqueue *kq, struct nlmsghdr const *nlh, int family)
+{
+    if (family == AF_UNIX) {
+        struct unix_diag_msg const *msg = NLMSG_DATA(nlh);
+        struct rtattr const *rta = (struct rtattr const *)(msg + 1);
+        int len = (int)nlh->nlmsg_len - NLMSG_LENGTH(sizeof(*msg));
+
+        for (; RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+            struct unix_diag_rqlen const *rql = RTA_DATA(rta);
+
+            if ((rta->rta_type != UNIX_DIAG_RQLEN) || (RTA_PAYLOAD(rta) < sizeof(*rql)))
+                continue;
+            return listen_depth_add(kq, msg->udiag_ino, rql->udiag_rqueue);
+        }
+        return (0);
+    } else {
+        struct inet_diag_msg const *msg = NLMSG_DATA(nlh);
+
+        /* For listeners rqueue is the accept queue, wqueue its limit */
+        return listen_depth_add(kq, msg->idiag_inode, msg->idiag_rqueue);
+    }
+}
+
+/** Dump every listener of an address family into the kqueue's cache
+ *
+ * @param[in] filt      the EVFILT_READ filter, for syscall stats.
+ * @param[in] family    AF_INET, AF_INET6 or AF_UNIX.
+ * @return
+ *      - 0 on success.
+ *      - -1 on failure.  The cache may hold a partial dump.
+ */
+static int
+listen_diag_dump(struct filter *filt, int family)
+{
+    struct kqueue *kq = filt->kf_kqueue;
+    struct {
+        struct nlmsghdr nlh;
+        union {
+            struct inet_diag_req_v2 in;
+            struct unix_diag_req    un;
+        };
+    } req;
+    long buf[8192 / sizeof(long)];     /* aligned for struct nlmsghdr */
+    ssize_t n;
+
+    if (kq->kq_diag_fd < 0) {
+        kq->kq_diag_fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_SOCK_DIAG);
+        if (kq->kq_diag_fd < 0) {
+            dbg_perror("socket(AF_NETLINK)");
+            return (-1);
+        }
+        dbg_printf("diag_fd=%i - created", kq->kq_diag_fd);
+    }
+
+    memset(&req, 0, sizeof(req));
+    req.nlh.nlmsg_type = SOCK_DIAG_BY_FAMILY;
+    req.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    req.nlh.nlmsg_seq = ++kq->kq_diag_seq;
+    if (family == AF_UNIX) {
+        req.nlh.nlmsg_len = NLMSG_LENGTH(sizeof(req.un));
+        req.un.sdiag_family = AF_UNIX;
+        req.un.udiag_states = 1U << TCP_LISTEN;
+        req.un.udiag_show = UDIAG_SHOW_RQLEN;
+    } else {
+        req.nlh.nlmsg_len = NLMSG_LENGTH(sizeof(req.in));
+        req.in.sdiag_family = family;
+        req.in.sdiag_protocol = IPPROTO_TCP;
+        req.in.idiag_states = 1U << TCP_LISTEN;
+    }
+
+    filter_stat_inc(filt, kfs_syscalls);
+    if (send(kq->kq_diag_fd, &req, req.nlh.nlmsg_len, 0) < 0) {
+        dbg_perror("send(2) - diag_fd=%i", kq->kq_diag_fd);
+        goto error;
+    }
+
+    for (;;) {
+        struct nlmsghdr *nlh;
+
+        filter_stat_inc(filt, kfs_syscalls);
+        n = recv(kq->kq_diag_fd, buf, sizeof(buf), 0);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            dbg_perror("recv(2) - diag_fd=%i", kq->kq_diag_fd);
+            goto error;
+        }
+
+        for (nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, n); nlh = NLMSG_NEXT(nlh, n)) {
+            if (nlh->nlmsg_seq != kq->kq_diag_seq)
+                continue;       /* left over from a dump we gave up on */
+
+            switch (nlh->nlmsg_type) {
+            case NLMSG_DONE:
+                return (0);
+
+            case NLMSG_ERROR:
+                errno = -((struct nlmsgerr const *)NLMSG_DATA(nlh))->error;
+                dbg_perror("sock_diag family=%i", family);
+                return (-1);
+
+            default:
+                if (listen_diag_parse(kq, nlh, family) < 0)
+                    goto error;
+                break;
+            }
+        }
+    }
+
+error:
+    /*
+     * The rest of the dump may still be queued, start
+     * again with a fresh socket next time.
+     */
+    (void) close(kq->kq_diag_fd);
+    kq->kq_diag_fd = -1;
+    return (-1);
+}
+
+/** Find the accept queue depth of a listening socket
+ *
+ * @param[in] filt      the EVFILT_READ filter.
+ * @param[in] kn        for the listening socket.
+ * @param[out] depth    connections waiting to be accepted.
+ * @return
+ *      - 0 on success.
+ *      - -1 if the depth isn't available, e.g. not a TCP or
+ *        unix domain socket.
+ */
+int
+linux_listen_backlog(struct filter *filt, struct knote *kn, intptr_t *depth)
+{
+    struct kqueue *kq = filt->kf_kqueue;
+    struct linux_listen_depth key, *found;
+    unsigned int bit;
+
+    /*
+     * The inode and family are looked up once per
+     * knote, the first time it's reported.
+     */
+    if (kn->kn_read.sock_family == AF_UNSPEC) {
+        struct stat sb;
+        socklen_t slen = sizeof(kn->kn_read.sock_family);
+
+        if ((fstat(kn->kev.ident, &sb) < 0) ||
+            (getsockopt(kn->kev.ident, SOL_SOCKET, SO_DOMAIN, &kn->kn_read.sock_family, &slen) < 0)) {
+            kn->kn_read.sock_family = -1;
+            return (-1);
+        }
+        kn->kn_read.sock_ino = sb.st_ino;
+    }
+
+    switch (kn->kn_read.sock_family) {
+    case AF_INET:
+        bit = LISTEN_DIAG_INET;
+        break;
+
+    case AF_INET6:
+        bit = LISTEN_DIAG_INET6;
+        break;
+
+    case AF_UNIX:
+        bit = LISTEN_DIAG_UNIX;
+        break;
+
+    default:
+        return (-1);
+    }
+
+    /*
+     * A failed dump isn't retried for every listener.  What
+     * it did get is still accurate, so it's kept.
+     */
+    if (!(kq->kq_diag_fresh & bit)) {
+        kq->kq_diag_fresh |= bit;
+        (void) listen_diag_dump(filt, kn->kn_read.sock_family);
+        qsort(kq->kq_diag, kq->kq_diag_len, sizeof(*kq->kq_diag), listen_depth_cmp);
+    }
+
+    key.ino = kn->kn_read.sock_ino;
+    found = bsearch(&key, kq->kq_diag, kq->kq_diag_len, sizeof(*kq->kq_diag), listen_depth_cmp);
+    if (found == NULL)
+        return (-1);
+    *depth = found->depth;
+
+    return (0);
+}
+
+/** Turn NOTE_LISTEN_BACKLOG on or off for a kqueue
+ *
+ * @return the previous setting.
+ */
+int
+linux_kqueue_listen_backlog(struct kqueue *kq, bool on)
+{
+    bool old = kq->kq_listen_backlog;
+
+    kq->kq_listen_backlog = on;
+    if (!on)
+        linux_listen_backlog_free(kq);
+
+    return (old);
+}
+
+/** Release the netlink socket and cache
+ */
+void
+linux_listen_backlog_free(struct kqueue *kq)
+{
+    if (kq->kq_diag_fd >= 0) {
+        dbg_printf("diag_fd=%i - closed", kq->kq_diag_fd);
+        (void) close(kq->kq_diag_fd);
+        kq->kq_diag_fd = -1;
+    }
+    free(kq->kq_diag);
+    kq->kq_diag = NULL;
+    kq->kq_diag_len = kq->kq_diag_size = 0;
+    kq->kq_diag_fresh = 0;
+}
+#endif
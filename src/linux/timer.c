@@ -131,6 +131,43 @@ convert_timedata_to_itimerspec(struct itimerspec *dst, long src,
     dbg_printf("%s", itimerspec_dump(dst));
 }
 
+/*
+ * NOTE_LEEWAY: each timerfd is its own kernel timer, so we can't
+ * defer one expiry to batch it with another.  Instead round the
+ * first expiry up to a CLOCK_MONOTONIC boundary, the largest power
+ * of two nanoseconds within the leeway.  Timers whose deadlines
+ * fall between the same two boundaries then expire together and
+ * are returned by the same epoll_wait.  Periodic timers keep the
+ * alignment as the kernel re-arms from the aligned expiry.
+ */
+static void
+convert_leeway_to_abstime(struct itimerspec *ts, unsigned int fflags, int *flags)
+{
+    struct timespec now;
+    int64_t period_ns, leeway_ns, due;
+    int64_t grain = 1;
+
+    if (*flags & TFD_TIMER_ABSTIME)
+        return;
+
+    period_ns = (int64_t)ts->it_value.tv_sec * 1000000000LL + ts->it_value.tv_nsec;
+    leeway_ns = timer_leeway_ns(fflags, period_ns);
+    if (leeway_ns <= 1)
+        return;
+
+    while ((grain << 1) <= leeway_ns)
+        grain <<= 1;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    due = (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec + period_ns;
+    due = (due + grain - 1) & ~(grain - 1);
+
+    ts->it_value.tv_sec = due / 1000000000LL;
+    ts->it_value.tv_nsec = due % 1000000000LL;
+    *flags |= TFD_TIMER_ABSTIME;
+    dbg_printf("leeway=%lld ns, aligned %s", (long long)leeway_ns, itimerspec_dump(ts));
+}
+
 int
 evfilt_timer_copyout(struct kevent *dst, UNUSED int nevents, struct filter *filt,
     struct knote *src, void *ptr)
@@ -147,6 +184,7 @@ evfilt_timer_copyout(struct kevent *dst, UNUSED int nevents, struct filter *filt
      * On return, data contains the number of times the
        timer has been trigered.
      */
+    filter_stat_inc(filt, kfs_syscalls);
     n = read(src->kn_timer.timerfd, &expired, sizeof(expired));
     if (n < 0 && errno == EAGAIN) {
         /*
@@ -168,16 +206,16 @@ evfilt_timer_copyout(struct kevent *dst, UNUSED int nevents, struct filter *filt
     return (1);
 }
 
-int
-evfilt_timer_knote_create(struct filter *filt, struct knote *kn)
+/** Create an unarmed timerfd for a knote with the given fflags
+ *
+ * @return
+ *      - The timerfd.
+ *      - -1 on failure (errno set).
+ */
+static int
+timer_fd_open(unsigned int fflags)
 {
-    struct itimerspec ts;
     int tfd;
-    int flags;
-    int events;
-
-    /* TODO: kn_create arms before EV_DISABLE - see kevent_copyin_one EV_ADD|EV_DISABLE race. */
-    kn->kev.flags |= EV_CLEAR;
 
     /*
      * TFD_NONBLOCK so concurrent readers (multiple kevent() callers
@@ -191,11 +229,8 @@ evfilt_timer_knote_create(struct filter *filt, struct knote *kn)
      * CLOCK_MONOTONIC so relative timers are immune to wall-clock
      * retunes / NTP.
      */
-    {
-        clockid_t clk = (kn->kev.fflags & NOTE_ABSOLUTE) ? CLOCK_REALTIME
-                                                         : CLOCK_MONOTONIC;
-        tfd = timerfd_create(clk, TFD_CLOEXEC | TFD_NONBLOCK);
-    }
+    tfd = timerfd_create((fflags & NOTE_ABSOLUTE) ? CLOCK_REALTIME : CLOCK_MONOTONIC,
+                         TFD_CLOEXEC | TFD_NONBLOCK);
     if (tfd < 0) {
         if ((errno == EMFILE) || (errno == ENFILE)) {
             dbg_perror("timerfd_create(2) fd_used=%u fd_max=%u", get_fd_used(), get_fd_limit());
@@ -206,9 +241,38 @@ evfilt_timer_knote_create(struct filter *filt, struct knote *kn)
     }
     dbg_printf("timer_fd=%i - created", tfd);
 
+    return (tfd);
+}
+
+int
+evfilt_timer_knote_create(struct filter *filt, struct knote *kn)
+{
+    struct itimerspec ts;
+    int tfd;
+    int flags;
+    int events;
+
+    /* TODO: kn_create arms before EV_DISABLE - see kevent_copyin_one EV_ADD|EV_DISABLE race. */
+    kn->kev.flags |= EV_CLEAR;
+
+    /*
+     * kevent_prepare may already have created the timerfd.  It's
+     * only armed here, so the timeout runs from registration.
+     */
+    if (kn->kn_flags & KNFL_PREPARED) {
+        kn->kn_flags &= ~KNFL_PREPARED;
+        tfd = kn->kn_timer.timerfd;
+    } else {
+        tfd = timer_fd_open(kn->kev.fflags);
+        if (tfd < 0)
+            return (-1);
+    }
+
     convert_timedata_to_itimerspec(&ts, kn->kev.data, kn->kev.fflags,
                                    kn->kev.flags & EV_ONESHOT);
     flags = (kn->kev.fflags & NOTE_ABSOLUTE) ? TFD_TIMER_ABSTIME : 0;
+    convert_leeway_to_abstime(&ts, kn->kev.fflags, &flags);
+    filter_stat_inc(filt, kfs_syscalls);
     if (timerfd_settime(tfd, flags, &ts, NULL) < 0) {
         dbg_printf("timerfd_settime(2): %s", strerror(errno));
         close(tfd);
@@ -220,6 +284,7 @@ evfilt_timer_knote_create(struct filter *filt, struct knote *kn)
         events |= EPOLLONESHOT;
 
     KN_UDATA_ALLOC(kn);   /* populate this knote's kn_udata field */
+    filter_stat_inc(filt, kfs_syscalls);
     if (epoll_ctl(filter_epoll_fd(filt), EPOLL_CTL_ADD, tfd, EPOLL_EV_KN(events, kn)) < 0) {
         dbg_printf("epoll_ctl(2): %d", errno);
         close(tfd);
@@ -252,26 +317,24 @@ evfilt_timer_knote_modify(struct filter *filt, struct knote *kn,
      * filt_timerstart in the new domain (kern_event.c:1033).
      */
     if (clk_changed) {
-        clockid_t clk = (kev->fflags & NOTE_ABSOLUTE) ? CLOCK_REALTIME
-                                                      : CLOCK_MONOTONIC;
         int newfd;
         int events;
 
-        newfd = timerfd_create(clk, TFD_CLOEXEC | TFD_NONBLOCK);
-        if (newfd < 0) {
-            dbg_perror("timerfd_create(2) on NOTE_ABSOLUTE toggle");
+        newfd = timer_fd_open(kev->fflags);
+        if (newfd < 0)
             return (-1);
-        }
 
         events = EPOLLIN | EPOLLET;
         if (kev->flags & (EV_ONESHOT | EV_DISPATCH))
             events |= EPOLLONESHOT;
 
+        filter_stat_inc(filt, kfs_syscalls);
         if (epoll_ctl(filter_epoll_fd(filt), EPOLL_CTL_DEL,
                       kn->kn_timer.timerfd, NULL) < 0)
             dbg_perror("epoll_ctl(DEL) on NOTE_ABSOLUTE toggle");
         (void) close(kn->kn_timer.timerfd);
 
+        filter_stat_inc(filt, kfs_syscalls);
         if (epoll_ctl(filter_epoll_fd(filt), EPOLL_CTL_ADD, newfd,
                       EPOLL_EV_KN(events, kn)) < 0) {
             dbg_perror("epoll_ctl(ADD) on NOTE_ABSOLUTE toggle");
@@ -285,6 +348,8 @@ evfilt_timer_knote_modify(struct filter *filt, struct knote *kn,
     convert_timedata_to_itimerspec(&ts, kev->data, kev->fflags,
                                    kev->flags & EV_ONESHOT);
     flags = (kev->fflags & NOTE_ABSOLUTE) ? TFD_TIMER_ABSTIME : 0;
+    convert_leeway_to_abstime(&ts, kev->fflags, &flags);
+    filter_stat_inc(filt, kfs_syscalls);
     if (timerfd_settime(kn->kn_timer.timerfd, flags, &ts, NULL) < 0) {
         dbg_printf("timerfd_settime(2): %s", strerror(errno));
         return (-1);
@@ -306,6 +371,7 @@ evfilt_timer_knote_delete(struct filter *filt, struct knote *kn)
     if (kn->kn_timer.timerfd == -1)
         return (0);
 
+    filter_stat_inc(filt, kfs_syscalls);
     if (epoll_ctl(filter_epoll_fd(filt), EPOLL_CTL_DEL, kn->kn_timer.timerfd, NULL) < 0) {
         dbg_printf("epoll_ctl(2): %s", strerror(errno));
         rv = -1;
@@ -323,6 +389,36 @@ evfilt_timer_knote_delete(struct filter *filt, struct knote *kn)
     return (rv);
 }
 
+/*
+ * Create the timerfd before the kqueue is locked, see kn_prepare.
+ */
+static struct knote *
+evfilt_timer_knote_prepare(const struct kevent *kev)
+{
+    struct knote *kn;
+    int tfd;
+
+    tfd = timer_fd_open(kev->fflags);
+    if (tfd < 0)
+        return (NULL);  /* kn_create retries and reports the error */
+
+    kn = knote_new();
+    if (kn == NULL) {
+        (void) close(tfd);
+        return (NULL);
+    }
+    kn->kn_timer.timerfd = tfd;
+    kn->kn_flags |= KNFL_PREPARED;
+
+    return (kn);
+}
+
+static void
+evfilt_timer_knote_unprepare(struct knote *kn)
+{
+    (void) close(kn->kn_timer.timerfd);
+}
+
 int
 evfilt_timer_knote_enable(struct filter *filt, struct knote *kn)
 {
@@ -343,4 +439,6 @@ const struct filter evfilt_timer = {
     .kn_delete  = evfilt_timer_knote_delete,
     .kn_enable  = evfilt_timer_knote_enable,
     .kn_disable = evfilt_timer_knote_disable,
+    .kn_prepare = evfilt_timer_knote_prepare,
+    .kn_unprepare = evfilt_timer_knote_unprepare,
 };
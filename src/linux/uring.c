@@ -0,0 +1,505 @@
+/*
+ * Copyright (c) 2026 Arran Cudbard-Bell <a.cudbardb@freeradius.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Batched epoll_ctl(2) submission, for NOTE_BATCH_CHANGES.
+ *
+ * A changelist adding N sockets normally costs N epoll_ctl calls.
+ * With NOTE_BATCH_CHANGES on, the EPOLL_CTL_ADDs made by kn_create
+ * are written to an io_uring submission queue as IORING_OP_EPOLL_CTL
+ * instead, and kevent_copyin submits them all with one io_uring_enter
+ * when it reaches the end of the changelist.  The ring is only used
+ * for submission, events are still collected with epoll_wait.
+ *
+ * Only ADDs for new knotes are queued, everything else on the fd
+ * flushes the queue first (see linux_uring_sync), so the kernel
+ * always sees the operations on a descriptor in the order they were
+ * made.  A queued ADD's knote is inserted before the kernel sees it,
+ * so if the kernel rejects it the fd_state is rolled back here, and
+ * kevent_copyin deletes the knote and reports the error.
+ *
+ * The ring helpers at the top of this file are also used by
+ * EVFILT_AIO, see uring.h.
+ */
+#include "private.h"
+
+#if HAVE_IO_URING
+#include "uring.h"
+#include <sys/mman.h>
+
+/** Submission queue entries, and the most ADDs submitted by one io_uring_enter
+ */
+#define LINUX_URING_ENTRIES 256
+
+struct linux_uring_op {
+    struct knote            *kn;        //!< Knote whose kn_create queued the ADD.
+    struct kevent           kev;        //!< Change which created it, for EV_ERROR.
+    struct epoll_event      ev;         //!< Read by the kernel during submission.
+    int                     epfd;       //!< Filter's epoll set.
+    int                     rollback;   //!< fd_state events to remove if the ADD fails.
+    int                     res;        //!< From the CQE, 0 or -errno.
+    bool                    done;       //!< CQE has been reaped.
+};
+
+struct linux_uring {
+    struct linux_ring       ring;       //!< fd is -1 while turned off.
+
+    unsigned int            nops;       //!< Queued since the last flush.
+    struct linux_uring_op   ops[LINUX_URING_ENTRIES];
+
+    struct kevent_change_error *errors; //!< Rejected since the last linux_kevent_flush.
+    unsigned int            nerrors;
+    unsigned int            errors_size;
+};
+
+static int
+sys_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+    return syscall(SYS_io_uring_setup, entries, p);
+}
+
+/** Submit SQEs and/or wait for CQEs
+ *
+ * @return the number of SQEs submitted, or -1 on failure (errno set).
+ */
+int
+linux_ring_enter(struct linux_ring *ring, unsigned int to_submit, unsigned int min_complete, unsigned int flags)
+{
+    return syscall(SYS_io_uring_enter, ring->fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+int
+linux_ring_register(struct linux_ring *ring, unsigned int opcode, void *arg, unsigned int nr_args)
+{
+    return syscall(SYS_io_uring_register, ring->fd, opcode, arg, nr_args);
+}
+
+/** Unmap and close a ring
+ *
+ * Safe to call on a ring which was never set up, or already freed.
+ */
+void
+linux_ring_free(struct linux_ring *ring)
+{
+    if (ring->sqes) {
+        munmap(ring->sqes, ring->sqes_size);
+        ring->sqes = NULL;
+    }
+    if (ring->rings) {
+        munmap(ring->rings, ring->rings_size);
+        ring->rings = NULL;
+    }
+    if (ring->fd >= 0) {
+        dbg_printf("uring_fd=%i - closed", ring->fd);
+        (void) close(ring->fd);
+        ring->fd = -1;
+    }
+}
+
+/** Create a ring and check the kernel supports the operations we need
+ *
+ * @param[out] ring     to set up.
+ * @param[in] entries   in the SQ, the CQ gets twice as many.
+ * @param[in] ops       IORING_OP_* the caller is going to use.
+ * @param[in] nops      in ops.
+ * @return
+ *      - 0 on success.
+ *      - -1 on failure (errno set).  ENOTSUP if io_uring is
+ *        available but can't be used for this.
+ */
+int
+linux_ring_init(struct linux_ring *ring, unsigned int entries, uint8_t const *ops, size_t nops)
+{
+    struct io_uring_params p;
+    struct io_uring_probe *probe;
+    unsigned int *sq_array, i;
+    uint8_t *rings;
+    size_t cq_size;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&p, 0, sizeof(p));
+    ring->fd = sys_io_uring_setup(entries, &p);
+    if (ring->fd < 0) {
+        dbg_perror("io_uring_setup(2)");
+        if ((errno == ENOSYS) || (errno == EPERM))
+            errno = ENOTSUP;            /* not built in, or io_uring_disabled */
+        return (-1);
+    }
+    dbg_printf("uring_fd=%i - created", ring->fd);
+
+    /*
+     * Every kernel with the IORING_REGISTER_PROBE we use below
+     * has a single mapping for both rings, so we don't handle two.
+     */
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        errno = ENOTSUP;
+        goto error;
+    }
+
+    probe = calloc(1, sizeof(*probe) + (IORING_OP_LAST * sizeof(probe->ops[0])));
+    if (!probe)
+        goto error;
+    if (linux_ring_register(ring, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) < 0) {
+        dbg_perror("io_uring_register(2) - IORING_REGISTER_PROBE");
+        free(probe);
+        errno = ENOTSUP;
+        goto error;
+    }
+    for (i = 0; i < nops; i++) {
+        if ((probe->last_op < ops[i]) || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+            dbg_printf("io_uring op %u not supported", ops[i]);
+            free(probe);
+            errno = ENOTSUP;
+            goto error;
+        }
+    }
+    free(probe);
+
+    ring->rings_size = p.sq_off.array + (p.sq_entries * sizeof(unsigned int));
+    cq_size = p.cq_off.cqes + (p.cq_entries * sizeof(struct io_uring_cqe));
+    if (cq_size > ring->rings_size)
+        ring->rings_size = cq_size;
+
+    ring->rings = mmap(NULL, ring->rings_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ring->fd, IORING_OFF_SQ_RING);
+    if (ring->rings == MAP_FAILED) {
+        ring->rings = NULL;
+        dbg_perror("mmap(2) - rings");
+        goto error;
+    }
+
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        dbg_perror("mmap(2) - sqes");
+        goto error;
+    }
+
+    rings = ring->rings;
+    ring->sq_head = (atomic_uint *)(rings + p.sq_off.head);
+    ring->sq_tail = (atomic_uint *)(rings + p.sq_off.tail);
+    ring->sq_mask = *(unsigned int *)(rings + p.sq_off.ring_mask);
+    ring->sq_entries = p.sq_entries;
+    ring->cq_head = (atomic_uint *)(rings + p.cq_off.head);
+    ring->cq_tail = (atomic_uint *)(rings + p.cq_off.tail);
+    ring->cq_mask = *(unsigned int *)(rings + p.cq_off.ring_mask);
+    ring->cq_entries = p.cq_entries;
+    ring->cqes = (struct io_uring_cqe *)(rings + p.cq_off.cqes);
+
+    sq_array = (unsigned int *)(rings + p.sq_off.array);
+    for (i = 0; i < p.sq_entries; i++)
+        sq_array[i] = i;
+    ring->tail = atomic_load_explicit(ring->sq_tail, memory_order_relaxed);
+
+    return (0);
+
+error:
+    {
+        int saved_errno = errno;
+
+        linux_ring_free(ring);
+        errno = saved_errno;
+    }
+    return (-1);
+}
+
+/** Pass each CQE to a callback and release it
+ *
+ * @return the number of CQEs reaped.
+ */
+unsigned int
+linux_ring_reap(struct linux_ring *ring, void (*func)(void *uctx, struct io_uring_cqe const *cqe), void *uctx)
+{
+    unsigned int head = atomic_load_explicit(ring->cq_head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(ring->cq_tail, memory_order_acquire);
+    unsigned int n = 0;
+
+    for (; head != tail; head++, n++)
+        func(uctx, &ring->cqes[head & ring->cq_mask]);
+    atomic_store_explicit(ring->cq_head, head, memory_order_release);
+
+    return (n);
+}
+
+/** Record the result of a CQE against its op
+ */
+static void
+uring_reap_op(void *uctx, struct io_uring_cqe const *cqe)
+{
+    struct linux_uring *ur = uctx;
+    struct linux_uring_op *op = &ur->ops[cqe->user_data];
+
+    op->res = cqe->res;
+    op->done = true;
+}
+
+static void
+uring_error(struct linux_uring *ur, struct linux_uring_op *op)
+{
+    struct kevent_change_error *ce;
+
+    if (ur->nerrors == ur->errors_size) {
+        unsigned int size = ur->errors_size ? ur->errors_size * 2 : 16;
+
+        ce = realloc(ur->errors, size * sizeof(*ce));
+        if (!ce) {
+            /*
+             * The knote stays, but will never fire.  Not
+             * much else we can do with no memory.
+             */
+            dbg_printf("kn=%p - can't record registration failure", op->kn);
+            return;
+        }
+        ur->errors = ce;
+        ur->errors_size = size;
+    }
+
+    ce = &ur->errors[ur->nerrors++];
+    ce->kce_kn = op->kn;
+    ce->kce_kev = op->kev;
+    ce->kce_errno = -op->res;
+    (void) knote_retain(op->kn);
+}
+
+/** Submit the queued ADDs and wait for them to complete
+ *
+ * Failures are rolled back and kept until linux_kevent_flush.
+ */
+static void
+uring_flush(struct kqueue *kq)
+{
+    struct linux_uring *ur = kq->kq_uring;
+    unsigned int n = ur->nops, submitted = 0, reaped = 0, i;
+
+    if (n == 0)
+        return;
+
+    linux_ring_publish(&ur->ring);
+
+    while (reaped < n) {
+        int rv;
+
+        kqueue_stat_inc(kq, kqs_syscalls);
+        rv = linux_ring_enter(&ur->ring, n - submitted, n - reaped, IORING_ENTER_GETEVENTS);
+        if (rv < 0) {
+            if (errno == EINTR)
+                continue;
+            dbg_perror("io_uring_enter(2) - uring_fd=%i", ur->ring.fd);
+
+            /*
+             * Entries left in the SQ could be submitted by a
+             * later call, long after their fd_state has gone.
+             * Stop using the ring rather than risk that.
+             */
+            (void) linux_ring_reap(&ur->ring, uring_reap_op, ur);
+            linux_ring_free(&ur->ring);
+            break;
+        }
+        submitted += rv;
+        reaped += linux_ring_reap(&ur->ring, uring_reap_op, ur);
+    }
+
+    ur->nops = 0;
+    for (i = 0; i < n; i++) {
+        struct linux_uring_op *op = &ur->ops[i];
+        struct fd_state *fds = op->kn->kn_fds;
+
+        /*
+         * If the ring broke, do whatever wasn't done the
+         * slow way.  EEXIST means it was submitted after all.
+         */
+        if (!op->done) {
+            kqueue_stat_inc(kq, kqs_syscalls);
+            if (epoll_ctl(op->epfd, EPOLL_CTL_ADD, op->kev.ident, &op->ev) < 0) {
+                op->res = (errno == EEXIST) ? 0 : -errno;
+            } else {
+                op->res = 0;
+            }
+        }
+
+        fds->fds_queued = false;
+        if (op->res < 0) {
+            dbg_printf("fd=%i kn=%p - EPOLL_CTL_ADD failed: %s", fds->fds_fd, op->kn, strerror(-op->res));
+            fds = NULL;
+            epoll_fd_state_del(&fds, op->kn, op->rollback);
+            uring_error(ur, op);
+        }
+    }
+}
+
+/** Queue an EPOLL_CTL_ADD for a knote being created
+ *
+ * @param[in] filt      the knote belongs to.
+ * @param[in] kn        being created, kn_kq->kq_creating is its change.
+ * @param[in] rollback  fd_state events to remove if the kernel rejects it.
+ * @param[in] ev        to register, copied.
+ * @return
+ *      - 0 if queued.
+ *      - -1 if the ring is turned off, the caller should call epoll_ctl.
+ */
+int
+linux_uring_epoll_ctl(struct filter *filt, struct knote *kn, int rollback, const struct epoll_event *ev)
+{
+    struct kqueue *kq = filt->kf_kqueue;
+    struct linux_uring *ur = kq->kq_uring;
+    struct linux_uring_op *op;
+    struct io_uring_sqe *sqe;
+
+    if (ur->ring.fd < 0)
+        return (-1);
+
+    if (ur->nops == LINUX_URING_ENTRIES)
+        uring_flush(kq);
+
+    op = &ur->ops[ur->nops];
+    *op = (struct linux_uring_op){
+        .kn = kn,
+        .kev = *kq->kq_creating,
+        .ev = *ev,
+        .epfd = filter_epoll_fd(filt),
+        .rollback = rollback
+    };
+
+    sqe = linux_ring_sqe(&ur->ring);
+    sqe->opcode = IORING_OP_EPOLL_CTL;
+    sqe->fd = op->epfd;
+    sqe->off = kn->kev.ident;
+    sqe->addr = (uintptr_t)&op->ev;
+    sqe->len = EPOLL_CTL_ADD;
+    sqe->user_data = ur->nops++;
+
+    kn->kn_fds->fds_queued = true;
+    dbg_printf("fd=%i kn=%p - queued EPOLL_CTL_ADD (%u queued)", (int)kn->kev.ident, kn, ur->nops);
+
+    return (0);
+}
+
+/** Submit the queue if it holds an operation on the knote's fd
+ *
+ * Called before anything else is done with an fd, so the kernel
+ * sees operations on it in the order they were made.
+ */
+void
+linux_uring_sync(struct knote *kn)
+{
+    struct fd_state *fds = NULL;
+
+    if (kn->kn_kq->kq_uring->nops == 0)
+        return;
+
+    (void) epoll_fd_state(&fds, kn, false);
+    if (fds && fds->fds_queued)
+        uring_flush(kn->kn_kq);
+}
+
+/** Submit queued registrations and AIO requests at the end of the changelist
+ */
+int
+linux_kevent_flush(struct kqueue *kq, struct kevent_change_error **errors)
+{
+    struct linux_uring *ur = kq->kq_uring;
+    int n;
+
+#ifdef EVFILT_AIO
+    if (kq->kq_filt[~EVFILT_AIO])
+        linux_evfilt_aio_flush(kq->kq_filt[~EVFILT_AIO]);
+#endif
+
+    if (!ur)
+        return (0);
+
+    uring_flush(kq);
+
+    *errors = ur->errors;
+    n = ur->nerrors;
+    ur->nerrors = 0;
+
+    return (n);
+}
+
+/** Turn NOTE_BATCH_CHANGES on or off for a kqueue
+ *
+ * The option is itself a change, so earlier changes in the
+ * same changelist may still be queued.  Turning it off submits
+ * them, but any errors are kept for linux_kevent_flush.
+ *
+ * @return
+ *      - The previous setting.
+ *      - -1 if the ring couldn't be set up (errno set).
+ */
+int
+linux_kqueue_batch_changes(struct kqueue *kq, bool on)
+{
+    struct linux_uring *ur = kq->kq_uring;
+    bool old = ur && (ur->ring.fd >= 0);
+
+    if (on == old)
+        return (old);
+
+    if (!on) {
+        uring_flush(kq);
+        linux_ring_free(&ur->ring);
+        return (old);
+    }
+
+    if (!ur) {
+        ur = calloc(1, sizeof(*ur));
+        if (!ur)
+            return (-1);
+        ur->ring.fd = -1;
+        kq->kq_uring = ur;
+    }
+
+    if (linux_ring_init(&ur->ring, LINUX_URING_ENTRIES, (uint8_t[]){ IORING_OP_EPOLL_CTL }, 1) < 0)
+        return (-1);
+
+    return (old);
+}
+
+/** Close the ring in a forked child
+ *
+ * Only async-signal-safe calls, the memory is leaked.
+ */
+void
+linux_uring_close(struct kqueue *kq)
+{
+    struct linux_uring *ur = kq->kq_uring;
+
+    if (ur && (ur->ring.fd >= 0)) {
+        if (close(ur->ring.fd) < 0)
+            dbg_perror("close(2)");
+        ur->ring.fd = -1;
+    }
+}
+
+/** Release the ring
+ */
+void
+linux_uring_free(struct kqueue *kq)
+{
+    struct linux_uring *ur = kq->kq_uring;
+
+    if (!ur)
+        return;
+
+    linux_ring_free(&ur->ring);
+    free(ur->errors);
+    free(ur);
+    kq->kq_uring = NULL;
+}
+#endif
@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2026 Arran Cudbard-Bell <a.cudbardb@freeradius.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#ifndef  _KQUEUE_LINUX_URING_H
+#define  _KQUEUE_LINUX_URING_H
+
+/*
+ * A minimal io_uring, driven with raw syscalls so there's no
+ * dependency on liburing.  Shared by NOTE_BATCH_CHANGES (uring.c)
+ * and EVFILT_AIO (aio.c).
+ *
+ * SQEs are always used in ring order, so the SQ's indirection
+ * array is set up once and never changes.  None of this is
+ * thread safe, callers hold the kqueue lock.
+ */
+#if HAVE_IO_URING
+#include <linux/io_uring.h>
+
+struct linux_ring {
+    int                     fd;         //!< From io_uring_setup, -1 if not set up.
+    void                    *rings;     //!< SQ and CQ rings, one mapping (IORING_FEAT_SINGLE_MMAP).
+    size_t                  rings_size;
+    struct io_uring_sqe     *sqes;
+    size_t                  sqes_size;
+
+    atomic_uint             *sq_head;   //!< Advanced by the kernel as it consumes SQEs.
+    atomic_uint             *sq_tail;
+    unsigned int            sq_mask;
+    unsigned int            sq_entries;
+    atomic_uint             *cq_head;
+    atomic_uint             *cq_tail;   //!< Advanced by the kernel as it posts CQEs.
+    unsigned int            cq_mask;
+    unsigned int            cq_entries;
+    struct io_uring_cqe     *cqes;
+
+    unsigned int            tail;       //!< Our copy of the SQ tail, see linux_ring_publish.
+};
+
+int     linux_ring_init(struct linux_ring *ring, unsigned int entries, uint8_t const *ops, size_t nops);
+void    linux_ring_free(struct linux_ring *ring);
+int     linux_ring_enter(struct linux_ring *ring, unsigned int to_submit, unsigned int min_complete,
+                         unsigned int flags);
+int     linux_ring_register(struct linux_ring *ring, unsigned int opcode, void *arg, unsigned int nr_args);
+unsigned int linux_ring_reap(struct linux_ring *ring,
+                             void (*func)(void *uctx, struct io_uring_cqe const *cqe), void *uctx);
+
+/** Get the next SQE, zeroed
+ *
+ * The caller must know there's room, see linux_ring_sq_space.
+ * It's only visible to the kernel after linux_ring_publish.
+ */
+static inline struct io_uring_sqe *
+linux_ring_sqe(struct linux_ring *ring)
+{
+    struct io_uring_sqe *sqe = &ring->sqes[ring->tail++ & ring->sq_mask];
+
+    memset(sqe, 0, sizeof(*sqe));
+
+    return (sqe);
+}
+
+/** Make SQEs from linux_ring_sqe visible to the kernel
+ */
+static inline void
+linux_ring_publish(struct linux_ring *ring)
+{
+    atomic_store_explicit(ring->sq_tail, ring->tail, memory_order_release);
+}
+
+/** @return the number of SQEs the kernel hasn't consumed yet.
+ */
+static inline unsigned int
+linux_ring_sq_pending(struct linux_ring *ring)
+{
+    return ring->tail - atomic_load_explicit(ring->sq_head, memory_order_acquire);
+}
+
+/** @return the number of SQEs which can be added before the SQ is full.
+ */
+static inline unsigned int
+linux_ring_sq_space(struct linux_ring *ring)
+{
+    return ring->sq_entries - linux_ring_sq_pending(ring);
+}
+#endif
+
+#endif  /* ! _KQUEUE_LINUX_URING_H */
@@ -19,80 +19,28 @@
 #include <sys/socket.h>
 
 
-int
-linux_evfilt_user_knote_enable(struct filter *filt, struct knote *kn);
-
-int
-linux_evfilt_user_knote_disable(struct filter *filt, struct knote *kn);
-
-/* NOTE: copy+pasted from linux_eventfd_raise() */
-static int
-eventfd_raise(int evfd)
-{
-    uint64_t counter;
-    int rv = 0;
-
-    dbg_printf("event_fd=%i - raising event level", evfd);
-    counter = 1;
-    if (write(evfd, &counter, sizeof(counter)) < 0) {
-        switch (errno) {
-            case EAGAIN:
-                /* Not considered an error */
-                break;
-
-            case EINTR:
-                rv = -EINTR;
-                break;
-
-            default:
-                dbg_printf("write(2): %s", strerror(errno));
-                rv = -1;
-        }
-    }
-    return (rv);
-}
+/*
+ * User events don't get an fd each.  A triggered knote is linked
+ * on the filter's kf_ready list and the kqueue's pending eventfd is
+ * raised, see linux_kqueue_pending_raise().  Copyout walks kf_ready,
+ * and knotes stay on it (so keep firing) until EV_CLEAR, EV_DISPATCH
+ * or EV_ONESHOT consume the trigger, or the knote is disabled or
+ * deleted, both of which unlink it in common code.
+ */
 
-/* NOTE: copy+pasted from linux_eventfd_lower()
- *
- * Drains the eventfd counter.  The eventfd is created O_NONBLOCK so a
- * concurrent reader (e.g. another thread that woke from epoll_wait on
- * the same kq) can race us to the read; the loser sees EAGAIN.
- *
- * @return
- *      - 1  drained the counter (this caller "owns" the trigger).
- *      - 0  EAGAIN: another reader already drained it; caller must
- *           not dispatch a kevent for this wakeup.
- *      - -1 read failed for some other reason.
- *      - -EINTR  interrupted by a signal.
+/** Link a triggered knote on kf_ready and wake the kqueue
  */
 static int
-eventfd_lower(int evfd)
+user_knote_ready(struct filter *filt, struct knote *kn)
 {
-    uint64_t cur;
-    ssize_t n;
-
-    /* Reset the counter */
-    dbg_printf("event_fd=%i - lowering event level", evfd);
-    n = read(evfd, &cur, sizeof(cur));
-    if (n < 0) {
-        switch (errno) {
-            case EAGAIN:
-                return (0);
-
-            case EINTR:
-                return (-EINTR);
-
-            default:
-                dbg_printf("read(2): %s", strerror(errno));
-                return (-1);
-        }
-    }
-    if (n != sizeof(cur)) {
-        dbg_puts("short read");
-        return (-1);
-    }
+    /*
+     * Coalesce repeated triggers, LIST_INSERT_HEAD
+     * assumes a detached entry.
+     */
+    if (!LIST_INSERTED(kn, kn_ready))
+        LIST_INSERT_HEAD(&filt->kf_ready, kn, kn_ready);
 
-    return (1);
+    return linux_kqueue_pending_raise(filt->kf_kqueue, filt);
 }
 
 int
@@ -105,16 +53,8 @@ linux_evfilt_user_copyout(struct kevent *dst, UNUSED int nevents, struct filter
     if (src->kev.flags & EV_CLEAR)
         src->kev.fflags &= ~NOTE_TRIGGER;
     if (src->kev.flags & (EV_DISPATCH | EV_CLEAR | EV_ONESHOT)) {
-        int rv = eventfd_lower(src->kn_user.eventfd);
-        if (rv < 0) return (-1);
-        /*
-         * Another waiter on the same kq drained the eventfd before
-         * we did - skip dispatch.  Without this, a blocking read on
-         * the eventfd would deadlock multi-waiter setups; with it,
-         * exactly one waiter dispatches per NOTE_TRIGGER and the
-         * losers return zero events from this slot.
-         */
-        if (rv == 0) return (0);
+        if (LIST_INSERTED(src, kn_ready))
+            LIST_REMOVE_ZERO(src, kn_ready);
     }
 
     if (src->kev.flags & EV_DISPATCH)
@@ -126,48 +66,13 @@ linux_evfilt_user_copyout(struct kevent *dst, UNUSED int nevents, struct filter
 }
 
 int
-linux_evfilt_user_knote_create(struct filter *filt, struct knote *kn)
+linux_evfilt_user_knote_create(struct filter *filt, UNUSED struct knote *kn)
 {
-    int evfd;
-
-    /*
-     * EFD_NONBLOCK so concurrent readers (multiple kevent() callers
-     * on the same kq racing for the same NOTE_TRIGGER) can detect
-     * "another thread already drained me" via EAGAIN rather than
-     * blocking forever in read().  See eventfd_lower() and
-     * linux_evfilt_user_copyout() for the consumer side.
-     */
-    evfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
-    if (evfd < 0) {
-        if ((errno == EMFILE) || (errno == ENFILE)) {
-            dbg_perror("eventfd(2) fd_used=%u fd_max=%u", get_fd_used(), get_fd_limit());
-        } else {
-            dbg_perror("eventfd(2)");
-        }
-        close(evfd);
-        kn->kn_user.eventfd = -1;
-        return (-1);
-    }
-
-    dbg_printf("event_fd=%i - created", evfd);
-    kn->kn_user.eventfd = evfd;
-    KN_UDATA_ALLOC(kn);   /* populate this knote's kn_udata field */
-
-    if (KNOTE_ENABLED(kn)) {
-        int rv = linux_evfilt_user_knote_enable(filt, kn);
-        if (rv < 0) {
-            /* enable's epoll_ctl(EPOLL_CTL_ADD) failed.  Kernel
-             * never saw the udata, free direct. */
-            KN_UDATA_FREE(kn);
-        }
-        return rv;
-    }
-
-    return (0);
+    return linux_kqueue_pending_init(filt->kf_kqueue);
 }
 
 int
-linux_evfilt_user_knote_modify(struct filter *filt UNUSED, struct knote *kn, const struct kevent *kev)
+linux_evfilt_user_knote_modify(struct filter *filt, struct knote *kn, const struct kevent *kev)
 {
     unsigned int ffctrl;
     unsigned int fflags;
@@ -204,7 +109,7 @@ linux_evfilt_user_knote_modify(struct filter *filt UNUSED, struct knote *kn, con
 
     if ((!(kn->kev.flags & EV_DISABLE)) && kev->fflags & NOTE_TRIGGER) {
         kn->kev.fflags |= NOTE_TRIGGER;
-        if (eventfd_raise(kn->kn_user.eventfd) < 0)
+        if (user_knote_ready(filt, kn) < 0)
             return (-1);
     }
 
@@ -212,46 +117,27 @@ linux_evfilt_user_knote_modify(struct filter *filt UNUSED, struct knote *kn, con
 }
 
 int
-linux_evfilt_user_knote_delete(struct filter *filt, struct knote *kn)
+linux_evfilt_user_knote_delete(UNUSED struct filter *filt, UNUSED struct knote *kn)
 {
-    int rv = 0;
-
-    if (KNOTE_ENABLED(kn))
-        linux_evfilt_user_knote_disable(filt, kn);
-
-    KN_UDATA_DEFER_FREE(filt->kf_kqueue, kn);
-
-    dbg_printf("event_fd=%i - closed", kn->kn_user.eventfd);
-    if (close(kn->kn_user.eventfd) < 0) {
-        dbg_perror("close(2)");
-        return (-1);
-    }
-    kn->kn_user.eventfd = -1;
-
-    return rv;
+    return (0);
 }
 
 int
 linux_evfilt_user_knote_enable(struct filter *filt, struct knote *kn)
 {
-    if (epoll_ctl(filter_epoll_fd(filt), EPOLL_CTL_ADD, kn->kn_user.eventfd, EPOLL_EV_KN(EPOLLIN, kn)) < 0) {
-        dbg_perror("epoll_ctl(2)");
-        return (-1);
-    }
-    dbg_printf("event_fd=%i - added to epoll_fd=%i", kn->kn_user.eventfd, filter_epoll_fd(filt));
+    /*
+     * A knote disabled while triggered, without EV_CLEAR,
+     * is still triggered when it comes back.
+     */
+    if (kn->kev.fflags & NOTE_TRIGGER)
+        return user_knote_ready(filt, kn);
 
     return (0);
 }
 
 int
-linux_evfilt_user_knote_disable(struct filter *filt, struct knote *kn)
+linux_evfilt_user_knote_disable(UNUSED struct filter *filt, UNUSED struct knote *kn)
 {
-    if (epoll_ctl(filter_epoll_fd(filt), EPOLL_CTL_DEL, kn->kn_user.eventfd, NULL) < 0) {
-            dbg_perror("epoll_ctl(2)");
-            return (-1);
-    }
-    dbg_printf("event_fd=%i - removed from epoll_fd=%i", kn->kn_user.eventfd, filter_epoll_fd(filt));
-
     return (0);
 }
 
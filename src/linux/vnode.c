@@ -127,20 +127,38 @@ get_one_event(struct inotify_event *dst, size_t len, int inofd)
     return (1);
 }
 
+/** Open an inotify instance watching the file a vnode kevent refers to
+ *
+ * @param[in] kev   giving the fd, and the NOTE_* flags to watch for.
+ * @param[out] wd   the watch descriptor.
+ * @return
+ *      - The inotify fd.
+ *      - -1 on failure (errno set).
+ */
 static int
-add_watch(struct filter *filt, struct knote *kn)
+open_watch(const struct kevent *kev, int *wd)
 {
     int ifd;
     char path[PATH_MAX];
     uint32_t mask;
 
     /* Convert the fd to a pathname */
-    if (linux_fd_to_path(path, sizeof(path), kn->kev.ident) < 0)
+    if (linux_fd_to_path(path, sizeof(path), kev->ident) < 0)
         return (-1);
 
+    /*
+     * Pipes, sockets and anonymous inodes have no path to
+     * watch, their link reads "pipe:[1234]" etc.
+     */
+    if (path[0] != '/') {
+        dbg_printf("fd=%i path=%s - not a vnode", (int)kev->ident, path);
+        errno = EINVAL;
+        return (-1);
+    }
+
     /* Convert the fflags to the inotify mask */
     mask = IN_CLOSE;
-    if (kn->kev.fflags & NOTE_DELETE)
+    if (kev->fflags & NOTE_DELETE)
         mask |= IN_ATTRIB | IN_DELETE_SELF;
     /*
      * NOTE_WRITE: file content writes are IN_MODIFY; for a directory a
@@ -149,14 +167,14 @@ add_watch(struct filter *filt, struct knote *kn)
      * rather than IN_MODIFY.  Watch both (the extra bits never fire on
      * a plain file).
      */
-    if (kn->kev.fflags & NOTE_WRITE)
+    if (kev->fflags & NOTE_WRITE)
         mask |= IN_MODIFY | IN_ATTRIB | IN_CREATE | IN_DELETE |
                 IN_MOVED_FROM | IN_MOVED_TO;
-    if (kn->kev.fflags & NOTE_EXTEND)
+    if (kev->fflags & NOTE_EXTEND)
         mask |= IN_MODIFY | IN_ATTRIB;
-    if (kn->kev.fflags & NOTE_TRUNCATE)
+    if (kev->fflags & NOTE_TRUNCATE)
         mask |= IN_MODIFY | IN_ATTRIB;
-    if (kn->kev.fflags & NOTE_ATTRIB)
+    if (kev->fflags & NOTE_ATTRIB)
         mask |= IN_ATTRIB;
     /*
      * NOTE_LINK means "link count changed".  For a file that's a
@@ -168,11 +186,11 @@ add_watch(struct filter *filt, struct knote *kn)
      * create/remove in the directory (which don't change its link
      * count) don't fire NOTE_LINK.
      */
-    if (kn->kev.fflags & NOTE_LINK)
+    if (kev->fflags & NOTE_LINK)
         mask |= IN_ATTRIB | IN_CREATE | IN_DELETE;
-    if (kn->kev.fflags & NOTE_RENAME)
+    if (kev->fflags & NOTE_RENAME)
         mask |= IN_MOVE_SELF;
-    if (kn->kev.flags & EV_ONESHOT)
+    if (kev->flags & EV_ONESHOT)
         mask |= IN_ONESHOT;
 
     /*
@@ -195,35 +213,53 @@ add_watch(struct filter *filt, struct knote *kn)
     /* Add the watch */
     dbg_printf("inotify_add_watch(2); inofd=%d flags=%s path=%s",
             ifd, inotify_mask_dump(mask), path);
-    kn->kev.data = inotify_add_watch(ifd, path, mask);
-    if (kn->kev.data < 0) {
+    *wd = inotify_add_watch(ifd, path, mask);
+    if (*wd < 0) {
         dbg_perror("inotify_add_watch(2)");
-        goto errout;
+        (void) close(ifd);
+        return (-1);
     }
 
-    /* Add the inotify fd to the epoll set */
+    return (ifd);
+}
+
+/** Add an inotify fd from open_watch to the epoll set
+ *
+ * The fd is closed on failure.
+ */
+static int
+register_watch(struct filter *filt, struct knote *kn, int ifd)
+{
     KN_UDATA_ALLOC(kn);   /* populate this knote's kn_udata field */
+    filter_stat_inc(filt, kfs_syscalls);
     if (epoll_ctl(filter_epoll_fd(filt), EPOLL_CTL_ADD, ifd, EPOLL_EV_KN(EPOLLIN, kn)) < 0) {
         dbg_perror("epoll_ctl(2)");
-        goto errout;
+        inotify_rm_watch(ifd, kn->kev.data);
+        kn->kn_vnode.inotifyfd = -1;
+        (void) close(ifd);
+        /* The kernel never accepted the udata - free direct. */
+        KN_UDATA_FREE(kn);
+        return (-1);
     }
 
     kn->kn_vnode.inotifyfd = ifd;
 
     return (0);
+}
 
-errout:
-    inotify_rm_watch(ifd, kn->kev.data);
-    kn->kn_vnode.inotifyfd = -1;
-    (void) close(ifd);
-    /*
-     * If we reached here from the post-KN_UDATA epoll_ctl failure,
-     * the kernel never accepted the udata - free direct.  If we came
-     * from the pre-KN_UDATA inotify_add_watch failure, kn_udata is
-     * still NULL and KN_UDATA_FREE is a no-op.
-     */
-    KN_UDATA_FREE(kn);
-    return (-1);
+static int
+add_watch(struct filter *filt, struct knote *kn)
+{
+    int ifd, wd;
+
+    ifd = open_watch(&kn->kev, &wd);
+    if (ifd < 0) {
+        kn->kn_vnode.inotifyfd = -1;
+        return (-1);
+    }
+    kn->kev.data = wd;
+
+    return (register_watch(filt, kn, ifd));
 }
 
 static int
@@ -233,6 +269,7 @@ delete_watch(struct filter *filt, struct knote *kn)
 
     if (ifd < 0)
         return (0);
+    filter_stat_inc(filt, kfs_syscalls);
     if (epoll_ctl(filter_epoll_fd(filt), EPOLL_CTL_DEL, ifd, NULL) < 0) {
         dbg_perror("epoll_ctl(2)");
         return (-1);
@@ -386,6 +423,17 @@ evfilt_vnode_knote_create(struct filter *filt, struct knote *kn)
     struct stat sb;
 
     /* TODO: kn_create arms before EV_DISABLE - see kevent_copyin_one EV_ADD|EV_DISABLE race. */
+
+    /*
+     * kevent_prepare may already have resolved the path and
+     * opened the watch, before the kqueue was locked.
+     */
+    if (kn->kn_flags & KNFL_PREPARED) {
+        kn->kn_flags &= ~KNFL_PREPARED;
+        kn->kev.data = kn->kn_vnode.wd;
+        return (register_watch(filt, kn, kn->kn_vnode.inotifyfd));
+    }
+
     if (fstat(kn->kev.ident, &sb) < 0) {
         dbg_puts("fstat failed");
         return (-1);
@@ -397,6 +445,45 @@ evfilt_vnode_knote_create(struct filter *filt, struct knote *kn)
     return (add_watch(filt, kn));
 }
 
+/*
+ * Resolve the path and open the watch before the kqueue is
+ * locked, see kn_prepare.  Only the epoll registration is left
+ * for kn_create.
+ */
+static struct knote *
+evfilt_vnode_knote_prepare(const struct kevent *kev)
+{
+    struct knote *kn;
+    struct stat sb;
+    int ifd, wd;
+
+    if (fstat(kev->ident, &sb) < 0)
+        return (NULL);  /* kn_create retries and reports the error */
+
+    ifd = open_watch(kev, &wd);
+    if (ifd < 0)
+        return (NULL);
+
+    kn = knote_new();
+    if (kn == NULL) {
+        (void) close(ifd);
+        return (NULL);
+    }
+    kn->kn_vnode.nlink = sb.st_nlink;
+    kn->kn_vnode.size = sb.st_size;
+    kn->kn_vnode.inotifyfd = ifd;
+    kn->kn_vnode.wd = wd;
+    kn->kn_flags |= KNFL_PREPARED;
+
+    return (kn);
+}
+
+static void
+evfilt_vnode_knote_unprepare(struct knote *kn)
+{
+    (void) close(kn->kn_vnode.inotifyfd);
+}
+
 int
 evfilt_vnode_knote_modify(struct filter *filt UNUSED, struct knote *kn,
         const struct kevent *kev)
@@ -489,4 +576,6 @@ const struct filter evfilt_vnode = {
     .kn_delete  = evfilt_vnode_knote_delete,
     .kn_enable  = evfilt_vnode_knote_enable,
     .kn_disable = evfilt_vnode_knote_disable,
+    .kn_prepare = evfilt_vnode_knote_prepare,
+    .kn_unprepare = evfilt_vnode_knote_unprepare,
 };
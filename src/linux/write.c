@@ -103,9 +103,20 @@ done:
 int
 evfilt_write_knote_create(struct filter *filt, struct knote *kn)
 {
+    bool prepared = false;
+
     /* TODO: kn_create arms before EV_DISABLE - see kevent_copyin_one EV_ADD|EV_DISABLE race. */
-    if (linux_get_descriptor_type(kn) < 0)
+
+    /*
+     * kevent_prepare may already have classified the descriptor,
+     * and opened the surrogate eventfd for a regular file.
+     */
+    if (kn->kn_flags & KNFL_PREPARED) {
+        kn->kn_flags &= ~KNFL_PREPARED;
+        prepared = true;
+    } else if (linux_get_descriptor_type(kn) < 0) {
         return (-1);
+    }
 
     /*
      * Epoll won't allow us to add EPOLLOUT on a regular file
@@ -133,21 +144,18 @@ evfilt_write_knote_create(struct filter *filt, struct knote *kn)
             kn->epoll_events |= EPOLLONESHOT;
 
         kn->kn_epollfd = filter_epoll_fd(filt);
-        evfd = eventfd(0, EFD_CLOEXEC);
-        if (evfd < 0) {
-            dbg_perror("eventfd(2)");
-            return (-1);
-        }
-        /* Now the FD will be permanently high */
-        if (eventfd_write(evfd, 1) < 0) {
-            dbg_perror("eventfd_write(3)");
-            (void) close(evfd);
-            return (-1);
+        if (prepared) {
+            evfd = kn->kn_write.eventfd;
+        } else {
+            evfd = linux_surrogate_eventfd();
+            if (evfd < 0)
+                return (-1);
         }
 
         kn->kn_write.eventfd = evfd;
 
         KN_UDATA_ALLOC(kn);   /* populate this knote's kn_udata field */
+        filter_stat_inc(filt, kfs_syscalls);
         if (epoll_ctl(kn->kn_epollfd, EPOLL_CTL_ADD, kn->kn_write.eventfd, EPOLL_EV_KN(kn->epoll_events, kn)) < 0) {
             dbg_printf("epoll_ctl(2): %s", strerror(errno));
             (void) close(evfd);
@@ -187,6 +195,44 @@ evfilt_write_knote_create(struct filter *filt, struct knote *kn)
     return epoll_update(EPOLL_CTL_ADD, filt, kn, kn->epoll_events, false);
 }
 
+/*
+ * Classify the descriptor, and for regular files create the
+ * surrogate eventfd, before the kqueue is locked, see kn_prepare.
+ */
+static struct knote *
+evfilt_write_knote_prepare(const struct kevent *kev)
+{
+    struct knote *kn;
+
+    kn = knote_new();
+    if (kn == NULL)
+        return (NULL);
+    kn->kev.ident = kev->ident;
+
+    if (linux_get_descriptor_type(kn) < 0)
+        goto error;
+
+    if (kn->kn_flags & KNFL_FILE) {
+        kn->kn_write.eventfd = linux_surrogate_eventfd();
+        if (kn->kn_write.eventfd < 0) {
+        error:
+            kn->kn_flags |= KNFL_KNOTE_DELETED;
+            knote_release(kn);
+            return (NULL);  /* kn_create retries and reports the error */
+        }
+    }
+    kn->kn_flags |= KNFL_PREPARED;
+
+    return (kn);
+}
+
+static void
+evfilt_write_knote_unprepare(struct knote *kn)
+{
+    if (kn->kn_flags & KNFL_FILE)
+        (void) close(kn->kn_write.eventfd);
+}
+
 int
 evfilt_write_knote_modify(UNUSED struct filter *filt, struct knote *kn,
         const struct kevent *kev)
@@ -255,6 +301,7 @@ int
 evfilt_write_knote_enable(struct filter *filt, struct knote *kn)
 {
     if (kn->kn_flags & KNFL_FILE) {
+        filter_stat_inc(filt, kfs_syscalls);
         if (epoll_ctl(kn->kn_epollfd, EPOLL_CTL_ADD, kn->kn_write.eventfd, EPOLL_EV_KN(kn->epoll_events, kn)) < 0) {
             dbg_perror("epoll_ctl(2)");
             return (-1);
@@ -270,6 +317,7 @@ int
 evfilt_write_knote_disable(struct filter *filt, struct knote *kn)
 {
     if (kn->kn_flags & KNFL_FILE) {
+        filter_stat_inc(filt, kfs_syscalls);
         if (epoll_ctl(kn->kn_epollfd, EPOLL_CTL_DEL, kn->kn_write.eventfd, NULL) < 0) {
             dbg_perror("epoll_ctl(2)");
             return (-1);
@@ -289,4 +337,6 @@ const struct filter evfilt_write = {
     .kn_delete  = evfilt_write_knote_delete,
     .kn_enable  = evfilt_write_knote_enable,
     .kn_disable = evfilt_write_knote_disable,
+    .kn_prepare = evfilt_write_knote_prepare,
+    .kn_unprepare = evfilt_write_knote_unprepare,
 };
@@ -92,6 +92,8 @@ int
 posix_eventfd_raise(struct eventfd *efd)
 {
     dbg_printf("eventfd=%i - raising event level", efd->ef_id);
+    if (efd->ef_filt)
+        filter_stat_inc(efd->ef_filt, kfs_syscalls);
     if (write(efd->ef_wfd, ".", 1) < 0) {
         /* FIXME: handle EAGAIN and EINTR */
         dbg_printf("write(2) on fd %d: %s", efd->ef_wfd, strerror(errno));
@@ -107,6 +109,8 @@ posix_eventfd_lower(struct eventfd *efd)
 
     /* Reset the counter */
     dbg_printf("eventfd=%i - lowering event level", efd->ef_id);
+    if (efd->ef_filt)
+        filter_stat_inc(efd->ef_filt, kfs_syscalls);
     if (read(efd->ef_id, &buf, sizeof(buf)) < 0) {
         /* FIXME: handle EAGAIN and EINTR */
         /* FIXME: loop so as to consume all data.. may need mutex */
@@ -15,10 +15,20 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#ifdef __linux__
+#  define _GNU_SOURCE 1     /* ppoll(2) */
+#endif
+
 #include "../common/private.h"
 #include "platform.h"
 #include "eventfd.h"
 
+/*
+ * Poll sets up to this size are snapshotted onto the stack
+ * in posix_kevent_wait, larger ones go on the heap.
+ */
+#define POSIX_POLL_STACK 64
+
 /*
  * Self-pipe used as the kqueue's "fd" handle.  pipe(2)+fcntl is
  * used unconditionally so the same code path runs on hosts that
@@ -50,10 +60,10 @@ posix_self_pipe(int fd[2])
 }
 
 /*
- * Wake any parked pselect on this kqueue.  Writing a byte to
- * kq_wake_wfd makes its read-side (kq_id, registered in kq_fds)
- * readable, so the parked caller's next pselect iteration sees
- * the new fd_set state.  EAGAIN on a full pipe is benign - the
+ * Wake any parked poll on this kqueue.  Writing a byte to
+ * kq_wake_wfd makes its read-side (kq_id, in the poll set)
+ * readable, so the parked caller's next poll iteration sees
+ * the new poll set.  EAGAIN on a full pipe is benign - the
  * pipe is already primed.
  */
 void
@@ -63,10 +73,239 @@ posix_wake_kqueue(struct kqueue *kq)
 
     if (kq->kq_wake_wfd < 0)
         return;
+    kqueue_stat_inc(kq, kqs_syscalls);
     rv = write(kq->kq_wake_wfd, "K", 1);
     (void) rv;                          /* silence -Wunused-result */
 }
 
+/*
+ * Grow the fd-indexed table so fd is a valid index.  New entries
+ * are zeroed, i.e. "not watched".
+ */
+static int
+posix_fdtab_grow(struct kqueue *kq, int fd)
+{
+    struct posix_fd *fdtab;
+    int size = kq->kq_fdtab_size ? kq->kq_fdtab_size : 64;
+
+    while (size <= fd)
+        size *= 2;
+
+    fdtab = realloc(kq->kq_fdtab, sizeof(*fdtab) * (size_t)size);
+    if (fdtab == NULL)
+        return (-1);
+    memset(fdtab + kq->kq_fdtab_size, 0,
+           sizeof(*fdtab) * (size_t)(size - kq->kq_fdtab_size));
+    kq->kq_fdtab = fdtab;
+    kq->kq_fdtab_size = size;
+    return (0);
+}
+
+/*
+ * Grow the poll set, and the ready list alongside it so that
+ * publishing a poll result never has to allocate.
+ */
+static int
+posix_pfds_grow(struct kqueue *kq)
+{
+    struct pollfd *pfds;
+    int *ready;
+    unsigned int size = kq->kq_pfds_size ? kq->kq_pfds_size * 2 : 16;
+
+    pfds = realloc(kq->kq_pfds, sizeof(*pfds) * size);
+    if (pfds == NULL)
+        return (-1);
+    kq->kq_pfds = pfds;
+
+    ready = realloc(kq->kq_ready, sizeof(*ready) * size);
+    if (ready == NULL)
+        return (-1);
+    kq->kq_ready = ready;
+
+    kq->kq_pfds_size = size;
+    return (0);
+}
+
+/** Add events to the set an fd is polled for
+ *
+ * Adds the fd to the poll set if it's not already there.  There's
+ * no upper bound on the fd number, and the cost of a wait is
+ * proportional to the number of watched fds, not the highest one.
+ *
+ * @param[in] kq        to watch the fd in.
+ * @param[in] fd        to watch.
+ * @param[in] events    POLLIN and/or POLLOUT.
+ * @param[in] kn        to dispatch when the fd is ready, NULL
+ *                      for fds that aren't dispatched per knote
+ *                      (the wake pipe and filter eventfds).
+ * @return
+ *      - 0 on success.
+ *      - -1 on failure (errno set).
+ */
+int
+posix_fd_watch(struct kqueue *kq, int fd, short events, struct knote *kn)
+{
+    struct pollfd *pfd;
+    unsigned int slot;
+
+    if (fd < 0) {
+        errno = EBADF;
+        return (-1);
+    }
+    if ((fd >= kq->kq_fdtab_size) && (posix_fdtab_grow(kq, fd) < 0))
+        return (-1);
+
+    slot = kq->kq_fdtab[fd].pf_slot;
+    if (slot == 0) {
+        if ((kq->kq_npfds == kq->kq_pfds_size) && (posix_pfds_grow(kq) < 0))
+            return (-1);
+        pfd = &kq->kq_pfds[kq->kq_npfds++];
+        pfd->fd = fd;
+        pfd->events = 0;
+        pfd->revents = 0;
+        kq->kq_fdtab[fd].pf_slot = kq->kq_npfds;
+    } else {
+        pfd = &kq->kq_pfds[slot - 1];
+    }
+    pfd->events |= events;
+    if (events & POLLIN)
+        kq->kq_fdtab[fd].pf_rkn = kn;
+    if (events & POLLOUT)
+        kq->kq_fdtab[fd].pf_wkn = kn;
+
+    return (0);
+}
+
+/** Remove events from the set an fd is polled for
+ *
+ * Once no events remain the fd is dropped from the poll set, the
+ * last entry is moved into its slot so the set stays dense.
+ */
+void
+posix_fd_unwatch(struct kqueue *kq, int fd, short events)
+{
+    struct pollfd *pfd, *last;
+    unsigned int slot;
+
+    if ((fd < 0) || (fd >= kq->kq_fdtab_size))
+        return;
+
+    slot = kq->kq_fdtab[fd].pf_slot;
+    if (slot == 0)
+        return;
+
+    if (events & POLLIN)
+        kq->kq_fdtab[fd].pf_rkn = NULL;
+    if (events & POLLOUT)
+        kq->kq_fdtab[fd].pf_wkn = NULL;
+
+    pfd = &kq->kq_pfds[slot - 1];
+    pfd->events &= ~events;
+    if (pfd->events != 0)
+        return;
+
+    last = &kq->kq_pfds[--kq->kq_npfds];
+    if (pfd != last) {
+        *pfd = *last;
+        kq->kq_fdtab[pfd->fd].pf_slot = slot;
+    }
+    kq->kq_fdtab[fd].pf_slot = 0;
+}
+
+/** Whether the last poll found fd ready for events, and it's still watched for them
+ *
+ * The "still watched" check is the single-delivery gate under
+ * KEVENT_WAIT_DROP_LOCK: once one waiter's EV_CLEAR copyout
+ * disarms the fd, later waiters working from the same poll
+ * result see it's gone and drop the duplicate emit.
+ *
+ * Error and hangup conditions count as ready, as they would
+ * with select(2), so copyout gets a chance to report EV_EOF.
+ */
+bool
+posix_fd_ready(struct kqueue *kq, int fd, short events)
+{
+    struct posix_fd *pf;
+    short mask = events;
+
+    if ((fd < 0) || (fd >= kq->kq_fdtab_size))
+        return (false);
+
+    pf = &kq->kq_fdtab[fd];
+    if (pf->pf_slot == 0)
+        return (false);
+    if (!(kq->kq_pfds[pf->pf_slot - 1].events & events))
+        return (false);
+
+    if (events & POLLIN)
+        mask |= POLLHUP;
+    mask |= POLLERR | POLLNVAL;
+
+    return ((pf->pf_revents & mask) != 0);
+}
+
+/*
+ * Replace the previous poll result with a new one.  Called with
+ * the kqueue locked.  Returns the number of ready fds other than
+ * the wake pipe.
+ */
+static int
+posix_fd_publish(struct kqueue *kq, struct pollfd const *pfds, unsigned int npfds)
+{
+    unsigned int i;
+    int real = 0;
+
+    for (i = 0; i < kq->kq_nready; i++) {
+        int fd = kq->kq_ready[i];
+
+        if (fd < kq->kq_fdtab_size)
+            kq->kq_fdtab[fd].pf_revents = 0;
+    }
+    kq->kq_nready = 0;
+
+    /*
+     * npfds can't exceed kq_pfds_size, the poll set never
+     * shrinks, so kq_ready always has room.
+     */
+    for (i = 0; i < npfds; i++) {
+        int fd = pfds[i].fd;
+
+        if (pfds[i].revents == 0)
+            continue;
+        if (fd >= kq->kq_fdtab_size)
+            continue;
+
+        kq->kq_fdtab[fd].pf_revents = pfds[i].revents;
+        kq->kq_ready[kq->kq_nready++] = fd;
+        if (fd != kq->kq_id)
+            real++;
+    }
+
+    return (real);
+}
+
+/*
+ * poll(2) with a timespec timeout.  Without ppoll the timeout is
+ * rounded up to the next millisecond, so a timer deadline can't
+ * turn into a zero-timeout spin.
+ */
+static int
+posix_poll(struct pollfd *pfds, unsigned int npfds, const struct timespec *timeout)
+{
+#if HAVE_PPOLL
+    return ppoll(pfds, (nfds_t)npfds, timeout, kevent_wait_sigmask);
+#else
+    int ms = -1;
+
+    if (timeout != NULL) {
+        long long ll = (long long)timeout->tv_sec * 1000LL +
+                       (timeout->tv_nsec + 999999L) / 1000000L;
+        ms = (ll > INT_MAX) ? INT_MAX : (int)ll;
+    }
+    return poll(pfds, (nfds_t)npfds, ms);
+#endif
+}
+
 /*
  * In-flight tracking for KEVENT_WAIT_DROP_LOCK.  Common code in
  * kevent.c calls these around the kevent_wait/copyout pair so
@@ -89,11 +328,10 @@ posix_kevent_exit(struct kqueue *kq, struct kqueue_kevent_state *state)
 
 /*
  * Set the per-kqueue file-knote poll interval (NOTE_FILE_POLL_INTERVAL
- * on EVFILT_LIBKQUEUE).  Negative is rejected; 0 disables auto-poll
- * (kqueue sleeps indefinitely with file knotes registered,
- * re-evaluation only on other wake sources).  Positive values clamp
- * pselect's timeout when the only readiness sources are KNFL_FILE
- * knotes.
+ * on EVFILT_LIBKQUEUE).  Negative is rejected; 0 restores the
+ * default adaptive per-knote backoff.  Positive values poll every
+ * file and vnode knote at that fixed interval.  Knotes pick up the
+ * new interval the next time their poll timer comes due.
  */
 static int
 posix_set_file_poll_interval(struct kqueue *kq, intptr_t interval_ns)
@@ -103,7 +341,7 @@ posix_set_file_poll_interval(struct kqueue *kq, intptr_t interval_ns)
         return (-1);
     }
     kq->kq_file_poll_interval_ns = (long) interval_ns;
-    posix_wake_kqueue(kq);              /* parked pselects need to re-clamp */
+    posix_wake_kqueue(kq);              /* parked polls need to re-clamp */
     return (0);
 }
 
@@ -115,34 +353,27 @@ posix_kqueue_init(struct kqueue *kq)
     if (posix_self_pipe(sd) < 0)
         return (-1);
 
-    if (sd[0] >= FD_SETSIZE) {
-        dbg_printf("self-pipe read end fd=%d >= FD_SETSIZE=%d; too many open files",
-                   sd[0], FD_SETSIZE);
-        close(sd[0]);
-        close(sd[1]);
-        errno = EMFILE;
-        return (-1);
-    }
-
     TAILQ_INIT(&kq->kq_inflight);
     RB_INIT(&kq->kq_timers);
 
     /*
      * Hand the read end back as the kqueue's identifying fd; the
      * write end is reserved for cross-thread wakeups (future work).
-     * Adding the read end to kq_fds means a user-side close(kq) is
-     * surfaced to pselect(2) as readiness, but we do not currently
-     * react to that beyond making the wait return.
+     * Adding the read end to the poll set means a user-side
+     * close(kq) is surfaced to poll(2) as readiness, but we do not
+     * currently react to that beyond making the wait return.
      */
     kq->kq_id = sd[0];
-    FD_ZERO(&kq->kq_fds);
-    FD_ZERO(&kq->kq_wfds);
-    FD_SET(sd[0], &kq->kq_fds);
-    kq->kq_nfds = sd[0] + 1;
-
     kq->kq_wake_wfd = sd[1];
 
-    if (filter_register_all(kq) < 0) {
+    if ((posix_fd_watch(kq, sd[0], POLLIN, NULL) < 0) ||
+        (filter_register_eager(kq) < 0)) {
+        free(kq->kq_pfds);
+        free(kq->kq_ready);
+        free(kq->kq_fdtab);
+        kq->kq_pfds = NULL;
+        kq->kq_ready = NULL;
+        kq->kq_fdtab = NULL;
         if (close(sd[0]) < 0)
             dbg_perror("close(sd[0]) on cleanup");
         if (close(sd[1]) < 0)
@@ -180,13 +411,19 @@ posix_kqueue_free(struct kqueue *kq)
             dbg_perror("close(kq_wake_wfd)");
         kq->kq_wake_wfd = -1;
     }
-    FD_ZERO(&kq->kq_fds);
-    kq->kq_nfds = 0;
+    free(kq->kq_pfds);
+    free(kq->kq_ready);
+    free(kq->kq_fdtab);
+    kq->kq_pfds = NULL;
+    kq->kq_ready = NULL;
+    kq->kq_fdtab = NULL;
+    kq->kq_npfds = kq->kq_pfds_size = kq->kq_nready = 0;
+    kq->kq_fdtab_size = 0;
 }
 
 /*
- * Add the eventfd's read end to the kqueue's master fd_set so the
- * filter's eventfd_raise() wakes the next pselect.  The unregister
+ * Add the eventfd's read end to the kqueue's poll set so the
+ * filter's eventfd_raise() wakes the next poll.  The unregister
  * path is symmetric.  These are no-ops if ef_id is not a valid fd.
  */
 int
@@ -196,14 +433,8 @@ posix_eventfd_register(struct kqueue *kq, struct eventfd *efd)
 
     if (fd < 0)
         return (0);
-    if (fd >= FD_SETSIZE) {
-        dbg_printf("eventfd fd=%d >= FD_SETSIZE=%d", fd, FD_SETSIZE);
-        errno = EMFILE;
+    if (posix_fd_watch(kq, fd, POLLIN, NULL) < 0)
         return (-1);
-    }
-    FD_SET(fd, &kq->kq_fds);
-    if (fd >= kq->kq_nfds)
-        kq->kq_nfds = fd + 1;
     /*
      * Stash the eventfd's read descriptor on the owning filter so
      * posix_kevent_copyout can identify "this filter fired" without
@@ -213,7 +444,7 @@ posix_eventfd_register(struct kqueue *kq, struct eventfd *efd)
      */
     if (efd->ef_filt != NULL)
         efd->ef_filt->kf_pfd = fd;
-    dbg_printf("registered eventfd fd=%d (nfds=%d)", fd, kq->kq_nfds);
+    dbg_printf("registered eventfd fd=%d (npfds=%u)", fd, kq->kq_npfds);
     return (0);
 }
 
@@ -222,9 +453,9 @@ posix_eventfd_unregister(struct kqueue *kq, struct eventfd *efd)
 {
     int fd = efd->ef_id;
 
-    if (fd < 0 || fd >= FD_SETSIZE)
+    if (fd < 0)
         return;
-    FD_CLR(fd, &kq->kq_fds);
+    posix_fd_unwatch(kq, fd, POLLIN);
     if (efd->ef_filt != NULL && efd->ef_filt->kf_pfd == fd)
         efd->ef_filt->kf_pfd = -1;
     dbg_printf("unregistered eventfd fd=%d", fd);
@@ -233,74 +464,93 @@ posix_eventfd_unregister(struct kqueue *kq, struct eventfd *efd)
 int
 posix_kevent_wait(struct kqueue *kq, UNUSED int numevents, const struct timespec *timeout)
 {
-    int n;
-    fd_set rfds, wfds;
-    struct timespec file_poll_to;
+    int n, real;
+    struct timespec deadline;
 
     /*
-     * Always-ready knotes (EVFILT_VNODE, EVFILT_READ on regular
-     * files) have no kernel-level wake source - their state is
-     * derived from periodic fstat.  Whenever ANY always-ready
-     * knote is registered we must drive the pselect loop, even
-     * if non-always-ready knotes are also registered: the
-     * non-always-ready ones might never fire while the
-     * always-ready one is the thing that actually changed.
-     *
-     *  - kq_file_poll_interval_ns > 0: clamp pselect's timeout to
-     *    that many ns (the kqueue actually sleeps between polls).
-     *  - kq_file_poll_interval_ns == 0 (default): sched_yield()
-     *    each loop iteration with timeout=0 (cooperative spin).
-     *    Only safe when the entire knote set is always-ready;
-     *    otherwise the spin would burn CPU forever waiting on
-     *    a co-resident kernel-wake knote.
+     * Spurious wakes and poll timers that find nothing loop
+     * rather than returning early, so track the caller's timeout
+     * as an absolute deadline.
      */
-    bool any_always_ready  = (kq->kq_always_ready > 0);
-    bool only_always_ready = any_always_ready &&
-                             (kq->kq_knote_count == kq->kq_always_ready);
-    if (any_always_ready) {
-        /*
-         * If the user set NOTE_FILE_POLL_INTERVAL, honour it.
-         * Otherwise pick a 100ms default so a caller blocking on
-         * kevent(timeout=NULL) wakes up periodically to drive
-         * the always-ready knote's stat-poll.  The cooperative
-         * sched_yield path below kicks in additionally when the
-         * entire knote set is always-ready.
-         */
-        long ns = kq->kq_file_poll_interval_ns;
-        if (ns <= 0) ns = 100L * 1000L * 1000L;  /* 100ms default */
-        file_poll_to.tv_sec  = ns / 1000000000L;
-        file_poll_to.tv_nsec = ns % 1000000000L;
-        if (timeout == NULL ||
-            timeout->tv_sec > file_poll_to.tv_sec ||
-            (timeout->tv_sec == file_poll_to.tv_sec &&
-             timeout->tv_nsec > file_poll_to.tv_nsec))
-            timeout = &file_poll_to;
+    if (timeout != NULL) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += timeout->tv_sec;
+        deadline.tv_nsec += timeout->tv_nsec;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
     }
 
     for (;;) {
         static const struct timespec zero = { 0, 0 };
         char buf[64];
-        bool real_event;
-        struct timespec timer_to;
-        const struct timespec *use_to = timeout;
+        struct pollfd pfds_stack[POSIX_POLL_STACK], *pfds = pfds_stack;
+        unsigned int npfds;
+        struct timespec timer_to, user_to;
+        const struct timespec *use_to = NULL;
         long timer_ns;
-
-        if (only_always_ready && kq->kq_file_poll_interval_ns == 0) {
-            sched_yield();
-            use_to = &zero;
+        int fired, hot;
+
+        if (timeout != NULL) {
+            clock_gettime(CLOCK_MONOTONIC, &user_to);
+            user_to.tv_sec = deadline.tv_sec - user_to.tv_sec;
+            user_to.tv_nsec = deadline.tv_nsec - user_to.tv_nsec;
+            if (user_to.tv_nsec < 0) {
+                user_to.tv_sec--;
+                user_to.tv_nsec += 1000000000L;
+            }
+            if (user_to.tv_sec < 0)
+                user_to = zero;
+            use_to = &user_to;
         }
 
         /*
-         * Clamp the pselect timeout against the next EVFILT_TIMER
-         * deadline so timer fires drive wakeups without a sleeper
-         * thread.  -1 means "no timer constrains us".  Take the
-         * lock: posix_timer_min_deadline_ns peeks at kq_timers which
-         * a concurrent copyout thread modifies under the mutex.
+         * Drain wake bytes left in kq_id from cross-thread arms
+         * or same-thread copyin paths.  Without this, an EV_ADD
+         * that primed the wake-pipe inside the same kevent() call
+         * would make poll return immediately on a synthetic
+         * "kqueue changed" signal; copyout then finds nothing
+         * really ready and returns 0, surfacing to the caller of
+         * kevent(...,timeout=NULL) as a spurious 0 return.  The
+         * poll set snapshot below already incorporates any
+         * changes, so the wake byte itself is redundant once
+         * we've reloaded.
+         */
+        if (kq->kq_id >= 0)
+            while (read(kq->kq_id, buf, sizeof(buf)) > 0)
+                /* repeat */;
+
+        /*
+         * Fire due timers and evaluate due file/vnode poll timers,
+         * then clamp the poll timeout against the next deadline so
+         * both drive wakeups without a sleeper thread.  -1 means
+         * "no timer constrains us".  If anything fired, or a
+         * polled knote is waiting for copyout, don't block.
+         *
+         * Take the lock: kq_timers may be modified by a concurrent
+         * copyin or copyout, and the poll set may be grown
+         * (realloc'd).  We poll a private copy of the set as other
+         * threads may be waiting on this kqueue too.
          */
         kqueue_lock(kq);
+        fired = posix_timer_check(kq);
         timer_ns = posix_timer_min_deadline_ns(kq);
+        hot = kq->kq_poll_hot;
+        npfds = kq->kq_npfds;
+        if (npfds > NUM_ELEMENTS(pfds_stack)) {
+            pfds = malloc(sizeof(*pfds) * npfds);
+            if (pfds == NULL) {
+                kqueue_unlock(kq);
+                return (-1);
+            }
+        }
+        memcpy(pfds, kq->kq_pfds, sizeof(*pfds) * npfds);
         kqueue_unlock(kq);
-        if (timer_ns >= 0) {
+
+        if ((fired > 0) || (hot > 0)) {
+            use_to = &zero;
+        } else if (timer_ns >= 0) {
             timer_to.tv_sec  = timer_ns / 1000000000L;
             timer_to.tv_nsec = timer_ns % 1000000000L;
             if (use_to == NULL ||
@@ -310,86 +560,71 @@ posix_kevent_wait(struct kqueue *kq, UNUSED int numevents, const struct timespec
                 use_to = &timer_to;
         }
 
-        /*
-         * Drain wake bytes left in kq_id from cross-thread arms
-         * or same-thread copyin paths.  Without this, an EV_ADD
-         * that primed the wake-pipe inside the same kevent() call
-         * would make pselect return immediately on a synthetic
-         * "kqueue changed" signal; copyout then finds nothing
-         * really ready and returns 0, surfacing to the caller of
-         * kevent(...,timeout=NULL) as a spurious 0 return.  The
-         * pselect snapshot below already incorporates the
-         * up-to-date kq_fds, so the wake byte itself is redundant
-         * once we've reloaded.
-         */
-        if (kq->kq_id >= 0)
-            while (read(kq->kq_id, buf, sizeof(buf)) > 0)
-                /* repeat */;
-
-        rfds = kq->kq_fds;
-        wfds = kq->kq_wfds;
-
-        dbg_printf("waiting on nfds=%d (always_ready=%d)",
-                   kq->kq_nfds, kq->kq_always_ready);
-        n = pselect(kq->kq_nfds, &rfds, &wfds, NULL, use_to, NULL);
+        dbg_printf("waiting on npfds=%u (fired=%d hot=%d)", npfds, fired, hot);
+        n = posix_poll(pfds, npfds, use_to);
+        kqueue_stat_inc(kq, kqs_syscalls);
         if (n < 0) {
-            if (errno == EINTR) {
+            int err = errno;
+
+            if (pfds != pfds_stack)
+                free(pfds);
+            if ((err == EINTR) && (kevent_wait_sigmask == NULL)) {
                 /*
                  * Interrupted by a signal.  SIGCHLD is blocked in this
                  * thread (evfilt_proc_init did pthread_sigmask SIG_BLOCK);
                  * the wait thread handles it via sigwaitinfo and then
                  * raises the proc eventfd.  Other signals (e.g. SIGPROF
                  * from ASAN profiling) must not terminate a NULL-timeout
-                 * kevent call with 0 events.  Retry; the next pselect
+                 * kevent call with 0 events.  Retry; the next poll
                  * iteration will see the eventfd if the wait thread fired.
+                 *
+                 * kevent_pwait() callers unmasked signals for the wait
+                 * precisely so they'd be interrupted, they get EINTR.
                  */
-                dbg_puts("pselect: EINTR, retrying");
+                dbg_puts("poll: EINTR, retrying");
                 continue;
             }
-            dbg_perror("pselect(2)");
+            errno = err;
+            dbg_perror("poll(2)");
             return (-1);
         }
 
-        kq->kq_rfds = rfds;
-        kq->kq_wrfds = wfds;
+        kqueue_lock(kq);
+        real = posix_fd_publish(kq, pfds, npfds);
+        kqueue_unlock(kq);
+
+        if (pfds != pfds_stack)
+            free(pfds);
 
         /*
-         * A timer expiry presents to pselect as a plain timeout
-         * (n == 0).  Signal the caller to run copyout, which calls
-         * posix_timer_check under the kqueue lock.  Do NOT call
-         * posix_timer_check here: this path runs without the lock
-         * (KEVENT_WAIT_DROP_LOCK) and a concurrent copyout thread
-         * may be modifying kq_timers, causing a UAF on the RB tree.
+         * Timers which fired above, and hot poll knotes, are
+         * delivered by copyout.  Copyout also re-runs
+         * posix_timer_check under the kqueue lock, in case another
+         * thread's copyout got there first.
+         */
+        if ((fired > 0) || (hot > 0))
+            return (n > 0 ? n : 1);
+
+        /*
+         * A timer deadline presents to poll as a plain timeout
+         * (n == 0).  Loop so the check at the top fires it; poll
+         * timers which find nothing changed put us straight back
+         * to sleep without a spurious return to the caller.
          */
         if (n == 0) {
-            if (kq->kq_always_ready > 0)
-                return (1);
-            if (timer_ns >= 0 && (use_to == &timer_to))
-                return (1);              /* let copyout drain timers */
+            if (use_to == &timer_to)
+                continue;
             return (0);                  /* genuine user timeout */
         }
 
         /*
-         * Determine whether pselect saw a real fd transition or
-         * only the wake-pipe.  Clear kq_id from the read snapshot
-         * and see if anything remains; if both rfds and wfds are
-         * empty, this was a spurious wake.  When the caller asked
-         * to block (timeout NULL) we loop; otherwise return n and
-         * let copyout do its thing (it will just produce zero
-         * events, matching kevent's "timed out" semantics).
+         * Determine whether poll saw a real fd transition or only
+         * the wake-pipe.  A wake-only return means the kqueue
+         * changed under us (e.g. a cross-thread EV_ADD), reload
+         * and re-arm with whatever's left of the timeout.
          */
-        if (kq->kq_id >= 0 && FD_ISSET(kq->kq_id, &rfds))
-            FD_CLR(kq->kq_id, &rfds);
-        real_event = false;
-        for (int fd = 0; fd < kq->kq_nfds; fd++) {
-            if (FD_ISSET(fd, &rfds) || FD_ISSET(fd, &wfds)) {
-                real_event = true;
-                break;
-            }
-        }
-        if (real_event || timeout != NULL)
+        if (real > 0)
             return (n);
-        /* Spurious wake on a NULL-timeout caller - reload and re-arm. */
     }
 }
 
@@ -436,12 +671,9 @@ posix_dispatch_filter(struct filter *filt, struct kevent *eventlist,
 #endif
 #ifdef EVFILT_TIMER
             filt->kf_id == EVFILT_TIMER ||
-#endif
-#ifdef EVFILT_VNODE
-            filt->kf_id == EVFILT_VNODE ||
 #endif
             0) {
-            rv = filt->kf_copyout(eventlist, nevents, filt, NULL, NULL);
+            rv = filter_copyout(eventlist, nevents, filt, NULL, NULL);
             if (rv < 0)
                 return (-1);
             return rv;
@@ -470,7 +702,7 @@ posix_dispatch_filter(struct filter *filt, struct kevent *eventlist,
          */
         LIST_REMOVE_ZERO(kn, kn_ready);
 
-        rv = filt->kf_copyout(eventlist + n, nevents - n, filt, kn, NULL);
+        rv = filter_copyout(eventlist + n, nevents - n, filt, kn, NULL);
         if (rv < 0) {
             dbg_puts("kf_copyout failed");
             return (-1);
@@ -483,84 +715,67 @@ posix_dispatch_filter(struct filter *filt, struct kevent *eventlist,
 }
 
 /*
- * Walk an fd-keyed filter's knotes and emit one kevent per knote
- * whose descriptor is readable in the kqueue's last pselect result.
+ * Emit one kevent per knote of an fd-keyed filter whose descriptor
+ * is ready in the kqueue's last poll result.  Only the ready fds
+ * are visited, so the cost scales with the number of events, not
+ * the number of registered knotes.
  */
-struct posix_dispatch_fd_ctx {
-    struct filter   *filt;
-    fd_set          *active;
-    struct kevent   *eventlist;
-    int             nevents;
-    int             nout;
-    int             err;
-};
-
 static int
-posix_dispatch_fd_cb(struct knote *kn, void *uctx)
+posix_dispatch_fd_filter(struct filter *filt, short events,
+        struct kevent *eventlist, int nevents)
 {
-    struct posix_dispatch_fd_ctx *ctx = uctx;
-    int fd = (int)kn->kev.ident;
-    bool always_ready = (kn->kn_flags & KNFL_FILE) != 0;
-    fd_set *master;
-    int rv;
+    struct kqueue *kq = filt->kf_kqueue;
+    struct knote *kn, *kn_tmp;
+    unsigned int i;
+    int rv, nout = 0;
 
-    if (ctx->nout >= ctx->nevents)
-        return (1);                    /* stop iteration, output buffer full */
-    if (KNOTE_DISABLED(kn))
-        return (0);
     /*
-     * Regular files are "always readable" up to EOF; we don't
-     * gate them on FD_ISSET because they can't be select()-armed.
-     * Everything else has to show up in the post-pselect set AND
-     * still be present in the master watch set.  The master check
-     * is the single-delivery gate under KEVENT_WAIT_DROP_LOCK:
-     * once one waiter's EV_CLEAR copyout disarms the fd, later
-     * waiters with stale snapshots see the CLR and quietly drop
-     * the duplicate emit.
+     * Regular files can't be polled, evfilt_read fstat polls them
+     * on a timer instead and parks them on kf_ready while they
+     * have data (see posix_poll_start).
      */
-    master = (ctx->active == &ctx->filt->kf_kqueue->kq_rfds)
-        ? &ctx->filt->kf_kqueue->kq_fds
-        : &ctx->filt->kf_kqueue->kq_wfds;
-    if (!always_ready) {
-        if (fd < 0 || fd >= FD_SETSIZE)
-            return (0);
-        if (!FD_ISSET(fd, ctx->active))
-            return (0);
-        if (!FD_ISSET(fd, master))
-            return (0);
+    LIST_FOREACH_SAFE(kn, &filt->kf_ready, kn_ready, kn_tmp) {
+        if (nout >= nevents)
+            return (nout);
+        if (KNOTE_DISABLED(kn))
+            continue;
+
+        rv = filter_copyout(eventlist + nout, nevents - nout, filt, kn, NULL);
+        if (rv < 0)
+            return (-1);
+        nout += rv;
     }
 
-    rv = ctx->filt->kf_copyout(ctx->eventlist + ctx->nout,
-                               ctx->nevents - ctx->nout,
-                               ctx->filt, kn, NULL);
-    if (rv < 0) {
-        ctx->err = -1;
-        return (1);                    /* abort iteration */
+    for (i = 0; (i < kq->kq_nready) && (nout < nevents); i++) {
+        int fd = kq->kq_ready[i];
+
+        /*
+         * Also filters out fds which were ready but have since been
+         * disarmed, see posix_fd_ready.
+         */
+        if (!posix_fd_ready(kq, fd, events))
+            continue;
+
+        kn = (events & POLLIN) ? kq->kq_fdtab[fd].pf_rkn : kq->kq_fdtab[fd].pf_wkn;
+        if ((kn == NULL) || KNOTE_DISABLED(kn))
+            continue;               /* wake pipe or filter eventfd */
+
+        rv = filter_copyout(eventlist + nout, nevents - nout, filt, kn, NULL);
+        if (rv < 0)
+            return (-1);
+        nout += rv;
     }
-    ctx->nout += rv;
-    return (0);
-}
 
-static int
-posix_dispatch_fd_filter(struct filter *filt, fd_set *active,
-        struct kevent *eventlist, int nevents)
-{
-    struct posix_dispatch_fd_ctx ctx = {
-        .filt = filt, .active = active,
-        .eventlist = eventlist, .nevents = nevents,
-        .nout = 0, .err = 0,
-    };
-
-    (void) knote_foreach(filt, posix_dispatch_fd_cb, &ctx);
-    return ctx.err < 0 ? -1 : ctx.nout;
+    return (nout);
 }
 
 /*
  * Drain the kqueue's wake-pipe.  Filters write a byte to
- * kq_wake_wfd when they need pselect to return promptly even
+ * kq_wake_wfd when they need poll to return promptly even
  * though no kernel-level fd has changed state (the canonical
- * trigger is a regular-file READ knote being added: such knotes
- * are always-ready and dispatched on every wait).
+ * trigger is a regular-file READ knote being added: its poll
+ * timer is due immediately and the wait loop must re-read the
+ * timer tree).
  */
 static void
 posix_kevent_drain_wake(struct kqueue *kq)
@@ -569,110 +784,136 @@ posix_kevent_drain_wake(struct kqueue *kq)
 
     if (kq->kq_id < 0)
         return;
-    if (!FD_ISSET(kq->kq_id, &kq->kq_rfds))
+    if (!posix_fd_ready(kq, kq->kq_id, POLLIN))
         return;
     while (read(kq->kq_id, buf, sizeof(buf)) > 0)
         /* repeat */;
 }
 
-int
-posix_kevent_copyout(struct kqueue *kq, UNUSED int nready,
+/** Copy out whatever a single filter has ready
+ *
+ * @return
+ *      - The number of events written.
+ *      - -1 on error.
+ */
+static int
+posix_kevent_copyout_filter(struct kqueue *kq, struct filter *filt,
         struct kevent *eventlist, int nevents)
 {
-    struct filter *filt;
-    int i, rv, nout = 0;
-
-    posix_kevent_drain_wake(kq);
-
-    for (i = 0; i < NUM_ELEMENTS(kq->kq_filt); i++) {
-        if (nout >= nevents)
-            break;
-
-        filt = &kq->kq_filt[i];
-        if (filt->kf_id == 0)
-            continue;
+    int rv;
 
-        /*
-         * READ/WRITE are fd-keyed: dispatch one event per knote
-         * whose descriptor showed up in the post-pselect set.
-         */
+    /*
+     * READ/WRITE are fd-keyed: dispatch one event per knote
+     * whose descriptor showed up in the last poll result.
+     */
 #ifdef EVFILT_READ
-        if (filt->kf_id == EVFILT_READ) {
-            rv = posix_dispatch_fd_filter(filt, &kq->kq_rfds,
-                    eventlist + nout, nevents - nout);
-            if (rv < 0)
-                return (-1);
-            nout += rv;
-            continue;
-        }
+    if (filt->kf_id == EVFILT_READ)
+        return posix_dispatch_fd_filter(filt, POLLIN, eventlist, nevents);
 #endif
 #ifdef EVFILT_WRITE
-        if (filt->kf_id == EVFILT_WRITE) {
-            rv = posix_dispatch_fd_filter(filt, &kq->kq_wrfds,
-                    eventlist + nout, nevents - nout);
-            if (rv < 0)
-                return (-1);
-            nout += rv;
-            continue;
-        }
+    if (filt->kf_id == EVFILT_WRITE)
+        return posix_dispatch_fd_filter(filt, POLLOUT, eventlist, nevents);
 #endif
 
 #ifdef EVFILT_TIMER
-        /*
-         * EVFILT_TIMER has no eventfd: it's driven entirely from
-         * the pselect timeout clamp.  Run its copyout every pass
-         * and let it walk kq_timers for fired entries.
-         */
-        if (filt->kf_id == EVFILT_TIMER) {
-            rv = posix_dispatch_filter(filt, eventlist + nout, nevents - nout);
-            if (rv < 0)
-                return (-1);
-            nout += rv;
-            continue;
-        }
+    /*
+     * EVFILT_TIMER has no eventfd: it's driven entirely from
+     * the poll timeout clamp.  Run its copyout every pass
+     * and let it walk kq_timers for fired entries.
+     */
+    if (filt->kf_id == EVFILT_TIMER)
+        return posix_dispatch_filter(filt, eventlist, nevents);
 #endif
 #ifdef EVFILT_VNODE
-        /*
-         * EVFILT_VNODE on POSIX is fstat-snapshot polling: no
-         * eventfd, knotes don't link to kf_ready, copyout walks
-         * the knote index itself.  Run it every pass; the wait
-         * loop's poll-interval mechanism gates how often "every
-         * pass" actually happens.
-         */
-        if (filt->kf_id == EVFILT_VNODE) {
-            rv = posix_dispatch_filter(filt, eventlist + nout, nevents - nout);
-            if (rv < 0)
-                return (-1);
-            nout += rv;
-            continue;
-        }
+    /*
+     * EVFILT_VNODE on POSIX is fstat-snapshot polling: no
+     * eventfd, knotes whose poll timer saw a change are linked
+     * on kf_ready and copyout walks that list itself.  It must
+     * not go through posix_dispatch_filter, which detaches each
+     * knote before copyout.
+     */
+    if (filt->kf_id == EVFILT_VNODE) {
+        if (LIST_EMPTY(&filt->kf_ready))
+            return (0);
+        return filter_copyout(eventlist, nevents, filt, NULL, NULL);
+    }
 #endif
 
-        /*
-         * Eventfd-keyed filters (USER, PROC, SIGNAL):
-         * a non-empty kf_pfd that turned readable means the
-         * filter has knotes queued on its kf_ready list.  Drain
-         * the eventfd and let the filter's copyout emit them.
-         */
-        if (filt->kf_pfd <= 0)
-            continue;
-        if (!FD_ISSET(filt->kf_pfd, &kq->kq_rfds))
-            continue;
+    /*
+     * Eventfd-keyed filters (USER, PROC, SIGNAL):
+     * a non-empty kf_pfd that turned readable means the
+     * filter has knotes queued on its kf_ready list.  Drain
+     * the eventfd and let the filter's copyout emit them.
+     */
+    if (filt->kf_pfd <= 0)
+        return (0);
+    if (!posix_fd_ready(kq, filt->kf_pfd, POLLIN))
+        return (0);
 
-        dbg_printf("draining filter %s (pfd=%d)",
-                   filter_name(filt->kf_id), filt->kf_pfd);
+    dbg_printf("draining filter %s (pfd=%d)",
+               filter_name(filt->kf_id), filt->kf_pfd);
 
-        kqops.eventfd_lower(&filt->kf_efd);
+    kqops.eventfd_lower(&filt->kf_efd);
 
-        rv = posix_dispatch_filter(filt, eventlist + nout, nevents - nout);
-        if (rv < 0)
-            return (-1);
-        nout += rv;
+    rv = posix_dispatch_filter(filt, eventlist, nevents);
+
+    /*
+     * If the eventlist filled up before kf_ready was drained,
+     * raise the eventfd again or the rest wait for the next
+     * trigger.
+     */
+    if ((rv >= 0) && !LIST_EMPTY(&filt->kf_ready))
+        kqops.eventfd_raise(&filt->kf_efd);
+
+    return (rv);
+}
+
+int
+posix_kevent_copyout(struct kqueue *kq, UNUSED int nready,
+        struct kevent *eventlist, int nevents)
+{
+    struct filter *filt;
+    int i, prio, rv, nout = 0;
+
+    posix_kevent_drain_wake(kq);
+
+    /*
+     * With NOTE_PRIORITY in use, make one pass per class,
+     * highest first, so when the eventlist fills up it's
+     * lower class readiness that's left for the next call.
+     * Poll results and fired timers persist until they're
+     * copied out, so nothing is lost.
+     */
+    for (prio = (int)kq->kq_priority_max; prio >= 0; prio--) {
+        for (i = 0; i < NUM_ELEMENTS(kq->kq_filt); i++) {
+            if (nout >= nevents)
+                return (nout);
+
+            filt = kq->kq_filt[i];
+            if ((filt == NULL) || (filt->kf_priority != (unsigned int)prio))
+                continue;
+
+            rv = posix_kevent_copyout_filter(kq, filt, eventlist + nout, nevents - nout);
+            if (rv < 0)
+                return (-1);
+            filter_stat_add(filt, kfs_events, rv);
+            nout += rv;
+        }
     }
 
     return (nout);
 }
 
+/*
+ * NOTE_PRIORITY needs no backend state, posix_kevent_copyout
+ * orders its filter passes by kf_priority directly.
+ */
+static int
+posix_priority_init(UNUSED struct kqueue *kq)
+{
+    return (0);
+}
+
 const struct kqueue_vtable kqops = {
     .kqueue_init        = posix_kqueue_init,
     .kqueue_free        = posix_kqueue_free,
@@ -686,4 +927,5 @@ const struct kqueue_vtable kqops = {
     .eventfd_lower      = posix_eventfd_lower,
     .eventfd_descriptor = posix_eventfd_descriptor,
     .set_file_poll_interval = posix_set_file_poll_interval,
+    .priority_init      = posix_priority_init,
 };
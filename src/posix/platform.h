@@ -28,7 +28,6 @@
 #include <string.h>
 #include <stdatomic.h>
 #include <sys/resource.h>
-#include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -55,6 +54,14 @@ void    posix_kevent_exit(struct kqueue *kq, struct kqueue_kevent_state *state);
 
 #define KEVENT_WAIT_DROP_LOCK 1
 
+/*
+ * Only ppoll can swap the signal mask atomically, without it
+ * kevent_pwait() fails with ENOTSUP.
+ */
+#if HAVE_PPOLL
+#  define KEVENT_WAIT_SIGMASK 1
+#endif
+
 #define EVENTFD_PLATFORM_SPECIFIC	POSIX_EVENTFD_PLATFORM_SPECIFIC
 #define PROC_PLATFORM_SPECIFIC		POSIX_PROC_PLATFORM_SPECIFIC
 #define FILTER_PLATFORM_SPECIFIC	POSIX_FILTER_PLATFORM_SPECIFIC
@@ -79,12 +86,44 @@ int     posix_kqueue_init(struct kqueue *);
 int     posix_kevent_wait(struct kqueue *, int, const struct timespec *);
 int     posix_kevent_copyout(struct kqueue *, int, struct kevent *, int);
 
+#ifdef LIBKQUEUE_STATIC_DISPATCH
+#define kqueue_kevent_wait(_kq, _nevents, _ts)          posix_kevent_wait((_kq), (_nevents), (_ts))
+#define kqueue_kevent_copyout(_kq, _nready, _el, _n)    posix_kevent_copyout((_kq), (_nready), (_el), (_n))
+#endif
+
 int     posix_eventfd_register(struct kqueue *, struct eventfd *);
 void    posix_eventfd_unregister(struct kqueue *, struct eventfd *);
 
 void    posix_wake_kqueue(struct kqueue *kq);
 
+/** Per-fd state for the kqueue's poll set, indexed by fd
+ *
+ * Lets arm/disarm find an fd's pollfd in O(1), and copyout go
+ * straight from a ready fd to the knotes watching it.
+ */
+struct posix_fd {
+    unsigned int    pf_slot;        //!< Index into kq_pfds + 1, 0 if the fd isn't watched.
+    short           pf_revents;     //!< revents from the most recent poll.
+    struct knote    *pf_rkn;        //!< EVFILT_READ knote, set while watched for POLLIN.
+    struct knote    *pf_wkn;        //!< EVFILT_WRITE knote, set while watched for POLLOUT.
+};
+
+int     posix_fd_watch(struct kqueue *kq, int fd, short events, struct knote *kn);
+void    posix_fd_unwatch(struct kqueue *kq, int fd, short events);
+bool    posix_fd_ready(struct kqueue *kq, int fd, short events);
+
 long    posix_timer_min_deadline_ns(struct kqueue *kq);
-void    posix_timer_check(struct kqueue *kq);
+int     posix_timer_check(struct kqueue *kq);
+
+struct filter;
+
+/** Re-evaluate a polled knote, returns true if it has something to report
+ */
+typedef bool (*posix_poll_func_t)(struct filter *filt, struct knote *kn);
+
+int     posix_poll_start(struct filter *filt, struct knote *kn, posix_poll_func_t poll);
+void    posix_poll_stop(struct filter *filt, struct knote *kn);
+void    posix_poll_free(struct filter *filt, struct knote *kn);
+void    posix_poll_cool(struct filter *filt, struct knote *kn, bool changed);
 
 #endif  /* ! _KQUEUE_POSIX_PLATFORM_H */
@@ -57,8 +57,8 @@ struct posix_knote_proc {
  * gets its own struct; they're grouped in union posix_filter_state
  * because a given struct-filter slot only ever serves one filter
  * id.  Filters with no platform state (READ, WRITE, USER, TIMER)
- * don't appear here - READ/WRITE work directly off kq_fds /
- * kq_wfds, USER off the common kf_efd, TIMER off kq_timers.
+ * don't appear here - READ/WRITE work directly off the kqueue's
+ * poll set, USER off the common kf_efd, TIMER off kq_timers.
  *
  * Add a new struct here when a new filter grows per-filter state;
  * adding a member to the union is a no-op for unrelated filters.
@@ -69,8 +69,15 @@ struct posix_filter_signal {
     struct sig_filter_state *state; /* heap-allocated dispatcher state */
 };
 
+struct aio_filter_state;            /* defined in linux/aio.c */
+
+struct posix_filter_aio {
+    struct aio_filter_state *state; /* io_uring the requests are submitted to */
+};
+
 union posix_filter_state {
     struct posix_filter_signal  sig;
+    struct posix_filter_aio     aio;
 };
 
 /** Additional members of 'struct filter'
@@ -98,24 +105,30 @@ TAILQ_HEAD(posix_kqueue_kevent_state_head, kqueue_kevent_state);
 struct posix_timer;
 RB_HEAD(posix_timer_tree, posix_timer);
 
+struct pollfd;
+struct posix_fd;
+
 #define POSIX_KQUEUE_PLATFORM_SPECIFIC \
-    fd_set          kq_fds;          /* watched-for-read fd set */ \
-    fd_set          kq_rfds;         /* read-readable fds after last pselect */ \
-    fd_set          kq_wfds;         /* watched-for-write fd set */ \
-    fd_set          kq_wrfds;        /* write-ready fds after last pselect */ \
-    int             kq_nfds;         /* highest watched fd + 1, for pselect's nfds */ \
+    struct pollfd   *kq_pfds;        /* watched fds, dense, handed to poll(2) */ \
+    unsigned int    kq_npfds;        /* entries in use in kq_pfds */ \
+    unsigned int    kq_pfds_size;    /* entries allocated in kq_pfds and kq_ready */ \
+    struct posix_fd *kq_fdtab;       /* indexed by fd, slot in kq_pfds + last revents */ \
+    int             kq_fdtab_size;   /* entries allocated in kq_fdtab */ \
+    int             *kq_ready;       /* fds with non-zero revents after the last poll */ \
+    unsigned int    kq_nready;       /* entries in use in kq_ready */ \
     int             kq_wake_wfd;     /* write end of the self-pipe used as kq_id */ \
-    int             kq_always_ready; /* count of "always-ready" knotes; non-zero \
-                                      * means file knotes are registered and the \
-                                      * wait loop drives them through \
-                                      * kq_file_poll_interval_ns */ \
+    int             kq_poll_hot;     /* polled file/vnode knotes linked on their \
+                                      * filter's kf_ready; non-zero means the wait \
+                                      * loop must not block */ \
+    int             kq_timers_pending; /* EVFILT_TIMER timers with fires not yet \
+                                      * copied out; non-zero means the wait loop \
+                                      * must not block */ \
     long            kq_file_poll_interval_ns; /* set via NOTE_FILE_POLL_INTERVAL on \
-                                      * EVFILT_LIBKQUEUE.  Default 0 = sched_yield() \
-                                      * each loop (cooperative spin).  Positive = \
-                                      * clamp pselect's timeout to this many ns so \
-                                      * the kqueue actually sleeps between polls. */ \
+                                      * EVFILT_LIBKQUEUE.  Default 0 = adaptive \
+                                      * per-knote backoff.  Positive = poll every \
+                                      * file/vnode knote at this fixed interval. */ \
     struct posix_kqueue_kevent_state_head kq_inflight; /* kevent() callers in-flight */ \
-    struct posix_timer_tree kq_timers   /* EVFILT_TIMER deadlines (RB-tree by next-deadline) */
+    struct posix_timer_tree kq_timers   /* EVFILT_TIMER and file poll deadlines (RB-tree by next-deadline) */
 
 /** Additional members of 'struct knote'
  *
@@ -40,14 +40,14 @@
 #include "../common/private.h"
 
 /*
- * An entry in the proc_pid tree
+ * An entry in the proc_pid hash
  *
  * This contains a list of PIDs all kqueues are interested in
  * and a list of knotes that are waiting on notifications for
  * those PIDs.
  */
 struct proc_pid {
-    RB_ENTRY(proc_pid)            ppd_entry;   //!< Entry in the proc_pid_index tree.
+    LIST_ENTRY(proc_pid)          ppd_entry;   //!< Entry in a proc_pid_hash bucket.
     pid_t                         ppd_pid;     //!< PID we're waiting on.
     LIST_HEAD(pid_waiters, knote) ppd_proc_waiters; //!< knotes that are waiting on this PID.
 };
@@ -59,7 +59,7 @@ struct proc_pid {
  * and stops multiple threads attempting to start a monitor thread
  * at the same time.
  */
-static tracing_mutex_t     proc_init_mtx = TRACING_MUTEX_INITIALIZER;
+static tracing_mutex_t     proc_init_mtx = TRACING_MUTEX_INITIALIZER_CLASS(LOCKSTAT_PROC);
 static int                 proc_count = 0;
 static pthread_t           proc_wait_thread;
 static pid_t               proc_wait_tid; /* Monitoring thread; set inside wait_thread_loop. */
@@ -88,27 +88,185 @@ static pthread_cond_t      proc_wait_thread_cond = PTHREAD_COND_INITIALIZER;
 static bool                proc_wait_thread_started;   /* protected by proc_wait_thread_mtx */
 
 /*
- * The global PID tree
+ * The global PID hash
  *
- * Contains all the PIDs any kqueue is interested in waiting on
+ * Contains all the PIDs any kqueue is interested in waiting on,
+ * hashed so the pid in a SIGCHLD siginfo is matched in O(1) no
+ * matter how many children are being watched.  Grows (never
+ * shrinks) to keep the load factor at or below 1.
  */
-static RB_HEAD(pid_index, proc_pid) proc_pid_index;
-static tracing_mutex_t    proc_pid_index_mtx = TRACING_MUTEX_INITIALIZER;
+LIST_HEAD(proc_pid_bucket, proc_pid);
+static struct proc_pid_bucket *proc_pid_hash;
+static unsigned int       proc_pid_hash_size;     /* buckets, always a power of 2 */
+static unsigned int       proc_pid_hash_count;    /* entries */
+static tracing_mutex_t    proc_pid_index_mtx = TRACING_MUTEX_INITIALIZER_CLASS(LOCKSTAT_PROC);
 #ifndef _WIN32
 pthread_mutexattr_t       proc_pid_index_mtx_attr;
 #endif
 
+#define PROC_PID_HASH_MIN   64
+
+/*
+ * Filters with knotes that became ready during a wait thread pass
+ *
+ * Raised once each when the pass ends, so a batch of exits wakes
+ * each kqueue once rather than once per exited pid.  Protected by
+ * proc_pid_index_mtx.
+ */
+static struct filter      **proc_wake;
+static size_t             proc_wake_count;
+static size_t             proc_wake_size;
+static bool               proc_wake_batching;
+
+static inline struct proc_pid_bucket *
+proc_pid_bucket(pid_t pid)
+{
+    return &proc_pid_hash[((uint32_t)pid * 2654435761U) & (proc_pid_hash_size - 1)];
+}
+
+/* Caller must hold proc_pid_index_mtx. */
+static struct proc_pid *
+proc_pid_find(pid_t pid)
+{
+    struct proc_pid *ppd;
+
+    if (proc_pid_hash_count == 0)
+        return (NULL);
+
+    LIST_FOREACH(ppd, proc_pid_bucket(pid), ppd_entry) {
+        if (ppd->ppd_pid == pid)
+            return (ppd);
+    }
+
+    return (NULL);
+}
+
+/*
+ * Double the number of buckets, rehashing every entry.  If the
+ * allocation fails the old table is kept, lookups just get a
+ * little slower.
+ *
+ * Caller must hold proc_pid_index_mtx.
+ */
+static void
+proc_pid_hash_grow(void)
+{
+    struct proc_pid_bucket *old = proc_pid_hash;
+    unsigned int old_size = proc_pid_hash_size, i;
+    struct proc_pid *ppd;
+
+    proc_pid_hash = calloc(old_size ? old_size * 2 : PROC_PID_HASH_MIN, sizeof(*proc_pid_hash));
+    if (unlikely(!proc_pid_hash)) {
+        proc_pid_hash = old;
+        return;
+    }
+    proc_pid_hash_size = old_size ? old_size * 2 : PROC_PID_HASH_MIN;
+
+    for (i = 0; i < old_size; i++) {
+        while ((ppd = LIST_FIRST(&old[i]))) {
+            LIST_REMOVE(ppd, ppd_entry);
+            LIST_INSERT_HEAD(proc_pid_bucket(ppd->ppd_pid), ppd, ppd_entry);
+        }
+    }
+    free(old);
+}
+
+/*
+ * Caller must hold proc_pid_index_mtx.
+ *
+ * @return 0 on success, -1 if the table couldn't be allocated.
+ */
 static int
-proc_pid_cmp(struct proc_pid *a, struct proc_pid *b)
+proc_pid_insert(struct proc_pid *ppd)
 {
-    return (a->ppd_pid > b->ppd_pid) - (a->ppd_pid < b->ppd_pid);
+    if (proc_pid_hash_count >= proc_pid_hash_size) {
+        proc_pid_hash_grow();
+        if (unlikely(proc_pid_hash_size == 0))
+            return (-1);
+    }
+
+    LIST_INSERT_HEAD(proc_pid_bucket(ppd->ppd_pid), ppd, ppd_entry);
+    proc_pid_hash_count++;
+
+    return (0);
 }
 
-RB_GENERATE(pid_index, proc_pid, ppd_entry, proc_pid_cmp)
+/* Caller must hold proc_pid_index_mtx. */
+static void
+proc_pid_remove(struct proc_pid *ppd)
+{
+    LIST_REMOVE(ppd, ppd_entry);
+    proc_pid_hash_count--;
+    free(ppd);
+}
+
+/*
+ * Wake the kqueue a knote belongs to, or defer the wake to the
+ * end of the wait thread's current pass.
+ *
+ * Caller must hold proc_pid_index_mtx.
+ */
+static void
+proc_wake_filter(struct filter *filt)
+{
+    if (proc_wake_batching) {
+        if (proc_wake_count == proc_wake_size) {
+            size_t size = proc_wake_size ? proc_wake_size * 2 : 16;
+            struct filter **wake = realloc(proc_wake, size * sizeof(*proc_wake));
+
+            if (unlikely(!wake))
+                goto raise;     /* Correct, just not batched */
+            proc_wake = wake;
+            proc_wake_size = size;
+        }
+        proc_wake[proc_wake_count++] = filt;
+        return;
+    }
+
+raise:
+    kqops.eventfd_raise(&filt->kf_efd);
+}
+
+static int
+proc_wake_cmp(void const *a, void const *b)
+{
+    uintptr_t x = (uintptr_t)*(struct filter * const *)a, y = (uintptr_t)*(struct filter * const *)b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * Raise each filter deferred by proc_wake_filter exactly once.
+ *
+ * Caller must hold proc_pid_index_mtx, which also keeps the
+ * filters from being freed, see waiter_notify.
+ */
+static void
+proc_wake_flush(void)
+{
+    size_t i;
+
+    proc_wake_batching = false;
+    if (proc_wake_count == 0)
+        return;
+
+    if (proc_wake_count > 1)
+        qsort(proc_wake, proc_wake_count, sizeof(*proc_wake), proc_wake_cmp);
+
+    for (i = 0; i < proc_wake_count; i++) {
+        if ((i > 0) && (proc_wake[i] == proc_wake[i - 1]))
+            continue;
+        kqops.eventfd_raise(&proc_wake[i]->kf_efd);
+    }
+    proc_wake_count = 0;
+}
 
 /*
  * Notify all the waiters on a PID
  *
+ * Inside a wait thread pass the kqueues are woken when the pass
+ * ends (proc_wake_flush), otherwise immediately.
+ *
  * @note This must be called with the proc_pid_index_mtx held
  *       to prevent knotes/filters/kqueues being freed out from
  *       beneath us.  When a filter is freed it will attempt
@@ -136,20 +294,19 @@ waiter_notify(struct proc_pid *ppd, int status)
         dbg_printf("pid=%u exited, notifying kq=%u filter=%p kn=%p",
                    (unsigned int)ppd->ppd_pid, kn->kn_kq->kq_id, filt, kn);
         /*
-         * Insert before raising: pselect wakes on the eventfd write
+         * Insert before raising: poll wakes on the eventfd write
          * (a full memory barrier), so by the time copyout reads
          * kf_ready the insert is already visible.  Raising first
          * creates a window where copyout sees an empty kf_ready.
          */
         LIST_INSERT_HEAD(&filt->kf_ready, kn, kn_ready);
-        kqops.eventfd_raise(&filt->kf_efd);
+        proc_wake_filter(filt);
 
         LIST_REMOVE_ZERO(kn, kn_proc.waiter);
     }
 
     dbg_printf("pid=%u removing waiter list", (unsigned int)ppd->ppd_pid);
-    RB_REMOVE(pid_index, &proc_pid_index, ppd);
-    free(ppd);
+    proc_pid_remove(ppd);
 }
 
 static void
@@ -166,14 +323,13 @@ waiter_notify_error(struct proc_pid *ppd, int wait_errno)
         dbg_printf("pid=%u errored (%s), notifying kq=%u filter=%p kn=%p",
                    (unsigned int)ppd->ppd_pid, strerror(errno), kn->kn_kq->kq_id, filt, kn);
         LIST_INSERT_HEAD(&filt->kf_ready, kn, kn_ready);
-        kqops.eventfd_raise(&filt->kf_efd);
+        proc_wake_filter(filt);
 
         LIST_REMOVE_ZERO(kn, kn_proc.waiter);
     }
 
     dbg_printf("pid=%u removing waiter list", (unsigned int)ppd->ppd_pid);
-    RB_REMOVE(pid_index, &proc_pid_index, ppd);
-    free(ppd);
+    proc_pid_remove(ppd);
 }
 
 /*
@@ -218,6 +374,45 @@ waiter_siginfo_to_status(int *status_out, siginfo_t *info)
     return (0);
 }
 
+/*
+ * Check every watched PID for an exit we haven't been told about
+ *
+ * SIGCHLD coalesces, so one signal may stand for any number of
+ * exits.
+ *
+ * Caller must hold proc_pid_index_mtx.
+ */
+static void
+proc_pid_scan(void)
+{
+    struct proc_pid *ppd, *ppd_tmp;
+    siginfo_t info;
+    unsigned int i;
+    int status;
+
+    for (i = 0; i < proc_pid_hash_size; i++) {
+        LIST_FOREACH_SAFE(ppd, &proc_pid_hash[i], ppd_entry, ppd_tmp) {
+            memset(&info, 0, sizeof(info));
+        again:
+            if (waitid(P_PID, ppd->ppd_pid, &info, WEXITED | WNOWAIT | WNOHANG) < 0) {
+                switch (errno) {
+                case ECHILD:
+                    dbg_printf("waitid(2): pid=%u reaped too early - %s", ppd->ppd_pid, strerror(errno));
+
+                    waiter_notify_error(ppd, errno);
+                    continue;
+
+                case EINTR:
+                    goto again;
+                }
+            }
+
+            if ((info.si_pid == ppd->ppd_pid) && (waiter_siginfo_to_status(&status, &info) == 0))
+                waiter_notify(ppd, status);
+        }
+    }
+}
+
 /*
  * This waiter thread serves all kqueues in a given process
  *
@@ -229,7 +424,7 @@ wait_thread_loop(UNUSED void *arg)
     int ret = 0;
     siginfo_t info;
     sigset_t sigmask;
-    struct proc_pid *ppd, *ppd_tmp;
+    struct proc_pid *ppd;
 
 #ifdef __linux__
     /*
@@ -381,11 +576,13 @@ wait_thread_loop(UNUSED void *arg)
          * starting, EVFILT_PROC kevents being added, and a
          * process exiting.
          */
+        proc_wake_batching = true;
+
         if (ret > 0) {
             /*
              * Check if this is a process we want to monitor
              */
-            ppd = RB_FIND(pid_index, &proc_pid_index, &(struct proc_pid){ .ppd_pid = info.si_pid });
+            ppd = proc_pid_find(info.si_pid);
             if (ppd && waiter_siginfo_to_status(&status, &info) == 0)
                 waiter_notify(ppd, status);
         }
@@ -393,25 +590,20 @@ wait_thread_loop(UNUSED void *arg)
         /*
          * Scan the list of outstanding PIDs to see if
          * there are any we need to notify.
+         *
+         * This can't be skipped when no child is waiting to
+         * be reaped.  A watched PID the application reaped
+         * itself isn't a zombie either, and it's only the
+         * per-PID waitid failing with ECHILD which reports it.
          */
-        RB_FOREACH_SAFE(ppd, pid_index, &proc_pid_index, ppd_tmp) {
-        again:
-            if (waitid(P_PID, ppd->ppd_pid, &info, WEXITED | WNOWAIT | WNOHANG) < 0) {
-                switch (errno) {
-                case ECHILD:
-                    dbg_printf("waitid(2): pid=%u reaped too early - %s", ppd->ppd_pid, strerror(errno));
-
-                    waiter_notify_error(ppd, errno);
-                    continue;
+        if (proc_pid_hash_count > 0)
+            proc_pid_scan();
 
-                case EINTR:
-                    goto again;
-                }
-            }
-
-            if (waiter_siginfo_to_status(&status, &info) == 0)
-                waiter_notify(ppd, status);
-        }
+        /*
+         * Wake each kqueue with newly ready knotes once,
+         * however many of its PIDs exited.
+         */
+        proc_wake_flush();
         tracing_mutex_unlock(&proc_pid_index_mtx);
 
         dbg_printf("waiting for SIGCHLD");
@@ -437,7 +629,7 @@ evfilt_proc_libkqueue_init(void)
      pthread_mutexattr_init(&proc_pid_index_mtx_attr);
      pthread_mutexattr_settype(&proc_pid_index_mtx_attr, PTHREAD_MUTEX_RECURSIVE);
 #endif
-     tracing_mutex_init(&proc_pid_index_mtx, &proc_pid_index_mtx_attr);
+     tracing_mutex_init_class(&proc_pid_index_mtx, &proc_pid_index_mtx_attr, LOCKSTAT_PROC);
 }
 
 static void
@@ -574,6 +766,22 @@ evfilt_proc_destroy(struct filter *filt)
         proc_wait_thread_started = false;
         pthread_mutex_unlock(&proc_wait_thread_mtx);
     }
+    /*
+     * The wait thread is gone (or was never duplicated into
+     * this forked copy), and every knote has been deleted, so
+     * nothing else can be using the wake list or the index.
+     */
+    if (proc_count == 0) {
+        free(proc_wake);
+        proc_wake = NULL;
+        proc_wake_count = proc_wake_size = 0;
+
+        if (proc_pid_hash_count == 0) {
+            free(proc_pid_hash);
+            proc_pid_hash = NULL;
+            proc_pid_hash_size = 0;
+        }
+    }
     tracing_mutex_unlock(&proc_init_mtx);
 
     kqops.eventfd_unregister(filt->kf_kqueue, &filt->kf_efd);
@@ -615,7 +823,7 @@ proc_pid_arm(struct filter *filt, struct knote *kn)
 
     tracing_mutex_lock(&proc_pid_index_mtx);
 
-    ppd = RB_FIND(pid_index, &proc_pid_index, &(struct proc_pid){ .ppd_pid = kn->kev.ident });
+    ppd = proc_pid_find(kn->kev.ident);
     if (!ppd) {
         dbg_printf("pid=%u adding waiter list", (unsigned int)kn->kev.ident);
         ppd = calloc(1, sizeof(struct proc_pid));
@@ -624,18 +832,10 @@ proc_pid_arm(struct filter *filt, struct knote *kn)
             return (-1);
         }
         ppd->ppd_pid = kn->kev.ident;
-        {
-            /*
-             * RB_INSERT returns NULL on success, the existing entry
-             * on duplicate.  We hold proc_pid_index_mtx and just
-             * did RB_FIND, so duplicate is impossible by
-             * construction; assert documents the invariant for
-             * future refactors.  The call must be outside assert()
-             * so it still runs under NDEBUG.
-             */
-            struct proc_pid *dup = RB_INSERT(pid_index, &proc_pid_index, ppd);
-            assert(dup == NULL);
-            (void) dup;
+        if (unlikely(proc_pid_insert(ppd) < 0)) {
+            free(ppd);
+            tracing_mutex_unlock(&proc_pid_index_mtx);
+            return (-1);
         }
     }
     LIST_INSERT_HEAD(&ppd->ppd_proc_waiters, kn, kn_proc.waiter);
@@ -655,6 +855,7 @@ proc_pid_arm(struct filter *filt, struct knote *kn)
 
         if (waiter_siginfo_to_status(&status, &info) == 0) {
             dbg_printf("pid=%u already exited, firing immediately", (unsigned int) kn->kev.ident);
+            /* proc_wake_batching is only set by the wait thread, this raises immediately */
             waiter_notify(ppd, status);
         }
         /*
@@ -691,11 +892,10 @@ proc_pid_disarm(struct knote *kn)
     if (LIST_INSERTED(kn, kn_proc.waiter))
         LIST_REMOVE_ZERO(kn, kn_proc.waiter);
 
-    ppd = RB_FIND(pid_index, &proc_pid_index, &(struct proc_pid){ .ppd_pid = kn->kev.ident });
+    ppd = proc_pid_find(kn->kev.ident);
     if (ppd && LIST_EMPTY(&ppd->ppd_proc_waiters)) {
         dbg_printf("pid=%u removing waiter list", (unsigned int)ppd->ppd_pid);
-        RB_REMOVE(pid_index, &proc_pid_index, ppd);
-        free(ppd);
+        proc_pid_remove(ppd);
     }
 }
 
@@ -905,6 +1105,7 @@ const struct filter evfilt_proc = {
     .libkqueue_init   = evfilt_proc_libkqueue_init,
     .libkqueue_fork   = evfilt_proc_libkqueue_fork,
     .kf_id            = EVFILT_PROC,
+    .kf_eager         = true,   /* SIGCHLD blocked and the wait thread running from kqueue() on */
     .kf_init          = evfilt_proc_init,
     .kf_destroy       = evfilt_proc_destroy,
     .kf_copyout       = evfilt_proc_knote_copyout,
@@ -109,10 +109,32 @@ posix_read_descriptor_type(struct knote *kn)
  * src/posix/platform.c. */
 
 /*
- * Add fd to the kqueue's read fd_set so the next pselect picks up
- * its readability.  Regular-file knotes are "always readable", so
- * instead of an FD_SET we park them on the filter's kf_ready list
- * and wake the kqueue; the dispatch path walks kf_ready unconditionally.
+ * BSD spec: a regular-file read knote is "active when size >
+ * position".  Called from the wait loop when the knote's poll
+ * timer comes due.
+ */
+static bool
+posix_read_file_poll(struct filter *filt, struct knote *kn)
+{
+    int fd = (int)kn->kev.ident;
+    struct stat sb;
+    off_t curpos;
+
+    filter_stat_add(filt, kfs_syscalls, 2);    /* fstat + lseek */
+    if (fstat(fd, &sb) < 0)
+        return (false);
+    curpos = lseek(fd, 0, SEEK_CUR);
+    if (curpos == (off_t) -1)
+        curpos = 0;
+
+    return (curpos < sb.st_size);
+}
+
+/*
+ * Add fd to the kqueue's poll set so the next poll picks up
+ * its readability.  Regular files always poll as readable, so
+ * instead we fstat them on an adaptive timer, and the knote is
+ * parked on the filter's kf_ready list while there's data.
  */
 static int
 posix_read_arm(struct filter *filt, struct knote *kn)
@@ -120,28 +142,14 @@ posix_read_arm(struct filter *filt, struct knote *kn)
     int fd = (int)kn->kev.ident;
     struct kqueue *kq = filt->kf_kqueue;
 
-    if (kn->kn_flags & KNFL_FILE) {
-        if (!(kn->kn_flags & KNFL_ALWAYS_READY_BUMPED)) {
-            if (!LIST_INSERTED(kn, kn_ready))
-                LIST_INSERT_HEAD(&filt->kf_ready, kn, kn_ready);
-            kq->kq_always_ready++;
-            kn->kn_flags |= KNFL_ALWAYS_READY_BUMPED;
-        }
-        posix_wake_kqueue(kq);
-        return (0);
-    }
-    if (fd < 0 || fd >= FD_SETSIZE) {
-        dbg_printf("fd=%d out of FD_SETSIZE=%d", fd, FD_SETSIZE);
-        errno = EBADF;
+    if (kn->kn_flags & KNFL_FILE)
+        return posix_poll_start(filt, kn, posix_read_file_poll);
+    if (posix_fd_watch(kq, fd, POLLIN, kn) < 0)
         return (-1);
-    }
-    FD_SET(fd, &kq->kq_fds);
-    if (fd >= kq->kq_nfds)
-        kq->kq_nfds = fd + 1;
     /*
-     * Wake any thread currently parked in pselect with a stale
-     * fd_set snapshot so it re-reads kq_fds and picks up our new
-     * watch.  Without this, a cross-thread EV_ADD on an
+     * Wake any thread currently parked in poll with a stale
+     * poll set snapshot so it re-reads the set and picks up our
+     * new watch.  Without this, a cross-thread EV_ADD on an
      * already-readable fd doesn't deliver until the parked
      * caller times out for some other reason.
      */
@@ -156,24 +164,10 @@ posix_read_disarm(struct filter *filt, struct knote *kn)
     struct kqueue *kq = filt->kf_kqueue;
 
     if (kn->kn_flags & KNFL_FILE) {
-        if (kn->kn_flags & KNFL_ALWAYS_READY_BUMPED) {
-            /*
-             * Common knote_delete unlinks kn_ready before
-             * calling us, so the LIST_INSERTED check on its
-             * own would miss the decrement.  The flag tracks
-             * the +1 we owe to kq_always_ready independently.
-             */
-            if (LIST_INSERTED(kn, kn_ready))
-                LIST_REMOVE_ZERO(kn, kn_ready);
-            if (kq->kq_always_ready > 0)
-                kq->kq_always_ready--;
-            kn->kn_flags &= ~KNFL_ALWAYS_READY_BUMPED;
-        }
+        posix_poll_stop(filt, kn);
         return;
     }
-    if (fd < 0 || fd >= FD_SETSIZE)
-        return;
-    FD_CLR(fd, &kq->kq_fds);
+    posix_fd_unwatch(kq, fd, POLLIN);
 }
 
 int
@@ -186,7 +180,7 @@ evfilt_read_knote_create(struct filter *filt, struct knote *kn)
     /*
      * NOTE_LOWAT: BSD kqueue gates the read knote on at least
      * kev.data bytes being available.  We push the threshold to
-     * the kernel via SO_RCVLOWAT so select(2) won't report the
+     * the kernel via SO_RCVLOWAT so poll(2) won't report the
      * fd readable until the byte count crosses kev.data; the
      * dispatch path doesn't have to know about it.
      *
@@ -226,6 +220,8 @@ evfilt_read_knote_delete(struct filter *filt, struct knote *kn)
             dbg_perror("setsockopt(SO_RCVLOWAT, restore)");
     }
     posix_read_disarm(filt, kn);
+    if (kn->kn_flags & KNFL_FILE)
+        posix_poll_free(filt, kn);
     return (0);
 }
 
@@ -267,6 +263,7 @@ evfilt_read_copyout(struct kevent *dst, UNUSED int nevents,
         struct stat sb;
         off_t curpos;
 
+        filter_stat_add(filt, kfs_syscalls, 2);    /* fstat + lseek */
         if (fstat(fd, &sb) < 0) {
             dbg_perror("fstat(2)");
             sb.st_size = 0;
@@ -276,17 +273,16 @@ evfilt_read_copyout(struct kevent *dst, UNUSED int nevents,
             curpos = 0;
 
         /*
-         * BSD spec: a regular-file read knote is "active when
-         * size > position".  Suppress the emit when at/past
-         * EOF, but keep the knote on kf_ready so a later write
-         * (through any fd) or lseek-back picks up immediately
-         * on the next kevent.  We don't have a vfs-write
-         * callback to hand-fire the knote, so the kqueue stays
-         * in always-ready polling for the file knote's
-         * lifetime - the existing contract for any file knote.
+         * Suppress the emit when at/past EOF and hand the knote
+         * back to its poll timer, which picks up a later write
+         * (through any fd) or lseek-back.  The file was being
+         * read, so start again from the shortest interval.
+         * Otherwise the knote stays on kf_ready, level-triggered.
          */
-        if (curpos >= sb.st_size)
+        if (curpos >= sb.st_size) {
+            posix_poll_cool(filt, src, true);
             return (0);
+        }
         dst->data = (intptr_t)(sb.st_size - curpos);
     } else if (src->kn_flags & KNFL_SOCKET_PASSIVE) {
         /*
@@ -297,6 +293,8 @@ evfilt_read_copyout(struct kevent *dst, UNUSED int nevents,
         dst->data = 1;
     } else {
         int n = 0;
+
+        filter_stat_inc(filt, kfs_syscalls);
         if (ioctl(fd, FIONREAD, &n) < 0) {
             dbg_perror("ioctl(FIONREAD)");
             dst->data = 0;
@@ -304,7 +302,7 @@ evfilt_read_copyout(struct kevent *dst, UNUSED int nevents,
             dst->data = n;
         }
         /*
-         * For stream sockets / pipes, an FD that pselect reported
+         * For stream sockets / pipes, an FD that poll reported
          * readable but has zero queued bytes typically means the
          * peer closed.  Mirror BSD kqueue's EV_EOF.
          * For stream sockets also query SO_ERROR: a RST sets it to
@@ -327,9 +325,9 @@ evfilt_read_copyout(struct kevent *dst, UNUSED int nevents,
     /*
      * EV_CLEAR is "edge-triggered": each level transition
      * (not-readable -> readable) fires once, and we only refire
-     * when the consumer has drained back below readable.  select(2)
+     * when the consumer has drained back below readable.  poll(2)
      * has no edge detector so we approximate by removing the fd
-     * from the kq's master set on emit; the level-tracker (TODO)
+     * from the kq's poll set on emit; the level-tracker (TODO)
      * will rearm when FIONREAD returns 0 then >0.
      */
     if (src->kev.flags & EV_CLEAR)
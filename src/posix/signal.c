@@ -16,11 +16,11 @@
  */
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/select.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
@@ -32,7 +32,7 @@
  * EVFILT_SIGNAL on platforms without signalfd: sigaction +
  * self-pipe platform layer.  AS-safe handler writes the signum byte
  * to sig_pipe[1]; the dispatch loop in signal.h reads
- * bytes via select(2) on sig_pipe[0].
+ * bytes via poll(2) on sig_pipe[0].
  *
  * The fan-out machinery (sigtbl, per-filter pending list, copyout,
  * the public evfilt_signal struct) lives in signal.h.
@@ -130,16 +130,13 @@ static int
 sig_platform_wait_dispatch(void)
 {
     unsigned char buf[64];
-    fd_set rfds;
+    struct pollfd pfd = { .fd = sig_pipe[0], .events = POLLIN };
     ssize_t n;
     size_t i;
 
-    FD_ZERO(&rfds);
-    FD_SET(sig_pipe[0], &rfds);
-
-    if (select(sig_pipe[0] + 1, &rfds, NULL, NULL, NULL) < 0) {
+    if (poll(&pfd, 1, -1) < 0) {
         if (errno == EINTR) return (1);
-        dbg_printf("select(2): %s", strerror(errno));
+        dbg_printf("poll(2): %s", strerror(errno));
         return (-1);
     }
 
@@ -154,10 +151,10 @@ sig_platform_wait_dispatch(void)
         return (1); /* keep going on transient errors */
     }
 
-    pthread_mutex_lock(&sigtbl_mtx);
+    tracing_mutex_lock(&sigtbl_mtx);
     for (i = 0; i < (size_t) n; i++)
         sig_dispatch_handle(buf[i]);
-    pthread_mutex_unlock(&sigtbl_mtx);
+    tracing_mutex_unlock(&sigtbl_mtx);
     return (1);
 }
 
@@ -17,15 +17,16 @@
 
 /*
  * EVFILT_TIMER on POSIX, driven entirely from the dispatcher's
- * pselect(2) timeout - no sleeper threads, no eventfds, no
+ * poll(2) timeout - no sleeper threads, no eventfds, no
  * socketpairs.  Each registered, enabled knote owns a struct
  * posix_timer linked into kq->kq_timers, an RB-tree keyed on the
  * (CLOCK_MONOTONIC) next-deadline.  Two hooks let the dispatcher
  * integrate them:
  *
  *   posix_timer_min_deadline_ns - O(log N) peek at the earliest
- *       deadline; the wait loop clamps its pselect timeout
- *       against it.
+ *       deadline, pushed back as far as NOTE_LEEWAY allows so
+ *       nearby expirations share a wakeup; the wait loop clamps
+ *       its poll timeout against it.
  *
  *   posix_timer_check - pop past-due timers off the front of the
  *       tree, bump fire_count, advance and re-insert (periodics)
@@ -42,6 +43,15 @@
  * emits one kevent per knote with a non-zero fire_count.  We
  * iterate knotes rather than the deadline tree so a copyout
  * delivers in knote order, not deadline order.
+ *
+ * The same tree also schedules "poll timers", which drive the
+ * fstat re-evaluation of regular file EVFILT_READ knotes and
+ * EVFILT_VNODE knotes (see posix_poll_start).  Each such knote
+ * backs off exponentially while its file isn't changing, and
+ * drops back to the minimum interval when it does, so idle files
+ * cost a handful of fstats a second while busy ones are noticed
+ * quickly.  Deadlines are jittered so knotes registered together
+ * don't all come due on the same wakeup.
  */
 
 #include <signal.h>
@@ -55,13 +65,30 @@ struct posix_timer {
     RB_ENTRY(posix_timer) entry;
     struct knote   *kn;
     struct timespec next;       /* CLOCK_MONOTONIC */
-    long            interval_ns;/* 0 if oneshot */
+    long            interval_ns;/* 0 if oneshot, current backoff for poll timers */
+    long            leeway_ns;  /* NOTE_LEEWAY: may fire this late */
     bool            oneshot;
     bool            absolute;   /* NOTE_ABSOLUTE: fire once and stop */
     bool            in_tree;    /* linked in kq->kq_timers */
     unsigned int    fire_count;
+
+    /*
+     * Poll timers only.  poll is called when the timer comes
+     * due and returns true if the knote has something to report.
+     */
+    posix_poll_func_t poll;
+    struct filter   *filt;      /* filter kn belongs to */
+    bool            hot;        /* linked on filt->kf_ready, counted in kq_poll_hot */
+    uint64_t        seed;       /* jitter PRNG state */
 };
 
+/*
+ * Bounds for the adaptive poll interval, used unless the
+ * application pins it with NOTE_FILE_POLL_INTERVAL.
+ */
+#define POSIX_POLL_MIN_NS   (1L * 1000L * 1000L)        /* 1ms */
+#define POSIX_POLL_MAX_NS   (100L * 1000L * 1000L)      /* 100ms */
+
 static int
 ts_lt(const struct timespec *a, const struct timespec *b)
 {
@@ -179,6 +206,7 @@ timer_alloc(struct knote *kn)
     ns = timer_data_to_ns(kn->kev.data, kn->kev.fflags);
     if (ns < 1) ns = 1;
     t->interval_ns = t->oneshot ? 0 : ns;
+    t->leeway_ns = (long)timer_leeway_ns(kn->kev.fflags, ns);
     ts_now(&t->next);
     ts_add_ns(&t->next, ns);
     return (t);
@@ -203,36 +231,235 @@ timer_unlink(struct kqueue *kq, struct posix_timer *t)
 }
 
 /*
- * Smallest "now -> next deadline" delta across enabled timers,
- * in nanoseconds.  Returns -1 when no enabled timer would
- * constrain the pselect timeout.  O(log N) - just RB_MIN.
+ * How many timers posix_timer_min_deadline_ns will look at to
+ * find the latest wakeup every timer's leeway allows.
+ */
+#define POSIX_TIMER_LEEWAY_SCAN 64
+
+/*
+ * Smallest "now -> wakeup" delta across enabled timers, in
+ * nanoseconds.  Returns -1 when no enabled timer would constrain
+ * the poll timeout.
+ *
+ * Without NOTE_LEEWAY that's the first deadline, O(log N) - just
+ * RB_MIN.  Timers with leeway let us sleep until the earliest
+ * "deadline + leeway", so every timer due by then fires from the
+ * same wakeup.  Only the timers with a deadline before that
+ * point can lower it, so the walk stops there, or after
+ * POSIX_TIMER_LEEWAY_SCAN timers in which case we wake for the
+ * next one we didn't look at.
  */
 long
 posix_timer_min_deadline_ns(struct kqueue *kq)
 {
     struct posix_timer *t;
-    struct timespec now;
+    struct timespec now, wake, latest;
     long delta;
+    int i;
 
     t = RB_MIN(posix_timer_tree, &kq->kq_timers);
     if (t == NULL)
         return (-1);
+
+    wake = t->next;
+    ts_add_ns(&wake, t->leeway_ns);
+    for (i = 0, t = RB_NEXT(posix_timer_tree, &kq->kq_timers, t);
+         (t != NULL) && ts_lt(&t->next, &wake);
+         i++, t = RB_NEXT(posix_timer_tree, &kq->kq_timers, t)) {
+        if (i == POSIX_TIMER_LEEWAY_SCAN) {
+            wake = t->next;
+            break;
+        }
+        latest = t->next;
+        ts_add_ns(&latest, t->leeway_ns);
+        if (ts_lt(&latest, &wake))
+            wake = latest;
+    }
+
     ts_now(&now);
-    if (ts_lt(&t->next, &now))
+    if (ts_lt(&wake, &now))
         return (0);                              /* already past-due */
-    delta = (t->next.tv_sec - now.tv_sec) * 1000000000L
-          + (t->next.tv_nsec - now.tv_nsec);
+    delta = (wake.tv_sec - now.tv_sec) * 1000000000L
+          + (wake.tv_nsec - now.tv_nsec);
     return delta;
 }
 
+/*
+ * Reschedule a poll timer.  If the knote's file changed the
+ * interval drops back to the minimum, otherwise it doubles up to
+ * the maximum.  Up to a quarter of the interval is added as
+ * jitter so knotes don't come due in lockstep.
+ */
+static void
+poll_schedule(struct kqueue *kq, struct posix_timer *t, bool changed)
+{
+    long min = POSIX_POLL_MIN_NS, max = POSIX_POLL_MAX_NS;
+
+    if (kq->kq_file_poll_interval_ns > 0)
+        min = max = kq->kq_file_poll_interval_ns;
+
+    if (changed || (t->interval_ns < min))
+        t->interval_ns = min;
+    else if (t->interval_ns < max)
+        t->interval_ns = (t->interval_ns > (max / 2)) ? max : t->interval_ns * 2;
+    if (t->interval_ns > max)
+        t->interval_ns = max;
+
+    t->seed = t->seed * 6364136223846793005ULL + 1442695040888963407ULL;
+
+    timer_unlink(kq, t);
+    ts_now(&t->next);
+    ts_add_ns(&t->next, t->interval_ns + (long)((t->seed >> 33) % (uint64_t)(t->interval_ns / 4 + 1)));
+    timer_link(kq, t);
+}
+
+/*
+ * Link a poll timer's knote on its filter's kf_ready list, so
+ * copyout re-evaluates it, and count it so the wait loop doesn't
+ * block while it's there.
+ */
+static void
+poll_heat(struct kqueue *kq, struct posix_timer *t)
+{
+    if (t->hot)
+        return;
+    if (!LIST_INSERTED(t->kn, kn_ready))
+        LIST_INSERT_HEAD(&t->filt->kf_ready, t->kn, kn_ready);
+    t->hot = true;
+    kq->kq_poll_hot++;
+}
+
+static void
+poll_unheat(struct kqueue *kq, struct posix_timer *t)
+{
+    if (!t->hot)
+        return;
+    /*
+     * Common knote_delete unlinks kn_ready before calling the
+     * filter's kn_delete, so the list linkage and the hot flag
+     * are tracked separately.
+     */
+    if (LIST_INSERTED(t->kn, kn_ready))
+        LIST_REMOVE_ZERO(t->kn, kn_ready);
+    t->hot = false;
+    kq->kq_poll_hot--;
+}
+
+/** Start fstat polling of a file or vnode knote
+ *
+ * The knote is evaluated on the next wait, then polled at an
+ * adaptive interval.  Whenever poll returns true the knote is
+ * linked on filt->kf_ready for the filter's copyout, which must
+ * call posix_poll_cool when it has nothing more to report.
+ *
+ * Uses kn->kn_timer, so only for filters other than EVFILT_TIMER.
+ *
+ * @param[in] filt  the knote belongs to.
+ * @param[in] kn    to poll.
+ * @param[in] poll  called with the kqueue locked when the knote
+ *                  comes due, returns true if the knote has
+ *                  something to report.
+ * @return
+ *      - 0 on success.
+ *      - -1 on failure (errno set).
+ */
+int
+posix_poll_start(struct filter *filt, struct knote *kn, posix_poll_func_t poll)
+{
+    struct kqueue *kq = filt->kf_kqueue;
+    struct posix_timer *t = kn->kn_timer;
+
+    if (t == NULL) {
+        t = calloc(1, sizeof(*t));
+        if (t == NULL)
+            return (-1);
+        t->kn = kn;
+        t->filt = filt;
+        t->seed = (uint64_t)(uintptr_t)kn;
+        kn->kn_timer = t;
+    }
+    t->poll = poll;
+    t->interval_ns = 0;
+
+    timer_unlink(kq, t);
+    ts_now(&t->next);
+    timer_link(kq, t);
+
+    posix_wake_kqueue(kq);
+    return (0);
+}
+
+/** Stop polling a knote, e.g. on EV_DISABLE
+ */
+void
+posix_poll_stop(struct filter *filt, struct knote *kn)
+{
+    struct posix_timer *t = kn->kn_timer;
+
+    if (t == NULL)
+        return;
+    timer_unlink(filt->kf_kqueue, t);
+    poll_unheat(filt->kf_kqueue, t);
+}
+
+/** Stop polling a knote and free its poll timer
+ */
+void
+posix_poll_free(struct filter *filt, struct knote *kn)
+{
+    if (kn->kn_timer == NULL)
+        return;
+    posix_poll_stop(filt, kn);
+    free(kn->kn_timer);
+    kn->kn_timer = NULL;
+}
+
+/** Return a knote to timed polling once copyout has nothing more to report
+ *
+ * @param[in] filt      the knote belongs to.
+ * @param[in] kn        to reschedule.
+ * @param[in] changed   whether the file changed since the last
+ *                      evaluation, resets the backoff.
+ */
+void
+posix_poll_cool(struct filter *filt, struct knote *kn, bool changed)
+{
+    struct posix_timer *t = kn->kn_timer;
+
+    if (t == NULL)
+        return;
+    poll_unheat(filt->kf_kqueue, t);
+    poll_schedule(filt->kf_kqueue, t, changed);
+}
+
+/*
+ * Drop any fires a timer has accumulated but not yet delivered.
+ */
+static void
+timer_clear_fires(struct kqueue *kq, struct posix_timer *t)
+{
+    if (t->fire_count == 0)
+        return;
+    t->fire_count = 0;
+    kq->kq_timers_pending--;
+}
+
 /*
  * Pop past-due timers off the front of the tree.  For each one,
  * bump fire_count, advance the deadline (periodic) or detach
  * (oneshot/absolute), and re-insert if still relevant.  Idle
  * case is O(log N) for the RB_MIN; with K fires it's O(K log N).
  * Disabled timers aren't in the tree and aren't touched.
+ *
+ * Due poll timers are evaluated here too, so a poll that finds
+ * nothing can go straight back to sleep without waking the
+ * caller.
+ *
+ * Returns the number of EVFILT_TIMER timers with fires waiting
+ * for copyout, including ones which fired on an earlier pass but
+ * didn't fit in the caller's eventlist.
  */
-void
+int
 posix_timer_check(struct kqueue *kq)
 {
     struct posix_timer *t;
@@ -240,12 +467,23 @@ posix_timer_check(struct kqueue *kq)
 
     t = RB_MIN(posix_timer_tree, &kq->kq_timers);
     if (t == NULL)
-        return;
+        return (kq->kq_timers_pending);
     ts_now(&now);
 
     while (t != NULL && !ts_lt(&now, &t->next)) {
         timer_unlink(kq, t);
-        t->fire_count++;
+
+        if (t->poll != NULL) {
+            if (t->poll(t->filt, t->kn))
+                poll_heat(kq, t);
+            else
+                poll_schedule(kq, t, false);
+            t = RB_MIN(posix_timer_tree, &kq->kq_timers);
+            continue;
+        }
+
+        if (t->fire_count++ == 0)
+            kq->kq_timers_pending++;
         if (t->oneshot || t->absolute || t->interval_ns == 0) {
             /*
              * Detach from the deadline tree but leave the struct
@@ -268,6 +506,8 @@ posix_timer_check(struct kqueue *kq)
         }
         t = RB_MIN(posix_timer_tree, &kq->kq_timers);
     }
+
+    return (kq->kq_timers_pending);
 }
 
 int
@@ -301,7 +541,7 @@ evfilt_timer_copyout_one(struct kevent *dst, struct filter *filt,
     count = t->fire_count;
     if (count == 0)
         return (0);
-    t->fire_count = 0;
+    timer_clear_fires(filt->kf_kqueue, t);
 
     memcpy(dst, &src->kev, sizeof(*dst));
     dst->data = (intptr_t) count;
@@ -366,7 +606,7 @@ evfilt_timer_knote_create(struct filter *filt, struct knote *kn)
     timer_link(filt->kf_kqueue, t);
 
     /*
-     * A new deadline may be sooner than the one a parked pselect
+     * A new deadline may be sooner than the one a parked poll
      * is waiting on; wake it so it recomputes its timeout.
      */
     posix_wake_kqueue(filt->kf_kqueue);
@@ -384,6 +624,7 @@ evfilt_timer_knote_modify(struct filter *filt, struct knote *kn,
     unsigned short keep = kn->kev.flags & EV_RECEIPT;
     if (kn->kn_timer != NULL) {
         timer_unlink(filt->kf_kqueue, kn->kn_timer);
+        timer_clear_fires(filt->kf_kqueue, kn->kn_timer);
         free(kn->kn_timer);
         kn->kn_timer = NULL;
     }
@@ -397,6 +638,7 @@ evfilt_timer_knote_delete(struct filter *filt, struct knote *kn)
 {
     if (kn->kn_timer != NULL) {
         timer_unlink(filt->kf_kqueue, kn->kn_timer);
+        timer_clear_fires(filt->kf_kqueue, kn->kn_timer);
         free(kn->kn_timer);
         kn->kn_timer = NULL;
     }
@@ -417,7 +659,7 @@ evfilt_timer_knote_enable(struct filter *filt, struct knote *kn)
         long ns = t->absolute ? 0 : (t->interval_ns > 0 ? t->interval_ns : 1);
         ts_now(&t->next);
         ts_add_ns(&t->next, ns);
-        t->fire_count = 0;
+        timer_clear_fires(filt->kf_kqueue, t);
         timer_link(filt->kf_kqueue, t);
     }
     posix_wake_kqueue(filt->kf_kqueue);
@@ -429,11 +671,13 @@ evfilt_timer_knote_disable(struct filter *filt, struct knote *kn)
 {
     /*
      * Pause: unlink from the deadline tree so we don't constrain
-     * pselect on a knote that won't deliver.  EV_ENABLE re-links
+     * poll on a knote that won't deliver.  EV_ENABLE re-links
      * with a fresh deadline.
      */
-    if (kn->kn_timer != NULL)
+    if (kn->kn_timer != NULL) {
         timer_unlink(filt->kf_kqueue, kn->kn_timer);
+        timer_clear_fires(filt->kf_kqueue, kn->kn_timer);
+    }
     return (0);
 }
 
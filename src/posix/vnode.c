@@ -38,12 +38,12 @@
  * within one poll interval coalesces into a single event whose
  * fflags is the union of everything that happened.
  *
- * Vnode knotes count as always-ready (they ride the kf_ready /
- * kq_always_ready accounting), so the wait loop's polling-interval
- * mechanism (NOTE_FILE_POLL_INTERVAL on EVFILT_LIBKQUEUE) controls
- * how often the diff runs.  Default is sched_yield each loop
- * (cooperative spin); set a positive interval to switch to actual
- * sleep-between-polls.
+ * Each knote has a poll timer in the kqueue's timer tree (see
+ * posix_poll_start) which runs the diff.  The interval backs off
+ * from 1ms to 100ms while the file isn't changing and resets when
+ * it does, unless NOTE_FILE_POLL_INTERVAL on EVFILT_LIBKQUEUE pins
+ * it.  Knotes whose diff matched are linked on kf_ready for
+ * copyout, which re-diffs, emits and hands them back to the timer.
  *
  * Detection coverage:
  *   NOTE_DELETE   st_nlink dropped to 0 (last name unlinked).
@@ -177,41 +177,43 @@ vnode_diff_to_note(const struct stat *prev, const struct stat *now)
     return fflags;
 }
 
+/*
+ * Poll timer callback, true if the knote has something to emit.
+ * Leaves the snapshot alone, copyout re-diffs and updates it.
+ */
+static bool
+vnode_poll(struct filter *filt, struct knote *kn)
+{
+    struct stat now;
+
+    if (kn->kn_vnode == NULL || KNOTE_DISABLED(kn))
+        return (false);
+    filter_stat_inc(filt, kfs_syscalls);
+    if (fstat((int) kn->kev.ident, &now) < 0)
+        return ((errno == EBADF) && (kn->kev.fflags & NOTE_DELETE));
+
+    return ((vnode_diff_to_note(&kn->kn_vnode->last, &now) & kn->kev.fflags) != 0);
+}
+
 int
 evfilt_vnode_knote_create(struct filter *filt, struct knote *kn)
 {
-    struct kqueue *kq = filt->kf_kqueue;
-
     kn->kn_vnode = vnode_state_alloc((int) kn->kev.ident);
     if (kn->kn_vnode == NULL)
         return (-1);
 
-    /*
-     * Vnode knotes are always-ready and dispatched drain-style:
-     * we don't link to kf_ready (the dispatcher detaches before
-     * kf_copyout, which would lose the always-ready property);
-     * copyout instead walks the filter's knote index via
-     * knote_foreach.  We still bump kq_always_ready so the wait
-     * loop knows to drive periodic re-evaluation.
-     */
-    if (!(kn->kn_flags & KNFL_ALWAYS_READY_BUMPED)) {
-        kq->kq_always_ready++;
-        kn->kn_flags |= KNFL_ALWAYS_READY_BUMPED;
+    if (posix_poll_start(filt, kn, vnode_poll) < 0) {
+        free(kn->kn_vnode);
+        kn->kn_vnode = NULL;
+        return (-1);
     }
-    posix_wake_kqueue(kq);
     return (0);
 }
 
 int
 evfilt_vnode_knote_delete(struct filter *filt, struct knote *kn)
 {
-    struct kqueue *kq = filt->kf_kqueue;
-
-    if (kn->kn_flags & KNFL_ALWAYS_READY_BUMPED) {
-        if (kq->kq_always_ready > 0)
-            kq->kq_always_ready--;
-        kn->kn_flags &= ~KNFL_ALWAYS_READY_BUMPED;
-    }
+    posix_poll_free(filt, kn);
     if (kn->kn_vnode != NULL) {
         free(kn->kn_vnode);
         kn->kn_vnode = NULL;
@@ -236,14 +238,6 @@ evfilt_vnode_knote_modify(UNUSED struct filter *filt, struct knote *kn,
 int
 evfilt_vnode_knote_enable(struct filter *filt, struct knote *kn)
 {
-    struct kqueue *kq = filt->kf_kqueue;
-
-    if (!(kn->kn_flags & KNFL_ALWAYS_READY_BUMPED)) {
-        if (!LIST_INSERTED(kn, kn_ready))
-            LIST_INSERT_HEAD(&filt->kf_ready, kn, kn_ready);
-        kq->kq_always_ready++;
-        kn->kn_flags |= KNFL_ALWAYS_READY_BUMPED;
-    }
     /*
      * Re-seed the snapshot so changes that happened while
      * disabled don't all fire on the next poll.  Matches BSD's
@@ -251,22 +245,13 @@ evfilt_vnode_knote_enable(struct filter *filt, struct knote *kn)
      */
     if (kn->kn_vnode != NULL && fstat((int) kn->kev.ident, &kn->kn_vnode->last) < 0)
         dbg_perror("fstat (enable)");
-    posix_wake_kqueue(kq);
-    return (0);
+    return posix_poll_start(filt, kn, vnode_poll);
 }
 
 int
 evfilt_vnode_knote_disable(struct filter *filt, struct knote *kn)
 {
-    struct kqueue *kq = filt->kf_kqueue;
-
-    if (kn->kn_flags & KNFL_ALWAYS_READY_BUMPED) {
-        if (LIST_INSERTED(kn, kn_ready))
-            LIST_REMOVE_ZERO(kn, kn_ready);
-        if (kq->kq_always_ready > 0)
-            kq->kq_always_ready--;
-        kn->kn_flags &= ~KNFL_ALWAYS_READY_BUMPED;
-    }
+    posix_poll_stop(filt, kn);
     return (0);
 }
 
@@ -275,6 +260,9 @@ evfilt_vnode_knote_disable(struct filter *filt, struct knote *kn)
  * emit if any of the consumer's requested NOTE_* bits triggered.
  * Updates the snapshot on emit so subsequent calls don't re-fire
  * for the same change.
+ *
+ * Either way the knote goes back to its poll timer, before the
+ * flag actions as EV_ONESHOT may free it.
  */
 static int
 evfilt_vnode_copyout_one(struct kevent *dst, struct filter *filt,
@@ -284,16 +272,21 @@ evfilt_vnode_copyout_one(struct kevent *dst, struct filter *filt,
     unsigned int  changed;
     unsigned int  emit;
 
-    if (src->kn_vnode == NULL || KNOTE_DISABLED(src))
+    if (src->kn_vnode == NULL || KNOTE_DISABLED(src)) {
+        posix_poll_stop(filt, src);
         return (0);
+    }
+    filter_stat_inc(filt, kfs_syscalls);
     if (fstat((int) src->kev.ident, &now) < 0) {
         if (errno == EBADF && (src->kev.fflags & NOTE_DELETE)) {
             memcpy(dst, &src->kev, sizeof(*dst));
             dst->fflags = NOTE_DELETE;
+            posix_poll_cool(filt, src, true);
             if (knote_copyout_flag_actions(filt, src) < 0)
                 return (-1);
             return (1);
         }
+        posix_poll_cool(filt, src, false);
         return (0);
     }
 
@@ -308,8 +301,10 @@ evfilt_vnode_copyout_one(struct kevent *dst, struct filter *filt,
                (long) ST_CTIM(&now).tv_sec,
                (long) ST_CTIM(&now).tv_nsec,
                changed, (unsigned int) src->kev.fflags, emit);
-    if (emit == 0)
+    if (emit == 0) {
+        posix_poll_cool(filt, src, false);
         return (0);
+    }
 
     /*
      * BSD spec: dst->fflags is the full set of bits the change
@@ -319,48 +314,33 @@ evfilt_vnode_copyout_one(struct kevent *dst, struct filter *filt,
     memcpy(dst, &src->kev, sizeof(*dst));
     dst->fflags = changed;
     src->kn_vnode->last = now;
+    posix_poll_cool(filt, src, true);
 
     if (knote_copyout_flag_actions(filt, src) < 0)
         return (-1);
     return (1);
 }
 
-struct vnode_drain_ctx {
-    struct filter *filt;
-    struct kevent *eventlist;
-    int            nevents;
-    int            nout;
-    int            err;
-};
-
-static int
-vnode_drain_cb(struct knote *kn, void *uctx)
-{
-    struct vnode_drain_ctx *c = uctx;
-    int rv;
-
-    if (c->nout >= c->nevents)
-        return (1);
-    rv = evfilt_vnode_copyout_one(c->eventlist + c->nout, c->filt, kn);
-    if (rv < 0) {
-        c->err = -1;
-        return (1);
-    }
-    c->nout += rv;
-    return (0);
-}
-
+/*
+ * Drain-style: walk the knotes whose poll timer saw a change.
+ * Each one unlinks itself from kf_ready in copyout_one.
+ */
 int
 evfilt_vnode_copyout(struct kevent *dst, int nevents, struct filter *filt,
         UNUSED struct knote *src, UNUSED void *ptr)
 {
-    struct vnode_drain_ctx c = {
-        .filt = filt, .eventlist = dst, .nevents = nevents,
-        .nout = 0, .err = 0,
-    };
-
-    (void) knote_foreach(filt, vnode_drain_cb, &c);
-    return c.err < 0 ? -1 : c.nout;
+    struct knote *kn, *kn_tmp;
+    int rv, nout = 0;
+
+    LIST_FOREACH_SAFE(kn, &filt->kf_ready, kn_ready, kn_tmp) {
+        if (nout >= nevents)
+            break;
+        rv = evfilt_vnode_copyout_one(dst + nout, filt, kn);
+        if (rv < 0)
+            return (-1);
+        nout += rv;
+    }
+    return (nout);
 }
 
 const struct filter evfilt_vnode = {
@@ -23,13 +23,13 @@
 #include "platform.h"
 
 /*
- * Mark fd as "watched for write" in the kqueue's write fd_set so
- * the next pselect picks up writability.  Regular files are
+ * Mark fd as "watched for write" in the kqueue's poll set so
+ * the next poll picks up writability.  Regular files are
  * always-writable; we don't bother with a wake-pipe equivalent
  * because EVFILT_WRITE on a regular file is rarely interesting
  * (file is unconditionally writable up to disk-full).  If a
  * caller does add such a knote we treat it like a socket and let
- * pselect immediately report writable.
+ * poll immediately report writable.
  */
 static int
 posix_write_arm(struct filter *filt, struct knote *kn)
@@ -37,16 +37,10 @@ posix_write_arm(struct filter *filt, struct knote *kn)
     int fd = (int)kn->kev.ident;
     struct kqueue *kq = filt->kf_kqueue;
 
-    if (fd < 0 || fd >= FD_SETSIZE) {
-        dbg_printf("fd=%d out of FD_SETSIZE=%d", fd, FD_SETSIZE);
-        errno = EBADF;
+    if (posix_fd_watch(kq, fd, POLLOUT, kn) < 0)
         return (-1);
-    }
-    FD_SET(fd, &kq->kq_wfds);
-    if (fd >= kq->kq_nfds)
-        kq->kq_nfds = fd + 1;
     /*
-     * Wake parked pselects so they reload their fd_set snapshot.
+     * Wake parked polls so they reload their poll set snapshot.
      * Mirrors evfilt_read's posix_read_arm; a cross-thread EV_ADD
      * on an already-writable fd otherwise sits unnoticed until
      * the parked caller's timeout.
@@ -61,9 +55,7 @@ posix_write_disarm(struct filter *filt, struct knote *kn)
     int fd = (int)kn->kev.ident;
     struct kqueue *kq = filt->kf_kqueue;
 
-    if (fd < 0 || fd >= FD_SETSIZE)
-        return;
-    FD_CLR(fd, &kq->kq_wfds);
+    posix_fd_unwatch(kq, fd, POLLOUT);
 }
 
 /*
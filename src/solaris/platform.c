@@ -109,7 +109,7 @@ solaris_kqueue_init(struct kqueue *kq)
     TAILQ_INIT(&kq->kq_inflight);
     TAILQ_INIT(&kq->ud_deferred_free);
 
-    if (filter_register_all(kq) < 0) {
+    if (filter_register_eager(kq) < 0) {
         close(kq->kq_id);
         return (-1);
     }
@@ -336,6 +336,7 @@ solaris_kevent_wait(
         dbg_printf("waiting for events (timeout %ld.%09lds)",
                    (long) ts->tv_sec, (long) ts->tv_nsec);
     rv = port_getn(kq->kq_id, evbuf, max, &nget, (struct timespec *) ts);
+    kqueue_stat_inc(kq, kqs_syscalls);
 
     dbg_printf("rv=%d errno=%d (%s) nget=%d", rv, errno, strerror(errno), nget);
 
@@ -592,6 +593,8 @@ solaris_kevent_copyout(struct kqueue *kq, int nready,
             dbg_puts("kevent_copyout failed");
             return (-1);
         }
+        if (rv > 0 && !skip_event)
+            filter_stat_add(filt, kfs_events, rv);
 
         /*
          * Apply EV_DISPATCH/EV_ONESHOT for filters whose copyout
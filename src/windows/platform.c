@@ -234,7 +234,7 @@ windows_kqueue_init(struct kqueue *kq)
     }
     pipe_read = NULL; /* now owned by kq_close_read + IOCP */
 
-    if (filter_register_all(kq) < 0)
+    if (filter_register_eager(kq) < 0)
         goto err;
 
     return (0);
@@ -440,6 +440,7 @@ windows_kevent_wait(struct kqueue *kq, int no, const struct timespec *timeout)
     success = GetQueuedCompletionStatus(kq->kq_iocp,
             &iocp_buf.bytes, &iocp_buf.key, &iocp_buf.overlap,
             timeout_ms);
+    kqueue_stat_inc(kq, kqs_syscalls);
     /*
      * Re-check kq_consumer_closed / kq_freeing after the wait
      * returns.  Either another thread already ran the close-
@@ -655,6 +656,7 @@ windows_kevent_copyout(struct kqueue *kq, int nready,
             abort();
         }
         if (rv > 0 && eventlist->filter != 0) {
+            filter_stat_add(filt, kfs_events, rv);
             eventlist += rv;
             nevents -= rv;
             produced += rv;
@@ -750,7 +752,7 @@ windows_libkqueue_init(void)
      * CRITICAL_SECTION needs a runtime InitializeCriticalSection,
      * which tracing_mutex_init wraps.
      */
-    tracing_mutex_init(&kq_mtx, NULL);
+    tracing_mutex_init_class(&kq_mtx, NULL, LOCKSTAT_GLOBAL);
 
     /*
      * Winsock startup must succeed for any socket-shaped filter
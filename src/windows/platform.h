@@ -356,6 +356,7 @@ typedef CRITICAL_SECTION           pthread_rwlock_t;
 #define EnterCriticalSection(x)    EnterCriticalSection ((x))
 #define pthread_mutex_lock         EnterCriticalSection
 #define pthread_mutex_unlock       LeaveCriticalSection
+#define pthread_mutex_trylock(x)   (TryEnterCriticalSection((x)) ? 0 : EBUSY)
 #define pthread_mutex_init(x,y)    InitializeCriticalSection((x))
 #define pthread_spin_lock          EnterCriticalSection
 #define pthread_spin_unlock        LeaveCriticalSection
@@ -0,0 +1,333 @@
+/*
+ * Copyright (c) 2026 Arran Cudbard-Bell <a.cudbardb@freeradius.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "common.h"
+
+/*
+ * libkqueue's EVFILT_AIO starts the request with EV_ADD, ident
+ * pointing to the aiocb, rather than with aio_read/aio_write and
+ * SIGEV_KEVENT as on BSD.  So these only run against libkqueue.
+ */
+#if defined(EVFILT_AIO) && defined(LIBKQUEUE_BACKEND_LINUX)
+#include <aio.h>
+
+/** Start an aio request
+ *
+ * @return
+ *      - 0 on success.
+ *      - -1 if EVFILT_AIO isn't usable on this kernel (io_uring
+ *        too old or disabled), the test should be skipped.
+ */
+static int
+aio_start(int kqfd, struct kevent *kev, struct aiocb *cb, int opcode, int fd,
+          void *buf, size_t len, off_t offset)
+{
+    memset(cb, 0, sizeof(*cb));
+    cb->aio_lio_opcode = opcode;
+    cb->aio_fildes = fd;
+    cb->aio_buf = buf;
+    cb->aio_nbytes = len;
+    cb->aio_offset = offset;
+
+    EV_SET(kev, (uintptr_t)cb, EVFILT_AIO, EV_ADD, 0, 0, cb);
+    if (kevent(kqfd, kev, 1, NULL, 0, NULL) < 0) {
+        if (errno == ENOTSUP) {
+            printf("io_uring not usable, skipping\n");
+            return (-1);
+        }
+        die("kevent");
+    }
+    kev->flags |= EV_ONESHOT;
+
+    return (0);
+}
+
+/** Collect exactly n completions, in any order
+ */
+static void
+aio_wait(int kqfd, struct kevent ret[], int n)
+{
+    int got = 0, rv;
+
+    while (got < n) {
+        rv = kevent(kqfd, NULL, 0, &ret[got], n - got, NULL);
+        if (rv < 0)
+            die("kevent");
+        got += rv;
+    }
+}
+
+static void
+test_kevent_aio_pipe_read(struct test_context *ctx)
+{
+    struct aiocb cb;
+    struct kevent kev, ret;
+    char buf[16] = { 0 };
+    int fd[2];
+
+    if (pipe(fd) < 0)
+        die("pipe");
+
+    if (aio_start(ctx->kqfd, &kev, &cb, LIO_READ, fd[0], buf, sizeof(buf), 0) < 0)
+        goto done;
+
+    /* Nothing to read yet */
+    test_no_kevents(ctx->kqfd);
+
+    if (write(fd[1], "hello", 5) != 5)
+        die("write");
+
+    kevent_get(&ret, 1, ctx->kqfd, 1);
+    kev.data = 5;
+    kevent_cmp(&kev, &ret);
+    if (memcmp(buf, "hello", 5) != 0)
+        die("read the wrong data: %s", buf);
+
+    /* The knote is gone after the completion */
+    test_no_kevents(ctx->kqfd);
+    EV_SET(&kev, (uintptr_t)&cb, EVFILT_AIO, EV_DELETE, 0, 0, NULL);
+    if ((kevent(ctx->kqfd, &kev, 1, NULL, 0, NULL) == 0) || (errno != ENOENT))
+        die("completed request still registered");
+
+done:
+    close(fd[0]);
+    close(fd[1]);
+}
+
+static void
+test_kevent_aio_file_batch(struct test_context *ctx)
+{
+    char path[1024];
+    struct aiocb cb[4];
+    struct kevent kev[4], ret[4];
+    char out[2][8] = { "aaaaaaa", "bbbbbbb" }, in[2][8];
+    int fd, i, j;
+
+    snprintf(path, sizeof(path), "%s/kqueue-test-aio.XXXXXX", test_tmpdir());
+    fd = mkstemp(path);
+    if (fd < 0)
+        die("mkstemp");
+    unlink(path);
+
+    /* Two writes, submitted by the same kevent call */
+    for (i = 0; i < 2; i++) {
+        memset(&cb[i], 0, sizeof(cb[i]));
+        cb[i].aio_lio_opcode = LIO_WRITE;
+        cb[i].aio_fildes = fd;
+        cb[i].aio_buf = out[i];
+        cb[i].aio_nbytes = sizeof(out[i]);
+        cb[i].aio_offset = i * sizeof(out[i]);
+        EV_SET(&kev[i], (uintptr_t)&cb[i], EVFILT_AIO, EV_ADD, 0, 0, &cb[i]);
+    }
+    if (kevent(ctx->kqfd, kev, 2, NULL, 0, NULL) < 0) {
+        if (errno == ENOTSUP) {
+            printf("io_uring not usable, skipping\n");
+            goto done;
+        }
+        die("kevent");
+    }
+
+    aio_wait(ctx->kqfd, ret, 2);
+    for (i = 0; i < 2; i++) {
+        struct aiocb *cbp = ret[i].udata;
+
+        if ((ret[i].filter != EVFILT_AIO) || (ret[i].ident != (uintptr_t)cbp) ||
+            (ret[i].data != sizeof(out[0])) || (ret[i].flags & EV_EOF))
+            die("bad write completion: %s", kevent_to_str(&ret[i]));
+    }
+
+    /* And read them back */
+    for (i = 0; i < 2; i++) {
+        if (aio_start(ctx->kqfd, &kev[i], &cb[2 + i], LIO_READ, fd,
+                      in[i], sizeof(in[i]), i * sizeof(in[i])) < 0)
+            die("aio_start");
+    }
+    aio_wait(ctx->kqfd, ret, 2);
+    for (i = 0; i < 2; i++) {
+        for (j = 0; j < 2; j++) {
+            if (ret[i].ident != kev[j].ident)
+                continue;
+            kev[j].data = sizeof(in[j]);
+            kevent_cmp(&kev[j], &ret[i]);
+        }
+    }
+    if ((memcmp(in[0], out[0], sizeof(in[0])) != 0) || (memcmp(in[1], out[1], sizeof(in[1])) != 0))
+        die("read back the wrong data");
+
+    test_no_kevents(ctx->kqfd);
+
+done:
+    close(fd);
+}
+
+static void
+test_kevent_aio_error(struct test_context *ctx)
+{
+    struct aiocb cb;
+    struct kevent kev, ret;
+    char buf[8];
+    int fd[2];
+
+    if (pipe(fd) < 0)
+        die("pipe");
+    close(fd[1]);
+    close(fd[0]);
+
+    /* Failed requests complete with EV_EOF and the errno in fflags */
+    if (aio_start(ctx->kqfd, &kev, &cb, LIO_READ, fd[0], buf, sizeof(buf), 0) < 0)
+        return;
+    kevent_get(&ret, 1, ctx->kqfd, 1);
+    kev.flags |= EV_EOF;
+    kev.fflags = EBADF;
+    kevent_cmp(&kev, &ret);
+
+    /* Only reads and writes are supported */
+    cb.aio_lio_opcode = LIO_NOP;
+    EV_SET(&kev, (uintptr_t)&cb, EVFILT_AIO, EV_ADD, 0, 0, NULL);
+    if ((kevent(ctx->kqfd, &kev, 1, NULL, 0, NULL) == 0) || (errno != EINVAL))
+        die("LIO_NOP accepted");
+
+    test_no_kevents(ctx->kqfd);
+}
+
+static void
+test_kevent_aio_delete_cancels(struct test_context *ctx)
+{
+    struct aiocb cb;
+    struct kevent kev;
+    char buf[16];
+    int fd[2];
+
+    if (pipe(fd) < 0)
+        die("pipe");
+
+    if (aio_start(ctx->kqfd, &kev, &cb, LIO_READ, fd[0], buf, sizeof(buf), 0) < 0)
+        goto done;
+
+    kev.flags = EV_DELETE;
+    kevent_update(ctx->kqfd, &kev);
+
+    /* The read was cancelled, so the data stays in the pipe */
+    if (write(fd[1], "hello", 5) != 5)
+        die("write");
+    test_no_kevents(ctx->kqfd);
+    if (read(fd[0], buf, sizeof(buf)) != 5)
+        die("cancelled read consumed the data");
+
+done:
+    close(fd[0]);
+    close(fd[1]);
+}
+
+#define AIO_TEST_LIMIT 256
+
+static void
+test_kevent_aio_limit(struct test_context *ctx)
+{
+    struct aiocb *cb;
+    struct kevent kev, *kevs, ret;
+    char buf[8];
+    int fd[2], i, rv = -1;
+
+    if (pipe(fd) < 0)
+        die("pipe");
+    cb = calloc(AIO_TEST_LIMIT + 1, sizeof(*cb));
+    kevs = calloc(AIO_TEST_LIMIT, sizeof(*kevs));
+    if (!cb || !kevs)
+        die("calloc");
+
+    /* Reads from an empty pipe stay in flight */
+    for (i = 0; i < AIO_TEST_LIMIT; i++) {
+        if (aio_start(ctx->kqfd, &kevs[i], &cb[i], LIO_READ, fd[0], buf, sizeof(buf), 0) < 0)
+            goto done;
+    }
+    memset(&cb[AIO_TEST_LIMIT], 0, sizeof(cb[AIO_TEST_LIMIT]));
+    cb[AIO_TEST_LIMIT].aio_lio_opcode = LIO_READ;
+    cb[AIO_TEST_LIMIT].aio_fildes = fd[0];
+    cb[AIO_TEST_LIMIT].aio_buf = buf;
+    cb[AIO_TEST_LIMIT].aio_nbytes = sizeof(buf);
+    EV_SET(&kev, (uintptr_t)&cb[AIO_TEST_LIMIT], EVFILT_AIO, EV_ADD, 0, 0, NULL);
+    if ((kevent(ctx->kqfd, &kev, 1, NULL, 0, NULL) == 0) || (errno != EAGAIN))
+        die("request over the limit accepted");
+
+    /* Cancel them all, the slots come back once the cancels are done */
+    for (i = 0; i < AIO_TEST_LIMIT; i++)
+        kevs[i].flags = EV_DELETE;
+    if (kevent(ctx->kqfd, kevs, AIO_TEST_LIMIT, NULL, 0, NULL) < 0)
+        die("kevent");
+
+    for (i = 0; i < 100; i++) {
+        if (kevent(ctx->kqfd, NULL, 0, &ret, 1, &(struct timespec){ .tv_nsec = 10000000 }) != 0)
+            die("cancelled request returned an event: %s", kevent_to_str(&ret));
+        rv = kevent(ctx->kqfd, &kev, 1, NULL, 0, NULL);
+        if (rv == 0)
+            break;
+        if (errno != EAGAIN)
+            die("kevent");
+    }
+    if (rv != 0)
+        die("slots weren't released by the cancels");
+
+    /* Reap the last cancel, so it doesn't wake the next test */
+    kev.flags = EV_DELETE;
+    kevent_update(ctx->kqfd, &kev);
+    if (kevent(ctx->kqfd, NULL, 0, &ret, 1, &(struct timespec){ .tv_nsec = 100000000 }) != 0)
+        die("cancelled request returned an event: %s", kevent_to_str(&ret));
+
+done:
+    close(fd[0]);
+    close(fd[1]);
+    free(kevs);
+    free(cb);
+}
+#endif /* EVFILT_AIO && LIBKQUEUE_BACKEND_LINUX */
+
+const struct lkq_test_case lkq_aio_tests[] = {
+#if defined(EVFILT_AIO) && defined(LIBKQUEUE_BACKEND_LINUX)
+    {
+        .name  = "test_kevent_aio_pipe_read",
+        .desc  = "EVFILT_AIO read from a pipe completes once data arrives",
+        .func  = test_kevent_aio_pipe_read,
+    },
+    {
+        .name  = "test_kevent_aio_file_batch",
+        .desc  = "EVFILT_AIO writes submitted together complete, and read back",
+        .func  = test_kevent_aio_file_batch,
+    },
+    {
+        .name  = "test_kevent_aio_error",
+        .desc  = "EVFILT_AIO failures set EV_EOF and the errno, bad opcodes fail with EINVAL",
+        .func  = test_kevent_aio_error,
+    },
+    {
+        .name  = "test_kevent_aio_delete_cancels",
+        .desc  = "EV_DELETE cancels an EVFILT_AIO request which hasn't completed",
+        .func  = test_kevent_aio_delete_cancels,
+    },
+    {
+        .name  = "test_kevent_aio_limit",
+        .desc  = "EVFILT_AIO requests over the limit fail with EAGAIN, cancelled requests release their slots",
+        .func  = test_kevent_aio_limit,
+    },
+#endif
+    LKQ_SUITE_END
+};
+
+void
+test_evfilt_aio(struct test_context *ctx)
+{
+    run_test_suite(ctx, lkq_aio_tests);
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2026 Arran Cudbard-Bell <a.cudbardb@freeradius.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _BENCH_H
+#define _BENCH_H
+
+#include <err.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/event.h>
+#include <time.h>
+#include <unistd.h>
+
+/** Runtime configuration, set from the command line
+ */
+struct bench_config {
+    unsigned int        iterations;     //!< Samples to take per measurement.
+    unsigned int        max_timers;     //!< Upper bound for the timer scaling runs.
+    unsigned int        max_connections;//!< Upper bound for the echo runs.
+    unsigned int        active_pct;     //!< Percentage of echo connections carrying traffic.
+    unsigned int        threads;        //!< Echo client threads.
+};
+
+/** A set of latency samples for a single measurement
+ */
+struct bench_samples {
+    uint64_t            *ns;            //!< Per-sample latency.
+    size_t              count;          //!< Samples recorded.
+    size_t              size;           //!< Samples allocated.
+    uint64_t            ops;            //!< Operations covered by all samples.
+    uint64_t            total_ns;       //!< Sum of all sample durations.
+};
+
+/** A named benchmark
+ */
+struct bench_case {
+    char const          *name;          //!< Used to select the bench on the command line.
+    char const          *desc;          //!< Shown by -l.
+    void                (*func)(struct bench_config const *cfg);
+};
+
+#define BENCH_SUITE_END { .name = NULL }
+
+uint64_t bench_now(void);
+void     bench_samples_init(struct bench_samples *s, size_t size);
+void     bench_samples_free(struct bench_samples *s);
+void     bench_sample(struct bench_samples *s, uint64_t ns, uint64_t ops);
+void     bench_report(char const *bench, char const *param, struct bench_samples *s);
+void     bench_skip(char const *bench, char const *param, char const *reason);
+void     bench_report_value(char const *bench, char const *param, char const *unit, double value);
+void     bench_raise_fd_limit(void);
+
+extern const struct bench_case bench_kevent_cases[];
+extern const struct bench_case bench_echo_cases[];
+
+#endif  /* _BENCH_H */
@@ -0,0 +1,499 @@
+/*
+ * Copyright (c) 2026 Arran Cudbard-Bell <a.cudbardb@freeradius.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Loopback echo/RPC benchmark.
+ *
+ * A single server thread runs an event loop over a listener and
+ * every accepted connection, echoing whatever it reads.  Client
+ * threads issue fixed-size requests over blocking sockets and
+ * time each round trip.  Only a configurable fraction of the
+ * connections carry traffic, the rest sit idle in the server's
+ * interest set, which is where per-event overhead in the event
+ * loop shows up.
+ *
+ * Built with BENCH_RAW_EPOLL the server loop uses epoll(7)
+ * directly instead of kevent(), giving a baseline to measure
+ * libkqueue's overhead against on the same box.
+ */
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#ifdef BENCH_RAW_EPOLL
+#  include <sys/epoll.h>
+#  define ECHO_BENCH_NAME "echo_epoll"
+#else
+#  define ECHO_BENCH_NAME "echo"
+#endif
+
+#include "bench.h"
+
+/** Request/response size in bytes
+ */
+#define ECHO_MSG_SIZE   64
+
+/** Events fetched per wait by the server loop
+ */
+#define ECHO_MAX_EVENTS 64
+
+struct echo_server {
+    int                 loop;           //!< kqueue or epoll fd.
+    int                 listener;
+    int                 stop[2];        //!< Pipe, written to stop the server.
+    atomic_uint         accepted;       //!< Connections accepted so far.
+    atomic_uint         rejected;       //!< Connections the event loop wouldn't take.
+    atomic_int          reject_errno;   //!< Why the last one was rejected.
+    int                 *conns;         //!< Accepted connections, closed when the server stops.
+    unsigned int        nconns;
+    uint64_t            events;         //!< Events processed by the loop.
+    uint64_t            waits;          //!< Wait calls made by the loop.
+};
+
+struct echo_client {
+    int                 *fds;           //!< All client connections.
+    unsigned int        nfds;           //!< Active connections in fds.
+    unsigned int        stride;         //!< This thread handles fds[first + stride * n].
+    unsigned int        first;
+    unsigned int        requests;       //!< Requests to issue.
+    uint64_t            *ns;            //!< Where to write per-request latencies.
+    uint64_t            total_ns;
+};
+
+#ifdef BENCH_RAW_EPOLL
+static int
+loop_create(void)
+{
+    return epoll_create1(EPOLL_CLOEXEC);
+}
+
+static int
+loop_add(int loop, int fd)
+{
+    struct epoll_event ev = { .events = EPOLLIN, .data.fd = fd };
+
+    return epoll_ctl(loop, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static int
+loop_wait(int loop, int *fds, int nfds)
+{
+    struct epoll_event ev[ECHO_MAX_EVENTS];
+    int rv, i;
+
+    rv = epoll_wait(loop, ev, nfds, -1);
+    for (i = 0; i < rv; i++)
+        fds[i] = ev[i].data.fd;
+
+    return rv;
+}
+#else
+static int
+loop_create(void)
+{
+    return kqueue();
+}
+
+static int
+loop_add(int loop, int fd)
+{
+    struct kevent kev;
+
+    EV_SET(&kev, fd, EVFILT_READ, EV_ADD, 0, 0, NULL);
+    return kevent(loop, &kev, 1, NULL, 0, NULL);
+}
+
+static int
+loop_wait(int loop, int *fds, int nfds)
+{
+    struct kevent kev[ECHO_MAX_EVENTS];
+    int rv, i;
+
+    rv = kevent(loop, NULL, 0, kev, nfds, NULL);
+    for (i = 0; i < rv; i++)
+        fds[i] = (int)kev[i].ident;
+
+    return rv;
+}
+#endif
+
+static void
+echo_nodelay(int fd, int domain)
+{
+    int one = 1;
+
+    if (domain == AF_INET)
+        (void) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+static void
+echo_accept_all(struct echo_server *srv, int domain)
+{
+    for (;;) {
+        int fd = accept(srv->listener, NULL, NULL);
+
+        if (fd < 0) {
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == ECONNABORTED))
+                return;
+            err(EXIT_FAILURE, "accept");
+        }
+        echo_nodelay(fd, domain);
+
+        /*
+         * The event loop may refuse the fd (e.g. out of memory
+         * growing its tables), report it rather than die.
+         */
+        if (loop_add(srv->loop, fd) < 0) {
+            atomic_store(&srv->reject_errno, errno);
+            atomic_fetch_add(&srv->rejected, 1);
+            close(fd);
+            continue;
+        }
+        srv->conns[srv->nconns++] = fd;
+        atomic_fetch_add(&srv->accepted, 1);
+    }
+}
+
+struct echo_server_args {
+    struct echo_server  *srv;
+    int                 domain;
+};
+
+static void *
+echo_server_run(void *arg)
+{
+    struct echo_server_args *sa = arg;
+    struct echo_server *srv = sa->srv;
+    int ready[ECHO_MAX_EVENTS];
+
+    for (;;) {
+        int rv, i;
+
+        rv = loop_wait(srv->loop, ready, ECHO_MAX_EVENTS);
+        if (rv < 0) {
+            if (errno == EINTR)
+                continue;
+            err(EXIT_FAILURE, "loop_wait");
+        }
+        srv->waits++;
+        srv->events += (uint64_t)rv;
+
+        for (i = 0; i < rv; i++) {
+            char buf[ECHO_MSG_SIZE * 4];
+            ssize_t len, off;
+
+            if (ready[i] == srv->stop[0]) {
+                while (srv->nconns > 0)
+                    close(srv->conns[--srv->nconns]);
+                return NULL;
+            }
+
+            if (ready[i] == srv->listener) {
+                echo_accept_all(srv, sa->domain);
+                continue;
+            }
+
+            /*
+             * Clients only hang up at teardown, after the
+             * server has been stopped, so any EOF or error
+             * here is fatal.
+             */
+            len = read(ready[i], buf, sizeof(buf));
+            if (len <= 0)
+                err(EXIT_FAILURE, "read (request)");
+            for (off = 0; off < len; ) {
+                ssize_t w = write(ready[i], buf + off, (size_t)(len - off));
+
+                if (w < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    break;
+                }
+                off += w;
+            }
+        }
+    }
+}
+
+static void *
+echo_client_run(void *arg)
+{
+    struct echo_client *cl = arg;
+    char msg[ECHO_MSG_SIZE], reply[ECHO_MSG_SIZE];
+    unsigned int i, n = 0;
+
+    memset(msg, 'k', sizeof(msg));
+
+    for (i = 0; i < cl->requests; i++) {
+        unsigned int idx = cl->first + cl->stride * n;
+        uint64_t t0;
+        size_t got = 0;
+        int fd;
+
+        if (idx >= cl->nfds) {
+            n = 0;
+            idx = cl->first;
+        }
+        n++;
+        fd = cl->fds[idx];
+
+        t0 = bench_now();
+        if (write(fd, msg, sizeof(msg)) != (ssize_t)sizeof(msg))
+            err(EXIT_FAILURE, "write (request)");
+        while (got < sizeof(reply)) {
+            ssize_t r = read(fd, reply + got, sizeof(reply) - got);
+
+            if (r <= 0)
+                err(EXIT_FAILURE, "read (response)");
+            got += (size_t)r;
+        }
+        cl->ns[i] = bench_now() - t0;
+        cl->total_ns += cl->ns[i];
+    }
+
+    return NULL;
+}
+
+/** Create a listening socket for the given domain
+ *
+ * @param[in] domain    AF_INET or AF_UNIX.
+ * @param[out] addr     filled with the address to connect to.
+ * @param[out] addrlen  length of addr.
+ */
+static int
+echo_listen(int domain, struct sockaddr_storage *addr, socklen_t *addrlen)
+{
+    int fd = socket(domain, SOCK_STREAM, 0);
+    int one = 1;
+
+    if (fd < 0)
+        err(EXIT_FAILURE, "socket");
+
+    memset(addr, 0, sizeof(*addr));
+    if (domain == AF_INET) {
+        struct sockaddr_in *sin = (struct sockaddr_in *)addr;
+
+        (void) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        sin->sin_family = AF_INET;
+        sin->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        *addrlen = sizeof(*sin);
+    } else {
+        struct sockaddr_un *sun = (struct sockaddr_un *)addr;
+        char const *tmp = getenv("TMPDIR");
+
+        sun->sun_family = AF_UNIX;
+        snprintf(sun->sun_path, sizeof(sun->sun_path), "%s/libkqueue-bench.%ld.sock",
+                 tmp ? tmp : "/tmp", (long)getpid());
+        unlink(sun->sun_path);
+        *addrlen = sizeof(*sun);
+    }
+
+    if (bind(fd, (struct sockaddr *)addr, *addrlen) < 0)
+        err(EXIT_FAILURE, "bind");
+    if (listen(fd, SOMAXCONN) < 0)
+        err(EXIT_FAILURE, "listen");
+    if (getsockname(fd, (struct sockaddr *)addr, addrlen) < 0)
+        err(EXIT_FAILURE, "getsockname");
+    if (fcntl(fd, F_SETFL, O_NONBLOCK) < 0)
+        err(EXIT_FAILURE, "fcntl");
+
+    return fd;
+}
+
+/** Run one echo measurement
+ *
+ * @return false if the connections couldn't be established (skip reported).
+ */
+static bool
+echo_run(struct bench_config const *cfg, int domain, unsigned int nconn)
+{
+    struct echo_server srv = { 0 };
+    struct echo_server_args sa = { .srv = &srv, .domain = domain };
+    struct sockaddr_storage addr;
+    struct rlimit rl;
+    socklen_t addrlen;
+    struct echo_client *clients;
+    struct bench_samples s;
+    pthread_t server, *threads;
+    unsigned int nactive, nthreads, i, conn;
+    char param[64], reason[96];
+    char const *dname = domain == AF_INET ? "tcp" : "unix";
+    int *fds;
+    bool ok = true;
+
+    nactive = (unsigned int)(((uint64_t)nconn * cfg->active_pct) / 100);
+    if (nactive == 0)
+        nactive = 1;
+    nthreads = cfg->threads < nactive ? cfg->threads : nactive;
+
+    snprintf(param, sizeof(param), "%s/%u/%u%%", dname, nconn, cfg->active_pct);
+
+    /*
+     * Both ends of every connection live in this process.
+     * Check up front, running out of descriptors half way
+     * through leaves blocking connects hanging.
+     */
+    if ((getrlimit(RLIMIT_NOFILE, &rl) == 0) && (rl.rlim_cur != RLIM_INFINITY) &&
+        (rl.rlim_cur < (rlim_t)nconn * 2 + 32)) {
+        snprintf(reason, sizeof(reason), "needs %u descriptors, limit is %llu",
+                 nconn * 2 + 32, (unsigned long long)rl.rlim_cur);
+        bench_skip(ECHO_BENCH_NAME, param, reason);
+        return false;
+    }
+
+    srv.loop = loop_create();
+    if (srv.loop < 0)
+        err(EXIT_FAILURE, "loop_create");
+    if (pipe(srv.stop) < 0)
+        err(EXIT_FAILURE, "pipe");
+    srv.listener = echo_listen(domain, &addr, &addrlen);
+    if ((loop_add(srv.loop, srv.listener) < 0) || (loop_add(srv.loop, srv.stop[0]) < 0))
+        err(EXIT_FAILURE, "loop_add");
+
+    srv.conns = calloc(nconn, sizeof(*srv.conns));
+    if (srv.conns == NULL)
+        err(EXIT_FAILURE, "calloc");
+
+    if (pthread_create(&server, NULL, echo_server_run, &sa) != 0)
+        errx(EXIT_FAILURE, "pthread_create");
+
+    fds = calloc(nconn, sizeof(*fds));
+    if (fds == NULL)
+        err(EXIT_FAILURE, "calloc");
+
+    for (conn = 0; conn < nconn; conn++) {
+        int fd = socket(domain, SOCK_STREAM, 0);
+
+        if ((fd < 0) || (connect(fd, (struct sockaddr *)&addr, addrlen) < 0)) {
+            snprintf(reason, sizeof(reason), "failed after %u connections: %s", conn, strerror(errno));
+            if (fd >= 0)
+                close(fd);
+            ok = false;
+            break;
+        }
+        echo_nodelay(fd, domain);
+        fds[conn] = fd;
+    }
+
+    /*
+     * Wait for the server to catch up with the connects so
+     * every connection is in the interest set before timing.
+     */
+    while (ok && ((atomic_load(&srv.accepted) + atomic_load(&srv.rejected)) < nconn))
+        usleep(1000);
+    if (ok && (atomic_load(&srv.rejected) > 0)) {
+        snprintf(reason, sizeof(reason), "event loop rejected %u connections: %s",
+                 atomic_load(&srv.rejected), strerror(atomic_load(&srv.reject_errno)));
+        ok = false;
+    }
+
+    if (ok) {
+        clients = calloc(nthreads, sizeof(*clients));
+        threads = calloc(nthreads, sizeof(*threads));
+        if ((clients == NULL) || (threads == NULL))
+            err(EXIT_FAILURE, "calloc");
+
+        bench_samples_init(&s, (size_t)cfg->iterations);
+        for (i = 0; i < nthreads; i++) {
+            clients[i].fds = fds;
+            clients[i].nfds = nactive;
+            clients[i].first = i;
+            clients[i].stride = nthreads;
+            clients[i].requests = cfg->iterations / nthreads +
+                                  (i < cfg->iterations % nthreads ? 1 : 0);
+            clients[i].ns = s.ns + s.count;
+            s.count += clients[i].requests;
+            if (pthread_create(&threads[i], NULL, echo_client_run, &clients[i]) != 0)
+                errx(EXIT_FAILURE, "pthread_create");
+        }
+        for (i = 0; i < nthreads; i++) {
+            pthread_join(threads[i], NULL);
+            s.ops += clients[i].requests;
+            s.total_ns += clients[i].total_ns;
+        }
+
+        /*
+         * Client threads run concurrently, so normalise the
+         * summed latency to get aggregate requests/s.
+         */
+        s.total_ns /= nthreads;
+        bench_report(ECHO_BENCH_NAME, param, &s);
+        bench_samples_free(&s);
+        free(clients);
+        free(threads);
+    } else {
+        bench_skip(ECHO_BENCH_NAME, param, reason);
+    }
+
+    if (write(srv.stop[1], "x", 1) != 1)
+        err(EXIT_FAILURE, "write (stop)");
+    pthread_join(server, NULL);
+
+    while (conn-- > 0)
+        close(fds[conn]);
+    free(fds);
+    close(srv.listener);
+    close(srv.stop[0]);
+    close(srv.stop[1]);
+    close(srv.loop);
+    free(srv.conns);
+    if (domain == AF_UNIX)
+        unlink(((struct sockaddr_un *)&addr)->sun_path);
+
+    return ok;
+}
+
+static void
+bench_echo(struct bench_config const *cfg, int domain)
+{
+    unsigned int n;
+
+    for (n = 1000; n <= cfg->max_connections; n *= 10) {
+        if (!echo_run(cfg, domain, n))
+            break;
+    }
+}
+
+static void
+bench_echo_tcp(struct bench_config const *cfg)
+{
+    bench_echo(cfg, AF_INET);
+}
+
+static void
+bench_echo_unix(struct bench_config const *cfg)
+{
+    bench_echo(cfg, AF_UNIX);
+}
+
+const struct bench_case bench_echo_cases[] = {
+    {
+        .name = ECHO_BENCH_NAME "_tcp",
+        .desc = "Loopback TCP echo round trips, 1k..max connections",
+        .func = bench_echo_tcp,
+    },
+    {
+        .name = ECHO_BENCH_NAME "_unix",
+        .desc = "Unix socket echo round trips, 1k..max connections",
+        .func = bench_echo_unix,
+    },
+    BENCH_SUITE_END
+};
@@ -0,0 +1,520 @@
+/*
+ * Copyright (c) 2026 Arran Cudbard-Bell <a.cudbardb@freeradius.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#ifdef __GLIBC__
+#  include <malloc.h>
+#  if __GLIBC_PREREQ(2, 33)
+#    define HAVE_MALLINFO2 1
+#  endif
+#endif
+
+#include "bench.h"
+
+/** Number of distinct idents cycled through by the changelist bench
+ */
+#define CHANGELIST_IDENTS   256
+
+/** Timers are armed far enough out they never fire during a run
+ */
+#define TIMER_PERIOD_MS     (3600 * 1000)
+
+static const struct timespec zero_ts = { 0, 0 };
+
+static int
+bench_kqueue(void)
+{
+    int kqfd = kqueue();
+
+    if (kqfd < 0)
+        err(EXIT_FAILURE, "kqueue");
+
+    return kqfd;
+}
+
+static void
+bench_kevent_change(int kqfd, struct kevent *kev)
+{
+    if (kevent(kqfd, kev, 1, NULL, 0, NULL) < 0)
+        err(EXIT_FAILURE, "kevent (filter %d ident %lu flags 0x%04x)",
+            kev->filter, (unsigned long)kev->ident, kev->flags);
+}
+
+/** Fill in the ident set for a filter
+ *
+ * fd based filters get dups of one end of a socketpair so every
+ * knote has a distinct ident but we only burn one socket.
+ */
+static void
+changelist_idents(uintptr_t *idents, size_t n, short filter, int *sv)
+{
+    size_t i;
+
+    if ((filter != EVFILT_READ) && (filter != EVFILT_WRITE)) {
+        for (i = 0; i < n; i++)
+            idents[i] = i + 1;
+        return;
+    }
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+        err(EXIT_FAILURE, "socketpair");
+
+    for (i = 0; i < n; i++) {
+        int fd = dup(sv[0]);
+
+        if (fd < 0)
+            err(EXIT_FAILURE, "dup");
+        idents[i] = (uintptr_t)fd;
+    }
+}
+
+static void
+changelist_idents_free(uintptr_t *idents, size_t n, short filter, int *sv)
+{
+    size_t i;
+
+    if ((filter != EVFILT_READ) && (filter != EVFILT_WRITE))
+        return;
+
+    for (i = 0; i < n; i++)
+        close((int)idents[i]);
+    close(sv[0]);
+    close(sv[1]);
+}
+
+/** ADD/DISABLE/ENABLE/DELETE cost per filter, one change per call and batched
+ */
+static void
+bench_changelist(struct bench_config const *cfg)
+{
+    static const struct {
+        short       filter;
+        char const  *name;
+    } filters[] = {
+        { EVFILT_USER,  "EVFILT_USER" },
+        { EVFILT_TIMER, "EVFILT_TIMER" },
+        { EVFILT_READ,  "EVFILT_READ" },
+        { EVFILT_WRITE, "EVFILT_WRITE" },
+    };
+    static const struct {
+        unsigned short  flags;
+        char const      *name;
+    } ops[] = {
+        { EV_ADD,       "ADD" },
+        { EV_DISABLE,   "DISABLE" },
+        { EV_ENABLE,    "ENABLE" },
+        { EV_DELETE,    "DELETE" },
+    };
+    struct bench_samples single[4], batch[4];
+    struct kevent changes[CHANGELIST_IDENTS];
+    uintptr_t idents[CHANGELIST_IDENTS];
+    unsigned int rounds = (cfg->iterations + CHANGELIST_IDENTS - 1) / CHANGELIST_IDENTS;
+    char param[64];
+    size_t f, o, i;
+    unsigned int r;
+
+    for (f = 0; f < sizeof(filters) / sizeof(filters[0]); f++) {
+        short filter = filters[f].filter;
+        int kqfd = bench_kqueue();
+        int sv[2];
+
+        changelist_idents(idents, CHANGELIST_IDENTS, filter, sv);
+        for (o = 0; o < 4; o++) {
+            bench_samples_init(&single[o], (size_t)rounds * CHANGELIST_IDENTS);
+            bench_samples_init(&batch[o], rounds);
+        }
+
+        for (r = 0; r < rounds; r++) {
+            for (o = 0; o < 4; o++) {
+                uint64_t t0;
+
+                for (i = 0; i < CHANGELIST_IDENTS; i++) {
+                    struct kevent kev;
+
+                    EV_SET(&kev, idents[i], filter, ops[o].flags, 0,
+                           filter == EVFILT_TIMER ? TIMER_PERIOD_MS : 0, NULL);
+                    t0 = bench_now();
+                    bench_kevent_change(kqfd, &kev);
+                    bench_sample(&single[o], bench_now() - t0, 1);
+                }
+
+                /*
+                 * Undo the op unbatched so the batched run
+                 * sees the same starting state.
+                 */
+                for (i = 0; i < CHANGELIST_IDENTS; i++) {
+                    struct kevent kev;
+                    unsigned short undo = ops[o].flags == EV_ADD ? EV_DELETE :
+                                          ops[o].flags == EV_DELETE ? EV_ADD :
+                                          ops[o].flags == EV_DISABLE ? EV_ENABLE : EV_DISABLE;
+
+                    EV_SET(&kev, idents[i], filter, undo, 0,
+                           filter == EVFILT_TIMER ? TIMER_PERIOD_MS : 0, NULL);
+                    bench_kevent_change(kqfd, &kev);
+                }
+
+                for (i = 0; i < CHANGELIST_IDENTS; i++) {
+                    EV_SET(&changes[i], idents[i], filter, ops[o].flags, 0,
+                           filter == EVFILT_TIMER ? TIMER_PERIOD_MS : 0, NULL);
+                }
+                t0 = bench_now();
+                if (kevent(kqfd, changes, CHANGELIST_IDENTS, NULL, 0, NULL) < 0)
+                    err(EXIT_FAILURE, "kevent (batch %s)", ops[o].name);
+                bench_sample(&batch[o], bench_now() - t0, CHANGELIST_IDENTS);
+            }
+        }
+
+        for (o = 0; o < 4; o++) {
+            snprintf(param, sizeof(param), "%s/%s", filters[f].name, ops[o].name);
+            bench_report("changelist", param, &single[o]);
+            snprintf(param, sizeof(param), "%s/%s/batch%d", filters[f].name, ops[o].name, CHANGELIST_IDENTS);
+            bench_report("changelist", param, &batch[o]);
+            bench_samples_free(&single[o]);
+            bench_samples_free(&batch[o]);
+        }
+
+        close(kqfd);
+        changelist_idents_free(idents, CHANGELIST_IDENTS, filter, sv);
+    }
+}
+
+struct wake_ctx {
+    int                     kq_wait;        //!< Waiter blocks here.
+    int                     kq_ack;         //!< Waiter acknowledges here.
+    _Atomic uint64_t        triggered;      //!< bench_now() at NOTE_TRIGGER.
+    atomic_bool             stop;
+    struct bench_samples    samples;
+};
+
+static void *
+wake_waiter(void *arg)
+{
+    struct wake_ctx *ctx = arg;
+    struct kevent kev, ack;
+
+    EV_SET(&ack, 1, EVFILT_USER, 0, NOTE_TRIGGER, 0, NULL);
+
+    for (;;) {
+        int rv = kevent(ctx->kq_wait, NULL, 0, &kev, 1, NULL);
+
+        if (rv < 0)
+            err(EXIT_FAILURE, "kevent (wait)");
+        if (rv == 0)
+            continue;
+        if (atomic_load(&ctx->stop))
+            break;
+
+        bench_sample(&ctx->samples, bench_now() - atomic_load(&ctx->triggered), 1);
+        bench_kevent_change(ctx->kq_ack, &ack);
+    }
+
+    return NULL;
+}
+
+/** One-way latency from NOTE_TRIGGER in one thread to kevent() returning in another
+ */
+static void
+bench_wake(struct bench_config const *cfg)
+{
+    struct wake_ctx ctx = { 0 };
+    struct kevent kev;
+    pthread_t waiter;
+    unsigned int i;
+
+    ctx.kq_wait = bench_kqueue();
+    ctx.kq_ack = bench_kqueue();
+    bench_samples_init(&ctx.samples, cfg->iterations);
+
+    EV_SET(&kev, 1, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, NULL);
+    bench_kevent_change(ctx.kq_wait, &kev);
+    bench_kevent_change(ctx.kq_ack, &kev);
+
+    if (pthread_create(&waiter, NULL, wake_waiter, &ctx) != 0)
+        errx(EXIT_FAILURE, "pthread_create");
+
+    EV_SET(&kev, 1, EVFILT_USER, 0, NOTE_TRIGGER, 0, NULL);
+    for (i = 0; i < cfg->iterations; i++) {
+        struct kevent ack;
+
+        atomic_store(&ctx.triggered, bench_now());
+        bench_kevent_change(ctx.kq_wait, &kev);
+        if (kevent(ctx.kq_ack, NULL, 0, &ack, 1, NULL) != 1)
+            err(EXIT_FAILURE, "kevent (ack)");
+    }
+
+    atomic_store(&ctx.stop, true);
+    bench_kevent_change(ctx.kq_wait, &kev);
+    pthread_join(waiter, NULL);
+
+    bench_report("wake", "EVFILT_USER/cross-thread", &ctx.samples);
+    bench_samples_free(&ctx.samples);
+    close(ctx.kq_wait);
+    close(ctx.kq_ack);
+}
+
+/** Cost of arming, polling with, and removing 1k..max_timers timers
+ */
+static void
+bench_timer_scaling(struct bench_config const *cfg)
+{
+    unsigned int n;
+
+    for (n = 1000; n <= cfg->max_timers; n *= 10) {
+        struct bench_samples s;
+        struct kevent kev;
+        char param[32];
+        unsigned int i, added;
+        int kqfd = bench_kqueue();
+
+        snprintf(param, sizeof(param), "%u", n);
+
+        bench_samples_init(&s, n);
+        for (added = 0; added < n; added++) {
+            uint64_t t0;
+
+            EV_SET(&kev, added, EVFILT_TIMER, EV_ADD, 0, TIMER_PERIOD_MS, NULL);
+            t0 = bench_now();
+            if (kevent(kqfd, &kev, 1, NULL, 0, NULL) < 0)
+                break;
+            bench_sample(&s, bench_now() - t0, 1);
+        }
+        if (added < n) {
+            char reason[64];
+
+            snprintf(reason, sizeof(reason), "failed after %u timers: %s", added, strerror(errno));
+            bench_skip("timer_scaling", param, reason);
+            bench_samples_free(&s);
+            close(kqfd);
+            break;
+        }
+        snprintf(param, sizeof(param), "add/%u", n);
+        bench_report("timer_scaling", param, &s);
+        bench_samples_free(&s);
+
+        /*
+         * Cost of a non-blocking wait with n timers armed
+         * but none due.
+         */
+        bench_samples_init(&s, cfg->iterations);
+        for (i = 0; i < cfg->iterations; i++) {
+            uint64_t t0 = bench_now();
+
+            if (kevent(kqfd, NULL, 0, &kev, 1, &zero_ts) < 0)
+                err(EXIT_FAILURE, "kevent (poll)");
+            bench_sample(&s, bench_now() - t0, 1);
+        }
+        snprintf(param, sizeof(param), "poll/%u", n);
+        bench_report("timer_scaling", param, &s);
+        bench_samples_free(&s);
+
+        bench_samples_init(&s, n);
+        for (i = 0; i < n; i++) {
+            uint64_t t0;
+
+            EV_SET(&kev, i, EVFILT_TIMER, EV_DELETE, 0, 0, NULL);
+            t0 = bench_now();
+            bench_kevent_change(kqfd, &kev);
+            bench_sample(&s, bench_now() - t0, 1);
+        }
+        snprintf(param, sizeof(param), "delete/%u", n);
+        bench_report("timer_scaling", param, &s);
+        bench_samples_free(&s);
+
+        close(kqfd);
+    }
+}
+
+/** Events returned per second with 1, 64 and 512 always-ready knotes
+ */
+static void
+bench_copyout(struct bench_config const *cfg)
+{
+    static const int sizes[] = { 1, 64, 512 };
+    size_t z;
+
+    for (z = 0; z < sizeof(sizes) / sizeof(sizes[0]); z++) {
+        int n = sizes[z];
+        struct kevent *el;
+        uintptr_t *idents;
+        struct bench_samples s;
+        char param[32];
+        unsigned int i;
+        int sv[2], j;
+        int kqfd = bench_kqueue();
+
+        el = calloc((size_t)n, sizeof(*el));
+        idents = calloc((size_t)n, sizeof(*idents));
+        if ((el == NULL) || (idents == NULL))
+            err(EXIT_FAILURE, "calloc");
+
+        /* Sockets with empty send buffers stay writable */
+        changelist_idents(idents, (size_t)n, EVFILT_WRITE, sv);
+        for (j = 0; j < n; j++) {
+            struct kevent kev;
+
+            EV_SET(&kev, idents[j], EVFILT_WRITE, EV_ADD, 0, 0, NULL);
+            bench_kevent_change(kqfd, &kev);
+        }
+
+        bench_samples_init(&s, cfg->iterations);
+        for (i = 0; i < cfg->iterations; i++) {
+            uint64_t t0 = bench_now();
+            int rv = kevent(kqfd, NULL, 0, el, n, &zero_ts);
+
+            if (rv < 0)
+                err(EXIT_FAILURE, "kevent (copyout)");
+            bench_sample(&s, bench_now() - t0, (uint64_t)rv);
+        }
+        snprintf(param, sizeof(param), "EVFILT_WRITE/%d", n);
+        bench_report("copyout", param, &s);
+        bench_samples_free(&s);
+
+        close(kqfd);
+        changelist_idents_free(idents, (size_t)n, EVFILT_WRITE, sv);
+        free(idents);
+        free(el);
+    }
+}
+
+/** kqueue() + close() round trip
+ */
+static void
+bench_kqueue_create(struct bench_config const *cfg)
+{
+    struct bench_samples s;
+    unsigned int i;
+
+    bench_samples_init(&s, cfg->iterations);
+    for (i = 0; i < cfg->iterations; i++) {
+        uint64_t t0 = bench_now();
+        int kqfd = kqueue();
+
+        if (kqfd < 0)
+            err(EXIT_FAILURE, "kqueue");
+        close(kqfd);
+        bench_sample(&s, bench_now() - t0, 1);
+    }
+    bench_report("kqueue_create", "create+close", &s);
+    bench_samples_free(&s);
+}
+
+/** Most kqueues kept open at once by the memory bench
+ */
+#define KQUEUE_MEMORY_MAX   1000
+
+#ifdef HAVE_MALLINFO2
+/** Heap bytes in use
+ */
+static size_t
+bench_heap_used(void)
+{
+    return mallinfo2().uordblks;
+}
+
+/** Heap bytes held per empty kqueue, and added by its first EVFILT_USER knote
+ *
+ * Only counts userland allocations, not the kernel objects
+ * behind each kqueue's descriptors.
+ */
+static void
+bench_kqueue_memory(struct bench_config const *cfg)
+{
+    unsigned int n = cfg->iterations < KQUEUE_MEMORY_MAX ? cfg->iterations : KQUEUE_MEMORY_MAX;
+    int *kqfds;
+    size_t before;
+    unsigned int i;
+    char param[32];
+
+    kqfds = calloc(n, sizeof(*kqfds));
+    if (kqfds == NULL)
+        err(EXIT_FAILURE, "calloc");
+
+    before = bench_heap_used();
+    for (i = 0; i < n; i++) {
+        kqfds[i] = kqueue();
+        if (kqfds[i] < 0) {
+            char reason[64];
+
+            snprintf(reason, sizeof(reason), "failed after %u kqueues: %s", i, strerror(errno));
+            bench_skip("kqueue_memory", "empty", reason);
+            while (i > 0)
+                close(kqfds[--i]);
+            free(kqfds);
+            return;
+        }
+    }
+    snprintf(param, sizeof(param), "empty/%u", n);
+    bench_report_value("kqueue_memory", param, "bytes_per_kqueue",
+                       (double)(bench_heap_used() - before) / n);
+
+    before = bench_heap_used();
+    for (i = 0; i < n; i++) {
+        struct kevent kev;
+
+        EV_SET(&kev, 1, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, NULL);
+        bench_kevent_change(kqfds[i], &kev);
+    }
+    snprintf(param, sizeof(param), "first_user_knote/%u", n);
+    bench_report_value("kqueue_memory", param, "bytes_per_kqueue",
+                       (double)(bench_heap_used() - before) / n);
+
+    for (i = 0; i < n; i++)
+        close(kqfds[i]);
+    free(kqfds);
+}
+#else
+static void
+bench_kqueue_memory(struct bench_config const *cfg)
+{
+    (void) cfg;
+    bench_skip("kqueue_memory", "empty", "needs glibc mallinfo2()");
+}
+#endif
+
+const struct bench_case bench_kevent_cases[] = {
+    {
+        .name = "changelist",
+        .desc = "ADD/DISABLE/ENABLE/DELETE throughput per filter",
+        .func = bench_changelist,
+    },
+    {
+        .name = "wake",
+        .desc = "Cross-thread EVFILT_USER wake latency",
+        .func = bench_wake,
+    },
+    {
+        .name = "timer_scaling",
+        .desc = "Arm, poll and delete cost with 1k..max timers",
+        .func = bench_timer_scaling,
+    },
+    {
+        .name = "copyout",
+        .desc = "Copyout throughput at 1/64/512 ready events",
+        .func = bench_copyout,
+    },
+    {
+        .name = "kqueue_create",
+        .desc = "kqueue() create/close cost",
+        .func = bench_kqueue_create,
+    },
+    {
+        .name = "kqueue_memory",
+        .desc = "Heap bytes per empty kqueue, and per first knote",
+        .func = bench_kqueue_memory,
+    },
+    BENCH_SUITE_END
+};
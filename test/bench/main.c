@@ -0,0 +1,308 @@
+/*
+ * Copyright (c) 2026 Arran Cudbard-Bell <a.cudbardb@freeradius.org>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * libkqueue-bench - microbenchmarks for the kevent() hot paths.
+ *
+ * Results are written to stdout one measurement per line, either
+ * as TSV (the default, with a header row) or as JSON objects (-j),
+ * so runs can be diffed or fed to a plotting script.  Latencies are
+ * per kevent() call in nanoseconds, ops/s counts the unit of work
+ * named in the param column (changes, events, timers, ...) over the
+ * time spent inside the measured calls.
+ *
+ * Built with BENCH_RAW_EPOLL (libkqueue-bench-epoll) only the echo
+ * benches are included and their server loop runs on epoll(7), so
+ * the two binaries' echo results give libkqueue's per-event overhead.
+ */
+#include <getopt.h>
+#include <sys/resource.h>
+
+#include "bench.h"
+
+static bool bench_json;
+
+/*
+ * The raw epoll build only carries the echo bench, the
+ * rest measure kevent() itself.
+ */
+static const struct bench_case *bench_suites[] = {
+#ifndef BENCH_RAW_EPOLL
+    bench_kevent_cases,
+#endif
+    bench_echo_cases,
+    NULL
+};
+
+uint64_t
+bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ((uint64_t)ts.tv_sec * 1000000000ULL) + (uint64_t)ts.tv_nsec;
+}
+
+void
+bench_samples_init(struct bench_samples *s, size_t size)
+{
+    memset(s, 0, sizeof(*s));
+    s->ns = calloc(size ? size : 1, sizeof(*s->ns));
+    if (s->ns == NULL)
+        err(EXIT_FAILURE, "calloc");
+    s->size = size;
+}
+
+void
+bench_samples_free(struct bench_samples *s)
+{
+    free(s->ns);
+    memset(s, 0, sizeof(*s));
+}
+
+/** Record one latency sample
+ *
+ * @param[in] s     to add the sample to.
+ * @param[in] ns    duration of the sample.
+ * @param[in] ops   units of work the sample covered (for ops/s).
+ */
+void
+bench_sample(struct bench_samples *s, uint64_t ns, uint64_t ops)
+{
+    if (s->count < s->size)
+        s->ns[s->count++] = ns;
+    s->ops += ops;
+    s->total_ns += ns;
+}
+
+static int
+bench_cmp_u64(void const *a, void const *b)
+{
+    uint64_t x = *(uint64_t const *)a, y = *(uint64_t const *)b;
+
+    return (x > y) - (x < y);
+}
+
+static uint64_t
+bench_percentile(struct bench_samples const *s, double pct)
+{
+    size_t idx;
+
+    if (s->count == 0)
+        return 0;
+
+    idx = (size_t)(pct * (double)(s->count - 1) + 0.5);
+    return s->ns[idx];
+}
+
+/** Write a result row and reset the sample set for reuse
+ */
+void
+bench_report(char const *bench, char const *param, struct bench_samples *s)
+{
+    double ops_per_sec;
+
+    /*
+     * Rate over the time spent in the measured calls only,
+     * benches interleave setup and other measurements.
+     */
+    ops_per_sec = s->total_ns ? (double)s->ops * 1e9 / (double)s->total_ns : 0;
+
+    qsort(s->ns, s->count, sizeof(*s->ns), bench_cmp_u64);
+
+    if (bench_json) {
+        printf("{\"bench\":\"%s\",\"param\":\"%s\",\"samples\":%zu,\"ops\":%llu,"
+               "\"ops_per_sec\":%.0f,\"p50_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu}\n",
+               bench, param, s->count, (unsigned long long)s->ops, ops_per_sec,
+               (unsigned long long)bench_percentile(s, 0.50),
+               (unsigned long long)bench_percentile(s, 0.99),
+               (unsigned long long)bench_percentile(s, 0.999));
+    } else {
+        printf("%s\t%s\t%zu\t%llu\t%.0f\t%llu\t%llu\t%llu\n",
+               bench, param, s->count, (unsigned long long)s->ops, ops_per_sec,
+               (unsigned long long)bench_percentile(s, 0.50),
+               (unsigned long long)bench_percentile(s, 0.99),
+               (unsigned long long)bench_percentile(s, 0.999));
+    }
+    fflush(stdout);
+
+    s->count = 0;
+    s->ops = 0;
+    s->total_ns = 0;
+}
+
+/** Note a measurement which couldn't be taken, so gaps in the output are explained
+ */
+void
+bench_skip(char const *bench, char const *param, char const *reason)
+{
+    if (bench_json) {
+        printf("{\"bench\":\"%s\",\"param\":\"%s\",\"skipped\":\"%s\"}\n", bench, param, reason);
+    } else {
+        printf("# %s\t%s\tskipped: %s\n", bench, param, reason);
+    }
+    fflush(stdout);
+}
+
+/** Write a measurement which isn't a latency, e.g. a size
+ *
+ * Written as a comment row in TSV output so the table stays
+ * uniform.
+ */
+void
+bench_report_value(char const *bench, char const *param, char const *unit, double value)
+{
+    if (bench_json) {
+        printf("{\"bench\":\"%s\",\"param\":\"%s\",\"%s\":%.0f}\n", bench, param, unit, value);
+    } else {
+        printf("# %s\t%s\t%.0f %s\n", bench, param, value, unit);
+    }
+    fflush(stdout);
+}
+
+/** Lift the soft fd limit to the hard limit
+ *
+ * The scaling runs want thousands of descriptors (timerfds on
+ * Linux, socket dups for copyout).
+ */
+void
+bench_raise_fd_limit(void)
+{
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0)
+        return;
+    if (rl.rlim_cur == rl.rlim_max)
+        return;
+    rl.rlim_cur = rl.rlim_max;
+    (void) setrlimit(RLIMIT_NOFILE, &rl);
+}
+
+static void
+usage(char const *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-hjl] [-n iterations] [-t max-timers] [-c max-connections]\n"
+            "          [-a active-percent] [-T threads] [bench ...]\n"
+            " -h                This message\n"
+            " -j                Write results as JSON lines instead of TSV\n"
+            " -l                List available benchmarks\n"
+            " -n iterations     Samples per measurement (default: 10000)\n"
+            " -t max-timers     Largest timer count for timer_scaling (default: 1000000)\n"
+            " -c max-conns      Largest connection count for the echo benches (default: 100000)\n"
+            " -a active-percent Percentage of echo connections carrying traffic (default: 10)\n"
+            " -T threads        Echo client threads (default: 4)\n",
+            prog);
+}
+
+static bool
+bench_selected(char const *name, int argc, char **argv)
+{
+    int i;
+
+    if (argc == 0)
+        return true;
+
+    for (i = 0; i < argc; i++) {
+        if (strcmp(argv[i], name) == 0)
+            return true;
+    }
+
+    return false;
+}
+
+int
+main(int argc, char **argv)
+{
+    struct bench_config cfg = {
+        .iterations = 10000,
+        .max_timers = 1000000,
+        .max_connections = 100000,
+        .active_pct = 10,
+        .threads = 4
+    };
+    const struct bench_case **suite, *bc;
+    bool list = false;
+    int c;
+
+    while ((c = getopt(argc, argv, "a:c:hjln:t:T:")) != -1) {
+        switch (c) {
+        case 'j':
+            bench_json = true;
+            break;
+
+        case 'l':
+            list = true;
+            break;
+
+        case 'n':
+            cfg.iterations = (unsigned int)strtoul(optarg, NULL, 10);
+            if (cfg.iterations == 0)
+                errx(EXIT_FAILURE, "iterations must be > 0");
+            break;
+
+        case 't':
+            cfg.max_timers = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+
+        case 'c':
+            cfg.max_connections = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+
+        case 'a':
+            cfg.active_pct = (unsigned int)strtoul(optarg, NULL, 10);
+            if ((cfg.active_pct == 0) || (cfg.active_pct > 100))
+                errx(EXIT_FAILURE, "active-percent must be 1-100");
+            break;
+
+        case 'T':
+            cfg.threads = (unsigned int)strtoul(optarg, NULL, 10);
+            if (cfg.threads == 0)
+                errx(EXIT_FAILURE, "threads must be > 0");
+            break;
+
+        case 'h':
+        default:
+            usage(argv[0]);
+            exit(c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+    argc -= optind;
+    argv += optind;
+
+    if (list) {
+        for (suite = bench_suites; *suite; suite++) {
+            for (bc = *suite; bc->name; bc++)
+                printf("%-24s %s\n", bc->name, bc->desc);
+        }
+        return EXIT_SUCCESS;
+    }
+
+    bench_raise_fd_limit();
+
+    if (!bench_json)
+        printf("bench\tparam\tsamples\tops\tops_per_sec\tp50_ns\tp99_ns\tp999_ns\n");
+
+    for (suite = bench_suites; *suite; suite++) {
+        for (bc = *suite; bc->name; bc++) {
+            if (bench_selected(bc->name, argc, argv))
+                bc->func(&cfg);
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
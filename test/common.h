@@ -462,6 +462,14 @@ struct lkq_test_case {
 #  define TEST_GATE_NEEDS_NOTE_ABSOLUTE       LKQ_BUILD_PLATFORM
 #endif
 
+#ifdef NOTE_LEEWAY_PCT
+#  define TEST_FUNC_NEEDS_NOTE_LEEWAY_PCT(_fn)  (_fn)
+#  define TEST_GATE_NEEDS_NOTE_LEEWAY_PCT       0
+#else
+#  define TEST_FUNC_NEEDS_NOTE_LEEWAY_PCT(_fn)  NULL
+#  define TEST_GATE_NEEDS_NOTE_LEEWAY_PCT       LKQ_BUILD_PLATFORM
+#endif
+
 #ifdef EVFILT_VNODE
 #  define TEST_FUNC_NEEDS_EVFILT_VNODE(_fn)  (_fn)
 #  define TEST_GATE_NEEDS_EVFILT_VNODE       0
@@ -612,6 +620,9 @@ void test_evfilt_proc(struct test_context *);
 #ifdef EVFILT_USER
 void test_evfilt_user(struct test_context *);
 #endif
+#if defined(EVFILT_AIO) && defined(LIBKQUEUE_BACKEND_LINUX)
+void test_evfilt_aio(struct test_context *);
+#endif
 void test_evfilt_libkqueue(struct test_context *);
 void test_threading(struct test_context *);
 
@@ -800,13 +800,6 @@ test_kqueue_timer_callout_detach_race(struct test_context *ctx)
  * thread for minutes on nevents=-1 (likely casts int to size_t, producing
  * SIZE_MAX iterations).  Upstream DoS-class kernel bug; skip on NetBSD and
  * Windows (no mmap/mprotect).
- *
- * kqueue_pipe_peer_close_uaf / kqueue_timer_callout_detach_race: stress
- * libkqueue's own fd_state/knote teardown and run on every backend except
- * POSIX.  The POSIX dispatcher waits via pselect(2) with a hard
- * FD_SETSIZE=1024 fd-number ceiling, and the rapid per-iteration
- * pipe()+kqueue() churn (each kqueue allocates a 2-fd self-pipe) exhausts it
- * under concurrent threads, returning EMFILE from posix_kqueue_init.
  */
 static const struct lkq_test_gate gates_not_backend_native[] = {
     GATE(LKQ_PLATFORM_NOT_BACKEND_NATIVE,
@@ -822,12 +815,6 @@ static const struct lkq_test_gate gates_not_netbsd_not_windows[] = {
     { 0, NULL }
 };
 
-static const struct lkq_test_gate gates_not_backend_posix[] = {
-    GATE(LKQ_PLATFORM_BACKEND_POSIX,
-         "POSIX pselect backend's FD_SETSIZE=1024 fd-number ceiling is exhausted by the rapid per-iteration pipe()+kqueue() churn (each kqueue allocates a 2-fd self-pipe), returning EMFILE"),
-    { 0, NULL }
-};
-
 const struct lkq_test_case lkq_kqueue_tests[] = {
     {
         .name  = "peer_close_detection",
@@ -919,13 +906,11 @@ const struct lkq_test_case lkq_kqueue_tests[] = {
         .name  = "kqueue_pipe_peer_close_uaf",
         .desc  = "race EVFILT_WRITE registration against pipe close in a sibling thread",
         .func  = test_kqueue_pipe_peer_close_uaf,
-        .gates = gates_not_backend_posix
     },
     {
         .name  = "kqueue_timer_callout_detach_race",
         .desc  = "concurrent EVFILT_TIMER add/delete stress callout-vs-detach barrier",
         .func  = test_kqueue_timer_callout_detach_race,
-        .gates = gates_not_backend_posix
     },
     LKQ_SUITE_END
 };
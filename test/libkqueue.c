@@ -56,7 +56,785 @@ test_libkqueue_version_str(struct test_context *ctx)
     }
 }
 
+static void
+test_libkqueue_stats(struct test_context *ctx)
+{
+    struct kevent kev, receipt;
+    struct libkqueue_stats before, after, filt_before, filt_stats;
+    int i, kqfd;
+
+    EV_SET(&kev, 0, EVFILT_LIBKQUEUE, EV_ADD, NOTE_STATS, EVFILT_USER, &filt_before);
+    if (kevent(ctx->kqfd, &kev, 1, &receipt, 1, &(struct timespec){}) != 1)
+        die("kevent (NOTE_STATS EVFILT_USER): %s", strerror(errno));
+
+    EV_SET(&kev, 0, EVFILT_LIBKQUEUE, EV_ADD, NOTE_STATS, 0, &before);
+    if (kevent(ctx->kqfd, &kev, 1, &receipt, 1, &(struct timespec){}) != 1)
+        die("kevent (NOTE_STATS): %s", strerror(errno));
+    if (receipt.data != sizeof(before))
+        die("NOTE_STATS returned %d bytes, expected %zu", (int)receipt.data, sizeof(before));
+
+    /* Register, fire and drain a user event a few times */
+    kevent_add(ctx->kqfd, &kev, 1, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, NULL);
+    for (i = 0; i < 4; i++) {
+        kevent_add(ctx->kqfd, &kev, 1, EVFILT_USER, 0, NOTE_TRIGGER, 0, NULL);
+        if (kevent(ctx->kqfd, NULL, 0, &receipt, 1, &(struct timespec){}) != 1)
+            die("expected user event");
+    }
+
+    EV_SET(&kev, 0, EVFILT_LIBKQUEUE, EV_ADD, NOTE_STATS, 0, &after);
+    if (kevent(ctx->kqfd, &kev, 1, &receipt, 1, &(struct timespec){}) != 1)
+        die("kevent (NOTE_STATS): %s", strerror(errno));
+
+    if (after.kevent_calls < before.kevent_calls + 9)
+        die("kevent_calls didn't advance (%llu -> %llu)",
+            (unsigned long long)before.kevent_calls, (unsigned long long)after.kevent_calls);
+    if (after.changes < before.changes + 5)
+        die("changes didn't advance (%llu -> %llu)",
+            (unsigned long long)before.changes, (unsigned long long)after.changes);
+    if (after.events < before.events + 4)
+        die("events didn't advance (%llu -> %llu)",
+            (unsigned long long)before.events, (unsigned long long)after.events);
+    if (after.knotes < before.knotes + 1)
+        die("knotes didn't advance (%llu -> %llu)",
+            (unsigned long long)before.knotes, (unsigned long long)after.knotes);
+
+    EV_SET(&kev, 0, EVFILT_LIBKQUEUE, EV_ADD, NOTE_STATS, EVFILT_USER, &filt_stats);
+    if (kevent(ctx->kqfd, &kev, 1, &receipt, 1, &(struct timespec){}) != 1)
+        die("kevent (NOTE_STATS EVFILT_USER): %s", strerror(errno));
+    if (filt_stats.knotes != filt_before.knotes + 1)
+        die("expected %llu EVFILT_USER knotes, got %llu",
+            (unsigned long long)filt_before.knotes + 1, (unsigned long long)filt_stats.knotes);
+    if (filt_stats.events < filt_before.events + 4)
+        die("expected >= %llu EVFILT_USER events, got %llu",
+            (unsigned long long)filt_before.events + 4, (unsigned long long)filt_stats.events);
+    if (filt_stats.kevent_calls != 0)
+        die("kevent_calls should be zero for a per-filter query");
+
+    kevent_add(ctx->kqfd, &kev, 1, EVFILT_USER, EV_DELETE, 0, 0, NULL);
+
+    /* Bogus filter ids are rejected */
+    EV_SET(&kev, 0, EVFILT_LIBKQUEUE, EV_ADD, NOTE_STATS, 1, &filt_stats);
+    errno = 0;
+    if (kevent(ctx->kqfd, &kev, 1, NULL, 0, NULL) >= 0)
+        die("NOTE_STATS with a bogus filter id should have failed");
+    if (errno != EINVAL)
+        die("expected EINVAL, got %s", strerror(errno));
+
+    /*
+     * Filters a kqueue hasn't used report zeros, and changes
+     * other than EV_ADD don't set them up.
+     */
+    kqfd = kqueue();
+    if (kqfd < 0)
+        die("kqueue");
+    EV_SET(&kev, 1, EVFILT_USER, EV_DELETE, 0, 0, NULL);
+    if ((kevent(kqfd, &kev, 1, NULL, 0, NULL) >= 0) || (errno != ENOENT))
+        die("EV_DELETE on an unused filter should have failed with ENOENT");
+    memset(&filt_stats, 0xff, sizeof(filt_stats));
+    EV_SET(&kev, 0, EVFILT_LIBKQUEUE, EV_ADD, NOTE_STATS, EVFILT_USER, &filt_stats);
+    if (kevent(kqfd, &kev, 1, &receipt, 1, &(struct timespec){}) != 1)
+        die("kevent (NOTE_STATS EVFILT_USER): %s", strerror(errno));
+    if ((filt_stats.changes != 0) || (filt_stats.events != 0) ||
+        (filt_stats.syscalls != 0) || (filt_stats.knotes != 0))
+        die("expected zeros for an unused filter, got %llu changes",
+            (unsigned long long)filt_stats.changes);
+    close(kqfd);
+}
+
+static void
+test_libkqueue_trace(struct test_context *ctx)
+{
+    struct kevent kev, receipt;
+    char magic[8];
+    FILE *fp;
+    int i;
+
+    EV_SET(&kev, 0, EVFILT_LIBKQUEUE, EV_ADD, NOTE_TRACE, 1, NULL);
+    if (kevent(ctx->kqfd, &kev, 1, NULL, 0, NULL) < 0)
+        die("kevent (NOTE_TRACE): %s", strerror(errno));
+
+    kevent_add(ctx->kqfd, &kev, 1, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, NULL);
+    for (i = 0; i < 4; i++) {
+        kevent_add(ctx->kqfd, &kev, 1, EVFILT_USER, 0, NOTE_TRIGGER, 0, NULL);
+        if (kevent(ctx->kqfd, NULL, 0, &receipt, 1, &(struct timespec){}) != 1)
+            die("expected user event");
+    }
+    kevent_add(ctx->kqfd, &kev, 1, EVFILT_USER, EV_DELETE, 0, 0, NULL);
+
+    EV_SET(&kev, 0, EVFILT_LIBKQUEUE, EV_ADD, NOTE_TRACE, 0, NULL);
+    if (kevent(ctx->kqfd, &kev, 1, NULL, 0, NULL) < 0)
+        die("kevent (NOTE_TRACE): %s", strerror(errno));
+
+    fp = tmpfile();
+    if (fp == NULL)
+        die("tmpfile");
+
+    EV_SET(&kev, 0, EVFILT_LIBKQUEUE, EV_ADD, NOTE_TRACE_DUMP, fileno(fp), NULL);
+    if (kevent(ctx->kqfd, &kev, 1, &receipt, 1, &(struct timespec){}) != 1)
+        die("kevent (NOTE_TRACE_DUMP): %s", strerror(errno));
+
+    /*
+     * Each trigger and drain is an enter, a copyin or wait,
+     * and an exit, the drains also produce a copyout.
+     */
+    if (receipt.data < 4 * 6)
+        die("expected at least %d trace records, got %d", 4 * 6, (int)receipt.data);
+
+    rewind(fp);
+    if (fread(magic, sizeof(magic), 1, fp) != 1)
+        die("fread");
+    if (memcmp(magic, "KQTRACE", sizeof("KQTRACE")) != 0)
+        die("bad trace magic");
+    fclose(fp);
+}
+
+static void
+test_libkqueue_lockstat(struct test_context *ctx)
+{
+    struct kevent kev, receipt;
+    struct libkqueue_lockstat ls[16];
+    bool seen_kqueue = false;
+    int i;
+
+    EV_SET(&kev, 0, EVFILT_LIBKQUEUE, EV_ADD, NOTE_LOCKSTAT, 16, ls);
+    if (kevent(ctx->kqfd, &kev, 1, &receipt, 1, &(struct timespec){}) != 1)
+        die("kevent (NOTE_LOCKSTAT)");
+
+    if (receipt.flags & EV_ERROR) {
+        if (receipt.data == ENOTSUP)
+            return; /* Not built with ENABLE_LOCKSTAT */
+        die("NOTE_LOCKSTAT failed: %s", strerror((int)receipt.data));
+    }
+
+    if ((receipt.data <= 0) || (receipt.data > 16))
+        die("NOTE_LOCKSTAT returned %d classes", (int)receipt.data);
+
+    for (i = 0; i < receipt.data; i++) {
+        if (strcmp(ls[i].name, "kqueue") != 0)
+            continue;
+        seen_kqueue = true;
+        if (ls[i].acquisitions == 0)
+            die("no kqueue lock acquisitions recorded");
+        if (ls[i].contended > ls[i].acquisitions)
+            die("more contended acquisitions than acquisitions");
+    }
+    if (!seen_kqueue)
+        die("kqueue lock class missing");
+
+    /* Too small a buffer is rejected */
+    EV_SET(&kev, 0, EVFILT_LIBKQUEUE, EV_ADD, NOTE_LOCKSTAT, 1, ls);
+    if ((kevent(ctx->kqfd, &kev, 1, &receipt, 1, &(struct timespec){}) != 1) ||
+        !(receipt.flags & EV_ERROR) || (receipt.data != ENOSPC))
+        die("NOTE_LOCKSTAT with a short buffer should have failed with ENOSPC");
+}
+
+/*
+ * With NOTE_BATCH 2, a user event that's ready straight away must
+ * be held back until a timer fires 50ms later, so both come back
+ * from the same kevent() call.  A batch that never fills returns
+ * what it has once the batch timeout expires.
+ */
+static void
+test_libkqueue_batch(struct test_context *ctx)
+{
+    struct kevent   kev, ret[2];
+    struct timespec t0, t1;
+    long            elapsed_ms;
+
+    EV_SET(&kev, 0, EVFILT_LIBKQUEUE, EV_ADD, NOTE_BATCH, 2, NULL);
+    if (kevent(ctx->kqfd, &kev, 1, NULL, 0, NULL) < 0)
+        die("kevent (NOTE_BATCH): %s", strerror(errno));
+    EV_SET(&kev, 0, EVFILT_LIBKQUEUE, EV_ADD, NOTE_BATCH_TIMEOUT, 1000 * 1000 * 1000, NULL);
+    if (kevent(ctx->kqfd, &kev, 1, NULL, 0, NULL) < 0)
+        die("kevent (NOTE_BATCH_TIMEOUT): %s", strerror(errno));
+
+    kevent_add(ctx->kqfd, &kev, 1, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, NULL);
+    kevent_add(ctx->kqfd, &kev, 1, EVFILT_USER, 0, NOTE_TRIGGER, 0, NULL);
+    kevent_add(ctx->kqfd, &kev, 2, EVFILT_TIMER, EV_ADD | EV_ONESHOT, 0, 50, NULL);
+
+    if (kevent(ctx->kqfd, NULL, 0, ret, 2, &(struct timespec){ .tv_sec = 5 }) != 2)
+        die("expected the user and timer events in one batch");
+
+    /* Nothing else is coming, so the batch times out with one event */
+    EV_SET(&kev, 0, EVFILT_LIBKQUEUE, EV_ADD, NOTE_BATCH_TIMEOUT, 100 * 1000 * 1000, NULL);
+    if (kevent(ctx->kqfd, &kev, 1, NULL, 0, NULL) < 0)
+        die("kevent (NOTE_BATCH_TIMEOUT): %s", strerror(errno));
+    kevent_add(ctx->kqfd, &kev, 1, EVFILT_USER, 0, NOTE_TRIGGER, 0, NULL);
+
+    if (clock_gettime(CLOCK_MONOTONIC, &t0) < 0) die("clock_gettime");
+    if (kevent(ctx->kqfd, NULL, 0, ret, 2, &(struct timespec){ .tv_sec = 5 }) != 1)
+        die("expected a partial batch of one event");
+    if (clock_gettime(CLOCK_MONOTONIC, &t1) < 0) die("clock_gettime");
+    elapsed_ms = (t1.tv_sec - t0.tv_sec) * 1000 + (t1.tv_nsec - t0.tv_nsec) / 1000000;
+    if ((elapsed_ms < 50) || (elapsed_ms > 2000))
+        die("partial batch returned after %ldms, expected ~100ms", elapsed_ms);
+
+    /* Negative values are rejected */
+    EV_SET(&kev, 0, EVFILT_LIBKQUEUE, EV_ADD, NOTE_BATCH, -1, NULL);
+    errno = 0;
+    if ((kevent(ctx->kqfd, &kev, 1, NULL, 0, NULL) >= 0) || (errno != EINVAL))
+        die("NOTE_BATCH -1 should have failed with EINVAL");
+
+    kevent_add(ctx->kqfd, &kev, 1, EVFILT_USER, EV_DELETE, 0, 0, NULL);
+    EV_SET(&kev, 0, EVFILT_LIBKQUEUE, EV_ADD, NOTE_BATCH, 0, NULL);
+    kevent(ctx->kqfd, &kev, 1, NULL, 0, NULL);
+    EV_SET(&kev, 0, EVFILT_LIBKQUEUE, EV_ADD, NOTE_BATCH_TIMEOUT, 0, NULL);
+    kevent(ctx->kqfd, &kev, 1, NULL, 0, NULL);
+}
+
+/*
+ * With EVFILT_USER at a higher NOTE_PRIORITY, a user event that
+ * becomes ready after two timers have fired must still be the
+ * first thing copied out when the eventlist only has room for one,
+ * and the timers must stay pending for the next call.
+ */
+static void
+test_libkqueue_priority(struct test_context *ctx)
+{
+    struct kevent   kev, ret[4];
+    int             kqfd;
+
+    (void) ctx;
+
+    /* Needs a kqueue with no events registered */
+    kqfd = kqueue();
+    if (kqfd < 0)
+        die("kqueue");
+
+    /* Out of range priorities and filters are rejected */
+    EV_SET(&kev, EVFILT_USER, EVFILT_LIBKQUEUE, EV_ADD, NOTE_PRIORITY, NOTE_PRIORITY_MAX + 1, NULL);
+    errno = 0;
+    if ((kevent(kqfd, &kev, 1, NULL, 0, NULL) >= 0) || (errno != EINVAL))
+        die("NOTE_PRIORITY above NOTE_PRIORITY_MAX should have failed with EINVAL");
+    EV_SET(&kev, EVFILT_LIBKQUEUE, EVFILT_LIBKQUEUE, EV_ADD, NOTE_PRIORITY, 1, NULL);
+    errno = 0;
+    if ((kevent(kqfd, &kev, 1, NULL, 0, NULL) >= 0) || (errno != EINVAL))
+        die("NOTE_PRIORITY on EVFILT_LIBKQUEUE should have failed with EINVAL");
+
+    EV_SET(&kev, EVFILT_USER, EVFILT_LIBKQUEUE, EV_ADD, NOTE_PRIORITY, 1, NULL);
+    if (kevent(kqfd, &kev, 1, NULL, 0, NULL) < 0)
+        die("kevent (NOTE_PRIORITY): %s", strerror(errno));
+
+    kevent_add(kqfd, &kev, 1, EVFILT_TIMER, EV_ADD | EV_ONESHOT, 0, 10, NULL);
+    kevent_add(kqfd, &kev, 2, EVFILT_TIMER, EV_ADD | EV_ONESHOT, 0, 10, NULL);
+    usleep(50000);
+    kevent_add(kqfd, &kev, 1, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, NULL);
+    kevent_add(kqfd, &kev, 1, EVFILT_USER, 0, NOTE_TRIGGER, 0, NULL);
+
+    if (kevent(kqfd, NULL, 0, ret, 1, &(struct timespec){ .tv_sec = 5 }) != 1)
+        die("expected one event");
+    if (ret[0].filter != EVFILT_USER)
+        die("expected the EVFILT_USER event first, got %s", kevent_to_str(&ret[0]));
+
+    if (kevent(kqfd, NULL, 0, ret, 4, &(struct timespec){ .tv_sec = 5 }) != 2)
+        die("expected both timers to still be pending");
+    if ((ret[0].filter != EVFILT_TIMER) || (ret[1].filter != EVFILT_TIMER))
+        die("expected two EVFILT_TIMER events");
+
+    /* Can't change priorities once events are registered */
+    EV_SET(&kev, EVFILT_TIMER, EVFILT_LIBKQUEUE, EV_ADD, NOTE_PRIORITY, 2, NULL);
+    errno = 0;
+    if ((kevent(kqfd, &kev, 1, NULL, 0, NULL) >= 0) || (errno != EBUSY))
+        die("NOTE_PRIORITY with events registered should have failed with EBUSY");
+
+    close(kqfd);
+}
+
+struct test_dispatch_state {
+    int             kqfd;
+    int             calls;
+    uintptr_t       ident;
+};
+
+static void
+test_libkqueue_dispatch_handler(const struct kevent *kev, void *ctx)
+{
+    struct test_dispatch_state *st = ctx;
+    struct kevent kev_del;
+
+    st->calls++;
+    st->ident = kev->ident;
+
+    /* Handlers run with the kqueue unlocked, so can modify it */
+    kevent_add(st->kqfd, &kev_del, kev->ident, EVFILT_USER, EV_DELETE, 0, 0, NULL);
+}
+
+/*
+ * kevent_dispatch() must call the handler in each event's udata,
+ * drop events without one, and EV_ERROR entries for changes, and
+ * let handlers call kevent() on the kqueue they were dispatched
+ * from.
+ */
+static void
+test_libkqueue_dispatch(struct test_context *ctx)
+{
+    struct test_dispatch_state st = { .kqfd = ctx->kqfd };
+    struct kevent_handler kh = { .func = test_libkqueue_dispatch_handler, .ctx = &st };
+    struct kevent kev;
+    int kqfd, rv;
+
+    /* A modify replaces udata, so the trigger has to carry the handler too */
+    EV_SET(&kev, 1, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, &kh);
+    if (kevent(ctx->kqfd, &kev, 1, NULL, 0, NULL) < 0)
+        die("kevent (EV_ADD): %s", strerror(errno));
+    EV_SET(&kev, 1, EVFILT_USER, 0, NOTE_TRIGGER, 0, &kh);
+    if (kevent(ctx->kqfd, &kev, 1, NULL, 0, NULL) < 0)
+        die("kevent (NOTE_TRIGGER): %s", strerror(errno));
+    kevent_add(ctx->kqfd, &kev, 2, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, NULL);
+    kevent_add(ctx->kqfd, &kev, 2, EVFILT_USER, 0, NOTE_TRIGGER, 0, NULL);
+
+    rv = kevent_dispatch(ctx->kqfd, NULL, 0, 4, &(struct timespec){ .tv_sec = 1 });
+    if (rv != 2)
+        die("kevent_dispatch returned %i, expected 2", rv);
+    if ((st.calls != 1) || (st.ident != 1))
+        die("handler called %i times for ident %u, expected once for ident 1",
+            st.calls, (unsigned int)st.ident);
+
+    /* The handler deleted its knote */
+    errno = 0;
+    EV_SET(&kev, 1, EVFILT_USER, EV_DELETE, 0, 0, NULL);
+    if ((kevent(ctx->kqfd, &kev, 1, NULL, 0, NULL) >= 0) || (errno != ENOENT))
+        die("handler's EV_DELETE didn't remove the knote");
+
+    /*
+     * A failed change and a receipt aren't events, even with a
+     * handler.  Use our own kqueue, so nothing registered by other
+     * tests interferes, and nevents is 1 so the entry fills the
+     * eventlist, as a wait which times out returns 0.
+     */
+    kqfd = kqueue();
+    if (kqfd < 0)
+        die("kqueue");
+    EV_SET(&kev, 1, EVFILT_USER, EV_DELETE, 0, 0, &kh);
+    rv = kevent_dispatch(kqfd, &kev, 1, 1, &(struct timespec){ 0 });
+    if (rv != 1)
+        die("kevent_dispatch returned %i, expected 1 EV_ERROR entry", rv);
+    EV_SET(&kev, 1, EVFILT_USER, EV_ADD | EV_RECEIPT, 0, 0, &kh);
+    rv = kevent_dispatch(kqfd, &kev, 1, 1, &(struct timespec){ 0 });
+    if (rv != 1)
+        die("kevent_dispatch returned %i, expected 1 EV_RECEIPT entry", rv);
+    if (st.calls != 1)
+        die("handler called for an EV_ERROR entry");
+    close(kqfd);
+
+    errno = 0;
+    if ((kevent_dispatch(ctx->kqfd, NULL, 0, -1, NULL) >= 0) || (errno != EINVAL))
+        die("kevent_dispatch with nevents -1 should have failed with EINVAL");
+
+    kevent_add(ctx->kqfd, &kev, 2, EVFILT_USER, EV_DELETE, 0, 0, NULL);
+    test_no_kevents(ctx->kqfd);
+}
+
 #ifndef _WIN32
+static volatile sig_atomic_t test_pwait_caught;
+
+static void
+test_libkqueue_pwait_handler(int sig)
+{
+    (void) sig;
+    test_pwait_caught = 1;
+}
+
+/*
+ * A signal blocked outside the wait must be delivered during a
+ * kevent_pwait() which unblocks it, and interrupt it, but stay
+ * blocked for plain kevent().
+ */
+static void
+test_libkqueue_pwait(struct test_context *ctx)
+{
+    struct sigaction sa = { .sa_handler = test_libkqueue_pwait_handler }, sa_old;
+    sigset_t block, old, waitmask;
+    struct kevent ret[1];
+    int rv;
+
+    sigemptyset(&block);
+    sigaddset(&block, SIGUSR1);
+    if (pthread_sigmask(SIG_BLOCK, &block, &old) != 0)
+        die("pthread_sigmask");
+    if (sigaction(SIGUSR1, &sa, &sa_old) < 0)
+        die("sigaction");
+
+    test_pwait_caught = 0;
+    pthread_kill(pthread_self(), SIGUSR1);
+
+    rv = kevent(ctx->kqfd, NULL, 0, ret, 1, &(struct timespec){ .tv_nsec = 10000000 });
+    if ((rv != 0) || test_pwait_caught)
+        die("signal delivered during plain kevent()");
+
+    pthread_sigmask(SIG_SETMASK, NULL, &waitmask);
+    sigdelset(&waitmask, SIGUSR1);
+
+    errno = 0;
+    rv = kevent_pwait(ctx->kqfd, NULL, 0, ret, 1, &(struct timespec){ .tv_sec = 5 }, &waitmask);
+    if ((rv < 0) && (errno == ENOTSUP)) {
+        /* Backend can't swap masks atomically, the signal's still pending */
+        if (test_pwait_caught)
+            die("signal delivered by unsupported kevent_pwait()");
+        sigaction(SIGUSR1, &(struct sigaction){ .sa_handler = SIG_IGN }, NULL);
+    } else if ((rv >= 0) || (errno != EINTR) || !test_pwait_caught) {
+        die("kevent_pwait returned %i (%s), expected EINTR with the signal caught",
+            rv, strerror(errno));
+    }
+
+    sigaction(SIGUSR1, &sa_old, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+struct test_workq_state {
+    pthread_mutex_t mtx;
+    int             calls;
+    int             running;        //!< Handlers running now.
+    int             max_running;
+    int             running_ident[5];
+    bool            overlap;        //!< A knote's handler ran on two threads at once.
+};
+
+static void
+test_libkqueue_workq_handler(const struct kevent *kev, void *ctx)
+{
+    struct test_workq_state *st = ctx;
+
+    pthread_mutex_lock(&st->mtx);
+    st->calls++;
+    if (++st->running > st->max_running)
+        st->max_running = st->running;
+    if (st->running_ident[kev->ident]++ > 0)
+        st->overlap = true;
+    pthread_mutex_unlock(&st->mtx);
+
+    usleep(50000);
+
+    pthread_mutex_lock(&st->mtx);
+    st->running--;
+    st->running_ident[kev->ident]--;
+    pthread_mutex_unlock(&st->mtx);
+}
+
+/*
+ * A workqueue must start more threads when events are arriving
+ * faster than its handlers return, and never run an EV_DISPATCH
+ * knote's handler on two threads at once.
+ */
+static void
+test_libkqueue_workq(struct test_context *ctx)
+{
+    struct test_workq_state st = { .mtx = PTHREAD_MUTEX_INITIALIZER };
+    struct kevent_handler kh = { .func = test_libkqueue_workq_handler, .ctx = &st };
+    struct kqueue_workq *wq;
+    struct kevent kev;
+    int kqfd, i, calls;
+
+    (void) ctx;
+
+    errno = 0;
+    if ((kqueue_workq_create(0, 0, 1) != NULL) || (errno != EINVAL))
+        die("kqueue_workq_create with no threads should have failed with EINVAL");
+
+    kqfd = kqueue();
+    if (kqfd < 0)
+        die("kqueue");
+
+    wq = kqueue_workq_create(kqfd, 1, 4);
+    if (wq == NULL)
+        die("kqueue_workq_create: %s", strerror(errno));
+
+    for (i = 1; i <= 4; i++) {
+        EV_SET(&kev, i, EVFILT_USER, EV_ADD | EV_CLEAR | EV_DISPATCH, 0, 0, &kh);
+        if (kevent(kqfd, &kev, 1, NULL, 0, NULL) < 0)
+            die("kevent (EV_ADD): %s", strerror(errno));
+    }
+    for (i = 1; i <= 4; i++) {
+        EV_SET(&kev, i, EVFILT_USER, 0, NOTE_TRIGGER, 0, &kh);
+        if (kevent(kqfd, &kev, 1, NULL, 0, NULL) < 0)
+            die("kevent (NOTE_TRIGGER): %s", strerror(errno));
+    }
+
+    for (i = 0; i < 500; i++) {
+        pthread_mutex_lock(&st.mtx);
+        calls = st.calls;
+        pthread_mutex_unlock(&st.mtx);
+        if (calls >= 4)
+            break;
+        usleep(10000);
+    }
+    if (calls != 4)
+        die("expected 4 handler calls, got %i", calls);
+    if (st.max_running < 2)
+        die("pool never ran handlers concurrently");
+
+    /* Hammer one knote while its handler is running */
+    for (i = 0; i < 20; i++) {
+        EV_SET(&kev, 1, EVFILT_USER, 0, NOTE_TRIGGER, 0, &kh);
+        if (kevent(kqfd, &kev, 1, NULL, 0, NULL) < 0)
+            die("kevent (NOTE_TRIGGER): %s", strerror(errno));
+        usleep(5000);
+    }
+
+    if (kqueue_workq_destroy(wq) < 0)
+        die("kqueue_workq_destroy: %s", strerror(errno));
+    if (st.overlap)
+        die("an EV_DISPATCH handler ran on two threads at once");
+
+    close(kqfd);
+}
+
+struct test_workq_race {
+    int                     kqfd;
+    struct kevent_handler   *next;      //!< Handler for the knote we trigger.
+    sem_t                   running;
+};
+
+/*
+ * Lets the test call kqueue_workq_destroy(), then triggers
+ * knote 2 so it's pending alongside the destroy wakeup when
+ * the worker next calls kevent().
+ */
+static void
+test_libkqueue_workq_race_handler(const struct kevent *kev, void *ctx)
+{
+    struct test_workq_race *race = ctx;
+    struct kevent trig;
+
+    (void) kev;
+
+    sem_post(&race->running);
+    usleep(200000);
+
+    EV_SET(&trig, 2, EVFILT_USER, 0, NOTE_TRIGGER, 0, race->next);
+    if (kevent(race->kqfd, &trig, 1, NULL, 0, NULL) < 0)
+        die("kevent (NOTE_TRIGGER): %s", strerror(errno));
+}
+
+/*
+ * Destroying a pool while workers above min_threads are timing
+ * out must wait for all of them, and an event a worker picks
+ * up during destroy must still be handled, not dropped with its
+ * EV_DISPATCH knote left disabled.
+ */
+static void
+test_libkqueue_workq_destroy_shrinking(struct test_context *ctx)
+{
+    struct test_workq_state st = { .mtx = PTHREAD_MUTEX_INITIALIZER };
+    struct kevent_handler kh = { .func = test_libkqueue_workq_handler, .ctx = &st };
+    struct test_workq_race race = { .next = &kh };
+    struct kevent_handler race_kh = { .func = test_libkqueue_workq_race_handler, .ctx = &race };
+    struct kqueue_workq *wq;
+    struct kevent kev, ret;
+    int kqfd, i, pass, calls, rv;
+
+    (void) ctx;
+
+    kqfd = kqueue();
+    if (kqfd < 0)
+        die("kqueue");
+    race.kqfd = kqfd;
+    if (sem_init(&race.running, 0, 0) < 0)
+        die("sem_init");
+
+    for (i = 1; i <= 4; i++) {
+        EV_SET(&kev, i, EVFILT_USER, EV_ADD | EV_CLEAR | EV_DISPATCH, 0, 0, &kh);
+        if (kevent(kqfd, &kev, 1, NULL, 0, NULL) < 0)
+            die("kevent (EV_ADD): %s", strerror(errno));
+    }
+
+    /*
+     * Idle workers time out after a second, destroy at
+     * varying points around that.
+     */
+    for (pass = 0; pass < 4; pass++) {
+        st.calls = 0;
+
+        wq = kqueue_workq_create(kqfd, 1, 4);
+        if (wq == NULL)
+            die("kqueue_workq_create: %s", strerror(errno));
+
+        for (i = 1; i <= 4; i++) {
+            EV_SET(&kev, i, EVFILT_USER, 0, NOTE_TRIGGER, 0, &kh);
+            if (kevent(kqfd, &kev, 1, NULL, 0, NULL) < 0)
+                die("kevent (NOTE_TRIGGER): %s", strerror(errno));
+        }
+        for (i = 0; i < 500; i++) {
+            pthread_mutex_lock(&st.mtx);
+            calls = st.calls;
+            pthread_mutex_unlock(&st.mtx);
+            if (calls >= 4)
+                break;
+            usleep(10000);
+        }
+        if (calls != 4)
+            die("expected 4 handler calls, got %i", calls);
+
+        usleep(900000 + (pass * 50000));
+
+        if (kqueue_workq_destroy(wq) < 0)
+            die("kqueue_workq_destroy: %s", strerror(errno));
+    }
+
+    /* A single worker, busy in a handler while we destroy the pool */
+    st.calls = 0;
+    EV_SET(&kev, 1, EVFILT_USER, EV_ADD, 0, 0, &race_kh);
+    if (kevent(kqfd, &kev, 1, NULL, 0, NULL) < 0)
+        die("kevent (EV_ADD): %s", strerror(errno));
+
+    wq = kqueue_workq_create(kqfd, 1, 1);
+    if (wq == NULL)
+        die("kqueue_workq_create: %s", strerror(errno));
+
+    EV_SET(&kev, 1, EVFILT_USER, 0, NOTE_TRIGGER, 0, &race_kh);
+    if (kevent(kqfd, &kev, 1, NULL, 0, NULL) < 0)
+        die("kevent (NOTE_TRIGGER): %s", strerror(errno));
+    while (sem_wait(&race.running) < 0) {
+        if (errno != EINTR)
+            die("sem_wait");
+    }
+    if (kqueue_workq_destroy(wq) < 0)
+        die("kqueue_workq_destroy: %s", strerror(errno));
+
+    /* Either the pool handled it, or it's still pending */
+    rv = kevent(kqfd, NULL, 0, &ret, 1, &(struct timespec){ 0 });
+    if (rv < 0)
+        die("kevent: %s", strerror(errno));
+    if ((rv == 0) && (st.calls == 0))
+        die("event dropped by kqueue_workq_destroy");
+
+    if (rv == 0) {
+        EV_SET(&kev, 2, EVFILT_USER, 0, NOTE_TRIGGER, 0, &kh);
+        if (kevent(kqfd, &kev, 1, &ret, 1, &(struct timespec){ .tv_sec = 1 }) != 1)
+            die("EV_DISPATCH knote left disabled by kqueue_workq_destroy");
+    }
+
+    sem_destroy(&race.running);
+    close(kqfd);
+}
+
+/*
+ * The NOTE_POLL_FD descriptor must poll readable exactly while
+ * kevent() has something to return, both to poll() and when it's
+ * nested in a second kqueue.
+ */
+static void
+test_libkqueue_poll_fd(struct test_context *ctx)
+{
+    struct kevent   kev, ret[1];
+    struct pollfd   pfd;
+    int             outer;
+
+    EV_SET(&kev, 0, EVFILT_LIBKQUEUE, EV_ADD, NOTE_POLL_FD, 0, NULL);
+    if (kevent(ctx->kqfd, &kev, 1, ret, 1, NULL) != 1)
+        die("kevent (NOTE_POLL_FD): %s", strerror(errno));
+    if (ret[0].data < 0)
+        die("NOTE_POLL_FD returned an invalid descriptor %s", kevent_to_str(&ret[0]));
+    pfd = (struct pollfd){ .fd = (int)ret[0].data, .events = POLLIN };
+
+    if (poll(&pfd, 1, 0) != 0)
+        die("NOTE_POLL_FD descriptor readable with no events pending");
+
+    outer = kqueue();
+    if (outer < 0)
+        die("kqueue");
+    kevent_add(outer, &kev, pfd.fd, EVFILT_READ, EV_ADD, 0, 0, NULL);
+
+    kevent_add(ctx->kqfd, &kev, 1, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, NULL);
+    kevent_add(ctx->kqfd, &kev, 1, EVFILT_USER, 0, NOTE_TRIGGER, 0, NULL);
+
+    if (poll(&pfd, 1, 1000) != 1)
+        die("NOTE_POLL_FD descriptor not readable with an event pending");
+    if (kevent(outer, NULL, 0, ret, 1, &(struct timespec){ .tv_sec = 1 }) != 1)
+        die("nested kqueue didn't report the inner kqueue as readable");
+    if ((ret[0].filter != EVFILT_READ) || (ret[0].ident != (uintptr_t)pfd.fd))
+        die("unexpected event from nested kqueue %s", kevent_to_str(&ret[0]));
+
+    if (kevent(ctx->kqfd, NULL, 0, ret, 1, &(struct timespec){ 0 }) != 1)
+        die("expected the EVFILT_USER event");
+    if (poll(&pfd, 1, 0) != 0)
+        die("NOTE_POLL_FD descriptor still readable after events were drained");
+
+    close(outer);
+    kevent_add(ctx->kqfd, &kev, 1, EVFILT_USER, EV_DELETE, 0, 0, NULL);
+}
+
+/*
+ * With a NOTE_COALESCE window on EVFILT_READ, a socket with
+ * unread data is reported once, then held back until the window
+ * ends, then reported again with everything queued in between.
+ */
+static void
+test_libkqueue_coalesce(struct test_context *ctx)
+{
+    struct kevent   kev, ret[1];
+    int             kqfd, sv[2];
+    struct timespec start, end;
+    long            elapsed_ms;
+
+    (void) ctx;
+
+    kqfd = kqueue();
+    if (kqfd < 0)
+        die("kqueue");
+
+    EV_SET(&kev, EVFILT_USER, EVFILT_LIBKQUEUE, EV_ADD, NOTE_COALESCE, 1000, NULL);
+    errno = 0;
+    if ((kevent(kqfd, &kev, 1, NULL, 0, NULL) >= 0) || (errno != EINVAL))
+        die("NOTE_COALESCE on EVFILT_USER should have failed with EINVAL");
+    EV_SET(&kev, EVFILT_READ, EVFILT_LIBKQUEUE, EV_ADD, NOTE_COALESCE, -1, NULL);
+    errno = 0;
+    if ((kevent(kqfd, &kev, 1, NULL, 0, NULL) >= 0) || (errno != EINVAL))
+        die("NOTE_COALESCE -1 should have failed with EINVAL");
+    EV_SET(&kev, EVFILT_READ, EVFILT_LIBKQUEUE, EV_ADD, NOTE_COALESCE, INTPTR_MAX, NULL);
+    errno = 0;
+    if ((sizeof(intptr_t) == sizeof(int64_t)) &&
+        ((kevent(kqfd, &kev, 1, NULL, 0, NULL) >= 0) || (errno != EINVAL)))
+        die("NOTE_COALESCE INTPTR_MAX should have failed with EINVAL");
+
+    EV_SET(&kev, EVFILT_READ, EVFILT_LIBKQUEUE, EV_ADD, NOTE_COALESCE, 100000, NULL);
+    if (kevent(kqfd, &kev, 1, NULL, 0, NULL) < 0)
+        die("kevent (NOTE_COALESCE): %s", strerror(errno));
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+        die("socketpair");
+    kevent_add(kqfd, &kev, sv[0], EVFILT_READ, EV_ADD, 0, 0, NULL);
+
+    if (write(sv[1], "x", 1) != 1)
+        die("write");
+    if (kevent(kqfd, NULL, 0, ret, 1, &(struct timespec){ .tv_sec = 1 }) != 1)
+        die("expected the first EVFILT_READ event");
+    if (ret[0].data != 1)
+        die("expected 1 byte pending, got %s", kevent_to_str(&ret[0]));
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    /* Still readable, but held back for the rest of the window */
+    if (write(sv[1], "x", 1) != 1)
+        die("write");
+    if (kevent(kqfd, NULL, 0, ret, 1, &(struct timespec){ 0 }) != 0)
+        die("event wasn't held back by NOTE_COALESCE %s", kevent_to_str(&ret[0]));
+
+    if (kevent(kqfd, NULL, 0, ret, 1, &(struct timespec){ .tv_sec = 5 }) != 1)
+        die("expected an EVFILT_READ event once the window ended");
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (ret[0].data != 2)
+        die("expected both bytes to be reported, got %s", kevent_to_str(&ret[0]));
+
+    elapsed_ms = (long)(end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+    if ((elapsed_ms < 80) || (elapsed_ms > 2000))
+        die("expected the event after ~100ms, got it after %ldms", elapsed_ms);
+
+    /*
+     * A wait with no timeout, started while the knote is held
+     * back, mustn't sleep past the end of the window.
+     */
+    if (write(sv[1], "x", 1) != 1)
+        die("write");
+    if (kevent(kqfd, NULL, 0, ret, 1, NULL) != 1)
+        die("expected an EVFILT_READ event once the window ended");
+    if (ret[0].data != 3)
+        die("expected all three bytes to be reported, got %s", kevent_to_str(&ret[0]));
+
+    close(sv[0]);
+    close(sv[1]);
+    close(kqfd);
+}
+
 struct fork_no_hang_args {
     struct test_context *ctx;
     sem_t               *ready;
@@ -155,11 +933,10 @@ test_libkqueue_fork_no_hang(struct test_context *ctx)
 #if defined(LIBKQUEUE_BACKEND_POSIX)
 /*
  * NOTE_FILE_POLL_INTERVAL is the POSIX-backend hook for tuning how
- * the wait loop handles "only always-ready knotes" state (regular
- * file knotes with nothing else registered).  Default 0 ==
- * sched_yield + timeout=0; positive values clamp pselect to that
- * many nanoseconds.  Other backends return ENOSYS because they
- * have kernel-driven file-knote dispatch.
+ * often regular file and vnode knotes are fstat polled.  Default 0
+ * == adaptive per-knote backoff; positive values pin the interval
+ * to that many nanoseconds.  Other backends return ENOSYS because
+ * they have kernel-driven file-knote dispatch.
  */
 static void
 test_libkqueue_file_poll_interval_set(struct test_context *ctx)
@@ -258,6 +1035,74 @@ test_libkqueue_file_poll_interval_sleeps(struct test_context *ctx)
     close(rfd);
     unlink(path);
 }
+
+/*
+ * With the default adaptive interval an idle file knote backs off
+ * to one fstat every ~100ms, so a 500ms wait should only take a
+ * handful of syscalls.  Expiries which find nothing
+ * must not surface as empty wakeups either.  A write is still
+ * picked up promptly once the knote has backed off.
+ */
+static void
+test_libkqueue_file_poll_backoff(struct test_context *ctx)
+{
+    struct kevent           kev, ret[1], receipt;
+    struct libkqueue_stats  before, after;
+    char                    path[1024];
+    int                     rfd, wfd;
+
+    snprintf(path, sizeof(path), "%s/libkqueue-test-XXXXXX", test_tmpdir());
+    wfd = mkstemp(path);
+    if (wfd < 0) die("mkstemp");
+
+    rfd = open(path, O_RDONLY);
+    if (rfd < 0) die("open");
+
+    EV_SET(&kev, 0, EVFILT_LIBKQUEUE, EV_ADD, NOTE_FILE_POLL_INTERVAL, 0, NULL);
+    if (kevent(ctx->kqfd, &kev, 1, NULL, 0, NULL) < 0)
+        die("reset interval: %s", strerror(errno));
+
+    EV_SET(&kev, rfd, EVFILT_READ, EV_ADD, 0, 0, &rfd);
+    if (kevent(ctx->kqfd, &kev, 1, NULL, 0, NULL) < 0)
+        die("EV_ADD: %s", strerror(errno));
+
+    EV_SET(&kev, 0, EVFILT_LIBKQUEUE, EV_ADD, NOTE_STATS, 0, &before);
+    if (kevent(ctx->kqfd, &kev, 1, &receipt, 1, &(struct timespec){}) != 1)
+        die("kevent (NOTE_STATS): %s", strerror(errno));
+
+    if (kevent(ctx->kqfd, NULL, 0, ret, 1,
+               &(struct timespec){ .tv_sec = 0, .tv_nsec = 500 * 1000 * 1000 }) != 0)
+        die("expected timeout on a zero-byte file");
+
+    EV_SET(&kev, 0, EVFILT_LIBKQUEUE, EV_ADD, NOTE_STATS, 0, &after);
+    if (kevent(ctx->kqfd, &kev, 1, &receipt, 1, &(struct timespec){}) != 1)
+        die("kevent (NOTE_STATS): %s", strerror(errno));
+
+    /*
+     * ~10 expiries while backing off from 1ms, then every ~100ms,
+     * each costing a poll, fstat and lseek.
+     */
+    if (after.syscalls - before.syscalls > 60)
+        die("%llu syscalls in 500ms idle, expected backoff",
+            (unsigned long long)(after.syscalls - before.syscalls));
+    if (after.empty_wakeups != before.empty_wakeups)
+        die("poll timer expiries surfaced as %llu empty wakeups",
+            (unsigned long long)(after.empty_wakeups - before.empty_wakeups));
+
+    if (write(wfd, "x", 1) != 1)
+        die("write");
+    if (kevent(ctx->kqfd, NULL, 0, ret, 1,
+               &(struct timespec){ .tv_sec = 1, .tv_nsec = 0 }) != 1)
+        die("write to backed off file knote wasn't detected");
+    if (ret[0].ident != (uintptr_t)rfd || ret[0].data != 1)
+        die("unexpected event ident=%d data=%d", (int)ret[0].ident, (int)ret[0].data);
+
+    EV_SET(&kev, rfd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+    kevent(ctx->kqfd, &kev, 1, NULL, 0, NULL);
+    close(rfd);
+    close(wfd);
+    unlink(path);
+}
 #else
 /*
  * Backends with kernel-driven file-knote dispatch
@@ -292,6 +1137,80 @@ const struct lkq_test_case lkq_libkqueue_tests[] = {
         .desc  = "EVFILT_LIBKQUEUE NOTE_VERSION_STR returns version string",
         .func  = test_libkqueue_version_str,
     },
+    {
+        .name  = "test_libkqueue_stats",
+        .desc  = "EVFILT_LIBKQUEUE NOTE_STATS returns hot-path counters",
+        .func  = test_libkqueue_stats,
+    },
+    {
+        .name  = "test_libkqueue_trace",
+        .desc  = "EVFILT_LIBKQUEUE NOTE_TRACE records and NOTE_TRACE_DUMP dumps",
+        .func  = test_libkqueue_trace,
+    },
+    {
+        .name  = "test_libkqueue_lockstat",
+        .desc  = "EVFILT_LIBKQUEUE NOTE_LOCKSTAT returns lock contention stats",
+        .func  = test_libkqueue_lockstat,
+    },
+    {
+        .name  = "test_libkqueue_batch",
+        .desc  = "EVFILT_LIBKQUEUE NOTE_BATCH holds events back until a batch is ready",
+        .func  = test_libkqueue_batch,
+    },
+    {
+        .name  = "test_libkqueue_priority",
+        .desc  = "EVFILT_LIBKQUEUE NOTE_PRIORITY copies out higher priority filters first",
+        .func  = test_libkqueue_priority,
+        .gates = TEST_GATES(
+            GATE(LKQ_PLATFORM_BACKEND_SOLARIS, "Solaris backend doesn't support NOTE_PRIORITY"),
+            GATE(LKQ_PLATFORM_BACKEND_WINDOWS, "Windows backend doesn't support NOTE_PRIORITY")
+        ),
+    },
+    {
+        .name  = "test_libkqueue_dispatch",
+        .desc  = "kevent_dispatch() calls the handler registered in each event's udata",
+        .func  = test_libkqueue_dispatch,
+    },
+#ifndef _WIN32
+    {
+        .name  = "test_libkqueue_pwait",
+        .desc  = "kevent_pwait() installs its signal mask for the wait",
+        .func  = test_libkqueue_pwait,
+    },
+    {
+        .name  = "test_libkqueue_workq",
+        .desc  = "kqueue_workq runs handlers across threads, one at a time per knote",
+        .func  = test_libkqueue_workq,
+        .gates = TEST_GATES(
+            GATE(LKQ_PLATFORM_BACKEND_SOLARIS, "Solaris backend not yet verified with kqueue_workq")
+        ),
+    },
+    {
+        .name  = "test_libkqueue_workq_destroy_shrinking",
+        .desc  = "kqueue_workq_destroy() waits for shrinking workers and keeps racing events",
+        .func  = test_libkqueue_workq_destroy_shrinking,
+        .gates = TEST_GATES(
+            GATE(LKQ_PLATFORM_BACKEND_SOLARIS, "Solaris backend not yet verified with kqueue_workq")
+        ),
+    },
+    {
+        .name  = "test_libkqueue_poll_fd",
+        .desc  = "EVFILT_LIBKQUEUE NOTE_POLL_FD is readable while events are pending",
+        .func  = test_libkqueue_poll_fd,
+        .gates = TEST_GATES(
+            GATE(LKQ_PLATFORM_BACKEND_POSIX, "POSIX backend doesn't support NOTE_POLL_FD"),
+            GATE(LKQ_PLATFORM_BACKEND_SOLARIS, "Solaris backend doesn't support NOTE_POLL_FD")
+        ),
+    },
+    {
+        .name  = "test_libkqueue_coalesce",
+        .desc  = "EVFILT_LIBKQUEUE NOTE_COALESCE reports a knote at most once per window",
+        .func  = test_libkqueue_coalesce,
+        .gates = TEST_GATES(
+            GATE(LKQ_PLATFORM_BACKEND_SOLARIS, "Solaris backend doesn't support NOTE_COALESCE")
+        ),
+    },
+#endif
 #if defined(LIBKQUEUE_BACKEND_POSIX)
     {
         .name  = "test_libkqueue_file_poll_interval_set",
@@ -308,6 +1227,11 @@ const struct lkq_test_case lkq_libkqueue_tests[] = {
         .desc  = "POSIX backend polls at NOTE_FILE_POLL_INTERVAL cadence",
         .func  = test_libkqueue_file_poll_interval_sleeps,
     },
+    {
+        .name  = "test_libkqueue_file_poll_backoff",
+        .desc  = "POSIX backend backs off fstat polling of idle files",
+        .func  = test_libkqueue_file_poll_backoff,
+    },
 #else
     {
         .name  = "test_libkqueue_file_poll_interval_unsupported",
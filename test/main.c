@@ -602,6 +602,9 @@ extern const struct lkq_test_case lkq_write_tests[];
 #ifdef EVFILT_USER
 extern const struct lkq_test_case lkq_user_tests[];
 #endif
+#if defined(EVFILT_AIO) && defined(LIBKQUEUE_BACKEND_LINUX)
+extern const struct lkq_test_case lkq_aio_tests[];
+#endif
 #if defined(EVFILT_LIBKQUEUE) && !defined(_WIN32)
 extern const struct lkq_test_case lkq_libkqueue_tests[];
 #endif
@@ -635,6 +638,9 @@ static const struct lkq_filter_entry lkq_filter_table[] = {
 #ifdef EVFILT_USER
     { "user",      lkq_user_tests      },
 #endif
+#if defined(EVFILT_AIO) && defined(LIBKQUEUE_BACKEND_LINUX)
+    { "aio",       lkq_aio_tests       },
+#endif
 #if defined(EVFILT_LIBKQUEUE) && !defined(_WIN32)
     { "libkqueue", lkq_libkqueue_tests },
 #endif
@@ -728,6 +734,7 @@ usage(void)
            "timer "
            "vnode "
            "user "
+           "aio "
            "libkqueue]\n"
            "           All tests are run by default\n"
            "\n"
@@ -866,6 +873,12 @@ main(int argc, char **argv)
           .ut_func = test_evfilt_user,
           .ut_end = INT_MAX },
 #endif
+#if defined(EVFILT_AIO) && defined(LIBKQUEUE_BACKEND_LINUX)
+        { .ut_name = "aio",
+          .ut_enabled = 1,
+          .ut_func = test_evfilt_aio,
+          .ut_end = INT_MAX },
+#endif
 #if defined(EVFILT_LIBKQUEUE) && !defined(_WIN32)
         { .ut_name = "libkqueue",
           .ut_enabled = 1,
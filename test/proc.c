@@ -925,6 +925,37 @@ test_kevent_proc_udata_preserved(struct test_context *ctx)
     waitpid(child, NULL, 0);
 }
 
+/*
+ * Two EV_ADDs for the same pid in one changelist register a single
+ * knote, which delivers NOTE_EXIT once.
+ */
+static void
+test_kevent_proc_add_twice_one_call(struct test_context *ctx)
+{
+    struct kevent kev[2], buf;
+    pid_t         child;
+
+    child = fork();
+    if (child == 0) {
+        pause();
+        _exit(0);
+    }
+
+    EV_SET(&kev[0], child, EVFILT_PROC, EV_ADD, NOTE_EXIT, 0, NULL);
+    EV_SET(&kev[1], child, EVFILT_PROC, EV_ADD, NOTE_EXIT, 0, &kev[1]);
+    if (kevent(ctx->kqfd, kev, 2, NULL, 0, NULL) < 0)
+        die("kevent");
+
+    kill_or_die(child, SIGKILL);
+    if (kevent(ctx->kqfd, NULL, 0, &buf, 1, &(struct timespec){ .tv_sec = 5 }) != 1)
+        die("expected NOTE_EXIT");
+    if ((buf.ident != (uintptr_t)child) || (buf.udata != &kev[1]))
+        die("unexpected event %s", kevent_to_str(&buf));
+    test_no_kevents(ctx->kqfd);
+
+    waitpid(child, NULL, 0);
+}
+
 /*
  * EV_RECEIPT echoes the kev with EV_ERROR=0.
  */
@@ -1077,13 +1108,13 @@ test_kevent_proc_exit_signal_decode(struct test_context *ctx)
  * (slow) or sysctl knobs the test framework doesn't expose.
  */
 static void
-test_kevent_proc_fork_storm(struct test_context *ctx)
+proc_fork_storm(struct test_context *ctx, int n_children)
 {
-    enum { N_CHILDREN = 32 };
-    struct kevent kev;
-    pid_t         pids[N_CHILDREN];
+    struct kevent kev, *ret;
+    pid_t         *pids;
     int           sync_pipe[2];
-    int           seen[N_CHILDREN] = { 0 };
+    int           *seen;
+    char          *go;
     int           i;
     int           total_seen = 0;
     unsigned int  fflags = NOTE_EXIT;
@@ -1092,10 +1123,16 @@ test_kevent_proc_fork_storm(struct test_context *ctx)
     fflags |= NOTE_EXITSTATUS;
 #endif
 
+    pids = calloc(n_children, sizeof(*pids));
+    seen = calloc(n_children, sizeof(*seen));
+    go = malloc(n_children);
+    ret = calloc(n_children, sizeof(*ret));
+    if (!pids || !seen || !go || !ret) die("calloc");
+
     if (pipe(sync_pipe) < 0) die("pipe");
 
     /* Spawn children that wait on the gate. */
-    for (i = 0; i < N_CHILDREN; i++) {
+    for (i = 0; i < n_children; i++) {
         pid_t p = fork();
         if (p < 0) {
             close(sync_pipe[0]);
@@ -1115,32 +1152,28 @@ test_kevent_proc_fork_storm(struct test_context *ctx)
     close(sync_pipe[0]);
 
     /* Register all watches. */
-    for (i = 0; i < N_CHILDREN; i++) {
+    for (i = 0; i < n_children; i++) {
         EV_SET(&kev, pids[i], EVFILT_PROC, EV_ADD, fflags, 0, NULL);
         if (kevent(ctx->kqfd, &kev, 1, NULL, 0, NULL) < 0)
             die("kevent EV_ADD pid=%d", pids[i]);
     }
 
     /* Open the floodgate: write N bytes so all children read and exit. */
-    {
-        char go[N_CHILDREN];
-        memset(go, 'g', sizeof(go));
-        if (write(sync_pipe[1], go, sizeof(go)) != (ssize_t) sizeof(go))
-            die("write");
-    }
+    memset(go, 'g', n_children);
+    if (write(sync_pipe[1], go, n_children) != (ssize_t) n_children)
+        die("write");
     close(sync_pipe[1]);
 
     /* Drain until we've collected one NOTE_EXIT per child or time out. */
     {
-        struct kevent ret[N_CHILDREN];
         struct timespec timeout = { 5, 0 };
-        while (total_seen < N_CHILDREN) {
+        while (total_seen < n_children) {
             int n = kevent(ctx->kqfd, NULL, 0, ret,
-                           N_CHILDREN - total_seen, &timeout);
+                           n_children - total_seen, &timeout);
             if (n <= 0) break;
             for (int j = 0; j < n; j++) {
                 if (!(ret[j].fflags & NOTE_EXIT)) continue;
-                for (int k = 0; k < N_CHILDREN; k++) {
+                for (int k = 0; k < n_children; k++) {
                     if (pids[k] == (pid_t) ret[j].ident && !seen[k]) {
                         seen[k] = 1;
                         total_seen++;
@@ -1151,13 +1184,35 @@ test_kevent_proc_fork_storm(struct test_context *ctx)
         }
     }
 
-    if (total_seen != N_CHILDREN)
+    if (total_seen != n_children)
         die("fork-storm: expected %d NOTE_EXIT events, got %d",
-            N_CHILDREN, total_seen);
+            n_children, total_seen);
 
     /* Reap. */
-    for (i = 0; i < N_CHILDREN; i++)
+    for (i = 0; i < n_children; i++)
         waitpid(pids[i], NULL, 0);
+
+    free(ret);
+    free(go);
+    free(seen);
+    free(pids);
+}
+
+static void
+test_kevent_proc_fork_storm(struct test_context *ctx)
+{
+    proc_fork_storm(ctx, 32);
+}
+
+/*
+ * More children than the POSIX backend's PID index starts with
+ * (64 buckets), so the index is rehashed as the watches are added,
+ * and each SIGCHLD pass batches many exits into one kqueue wake.
+ */
+static void
+test_kevent_proc_many_children(struct test_context *ctx)
+{
+    proc_fork_storm(ctx, 200);
 }
 
 static const struct lkq_test_gate proc_modify_disarms_gates[] =
@@ -1265,6 +1320,11 @@ const struct lkq_test_case lkq_proc_tests[] =
         .desc  = "udata round-trips unchanged through NOTE_EXIT delivery",
         .func  = test_kevent_proc_udata_preserved,
     },
+    {
+        .name  = "test_kevent_proc_add_twice_one_call",
+        .desc  = "two EV_ADDs for one pid in a changelist register one knote",
+        .func  = test_kevent_proc_add_twice_one_call,
+    },
     {
         .name  = "test_kevent_proc_receipt_preserved",
         .desc  = "EV_RECEIPT echoes the kev with EV_ERROR=0",
@@ -1289,6 +1349,11 @@ const struct lkq_test_case lkq_proc_tests[] =
         .desc  = "many concurrent child exits all deliver NOTE_EXIT",
         .func  = test_kevent_proc_fork_storm,
     },
+    {
+        .name  = "test_kevent_proc_many_children",
+        .desc  = "NOTE_EXIT delivered for each of more children than the PID index starts with",
+        .func  = test_kevent_proc_many_children,
+    },
     LKQ_SUITE_END
 };
 
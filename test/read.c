@@ -17,6 +17,11 @@
 
 #include "common.h"
 
+#ifndef _WIN32
+#include <sys/resource.h>
+#include <sys/un.h>
+#endif
+
 /*
  * DragonFly's filt_soread/filt_piperead raise extra EOF sub-flags that the
  * other kqueue kernels don't.  At EOF (SS_CANTRCVMORE / PIPE_REOF) it sets
@@ -1044,6 +1049,58 @@ test_transition_from_write_to_read(struct test_context *ctx)
     close(sd[1]);
     close(kqfd);
 }
+
+/*
+ * Descriptors numbered above the historical FD_SETSIZE (1024)
+ * must be watchable; select(2) based backends can't do this.
+ */
+static void
+test_kevent_read_high_fd(struct test_context *ctx)
+{
+    struct kevent kev, ret[1];
+    struct rlimit rl, saved_rl;
+    int pfd[2], rfd, wfd;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0)
+        die("getrlimit");
+    saved_rl = rl;
+    if (rl.rlim_cur < 2048) {
+        if (rl.rlim_max < 2048)
+            return; /* Can't get an fd that high */
+        rl.rlim_cur = 2048;
+        if (setrlimit(RLIMIT_NOFILE, &rl) < 0)
+            die("setrlimit");
+    }
+
+    if (pipe(pfd) < 0)
+        die("pipe");
+    if ((rfd = fcntl(pfd[0], F_DUPFD, 1500)) < 0)
+        die("fcntl(F_DUPFD)");
+    if ((wfd = fcntl(pfd[1], F_DUPFD, 1500)) < 0)
+        die("fcntl(F_DUPFD)");
+    close(pfd[0]);
+    close(pfd[1]);
+
+    EV_SET(&kev, rfd, EVFILT_READ, EV_ADD, 0, 0, NULL);
+    kevent_rv_cmp(0, kevent(ctx->kqfd, &kev, 1, NULL, 0, NULL));
+    test_no_kevents(ctx->kqfd);
+
+    if (write(wfd, ".", 1) != 1)
+        die("write");
+    kevent_get(ret, NUM_ELEMENTS(ret), ctx->kqfd, 1);
+    if ((ret[0].ident != (uintptr_t)rfd) || (ret[0].filter != EVFILT_READ))
+        die("unexpected event: %s", kevent_to_str(&ret[0]));
+
+    EV_SET(&kev, rfd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+    kevent_rv_cmp(0, kevent(ctx->kqfd, &kev, 1, NULL, 0, NULL));
+
+    close(rfd);
+    close(wfd);
+
+    /* Put the limit back, so later tests see the process' usual one */
+    if (setrlimit(RLIMIT_NOFILE, &saved_rl) < 0)
+        die("setrlimit");
+}
 #endif /* !_WIN32 */
 
 /*
@@ -1254,6 +1311,186 @@ test_kevent_read_listen_backlog_count(struct test_context *ctx)
     close(lst);
 }
 
+#if defined(NOTE_LISTEN_BACKLOG) && !defined(_WIN32)
+/** Turn NOTE_LISTEN_BACKLOG on or off, returning the previous setting
+ */
+static intptr_t
+listen_backlog_set(int kqfd, intptr_t on)
+{
+    struct kevent kev, receipt;
+
+    EV_SET(&kev, 0, EVFILT_LIBKQUEUE, EV_ADD | EV_RECEIPT, NOTE_LISTEN_BACKLOG, on, NULL);
+    if (kevent(kqfd, &kev, 1, &receipt, 1, NULL) != 1)
+        die("kevent (NOTE_LISTEN_BACKLOG)");
+
+    return receipt.data;
+}
+
+static intptr_t
+listen_backlog_get(int kqfd, int lst)
+{
+    struct kevent kev, ret[1];
+
+    EV_SET(&kev, lst, EVFILT_READ, EV_ADD | EV_ONESHOT, 0, 0, NULL);
+    if (kevent(kqfd, &kev, 1, NULL, 0, NULL) < 0)
+        die("kevent");
+    kevent_get(ret, NUM_ELEMENTS(ret), kqfd, 1);
+
+    return ret[0].data;
+}
+
+/*
+ * With NOTE_LISTEN_BACKLOG set, kev.data on TCP and unix domain
+ * listeners is the exact number of pending connections, and
+ * tracks accepts.  Without it, it's 1.
+ */
+static void
+test_kevent_read_listen_backlog_opt_in(struct test_context *ctx)
+{
+    struct sockaddr_in sain;
+    struct sockaddr_un saun;
+    socklen_t          slen = sizeof(sain);
+    int                tcp, unx, c[5], i, fd;
+    intptr_t           data;
+
+    memset(&sain, 0, sizeof(sain));
+    sain.sin_family      = AF_INET;
+    sain.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if ((tcp = socket(AF_INET, SOCK_STREAM, 0)) < 0) die("socket(tcp)");
+    if (bind(tcp, (struct sockaddr *)&sain, slen) < 0) die("bind");
+    if (getsockname(tcp, (struct sockaddr *)&sain, &slen) < 0) die("getsockname");
+    if (listen(tcp, 8) < 0) die("listen");
+
+    /* Abstract address, nothing to clean up */
+    memset(&saun, 0, sizeof(saun));
+    saun.sun_family = AF_UNIX;
+    snprintf(saun.sun_path + 1, sizeof(saun.sun_path) - 1, "libkqueue-backlog-%d", (int)getpid());
+    if ((unx = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) die("socket(unix)");
+    if (bind(unx, (struct sockaddr *)&saun, sizeof(saun)) < 0) die("bind");
+    if (listen(unx, 8) < 0) die("listen");
+
+    for (i = 0; i < 2; i++) {
+        if ((c[i] = socket(AF_INET, SOCK_STREAM, 0)) < 0) die("socket");
+        if (connect(c[i], (struct sockaddr *)&sain, slen) < 0) die("connect");
+    }
+    for (; i < 5; i++) {
+        if ((c[i] = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) die("socket");
+        if (connect(c[i], (struct sockaddr *)&saun, sizeof(saun)) < 0) die("connect");
+    }
+    usleep(10 * 1000);      /* let the TCP handshakes complete */
+
+    if ((data = listen_backlog_get(ctx->kqfd, tcp)) != 1)
+        die("expected data 1 without NOTE_LISTEN_BACKLOG, got %lld", (long long)data);
+
+    if (listen_backlog_set(ctx->kqfd, 1) != 0)
+        die("NOTE_LISTEN_BACKLOG should default to off");
+    if ((data = listen_backlog_get(ctx->kqfd, tcp)) != 2)
+        die("expected 2 pending TCP connections, got %lld", (long long)data);
+    if ((data = listen_backlog_get(ctx->kqfd, unx)) != 3)
+        die("expected 3 pending unix connections, got %lld", (long long)data);
+
+    if ((fd = accept(unx, NULL, NULL)) < 0) die("accept");
+    close(fd);
+    if ((data = listen_backlog_get(ctx->kqfd, unx)) != 2)
+        die("expected 2 pending unix connections after accept, got %lld", (long long)data);
+
+    if (listen_backlog_set(ctx->kqfd, 0) != 1)
+        die("NOTE_LISTEN_BACKLOG receipt should hold the previous setting");
+
+    for (i = 0; i < 5; i++)
+        close(c[i]);
+    close(unx);
+    close(tcp);
+}
+#endif
+
+#if defined(NOTE_BATCH_CHANGES) && !defined(_WIN32)
+static intptr_t
+batch_changes_set(int kqfd, intptr_t on)
+{
+    struct kevent kev, receipt;
+
+    EV_SET(&kev, 0, EVFILT_LIBKQUEUE, EV_ADD | EV_RECEIPT, NOTE_BATCH_CHANGES, on, NULL);
+    if (kevent(kqfd, &kev, 1, &receipt, 1, NULL) != 1)
+        die("kevent (NOTE_BATCH_CHANGES)");
+    if ((receipt.flags & EV_ERROR) && (receipt.data != 0))
+        return -receipt.data;
+
+    return receipt.data;
+}
+
+/*
+ * With NOTE_BATCH_CHANGES the registrations for a changelist are
+ * submitted together once it's been processed.  One the kernel
+ * rejects (epoll won't take /dev/null) must still produce an
+ * EV_ERROR for its change and leave no knote behind, without
+ * upsetting the changes either side of it.
+ */
+static void
+test_kevent_socket_batch_changes(struct test_context *ctx)
+{
+    struct kevent changes[9], ret[9], kev;
+    int           sv[4][2], devnull, i, n;
+    intptr_t      old;
+
+    if ((old = batch_changes_set(ctx->kqfd, 1)) == -ENOTSUP)
+        return;                 /* kernel can't submit epoll_ctl via io_uring */
+    if (old != 0)
+        die("NOTE_BATCH_CHANGES should default to off, got %lld", (long long)old);
+
+    if ((devnull = open("/dev/null", O_RDONLY)) < 0) die("open(/dev/null)");
+    for (i = 0; i < 4; i++) {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv[i]) < 0) die("socketpair");
+        EV_SET(&changes[i < 2 ? i : i + 1], sv[i][0], EVFILT_READ, EV_ADD, 0, 0, NULL);
+        EV_SET(&changes[5 + i], sv[i][1], EVFILT_WRITE, EV_ADD | EV_ONESHOT, 0, 0, NULL);
+    }
+    EV_SET(&changes[2], devnull, EVFILT_READ, EV_ADD, 0, 0, &devnull);
+
+    /* The error, then the four writable sockets */
+    n = kevent(ctx->kqfd, changes, NUM_ELEMENTS(changes), ret, NUM_ELEMENTS(ret), &(struct timespec){ 0, 0 });
+    if (n != 5)
+        die("expected 5 events, got %d", n);
+    if (!(ret[0].flags & EV_ERROR) || (ret[0].ident != (uintptr_t)devnull) ||
+        (ret[0].data != EPERM) || (ret[0].udata != &devnull))
+        die("expected EPERM for /dev/null, got %s", kevent_to_str(&ret[0]));
+    for (i = 1; i < n; i++) {
+        if ((ret[i].filter != EVFILT_WRITE) || (ret[i].flags & EV_ERROR))
+            die("unexpected event %s", kevent_to_str(&ret[i]));
+    }
+
+    EV_SET(&kev, devnull, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+    if ((kevent(ctx->kqfd, &kev, 1, NULL, 0, NULL) == 0) || (errno != ENOENT))
+        die("rejected knote wasn't removed");
+
+    /* With nowhere to put the EV_ERROR, kevent() fails with it */
+    EV_SET(&kev, devnull, EVFILT_READ, EV_ADD, 0, 0, NULL);
+    if ((kevent(ctx->kqfd, &kev, 1, NULL, 0, NULL) == 0) || (errno != EPERM))
+        die("expected kevent() to fail with EPERM");
+
+    for (i = 0; i < 4; i++) {
+        if (write(sv[i][1], "x", 1) != 1) die("write");
+    }
+    n = kevent(ctx->kqfd, NULL, 0, ret, NUM_ELEMENTS(ret), &(struct timespec){ 1, 0 });
+    if (n != 4)
+        die("expected 4 read events, got %d", n);
+    for (i = 0; i < n; i++) {
+        if ((ret[i].filter != EVFILT_READ) || (ret[i].data != 1))
+            die("unexpected event %s", kevent_to_str(&ret[i]));
+    }
+
+    if (batch_changes_set(ctx->kqfd, 0) != 1)
+        die("NOTE_BATCH_CHANGES receipt should hold the previous setting");
+
+    for (i = 0; i < 4; i++) {
+        EV_SET(&kev, sv[i][0], EVFILT_READ, EV_DELETE, 0, 0, NULL);
+        if (kevent(ctx->kqfd, &kev, 1, NULL, 0, NULL) < 0) die("kevent(EV_DELETE)");
+        close(sv[i][0]);
+        close(sv[i][1]);
+    }
+    close(devnull);
+}
+#endif
+
 /*
  * Pipe with N bytes written: kev.data must equal N.  Two writes
  * before drain: data carries the total, single event delivered.
@@ -1368,6 +1605,22 @@ static const struct lkq_test_gate read_listen_backlog_gates[] = {
     { 0, NULL }
 };
 
+#if defined(NOTE_LISTEN_BACKLOG) && !defined(_WIN32)
+static const struct lkq_test_gate read_listen_backlog_opt_in_gates[] = {
+    GATE(LKQ_PLATFORM_BACKEND_POSIX | LKQ_PLATFORM_BACKEND_SOLARIS,
+         "NOTE_LISTEN_BACKLOG is only supported by the Linux backend"),
+    { 0, NULL }
+};
+#endif
+
+#if defined(NOTE_BATCH_CHANGES) && !defined(_WIN32)
+static const struct lkq_test_gate read_batch_changes_gates[] = {
+    GATE(LKQ_PLATFORM_BACKEND_POSIX | LKQ_PLATFORM_BACKEND_SOLARIS,
+         "NOTE_BATCH_CHANGES is only supported by the Linux backend"),
+    { 0, NULL }
+};
+#endif
+
 static const struct lkq_test_gate read_socket_eof_with_buffered_gates[] = {
     GATE(LKQ_PLATFORM_BACKEND_POSIX,
          "POSIX backend defers EV_EOF until buffered bytes are drained"),
@@ -1499,6 +1752,22 @@ const struct lkq_test_case lkq_read_tests[] = {
         .func  = test_kevent_read_listen_backlog_count,
         .gates = read_listen_backlog_gates,
     },
+#if defined(NOTE_LISTEN_BACKLOG) && !defined(_WIN32)
+    {
+        .name  = "test_kevent_read_listen_backlog_opt_in",
+        .desc  = "NOTE_LISTEN_BACKLOG reports the exact accept queue depth",
+        .func  = test_kevent_read_listen_backlog_opt_in,
+        .gates = read_listen_backlog_opt_in_gates,
+    },
+#endif
+#if defined(NOTE_BATCH_CHANGES) && !defined(_WIN32)
+    {
+        .name  = "test_kevent_socket_batch_changes",
+        .desc  = "NOTE_BATCH_CHANGES reports registrations the kernel rejects as EV_ERROR",
+        .func  = test_kevent_socket_batch_changes,
+        .gates = read_batch_changes_gates,
+    },
+#endif
     {
         .name  = "test_kevent_read_pipe_data_exact_count",
         .desc  = "kev.data equals the total bytes pending in a pipe",
@@ -1558,6 +1827,14 @@ const struct lkq_test_case lkq_read_tests[] = {
         .func  = TEST_FUNC_NEEDS_POSIX(test_transition_from_write_to_read),
         .gates = read_transition_write_to_read_gates,
     },
+    {
+        .name  = "test_kevent_read_high_fd",
+        .desc  = "EVFILT_READ on a descriptor numbered above 1024",
+        .func  = TEST_FUNC_NEEDS_POSIX(test_kevent_read_high_fd),
+        .gates = TEST_GATES(
+            GATE(LKQ_PLATFORM_OS_WINDOWS, "uses pipe() and fcntl(F_DUPFD)")
+        ),
+    },
     LKQ_SUITE_END
 };
 
@@ -602,6 +602,41 @@ test_kevent_timer_multi_kqueue(struct test_context *ctx)
     close(kq2);
 }
 
+/*
+ * More EV_ADDs in one changelist than libkqueue sets up before
+ * locking the kqueue, with ident 0 added twice.  Every timer
+ * fires once, and the second add of ident 0 wins.
+ */
+static void
+test_kevent_timer_add_many_one_call(struct test_context *ctx)
+{
+    struct kevent   kev[25], ret[25];
+    struct timespec timeout = { 1, 0 };
+    bool            seen[24] = { false };
+    int             i, n, total = 0;
+
+    for (i = 0; i < 24; i++)
+        EV_SET(&kev[i], i, EVFILT_TIMER, EV_ADD | EV_ONESHOT, 0, 10, NULL);
+    EV_SET(&kev[24], 0, EVFILT_TIMER, EV_ADD | EV_ONESHOT, 0, 10, &kev[24]);
+    if (kevent(ctx->kqfd, kev, NUM_ELEMENTS(kev), NULL, 0, NULL) < 0)
+        die("kevent");
+
+    while (total < 24) {
+        n = kevent(ctx->kqfd, NULL, 0, ret, NUM_ELEMENTS(ret), &timeout);
+        if (n <= 0)
+            die("only %d of 24 timers fired", total);
+        for (i = 0; i < n; i++) {
+            if ((ret[i].ident >= 24) || seen[ret[i].ident])
+                die("unexpected event %s", kevent_to_str(&ret[i]));
+            if ((ret[i].ident == 0) && (ret[i].udata != &kev[24]))
+                die("second EV_ADD didn't replace udata %s", kevent_to_str(&ret[i]));
+            seen[ret[i].ident] = true;
+        }
+        total += n;
+    }
+    test_no_kevents(ctx->kqfd);
+}
+
 /*
  * Huge interval (NOTE_NSECONDS data near INT64_MAX): the kernel
  * (FreeBSD) clamps via SBT_MAX on LP64; libkqueue must either
@@ -742,6 +777,54 @@ test_kevent_timer_ev_clear_resets_data(struct test_context *ctx)
     kevent_add(ctx->kqfd, &kev, 79, EVFILT_TIMER, EV_DELETE, 0, 0, NULL);
 }
 
+#ifdef NOTE_LEEWAY_PCT
+/*
+ * Timers whose deadlines are a few ms apart, each allowing 50%
+ * leeway, should be delivered by one or two wakeups rather than
+ * one per timer.  Leeway only ever delays a timer, so none may
+ * fire before its deadline.
+ */
+static void
+test_kevent_timer_note_leeway(struct test_context *ctx)
+{
+    struct kevent   kev, ret[5];
+    struct timespec timeout = { 2, 0 };
+    struct timespec t0, t1;
+    long            elapsed_ms;
+    int             i, n, got = 0, calls = 0;
+
+    test_no_kevents(ctx->kqfd);
+
+    if (clock_gettime(CLOCK_MONOTONIC, &t0) < 0) die("clock_gettime");
+    for (i = 0; i < 5; i++) {
+        EV_SET(&kev, 200 + i, EVFILT_TIMER, EV_ADD | EV_ONESHOT,
+               NOTE_LEEWAY_PCT(50), 100 + i, NULL);
+        if (kevent(ctx->kqfd, &kev, 1, NULL, 0, NULL) < 0)
+            die("kevent: %s", strerror(errno));
+    }
+
+    while (got < 5) {
+        n = kevent(ctx->kqfd, NULL, 0, ret, 5 - got, &timeout);
+        if (n < 0)
+            die("kevent: %s", strerror(errno));
+        if (n == 0)
+            die("only %d of 5 timers fired within 2s", got);
+        if (calls == 0) {
+            if (clock_gettime(CLOCK_MONOTONIC, &t1) < 0) die("clock_gettime");
+            elapsed_ms = (t1.tv_sec - t0.tv_sec) * 1000 +
+                         (t1.tv_nsec - t0.tv_nsec) / 1000000;
+            if (elapsed_ms < 100)
+                die("first timer fired after %ldms, before its 100ms deadline", elapsed_ms);
+        }
+        got += n;
+        calls++;
+    }
+
+    if (calls > 2)
+        die("5 timers with leeway took %d wakeups, expected at most 2", calls);
+}
+#endif
+
 static const struct lkq_test_gate timer_negative_interval_gates[] = {
     GATE(LKQ_PLATFORM_NATIVE_NOT_FREEBSD,
          "native kqueue on macOS/OpenBSD/NetBSD/DragonFly accepts negative intervals silently"),
@@ -814,6 +897,11 @@ const struct lkq_test_case lkq_timer_tests[] =
         .desc  = "same timer ident in two kqueues delivers independently",
         .func  = test_kevent_timer_multi_kqueue,
     },
+    {
+        .name  = "test_kevent_timer_add_many_one_call",
+        .desc  = "a long changelist of timer EV_ADDs registers each ident once",
+        .func  = test_kevent_timer_add_many_one_call,
+    },
     {
         .name  = "test_kevent_timer_negative_interval_rejected",
         .desc  = "negative timer interval is rejected with EINVAL",
@@ -945,6 +1033,16 @@ const struct lkq_test_case lkq_timer_tests[] =
             GATE(LKQ_PLATFORM_OS_MACOS, "macOS shared CI runners miss the tight NOTE_ABSOLUTE future-deadline window under scheduling jitter (epoch-ms semantics match; the _past variant runs unguarded)")
         ),
     },
+    {
+        .name  = "test_kevent_timer_note_leeway",
+        .desc  = "NOTE_LEEWAY coalesces nearby timer expirations",
+        .func  = TEST_FUNC_NEEDS_NOTE_LEEWAY_PCT(test_kevent_timer_note_leeway),
+        .gates = TEST_GATES(
+            GATE(TEST_GATE_NEEDS_NOTE_LEEWAY_PCT, "NOTE_LEEWAY_PCT undefined in this build's <sys/event.h>"),
+            GATE(LKQ_PLATFORM_BACKEND_SOLARIS, "Solaris backend ignores NOTE_LEEWAY"),
+            GATE(LKQ_PLATFORM_BACKEND_WINDOWS, "Windows backend ignores NOTE_LEEWAY")
+        ),
+    },
     {
         .name  = "test_kevent_timer_modify_preserves_ev_receipt",
         .desc  = "EV_RECEIPT flag survives a timer knote modify",
@@ -17,6 +17,10 @@
 
 #include "common.h"
 
+#ifndef _WIN32
+#  include <sys/resource.h>
+#endif
+
 static void
 test_kevent_user_add_and_delete(struct test_context *ctx)
 {
@@ -474,6 +478,92 @@ test_kevent_user_modify_clobbers_udata(struct test_context *ctx)
     test_no_kevents(ctx->kqfd);
 }
 
+/*
+ * More triggered knotes than fit in the eventlist must all be
+ * returned over successive kevent() calls.
+ */
+static void
+test_kevent_user_more_than_nevents(struct test_context *ctx)
+{
+    struct kevent kev, ret[1];
+    int i, seen = 0;
+
+    test_no_kevents(ctx->kqfd);
+
+    for (i = 1; i <= 4; i++) {
+        kevent_add(ctx->kqfd, &kev, i, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, NULL);
+        kevent_add(ctx->kqfd, &kev, i, EVFILT_USER, 0, NOTE_TRIGGER, 0, NULL);
+    }
+
+    for (i = 0; i < 4; i++) {
+        kevent_get(ret, NUM_ELEMENTS(ret), ctx->kqfd, 1);
+        if ((ret[0].ident < 1) || (ret[0].ident > 4))
+            die("unexpected event %s", kevent_to_str(ret));
+        seen |= 1 << ret[0].ident;
+    }
+    if (seen != 0x1e)
+        die("expected one event for each of idents 1-4, got mask 0x%x", seen);
+    test_no_kevents(ctx->kqfd);
+
+    for (i = 1; i <= 4; i++)
+        kevent_add(ctx->kqfd, &kev, i, EVFILT_USER, EV_DELETE, 0, 0, NULL);
+}
+
+#ifndef _WIN32
+/*
+ * User knotes don't cost a file descriptor each, so many more of
+ * them can be registered and triggered than there are fds left.
+ */
+static void
+test_kevent_user_no_fd_per_knote(struct test_context *ctx)
+{
+    struct kevent kev, ret[64];
+    struct rlimit curr_rlim, rlim;
+    int i, fd, got = 0;
+
+    test_no_kevents(ctx->kqfd);
+
+    if (getrlimit(RLIMIT_NOFILE, &curr_rlim) < 0)
+        die("getrlimit failed");
+
+    /* Leave a handful of fds free above the lowest one in use */
+    fd = dup(ctx->kqfd);
+    if (fd < 0)
+        die("dup");
+    close(fd);
+    rlim = curr_rlim;
+    rlim.rlim_cur = fd + 8;
+    if (rlim.rlim_cur > curr_rlim.rlim_cur)
+        rlim.rlim_cur = curr_rlim.rlim_cur;
+    if (setrlimit(RLIMIT_NOFILE, &rlim) < 0)
+        die("setrlimit failed");
+
+    for (i = 1; i <= 256; i++) {
+        EV_SET(&kev, i, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, NULL);
+        if (kevent(ctx->kqfd, &kev, 1, NULL, 0, NULL) < 0) {
+            (void) setrlimit(RLIMIT_NOFILE, &curr_rlim);
+            die("EV_ADD of user knote %i failed: %s", i, strerror(errno));
+        }
+        kevent_add(ctx->kqfd, &kev, i, EVFILT_USER, 0, NOTE_TRIGGER, 0, NULL);
+    }
+
+    if (setrlimit(RLIMIT_NOFILE, &curr_rlim) < 0)
+        die("setrlimit failed");
+
+    while (got < 256) {
+        int n = kevent(ctx->kqfd, NULL, 0, ret, NUM_ELEMENTS(ret), &(struct timespec){ 0, 0 });
+
+        if (n <= 0)
+            die("expected 256 events, got %i", got);
+        got += n;
+    }
+    test_no_kevents(ctx->kqfd);
+
+    for (i = 1; i <= 256; i++)
+        kevent_add(ctx->kqfd, &kev, i, EVFILT_USER, EV_DELETE, 0, 0, NULL);
+}
+#endif
+
 /*
  * EV_DELETE on a never-registered ident returns ENOENT.
  */
@@ -881,6 +971,18 @@ const struct lkq_test_case lkq_user_tests[] = {
         .desc  = "multiple NOTE_TRIGGERs between drains coalesce into one event",
         .func  = test_kevent_user_multi_trigger_merged,
     },
+    {
+        .name  = "test_kevent_user_more_than_nevents",
+        .desc  = "triggered knotes beyond nevents are returned by later calls",
+        .func  = test_kevent_user_more_than_nevents,
+    },
+#ifndef _WIN32
+    {
+        .name  = "test_kevent_user_no_fd_per_knote",
+        .desc  = "user knotes can outnumber the fds left under RLIMIT_NOFILE",
+        .func  = test_kevent_user_no_fd_per_knote,
+    },
+#endif
     {
         .name  = "test_kevent_user_del_nonexistent",
         .desc  = "EV_DELETE on a never-registered ident returns ENOENT",
@@ -1020,6 +1020,47 @@ test_kevent_vnode_non_file_rejected(struct test_context *ctx)
     close(pipefd[1]);
 }
 
+/*
+ * More EVFILT_VNODE adds on pipe fds in one changelist than
+ * libkqueue sets up before locking the kqueue, so both paths
+ * see a descriptor with no filesystem path.  Each change gets
+ * its own EV_ERROR entry with EINVAL.
+ */
+static void
+test_kevent_vnode_non_file_many_one_call(struct test_context *ctx)
+{
+    struct kevent kev[20], ret[20];
+    int           pipefd[10][2];
+    int           i, rv;
+
+    for (i = 0; i < 10; i++) {
+        if (pipe(pipefd[i]) < 0)
+            die("pipe");
+        EV_SET(&kev[i * 2], pipefd[i][0], EVFILT_VNODE, EV_ADD, NOTE_ATTRIB, 0, NULL);
+        EV_SET(&kev[(i * 2) + 1], pipefd[i][1], EVFILT_VNODE, EV_ADD, NOTE_ATTRIB, 0, NULL);
+    }
+
+    rv = kevent(ctx->kqfd, kev, NUM_ELEMENTS(kev), ret, NUM_ELEMENTS(ret), &(struct timespec){ 0 });
+    if (rv != NUM_ELEMENTS(kev))
+        die("expected %d EV_ERROR entries, got %d", (int)NUM_ELEMENTS(kev), rv);
+    for (i = 0; i < rv; i++) {
+        if (!(ret[i].flags & EV_ERROR))
+            die("EVFILT_VNODE on pipe accepted: %s", kevent_to_str(&ret[i]));
+        if ((ret[i].data != EINVAL)
+#ifdef __DragonFly__
+            && (ret[i].data != EOPNOTSUPP)
+#endif
+            )
+            die("EVFILT_VNODE on pipe failed with %s, expected EINVAL", strerror((int)ret[i].data));
+    }
+
+    for (i = 0; i < 10; i++) {
+        close(pipefd[i][0]);
+        close(pipefd[i][1]);
+    }
+    test_no_kevents(ctx->kqfd);
+}
+
 /*
  * Flag-behaviour tests.
  */
@@ -1398,6 +1439,11 @@ const struct lkq_test_case lkq_vnode_tests[] =
         .desc  = "EVFILT_VNODE on a pipe fd is rejected with EINVAL",
         .func  = test_kevent_vnode_non_file_rejected,
     },
+    {
+        .name  = "kevent_vnode_non_file_many_one_call",
+        .desc  = "Many EVFILT_VNODE adds on pipe fds in one call each fail with EINVAL",
+        .func  = test_kevent_vnode_non_file_many_one_call,
+    },
     {
         .name  = "kevent_vnode_modify_clobbers_udata",
         .desc  = "Re-EV_ADD with new udata overwrites the previous udata",
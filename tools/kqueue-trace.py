@@ -0,0 +1,109 @@
+#!/usr/bin/env python3
+"""
+Decode a libkqueue flight recorder dump.
+
+Dumps are produced by setting KQUEUE_TRACE=<path> (written at exit, and on
+KQUEUE_TRACE_SIGNAL=<signo> if set), or by an EVFILT_LIBKQUEUE
+NOTE_TRACE_DUMP query.  The layout is described in src/common/trace.h.
+
+Usage:
+    kqueue-trace.py [--per-thread] <dump>
+
+Output: one line per record, merged across threads in timestamp order
+(or grouped by thread with --per-thread).  Times are relative to the
+earliest record in the dump.
+"""
+import struct
+import sys
+
+FILE_HEADER = struct.Struct('=8sIIII')
+RING_HEADER = struct.Struct('=iIQ')
+RECORD = struct.Struct('=QQqiIiHhH6x')
+
+TYPES = {
+    1: 'ENTER',
+    2: 'EXIT',
+    3: 'COPYIN',
+    4: 'COPYOUT',
+    5: 'WAIT',
+}
+
+FILTERS = {
+    -1: 'READ',
+    -2: 'WRITE',
+    -3: 'AIO',
+    -4: 'VNODE',
+    -5: 'PROC',
+    -6: 'SIGNAL',
+    -7: 'TIMER',
+    -8: 'NETDEV',
+    -9: 'FS',
+    -10: 'LIO',
+    -11: 'USER',
+    -12: 'LIBKQUEUE',
+}
+
+
+def read_dump(path):
+    """Return a list of (tid, record-tuple) from a dump file."""
+    with open(path, 'rb') as f:
+        data = f.read()
+
+    magic, version, record_size, _ring_size, nrings = FILE_HEADER.unpack_from(data, 0)
+    if magic.rstrip(b'\0') != b'KQTRACE':
+        sys.exit('%s: not a libkqueue trace dump' % path)
+    if version != 1 or record_size != RECORD.size:
+        sys.exit('%s: unsupported trace version %d (record size %d)' % (path, version, record_size))
+
+    off = FILE_HEADER.size
+    out = []
+    for _ in range(nrings):
+        tid, count, _head = RING_HEADER.unpack_from(data, off)
+        off += RING_HEADER.size
+        for _ in range(count):
+            out.append((tid, RECORD.unpack_from(data, off)))
+            off += RECORD.size
+    return out
+
+
+def format_record(t0, tid, rec):
+    time, ident, rdata, kq, fflags, rv, rtype, rfilter, flags = rec
+    name = TYPES.get(rtype, '?%d' % rtype)
+    ts = '%14.6f' % ((time - t0) / 1e6)
+
+    if name == 'ENTER':
+        detail = 'nchanges=%d nevents=%d' % (rdata, rv)
+    elif name == 'EXIT':
+        detail = 'rv=%d errno=%d' % (rv, fflags)
+    elif name == 'WAIT':
+        detail = 'rv=%d waited=%.3fus' % (rv, rdata / 1e3)
+    else:
+        detail = 'filter=%s ident=%d flags=0x%04x fflags=0x%08x data=%d' % (
+            FILTERS.get(rfilter, str(rfilter)), ident, flags, fflags, rdata)
+        if name == 'COPYIN':
+            detail += ' rv=%d' % rv
+
+    return '%s ms [%d] kq=%d %-7s %s' % (ts, tid, kq, name, detail)
+
+
+def main(argv):
+    per_thread = '--per-thread' in argv
+    args = [a for a in argv if a != '--per-thread']
+    if len(args) != 1:
+        sys.exit(__doc__)
+
+    records = read_dump(args[0])
+    if not records:
+        return
+    t0 = min(rec[0] for _, rec in records)
+    if per_thread:
+        records.sort(key=lambda r: (r[0], r[1][0]))
+    else:
+        records.sort(key=lambda r: r[1][0])
+
+    for tid, rec in records:
+        print(format_record(t0, tid, rec))
+
+
+if __name__ == '__main__':
+    main(sys.argv[1:])